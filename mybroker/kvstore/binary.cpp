@@ -0,0 +1,745 @@
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "connection.hpp"
+#include "metrics.hpp"
+#include "replication.hpp"
+#include "store.hpp"
+#include "watch.hpp"
+
+
+// Reads length-prefixed fields out of a request body, never past its end.
+typedef struct body_reader {
+    const char *pos;
+    const char *end;
+} body_reader_t;
+
+
+bool read_field(body_reader_t *reader, boost::string_view *field)
+{
+    uint32_t length;
+    if ((size_t)(reader->end - reader->pos) < sizeof(length)) {
+        return false;
+    }
+    memcpy(&length, reader->pos, sizeof(length));
+    reader->pos += sizeof(length);
+    if ((size_t)(reader->end - reader->pos) < length) {
+        return false;
+    }
+    *field = boost::string_view(reader->pos, length);
+    reader->pos += length;
+    return true;
+}
+
+
+// Integer fields are exactly eight bytes; check_body() has verified that.
+int64_t read_int(body_reader_t *reader)
+{
+    boost::string_view field;
+    int64_t value;
+    read_field(reader, &field);
+    memcpy(&value, field.data(), sizeof(value));
+    return value;
+}
+
+
+void append_u32(std::string *out, uint32_t value)
+{
+    out->append((const char*)&value, sizeof(value));
+}
+
+
+void append_i64(std::string *out, int64_t value)
+{
+    out->append((const char*)&value, sizeof(value));
+}
+
+
+// Starts a response frame in conn->out; finish_response() fills in the
+// length once the body is complete.
+size_t begin_response(connection_t *conn, uint8_t opcode, uint16_t count)
+{
+    frame_header_t header;
+    header.magic = BINARY_MAGIC;
+    header.opcode = opcode;
+    header.count = count;
+    header.length = 0;
+
+    size_t start = conn->out.size();
+    conn->out.append((const char*)&header, sizeof(header));
+    return start;
+}
+
+
+void finish_response(connection_t *conn, size_t start)
+{
+    uint32_t length = conn->out.size() - start - sizeof(frame_header_t);
+    memcpy(&conn->out[start + offsetof(frame_header_t, length)], &length, sizeof(length));
+}
+
+
+void status_response(connection_t *conn, uint8_t opcode, uint8_t status)
+{
+    size_t start = begin_response(conn, opcode, 1);
+    conn->out.push_back(status);
+    finish_response(conn, start);
+}
+
+
+void bad_request(connection_t *conn, uint8_t opcode)
+{
+    status_response(conn, opcode, STATUS_BAD_REQUEST);
+}
+
+
+// Checks that the body holds exactly `count` items laid out as `fields`, one
+// character per field: 's' for a string, 'v' for a value, which like a text
+// value must not be empty, 'i' for an integer. Handlers then never find a
+// malformed item after applying earlier ones.
+bool check_body(body_reader_t body, uint16_t count, const char *fields)
+{
+    boost::string_view field;
+    for (uint16_t i = 0; i < count; ++i) {
+        for (const char *f = fields; *f; ++f) {
+            if (!read_field(&body, &field)) {
+                return false;
+            }
+            if (*f == 'i' && field.size() != sizeof(int64_t)) {
+                return false;
+            }
+            if (*f == 'v' && field.empty()) {
+                return false;
+            }
+        }
+    }
+    return body.pos == body.end;
+}
+
+
+uint8_t update_status(UpdateStatus status)
+{
+    switch (status) {
+    case UPDATE_OK:
+        return STATUS_OK;
+    case UPDATE_NOT_FOUND:
+        return STATUS_NOT_FOUND;
+    case UPDATE_WRONG_TYPE:
+        return STATUS_WRONG_TYPE;
+    case UPDATE_MISMATCH:
+        return STATUS_MISMATCH;
+    case UPDATE_OVERFLOW:
+        return STATUS_OVERFLOW;
+    case UPDATE_NO_KEYSPACE:
+        return STATUS_NO_NAMESPACE;
+    default:
+        return STATUS_FULL;
+    }
+}
+
+
+void mget_handler(connection_t *conn, const frame_header_t &header, body_reader_t *body)
+{
+    size_t start = begin_response(conn, header.opcode, header.count);
+
+    // Values are copied straight from the segment into the reply
+    for (uint16_t i = 0; i < header.count; ++i) {
+        boost::string_view key;
+        read_field(body, &key);
+        bool found = view_string_value(conn->keyspace, key, [conn](boost::string_view value) {
+            conn->out.push_back(STATUS_OK);
+            append_u32(&conn->out, value.size());
+            conn->out.append(value.data(), value.size());
+        });
+        record_get(found);
+        if (!found) {
+            conn->out.push_back(STATUS_NOT_FOUND);
+        }
+    }
+    finish_response(conn, start);
+}
+
+
+void mset_handler(connection_t *conn, const frame_header_t &header, body_reader_t *body)
+{
+    size_t start = begin_response(conn, header.opcode, header.count);
+
+    for (uint16_t i = 0; i < header.count; ++i) {
+        boost::string_view key, value;
+        read_field(body, &key);
+        read_field(body, &value);
+        conn->out.push_back(update_status(store_value(conn->keyspace, key, value)));
+    }
+    finish_response(conn, start);
+}
+
+
+void mdel_handler(connection_t *conn, const frame_header_t &header, body_reader_t *body)
+{
+    size_t start = begin_response(conn, header.opcode, header.count);
+
+    for (uint16_t i = 0; i < header.count; ++i) {
+        boost::string_view key;
+        read_field(body, &key);
+        conn->out.push_back(remove_value(conn->keyspace, key) ? STATUS_OK : STATUS_NOT_FOUND);
+    }
+    finish_response(conn, start);
+}
+
+
+void incr_handler(connection_t *conn, const frame_header_t &header, body_reader_t *body)
+{
+    size_t start = begin_response(conn, header.opcode, header.count);
+
+    for (uint16_t i = 0; i < header.count; ++i) {
+        boost::string_view key;
+        read_field(body, &key);
+        int64_t delta = read_int(body);
+        int64_t result;
+        UpdateStatus status;
+        if (header.opcode == OP_DECR && __builtin_sub_overflow((int64_t)0, delta, &delta)) {
+            status = UPDATE_OVERFLOW;
+        }
+        else {
+            status = incr_value(conn->keyspace, key, delta, &result);
+        }
+        conn->out.push_back(update_status(status));
+        if (status == UPDATE_OK) {
+            append_i64(&conn->out, result);
+        }
+    }
+    finish_response(conn, start);
+}
+
+
+void cas_handler(connection_t *conn, const frame_header_t &header, body_reader_t *body)
+{
+    size_t start = begin_response(conn, header.opcode, header.count);
+
+    for (uint16_t i = 0; i < header.count; ++i) {
+        boost::string_view key;
+        read_field(body, &key);
+        int64_t expected = read_int(body);
+        int64_t desired = read_int(body);
+        int64_t current;
+        UpdateStatus status = cas_value(conn->keyspace, key, expected, desired, &current);
+        conn->out.push_back(update_status(status));
+        if (status == UPDATE_OK || status == UPDATE_MISMATCH) {
+            append_i64(&conn->out, current);
+        }
+    }
+    finish_response(conn, start);
+}
+
+
+void expire_handler(connection_t *conn, const frame_header_t &header, body_reader_t *body)
+{
+    size_t start = begin_response(conn, header.opcode, header.count);
+
+    for (uint16_t i = 0; i < header.count; ++i) {
+        boost::string_view key;
+        read_field(body, &key);
+        int64_t ttl = read_int(body);
+        if (ttl < 0) {
+            conn->out.push_back(STATUS_BAD_REQUEST);
+            continue;
+        }
+        conn->out.push_back(update_status(expire_value(conn->keyspace, key, ttl)));
+    }
+    finish_response(conn, start);
+}
+
+
+void exec_handler(connection_t *conn, const frame_header_t &header, body_reader_t *body)
+{
+    std::vector<BatchOp> batch;
+    batch.reserve(header.count);
+    for (uint16_t i = 0; i < header.count; ++i) {
+        boost::string_view key, value;
+        read_field(body, &key);
+        int64_t op = read_int(body);
+        read_field(body, &value);
+        if (op == EXEC_STORE && !value.empty()) {
+            batch_store(&batch, key, value);
+        }
+        else if (op == EXEC_REMOVE) {
+            batch_remove(&batch, key);
+        }
+        else {
+            bad_request(conn, header.opcode);
+            return;
+        }
+    }
+
+    UpdateStatus status = apply_batch(conn->keyspace, &batch);
+    size_t start = begin_response(conn, header.opcode, header.count);
+    for (const BatchOp &op : batch) {
+        if (status != UPDATE_OK) {
+            conn->out.push_back(update_status(status));
+        }
+        else {
+            conn->out.push_back(op.remove && !op.found ? STATUS_NOT_FOUND : STATUS_OK);
+        }
+    }
+    finish_response(conn, start);
+}
+
+
+void append_field(std::string *out, boost::string_view field)
+{
+    append_u32(out, field.size());
+    out->append(field.data(), field.size());
+}
+
+
+// Queues the next frame of the connection's scan
+void scan_frame(connection_t *conn)
+{
+    std::vector<ScanEntry> entries;
+    bool more = scan_values(conn->keyspace, &conn->scan, SCAN_CHUNK, &entries);
+    size_t start = begin_response(conn, conn->scan_opcode, entries.size());
+    std::string scratch;
+
+    for (const ScanEntry &entry : entries) {
+        append_field(&conn->out, entry.first);
+        int64_t int_value;
+        boost::string_view value;
+        if (int_item_value(entry.second, &int_value)) {
+            char value_str[32];
+            snprintf(value_str, sizeof(value_str), "%" PRId64, int_value);
+            append_field(&conn->out, value_str);
+        }
+        else if (string_item_value(entry.second, &value, &scratch)) {
+            append_field(&conn->out, value);
+        }
+        else {
+            append_field(&conn->out, boost::string_view(entry.second).substr(1));
+        }
+    }
+    finish_response(conn, start);
+    if (!more && !entries.empty()) {
+        finish_response(conn, begin_response(conn, conn->scan_opcode, 0));
+    }
+    conn->scanning = more;
+}
+
+
+void scan_handler(connection_t *conn, const frame_header_t &header, body_reader_t *body)
+{
+    boost::string_view start, end;
+    read_field(body, &start);
+    if (header.opcode == OP_SCAN) {
+        conn->scan = prefix_range(start);
+    }
+    else {
+        read_field(body, &end);
+        conn->scan.start.assign(start.data(), start.size());
+        conn->scan.end.assign(end.data(), end.size());
+        conn->scan.inclusive = true;
+    }
+    conn->scanning = true;
+    conn->scan_opcode = header.opcode;
+    scan_frame(conn);
+}
+
+
+void ns_create_handler(connection_t *conn, const frame_header_t &header, body_reader_t *body)
+{
+    boost::string_view name;
+    read_field(body, &name);
+    int64_t quota = read_int(body);
+    bool created = quota >= 0 && create_namespace(name, quota);
+    status_response(conn, header.opcode, created ? STATUS_OK : STATUS_BAD_REQUEST);
+}
+
+
+void ns_drop_handler(connection_t *conn, const frame_header_t &header, body_reader_t *body)
+{
+    boost::string_view name;
+    read_field(body, &name);
+    status_response(conn, header.opcode, drop_namespace(name) ? STATUS_OK : STATUS_NOT_FOUND);
+}
+
+
+// Starts an OP_SYNC frame of `count` items
+size_t begin_sync_frame(connection_t *conn, uint16_t count, uint32_t flags)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    sync_block_t block;
+    block.position = watch_cursor();
+    block.head = watch_head();
+    block.sent_ms = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+    block.flags = flags;
+    block.reserved = 0;
+
+    size_t start = begin_response(conn, OP_SYNC, count);
+    conn->out.append((const char*)&block, sizeof(block));
+    return start;
+}
+
+
+// Appends a sync item holding a key of the keyspace in `slot` as it is now,
+// or deleting it
+void append_sync_item(connection_t *conn, uint32_t slot, KeyspaceId keyspace, boost::string_view key)
+{
+    std::string stored;
+    if (load_stored_value(keyspace, key, &stored)) {
+        conn->out.push_back(SYNC_SET);
+        append_u32(&conn->out, slot);
+        append_field(&conn->out, key);
+        append_field(&conn->out, stored);
+    }
+    else {
+        conn->out.push_back(SYNC_DEL);
+        append_u32(&conn->out, slot);
+        append_field(&conn->out, key);
+    }
+}
+
+
+void append_sync_namespace(connection_t *conn, uint32_t slot, boost::string_view name, uint64_t quota)
+{
+    conn->out.push_back(SYNC_NAMESPACE);
+    append_u32(&conn->out, slot);
+    append_field(&conn->out, name);
+    conn->out.append((const char*)&quota, sizeof(quota));
+}
+
+
+// Queues the next frame of a replica's full sync: the namespaces first, then
+// the keys of each in turn. The scan only supplies the keys; each is read
+// again in its stored form, expiry time included.
+void sync_frame(connection_t *conn)
+{
+    struct Namespace {
+        uint32_t slot;
+        std::string name;
+        size_t quota;
+    };
+    std::vector<Namespace> namespaces;
+    if (conn->sync_flags & SYNC_BEGIN) {
+        for (uint32_t slot = DEFAULT_KEYSPACE + 1; slot < MAX_KEYSPACES; ++slot) {
+            Namespace ns;
+            KeyspaceId keyspace;
+            if (namespace_at(slot, &keyspace, &ns.name, &ns.quota)) {
+                ns.slot = slot;
+                namespaces.push_back(ns);
+            }
+        }
+    }
+
+    std::vector<ScanEntry> entries;
+    KeyspaceId keyspace = conn->sync_keyspace;
+    bool more = scan_values(keyspace, &conn->scan, SCAN_CHUNK, &entries);
+    // A namespace created since the sync began is sent by its events
+    for (uint32_t slot = keyspace % MAX_KEYSPACES + 1; !more && slot < MAX_KEYSPACES; ++slot) {
+        more = namespace_at(slot, &conn->sync_keyspace, nullptr, nullptr);
+        conn->scan = prefix_range("");
+    }
+
+    uint32_t flags = conn->sync_flags;
+    if (!more) {
+        flags |= SYNC_END;
+    }
+    size_t start = begin_sync_frame(conn, namespaces.size() + entries.size(), flags);
+    for (const Namespace &ns : namespaces) {
+        append_sync_namespace(conn, ns.slot, ns.name, ns.quota);
+    }
+    for (const ScanEntry &entry : entries) {
+        append_sync_item(conn, keyspace % MAX_KEYSPACES, keyspace, entry.first);
+    }
+    finish_response(conn, start);
+    conn->sync_flags &= ~SYNC_BEGIN;
+    conn->scanning = more;
+}
+
+
+void start_full_sync(connection_t *conn)
+{
+    conn->sync_flags = SYNC_BEGIN;
+    conn->sync_keyspace = DEFAULT_KEYSPACE;
+    conn->scan = prefix_range("");
+    conn->scanning = true;
+    conn->scan_opcode = OP_SYNC;
+}
+
+
+// The change handler of a replica's connection. The watch ring only says
+// which key changed, so the replica is sent the key as it is now; changes
+// to one key are published in order, so the last one sent is the latest.
+// Keys arrive whole, however long: no request carries one too long for the
+// ring's spill. The namespace in the slot may have been dropped or replaced
+// since, but then the events that did so follow, and the replica ends up
+// the same.
+void sync_change(connection_t *conn, const Change &change)
+{
+    switch (change.type) {
+    case CHANGE_SET:
+    case CHANGE_DEL: {
+        KeyspaceId keyspace;
+        if (!namespace_at(change.slot, &keyspace, nullptr, nullptr)) {
+            keyspace = DEFAULT_KEYSPACE;
+        }
+        size_t start = begin_sync_frame(conn, 1, 0);
+        if (keyspace % MAX_KEYSPACES == change.slot) {
+            append_sync_item(conn, change.slot, keyspace, change.key);
+        }
+        else {
+            conn->out.push_back(SYNC_DEL);
+            append_u32(&conn->out, change.slot);
+            append_field(&conn->out, change.key);
+        }
+        finish_response(conn, start);
+        break;
+    }
+    case CHANGE_NS_CREATE: {
+        size_t start = begin_sync_frame(conn, 1, 0);
+        append_sync_namespace(conn, change.slot, change.key, change.quota);
+        finish_response(conn, start);
+        break;
+    }
+    case CHANGE_NS_DROP: {
+        size_t start = begin_sync_frame(conn, 1, 0);
+        conn->out.push_back(SYNC_DROP);
+        append_u32(&conn->out, change.slot);
+        finish_response(conn, start);
+        break;
+    }
+    case CHANGE_LOST:
+        // The replica may have missed anything
+        start_full_sync(conn);
+        break;
+    case CHANGE_UNWATCH:
+        replica_attached(false);
+        break;
+    }
+}
+
+
+// A replica's first OP_SYNC starts streaming the store to it; later ones
+// are heartbeats
+void sync_handler(connection_t *conn)
+{
+    if (!conn->watches.empty()) {
+        finish_response(conn, begin_sync_frame(conn, 0, 0));
+        return;
+    }
+    // Watch first, so no change made during the full sync is missed
+    watch_key(conn, "*", sync_change);
+    if (conn->watches.empty()) {
+        bad_request(conn, OP_SYNC);
+        return;
+    }
+    replica_attached(true);
+    start_full_sync(conn);
+    sync_frame(conn);
+}
+
+
+static bool is_write(uint8_t opcode)
+{
+    switch (opcode) {
+    case OP_MSET:
+    case OP_MDEL:
+    case OP_INCR:
+    case OP_DECR:
+    case OP_CAS:
+    case OP_EXPIRE:
+    case OP_NS_CREATE:
+    case OP_NS_DROP:
+    case OP_EXEC:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+// The text command each opcode is counted as in stats
+static Command opcode_command(uint8_t opcode)
+{
+    switch (opcode) {
+    case OP_MGET:
+        return CMD_LOAD;
+    case OP_MSET:
+        return CMD_STORE;
+    case OP_MDEL:
+        return CMD_REMOVE;
+    case OP_INCR:
+    case OP_DECR:
+        return CMD_INCR;
+    case OP_CAS:
+        return CMD_CAS;
+    case OP_EXPIRE:
+        return CMD_EXPIRE;
+    case OP_SCAN:
+    case OP_RANGE:
+        return CMD_SCAN;
+    case OP_EXEC:
+        return CMD_EXEC;
+    default:
+        return CMD_COUNT;
+    }
+}
+
+int handle_binary_request(connection_t *conn)
+{
+    frame_header_t header;
+    if (conn->scanning) {
+        if (!conn->out.empty()) {
+            return 0;
+        }
+        if (conn->scan_opcode == OP_SYNC) {
+            sync_frame(conn);
+        }
+        else {
+            scan_frame(conn);
+        }
+        return 1;
+    }
+    if (conn->in.size() < sizeof(header)) {
+        return 0;
+    }
+    memcpy(&header, conn->in.data(), sizeof(header));
+    if (header.magic != BINARY_MAGIC || header.length > MAX_FRAME_SIZE) {
+        return -1;
+    }
+    if (conn->in.size() < sizeof(header) + header.length) {
+        return 0;
+    }
+    if (!conn->watches.empty() && header.opcode != OP_SYNC) {
+        // A replica's connection carries nothing else
+        return -1;
+    }
+
+    uint64_t start = metrics_clock_ns();
+    body_reader_t body;
+    body.pos = conn->in.data() + sizeof(header);
+    body.end = body.pos + header.length;
+
+    // The namespace field is taken off the body and the flag off the opcode
+    conn->keyspace = DEFAULT_KEYSPACE;
+    if (header.opcode & OP_NAMESPACE) {
+        header.opcode &= ~OP_NAMESPACE;
+        boost::string_view name;
+        if (!read_field(&body, &name)) {
+            bad_request(conn, header.opcode);
+            conn->in.consume(sizeof(header) + header.length);
+            return 1;
+        }
+        if (!find_namespace(name, &conn->keyspace)) {
+            status_response(conn, header.opcode, STATUS_NO_NAMESPACE);
+            conn->in.consume(sizeof(header) + header.length);
+            return 1;
+        }
+    }
+
+    if (read_only() && is_write(header.opcode)) {
+        status_response(conn, header.opcode, STATUS_READ_ONLY);
+        conn->in.consume(sizeof(header) + header.length);
+        return 1;
+    }
+
+    switch (header.opcode) {
+    case OP_MGET:
+        if (check_body(body, header.count, "s")) {
+            mget_handler(conn, header, &body);
+            break;
+        }
+        bad_request(conn, header.opcode);
+        break;
+    case OP_MSET:
+        if (check_body(body, header.count, "sv")) {
+            mset_handler(conn, header, &body);
+            break;
+        }
+        bad_request(conn, header.opcode);
+        break;
+    case OP_MDEL:
+        if (check_body(body, header.count, "s")) {
+            mdel_handler(conn, header, &body);
+            break;
+        }
+        bad_request(conn, header.opcode);
+        break;
+    case OP_INCR:
+    case OP_DECR:
+        if (check_body(body, header.count, "si")) {
+            incr_handler(conn, header, &body);
+            break;
+        }
+        bad_request(conn, header.opcode);
+        break;
+    case OP_CAS:
+        if (check_body(body, header.count, "sii")) {
+            cas_handler(conn, header, &body);
+            break;
+        }
+        bad_request(conn, header.opcode);
+        break;
+    case OP_EXPIRE:
+        if (check_body(body, header.count, "si")) {
+            expire_handler(conn, header, &body);
+            break;
+        }
+        bad_request(conn, header.opcode);
+        break;
+    case OP_SCAN:
+        if (header.count == 1 && check_body(body, header.count, "s")) {
+            scan_handler(conn, header, &body);
+            break;
+        }
+        bad_request(conn, header.opcode);
+        break;
+    case OP_RANGE:
+        if (header.count == 1 && check_body(body, header.count, "ss")) {
+            scan_handler(conn, header, &body);
+            break;
+        }
+        bad_request(conn, header.opcode);
+        break;
+    case OP_EXEC:
+        if (check_body(body, header.count, "sis")) {
+            exec_handler(conn, header, &body);
+            break;
+        }
+        bad_request(conn, header.opcode);
+        break;
+    case OP_NS_CREATE:
+        if (header.count == 1 && check_body(body, header.count, "si")) {
+            ns_create_handler(conn, header, &body);
+            break;
+        }
+        bad_request(conn, header.opcode);
+        break;
+    case OP_NS_DROP:
+        if (header.count == 1 && check_body(body, header.count, "s")) {
+            ns_drop_handler(conn, header, &body);
+            break;
+        }
+        bad_request(conn, header.opcode);
+        break;
+    case OP_SYNC:
+        if (header.count == 0 && header.length == 0 && conn->keyspace == DEFAULT_KEYSPACE) {
+            sync_handler(conn);
+            break;
+        }
+        bad_request(conn, header.opcode);
+        break;
+    default:
+        bad_request(conn, header.opcode);
+        break;
+    }
+
+    Command cmd = opcode_command(header.opcode);
+    if (cmd != CMD_COUNT) {
+        record_command(cmd, start);
+    }
+    conn->in.consume(sizeof(header) + header.length);
+    return 1;
+}
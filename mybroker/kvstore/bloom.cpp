@@ -0,0 +1,64 @@
+#include <string.h>
+
+#include "bloom.hpp"
+
+#define MIN_COUNTERS 64
+
+
+CountingBloom::CountingBloom(SegmentManager* segment_manager, size_t expected_keys)
+    : alloc(segment_manager)
+    , counters(nullptr)
+    , mask(0)
+    , count(0) {
+    size_t capacity = MIN_COUNTERS;
+    while (capacity < expected_keys * BLOOM_COUNTERS_PER_KEY) {
+        capacity *= 2;
+    }
+    counters = alloc.allocate(capacity / 2);
+    memset(counters.get(), 0, capacity / 2);
+    mask = capacity - 1;
+}
+
+CountingBloom::~CountingBloom() {
+    alloc.deallocate(counters, (mask + 1) / 2);
+}
+
+void CountingBloom::add(uint64_t hash) {
+    uint64_t h = probes(hash);
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    for (int i = 0; i < BLOOM_PROBES; ++i) {
+        size_t j = (h1 + i * h2) & mask;
+        if (counter(counters.get(), j) < BLOOM_MAX_COUNT) {
+            counters[j / 2] += 1 << (j % 2 * 4);
+        }
+    }
+    ++count;
+}
+
+void CountingBloom::remove(uint64_t hash) {
+    uint64_t h = probes(hash);
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    for (int i = 0; i < BLOOM_PROBES; ++i) {
+        size_t j = (h1 + i * h2) & mask;
+        unsigned value = counter(counters.get(), j);
+        if (value > 0 && value < BLOOM_MAX_COUNT) {
+            counters[j / 2] -= 1 << (j % 2 * 4);
+        }
+    }
+    --count;
+}
+
+void CountingBloom::clear() {
+    memset(counters.get(), 0, (mask + 1) / 2);
+    count = 0;
+}
+
+void CountingBloom::grow() {
+    size_t capacity = (mask + 1) * 2;
+    bip::offset_ptr<uint8_t> new_counters = alloc.allocate(capacity / 2);
+    memset(new_counters.get(), 0, capacity / 2);
+    alloc.deallocate(counters, (mask + 1) / 2);
+    counters = new_counters;
+    mask = capacity - 1;
+    count = 0;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "shm.hpp"
+
+#define BLOOM_PROBES 4
+#define BLOOM_COUNTERS_PER_KEY 8        // about 2.4% false positives
+#define BLOOM_MAX_COUNT 15
+
+// Counting Bloom filter of a stripe's keys that lives inside the segment.
+//
+// Each key increments BLOOM_PROBES 4-bit counters picked by double hashing
+// from the low 32 bits of its hash_key() hash, the bits a hash index slot
+// caches, so the filter can be rebuilt without hashing any key again. A key
+// with any of its counters at zero is certainly absent, so most misses are
+// answered without reading the index. Erasing a key decrements its counters,
+// except that a counter that reached BLOOM_MAX_COUNT stays there: it no
+// longer knows how many keys share it.
+//
+// The caller keeps at most one key per BLOOM_COUNTERS_PER_KEY counters by
+// calling grow() and adding every key again when full() says so.
+class CountingBloom
+{
+public:
+    CountingBloom(SegmentManager* segment_manager, size_t expected_keys);
+    ~CountingBloom();
+
+    bool may_contain(uint64_t hash) const {
+        return may_contain_in(counters.get(), mask, hash);
+    }
+    // For readers that do not hold the lock, as HashIndex::find_optimistic():
+    // false means "absent" only if valid() still holds afterwards.
+    template <class Valid> bool may_contain_optimistic(uint64_t hash, Valid valid) const {
+        const uint8_t* table = counters.get();
+        size_t table_mask = mask;
+        if (!valid()) {
+            return true;
+        }
+        return may_contain_in(table, table_mask, hash);
+    }
+
+    void add(uint64_t hash);
+    void remove(uint64_t hash);
+    // Forgets every key, saturated counters included
+    void clear();
+
+    bool full() const { return count >= (mask + 1) / BLOOM_COUNTERS_PER_KEY; }
+    // Replaces the counters with twice as many, all zero. Throws
+    // bip::bad_alloc, leaving the filter as it was, if the segment is full.
+    void grow();
+
+    size_t size() const { return count; }
+    size_t bytes() const { return (mask + 1) / 2; }
+
+private:
+    CountingBloom(const CountingBloom&);
+    CountingBloom& operator=(const CountingBloom&);
+
+    static uint64_t probes(uint64_t hash) {
+        // A 64-bit mix of the 32 bits, split into the two hashes
+        uint64_t h = (uint32_t)hash * 0x9e3779b97f4a7c15ULL;
+        return h ^ (h >> 29);
+    }
+    static unsigned counter(const uint8_t* table, size_t i) {
+        return (table[i / 2] >> (i % 2 * 4)) & 0xf;
+    }
+    static bool may_contain_in(const uint8_t* table, size_t table_mask, uint64_t hash) {
+        uint64_t h = probes(hash);
+        uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+        for (int i = 0; i < BLOOM_PROBES; ++i) {
+            if (counter(table, (h1 + i * h2) & table_mask) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    Alloc<uint8_t> alloc;
+    bip::offset_ptr<uint8_t> counters;  // two per byte
+    size_t mask;                        // of counter indexes
+    size_t count;                       // keys added and not removed
+};
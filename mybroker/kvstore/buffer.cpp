@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <new>
+
+#include "buffer.hpp"
+
+// Compact once less than this much space is left at the end of the buffer
+#define MIN_FILL_SIZE 4096
+
+
+RecvBuffer::RecvBuffer(size_t initial_capacity, size_t max_capacity)
+    : buf((char*)malloc(initial_capacity))
+    , capacity(initial_capacity)
+    , max_capacity(max_capacity)
+    , head(0)
+    , tail(0) {
+    if (!buf) {
+        throw std::bad_alloc();
+    }
+}
+
+RecvBuffer::~RecvBuffer() {
+    free(buf);
+}
+
+bool RecvBuffer::make_room() {
+    if (capacity - tail >= MIN_FILL_SIZE) {
+        return true;
+    }
+    if (head > 0) {
+        memmove(buf, buf + head, tail - head);
+        tail -= head;
+        head = 0;
+        if (capacity - tail >= MIN_FILL_SIZE) {
+            return true;
+        }
+    }
+    if (capacity < max_capacity) {
+        size_t new_capacity = capacity * 2 < max_capacity ? capacity * 2 : max_capacity;
+        char *new_buf = (char*)realloc(buf, new_capacity);
+        if (!new_buf) {
+            return tail < capacity;
+        }
+        buf = new_buf;
+        capacity = new_capacity;
+    }
+    return tail < capacity;
+}
+
+ssize_t RecvBuffer::fill(int fd) {
+    if (!make_room()) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    ssize_t n = read(fd, buf + tail, capacity - tail);
+    if (n > 0) {
+        tail += n;
+    }
+    return n;
+}
+
+bool RecvBuffer::append(const char *data, size_t n) {
+    while (n > 0) {
+        if (!make_room()) {
+            return false;
+        }
+        size_t chunk = n < capacity - tail ? n : capacity - tail;
+        memcpy(buf + tail, data, chunk);
+        tail += chunk;
+        data += chunk;
+        n -= chunk;
+    }
+    return true;
+}
+
+void RecvBuffer::consume(size_t n) {
+    head += n;
+    if (head == tail) {
+        head = tail = 0;
+    }
+}
+
+bool RecvBuffer::next_field(size_t *pos, boost::string_view *field) const {
+    // glibc's memchr compares 16-32 bytes per instruction
+    const char *start = data() + *pos;
+    const char *end = (const char*)memchr(start, '\n', size() - *pos);
+    if (!end) {
+        return false;
+    }
+    *field = boost::string_view(start, end - start);
+    *pos = end + 1 - data();
+    return true;
+}
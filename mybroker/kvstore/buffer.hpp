@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <boost/utility/string_view.hpp>
+
+// Per-connection receive buffer.
+//
+// Bytes are read from the socket in large chunks and consumed from the front
+// as requests are parsed. Unconsumed bytes are moved back to the start of the
+// buffer only when the free space at the end runs low, so fields handed out
+// as views are always contiguous and stay valid until the next fill().
+class RecvBuffer
+{
+public:
+    RecvBuffer(size_t initial_capacity, size_t max_capacity);
+    ~RecvBuffer();
+
+    // Reads once from fd into the free space. Returns the result of read(), or
+    // -1 with errno set to ENOBUFS if the buffer is full at max_capacity.
+    ssize_t fill(int fd);
+    // Copies n bytes received some other way to the end. Returns false if
+    // they do not fit below max_capacity.
+    bool append(const char *data, size_t n);
+
+    const char* data() const { return buf + head; }
+    size_t size() const { return tail - head; }
+    void consume(size_t n);
+
+    // Returns the next '\n'-terminated field starting at *pos (relative to
+    // data()) and moves *pos past the terminator. Returns false if the field
+    // has not been fully received yet.
+    bool next_field(size_t *pos, boost::string_view *field) const;
+
+private:
+    RecvBuffer(const RecvBuffer&);
+    RecvBuffer& operator=(const RecvBuffer&);
+
+    bool make_room();
+
+    char *buf;
+    size_t capacity;
+    size_t max_capacity;
+    size_t head;
+    size_t tail;
+};
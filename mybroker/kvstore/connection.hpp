@@ -0,0 +1,84 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "buffer.hpp"
+#include "protocol.hpp"
+#include "store.hpp"
+#include "watch.hpp"
+
+#define READ_CHUNK_SIZE 16384
+#define MAX_REQUEST_SIZE 65536      // longest text request
+#define SCAN_CHUNK 64               // entries of a scan read from the store at a time
+#define MAX_BATCH_SIZE (1 << 20)    // bytes of keys and values a text batch may queue
+
+
+enum protocol_t {
+    PROTOCOL_UNKNOWN,   // nothing received yet
+    PROTOCOL_TEXT,
+    PROTOCOL_BINARY,
+};
+
+typedef struct connection {
+    int fd;
+    protocol_t protocol;
+    RecvBuffer in;      // received bytes that do not form a complete request yet
+    std::string out;    // replies waiting to be sent, in request order
+    bool closing;       // close the connection once `out` has been flushed
+    // A reply may be written to the socket by the handler itself while `out`
+    // is empty, instead of waiting to be flushed with the rest
+    bool direct_send;
+    // A scan streams its reply one chunk at a time, each once the last has
+    // been flushed; later requests wait until it is done
+    bool scanning;
+    uint8_t scan_opcode;
+    KeyRange scan;      // what is left of the range
+    // Keys and prefixes the connection watches, see watch.hpp. A watching
+    // connection gets change events instead of replies to other requests.
+    std::vector<std::string> watches;
+    ChangeHandler watch_handler;
+    bool watch_lost;    // events were dropped since the client fell behind
+    uint32_t sync_flags;    // of the next frame of a replica's full sync
+    KeyspaceId sync_keyspace;   // the one it is sending keys of
+    // Requests address this keyspace: the one chosen with use_namespace on
+    // a text connection, that of the current frame on a binary one
+    KeyspaceId keyspace;
+    // Between multi and exec on a text connection, stores and removals are
+    // queued here instead of being applied. A batch grown past
+    // MAX_BATCH_SIZE is discarded, and exec fails.
+    bool in_batch;
+    bool batch_too_large;
+    size_t batch_size;
+    std::vector<BatchOp> batch;
+
+    connection(int fd)
+        : fd(fd)
+        , protocol(PROTOCOL_UNKNOWN)
+        , in(READ_CHUNK_SIZE, MAX_FRAME_SIZE + sizeof(frame_header_t))
+        , closing(false)
+        , direct_send(true)
+        , scanning(false)
+        , scan_opcode(0)
+        , watch_handler(nullptr)
+        , watch_lost(false)
+        , sync_flags(0)
+        , sync_keyspace(DEFAULT_KEYSPACE)
+        , keyspace(DEFAULT_KEYSPACE)
+        , in_batch(false)
+        , batch_too_large(false)
+        , batch_size(0) {
+    }
+} connection_t;
+
+
+// Each handles the request at the front of conn->in and queues its reply,
+// or queues the next chunk of a scan once `out` is empty. Returns 1 if a
+// request was consumed or a chunk queued, 0 if more bytes are needed or the
+// scan waits for a flush, and -1 if the connection has to be closed.
+int handle_text_request(connection_t *conn);
+int handle_binary_request(connection_t *conn);
+
+// Handles every complete request buffered on the connection, or the next
+// chunk of a scan.
+void handle_requests(connection_t *conn);
@@ -0,0 +1,172 @@
+#include <atomic>
+#include <new>
+#include <tuple>
+
+#include "hashindex.hpp"
+
+// Resize once more than 7/8 of the slots are taken
+#define MAX_LOAD_NUM 7
+#define MAX_LOAD_DEN 8
+#define NO_SLOT ((size_t)-1)
+
+
+HashIndex::HashIndex(SlabPool* pool, size_t initial_capacity)
+    : alloc(pool)
+    , slots(nullptr)
+    , mask(0)
+    , count(0)
+    , previous(nullptr)
+    , previous_mask(0) {
+    size_t capacity = 8;
+    while (capacity < initial_capacity) {
+        capacity *= 2;
+    }
+    Alloc<Slot> slot_alloc(alloc.get_segment_manager());
+    slots = slot_alloc.allocate(capacity);
+    for (size_t i = 0; i < capacity; ++i) {
+        new (&slots[i]) Slot();
+    }
+    mask = capacity - 1;
+}
+
+HashIndex::~HashIndex() {
+    for (size_t i = 0; i <= mask; ++i) {
+        if (slots[i].dist != 0) {
+            Entry* entry = slots[i].entry.get();
+            entry->~Entry();
+            alloc.deallocate(entry, 1);
+        }
+    }
+    Alloc<Slot>(alloc.get_segment_manager()).deallocate(slots, mask + 1);
+}
+
+size_t HashIndex::find_slot(boost::string_view key, uint32_t hash) const {
+    size_t i = hash & mask;
+    for (uint32_t dist = 1; ; ++dist, i = (i + 1) & mask) {
+        const Slot& slot = slots[i];
+        if (slot.dist < dist) {
+            // Empty, or a key that would have been displaced by ours
+            return NO_SLOT;
+        }
+        if (slot.hash == hash && to_view(slot.entry->first) == key) {
+            return i;
+        }
+    }
+}
+
+Entry* HashIndex::find(boost::string_view key, uint64_t hash) {
+    size_t i = find_slot(key, (uint32_t)hash);
+    return i == NO_SLOT ? nullptr : slots[i].entry.get();
+}
+
+// Finds where the slot belongs, then moves the slots from there up to the
+// next empty one along by one, last first, so that each moving entry is
+// copied before it is overwritten. This leaves the slots as Robin Hood
+// displacement would.
+void HashIndex::place(Slot* table, size_t table_mask, Slot slot) {
+    size_t i = slot.hash & table_mask;
+    slot.dist = 1;
+    while (table[i].dist != 0 && table[i].dist >= slot.dist) {
+        // Closer to home than the entry there would be
+        ++slot.dist;
+        i = (i + 1) & table_mask;
+    }
+    size_t end = i;
+    while (table[end].dist != 0) {
+        end = (end + 1) & table_mask;
+    }
+    for (size_t j = end; j != i; j = (j - 1) & table_mask) {
+        Slot moved = table[(j - 1) & table_mask];
+        ++moved.dist;
+        table[j] = moved;
+        // Keeps the compiler from reordering the copies
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+    }
+    table[i] = slot;
+}
+
+void HashIndex::rehash(size_t new_capacity) {
+    Alloc<Slot> slot_alloc(alloc.get_segment_manager());
+    bip::offset_ptr<Slot> new_slots = slot_alloc.allocate(new_capacity);
+    for (size_t i = 0; i < new_capacity; ++i) {
+        new (&new_slots[i]) Slot();
+    }
+    for (size_t i = 0; i <= mask; ++i) {
+        if (slots[i].dist != 0) {
+            place(new_slots.get(), new_capacity - 1, slots[i]);
+        }
+    }
+
+    // The new array is complete before it replaces the old one. `previous`
+    // covers the two stores that switch them; see salvage().
+    size_t old_capacity = mask + 1;
+    previous_mask = mask;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    previous = slots;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    slots = new_slots;
+    mask = new_capacity - 1;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    bip::offset_ptr<Slot> old_slots = previous;
+    previous = nullptr;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    slot_alloc.deallocate(old_slots, old_capacity);
+}
+
+void HashIndex::put(boost::string_view key, uint64_t hash, boost::string_view value) {
+    size_t i = find_slot(key, (uint32_t)hash);
+    if (i != NO_SLOT) {
+        slots[i].entry->second.assign(value.data(), value.size());
+        return;
+    }
+
+    if ((count + 1) * MAX_LOAD_DEN > (mask + 1) * MAX_LOAD_NUM) {
+        rehash((mask + 1) * 2);
+    }
+
+    SlabAlloc<char> sa(alloc);
+    Entry* entry = alloc.allocate(1).get();
+    try {
+        new (entry) Entry(std::piecewise_construct,
+                          std::forward_as_tuple(key.data(), key.size(), sa),
+                          std::forward_as_tuple(value.data(), value.size(), sa));
+    }
+    catch (...) {
+        alloc.deallocate(entry, 1);
+        throw;
+    }
+
+    Slot slot;
+    slot.hash = (uint32_t)hash;
+    slot.dist = 1;
+    slot.entry = entry;
+    place(slots.get(), mask, slot);
+    ++count;
+}
+
+bool HashIndex::erase(boost::string_view key, uint64_t hash) {
+    size_t i = find_slot(key, (uint32_t)hash);
+    if (i == NO_SLOT) {
+        return false;
+    }
+
+    Entry* entry = slots[i].entry.get();
+
+    // Backward-shift deletion: pull the following entries one slot closer to
+    // home until one is already at home, so no tombstones are needed. Each
+    // entry is copied back before its old slot is overwritten.
+    size_t next = (i + 1) & mask;
+    while (slots[next].dist > 1) {
+        slots[i] = slots[next];
+        slots[i].dist--;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        i = next;
+        next = (next + 1) & mask;
+    }
+    slots[i] = Slot();
+    --count;
+
+    entry->~Entry();
+    alloc.deallocate(entry, 1);
+    return true;
+}
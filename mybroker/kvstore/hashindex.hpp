@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "shm.hpp"
+
+// Open-addressing hash index that lives inside the segment.
+//
+// Slots are kept in one flat array and use Robin Hood probing: every slot
+// records how far it is from its home bucket, so lookups stop as soon as they
+// reach a slot that is closer to home than the key being searched for. Each
+// slot caches 32 bits of the key's hash, so a probe only dereferences an entry
+// when the hashes match.
+//
+// Slots only ever move by being copied to their new place before the old one
+// is overwritten, so a writer that dies in the middle of a change leaves
+// every entry in at least one slot, where salvage() finds it.
+class HashIndex
+{
+public:
+    HashIndex(SlabPool* pool, size_t initial_capacity = 64);
+    ~HashIndex();
+
+    // `hash` is always hash_key(key); callers compute it once per request.
+    Entry* find(boost::string_view key, uint64_t hash);
+
+    // Inserts the key or replaces its value. Throws bip::bad_alloc if the
+    // segment is out of memory; the key is then not inserted, but the index
+    // stays consistent.
+    void put(boost::string_view key, uint64_t hash, boost::string_view value);
+
+    bool erase(boost::string_view key, uint64_t hash);
+
+    // Lookup for readers that do not hold the lock and may race with a
+    // writer. `valid()` must return false once the index may have been
+    // modified since the reader started. Every pointer read from the index is
+    // checked with it before being followed, so a torn read is never
+    // dereferenced. The result has to be validated again after use; null means
+    // "not found" only if the final validation succeeds.
+    template <class Valid> Entry* find_optimistic(boost::string_view key, uint64_t hash, Valid valid) const {
+        const Slot* table = slots.get();
+        size_t table_mask = mask;
+        if (!valid()) {
+            return nullptr;
+        }
+        size_t i = (uint32_t)hash & table_mask;
+        for (uint32_t dist = 1; dist <= table_mask + 1; ++dist, i = (i + 1) & table_mask) {
+            Slot slot = table[i];
+            if (slot.dist < dist) {
+                return nullptr;
+            }
+            if (slot.hash != (uint32_t)hash) {
+                continue;
+            }
+            const Entry* entry = slot.entry.get();
+            if (!valid()) {
+                return nullptr;
+            }
+            const char* data = entry->first.data();
+            size_t size = entry->first.size();
+            if (!valid()) {
+                return nullptr;
+            }
+            if (size == key.size() && memcmp(data, key.data(), size) == 0) {
+                return const_cast<Entry*>(entry);
+            }
+        }
+        return nullptr;
+    }
+
+    size_t size() const { return count; }
+
+    // Calls f(entry) for each entry the slots point to, once, after a writer
+    // died in the middle of changing them. An interrupted put() or erase()
+    // leaves some entries in two slots, and an interrupted rehash() leaves
+    // the old slot array whole. Entries sound() rejects are skipped, since
+    // their memory cannot be trusted. Returns how many were.
+    template <class Sound, class F> size_t salvage(Sound sound, F f) const {
+        // Interrupted while switching arrays: the new one may not be whole
+        const Slot* table = previous ? previous.get() : slots.get();
+        size_t table_mask = previous ? previous_mask : mask;
+        std::vector<const Entry*> kept, dropped;
+        for (size_t i = 0; i <= table_mask; ++i) {
+            if (table[i].dist != 0) {
+                const Entry* entry = table[i].entry.get();
+                (sound(entry) ? kept : dropped).push_back(entry);
+            }
+        }
+        std::sort(kept.begin(), kept.end());
+        kept.erase(std::unique(kept.begin(), kept.end()), kept.end());
+        std::sort(dropped.begin(), dropped.end());
+        dropped.erase(std::unique(dropped.begin(), dropped.end()), dropped.end());
+        for (const Entry* entry : kept) {
+            f(*entry);
+        }
+        return dropped.size();
+    }
+
+    // Whether every slot holds a sound entry under its own hash, where a
+    // lookup for it stops, and the count agrees with the slots
+    template <class Sound> bool consistent(Sound sound) const {
+        if (previous) {
+            return false;
+        }
+        size_t used = 0;
+        for (size_t i = 0; i <= mask; ++i) {
+            const Slot& slot = slots[i];
+            if (slot.dist == 0) {
+                continue;
+            }
+            ++used;
+            if (!sound(slot.entry.get()) || slot.hash != (uint32_t)hash_key(to_view(slot.entry->first))
+                || ((i - (slot.hash & mask)) & mask) + 1 != slot.dist) {
+                return false;
+            }
+            // Every slot on the way from home must keep a lookup going, and
+            // none may hold the entry already
+            size_t j = slot.hash & mask;
+            for (uint32_t dist = 1; dist < slot.dist; ++dist, j = (j + 1) & mask) {
+                if (slots[j].dist < dist || slots[j].entry == slot.entry) {
+                    return false;
+                }
+            }
+        }
+        return used == count;
+    }
+
+    // Slot-by-slot access for sweeps such as eviction. Returns the entry in
+    // slot i and its 32 cached hash bits, or null if the slot is empty. Entries
+    // move between slots on every put and erase.
+    size_t capacity() const { return mask + 1; }
+    Entry* at(size_t i, uint32_t* hash) const {
+        if (slots[i].dist == 0) {
+            return nullptr;
+        }
+        *hash = slots[i].hash;
+        return slots[i].entry.get();
+    }
+
+    template <class F> void for_each(F f) {
+        for (size_t i = 0; i <= mask; ++i) {
+            if (slots[i].dist != 0) {
+                f(*slots[i].entry);
+            }
+        }
+    }
+
+private:
+    struct Slot
+    {
+        uint32_t hash;
+        uint32_t dist;      // 1 + distance from the home bucket, 0 if empty
+        bip::offset_ptr<Entry> entry;
+    };
+
+    HashIndex(const HashIndex&);
+    HashIndex& operator=(const HashIndex&);
+
+    size_t find_slot(boost::string_view key, uint32_t hash) const;
+    static void place(Slot* table, size_t table_mask, Slot slot);
+    void rehash(size_t new_capacity);
+
+    // Entries come from the stripe's pool, the slot array from the segment
+    SlabAlloc<Entry> alloc;
+    bip::offset_ptr<Slot> slots;
+    size_t mask;
+    size_t count;
+    // The slot array being replaced, only while rehash() switches arrays
+    bip::offset_ptr<Slot> previous;
+    size_t previous_mask;
+};
@@ -0,0 +1,971 @@
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "protocol.hpp"
+
+// Load generator for a running server. Every connection keeps up to
+// `pipeline` requests in flight and sends the next one as soon as a reply
+// comes back, so the numbers are for a closed loop of N clients. The keys are
+// stored once before the measurement starts, so reads hit unless something
+// evicted them.
+#define DEFAULT_HOST "::1"
+#define DEFAULT_PORT 8902
+#define MAX_EVENTS 64
+#define READ_SIZE 65536
+#define NO_SUCH_KEY "No such key."
+// The replication check (-C): keys read back in one frame, and how long the
+// replica has to catch up
+#define CHECK_BATCH 500
+#define CHECK_TIMEOUT_MS 30000
+
+
+struct Options
+{
+    const char *host;
+    int port;
+    size_t connections;
+    size_t requests;
+    double seconds;         // run for this long instead of `requests`
+    unsigned read_percent;
+    size_t keys;
+    double zipf;            // skew of the key distribution; 0 is uniform
+    size_t min_value;
+    size_t max_value;
+    size_t pipeline;
+    bool binary;
+    bool reconnect;         // a new connection for every request
+    bool prefill;
+    unsigned seed;
+    int check_port;         // a replica of the server to check instead of measuring
+    bool write_only;        // make the check's changes but do not wait for the replica
+};
+
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Zipfian ranks in [0, n) by the method of Gray et al., "Quickly Generating
+// Billion-Record Synthetic Databases", as used by YCSB. Rank 0 is the most
+// popular key. theta has to be below 1.
+class Zipfian
+{
+public:
+    Zipfian(size_t n, double theta) : n(n), theta(theta) {
+        double zeta2 = zeta(2, theta);
+        zetan = zeta(n, theta);
+        alpha = 1 / (1 - theta);
+        eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    size_t next(std::mt19937_64& rng) {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        double uz = u * zetan;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, theta)) {
+            return 1;
+        }
+        return std::min(n - 1, (size_t)(n * std::pow(eta * u - eta + 1, alpha)));
+    }
+
+private:
+    static double zeta(size_t n, double theta) {
+        double sum = 0;
+        for (size_t i = 1; i <= n; ++i) {
+            sum += 1 / std::pow((double)i, theta);
+        }
+        return sum;
+    }
+
+    size_t n;
+    double theta;
+    double zetan;
+    double alpha;
+    double eta;
+};
+
+
+struct Pending
+{
+    uint64_t start_ns;
+    bool read;
+};
+
+struct Client
+{
+    int fd;
+    bool connecting;
+    std::string out;
+    size_t out_pos;
+    std::string in;
+    size_t in_pos;
+    std::deque<Pending> pending;
+};
+
+
+class Bench
+{
+public:
+    Bench(const Options& options);
+    ~Bench();
+
+    bool resolve();
+    // Stores every key once, unmeasured
+    bool fill();
+    bool measure();
+    void report() const;
+
+    size_t errors;
+
+private:
+    bool run();
+    bool more() const;
+    bool open_client(Client* client);
+    void close_client(Client* client);
+    void issue(Client* client);
+    bool flush(Client* client);
+    bool receive(Client* client);
+    int parse_reply(Client* client, bool read, bool* ok, bool* hit);
+    void append_request(Client* client, bool read, const std::string& key);
+
+    Options opt;
+    int epoll_fd;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    std::vector<Client> clients;
+    std::vector<std::string> keys;
+    std::string values;
+    std::mt19937_64 rng;
+    Zipfian* zipfian;
+
+    bool filling;
+    size_t issued;
+    size_t in_flight;
+    uint64_t deadline_ns;
+
+    uint64_t elapsed_ns;
+    size_t hits;
+    size_t misses;
+    std::vector<uint64_t> read_latency;
+    std::vector<uint64_t> write_latency;
+};
+
+
+Bench::Bench(const Options& options)
+    : errors(0), opt(options), epoll_fd(-1), addr_len(0), clients(options.connections), rng(options.seed),
+      zipfian(nullptr), filling(false), issued(0), in_flight(0), deadline_ns(0), elapsed_ns(0), hits(0), misses(0)
+{
+    char key[32];
+    for (size_t i = 0; i < opt.keys; ++i) {
+        snprintf(key, sizeof(key), "bench:%zu", i);
+        keys.push_back(key);
+    }
+    // Values are slices of this, and never hold a newline, which would end a
+    // text protocol value early
+    values.resize(opt.max_value);
+    for (size_t i = 0; i < values.size(); ++i) {
+        values[i] = 'a' + i % 26;
+    }
+    if (opt.zipf > 0) {
+        zipfian = new Zipfian(opt.keys, opt.zipf);
+    }
+    for (Client& client : clients) {
+        client.fd = -1;
+    }
+    epoll_fd = epoll_create1(0);
+}
+
+
+Bench::~Bench()
+{
+    for (Client& client : clients) {
+        close_client(&client);
+    }
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+    delete zipfian;
+}
+
+
+bool Bench::resolve()
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    char port[16];
+    snprintf(port, sizeof(port), "%d", opt.port);
+
+    struct addrinfo *result;
+    int err = getaddrinfo(opt.host, port, &hints, &result);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", opt.host, gai_strerror(err));
+        return false;
+    }
+    memcpy(&addr, result->ai_addr, result->ai_addrlen);
+    addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+
+bool Bench::open_client(Client* client)
+{
+    client->fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (client->fd < 0) {
+        perror("socket failed");
+        return false;
+    }
+    int one = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    client->connecting = connect(client->fd, (struct sockaddr *)&addr, addr_len) < 0;
+    if (client->connecting && errno != EINPROGRESS) {
+        perror("connect failed");
+        return false;
+    }
+    client->out.clear();
+    client->out_pos = 0;
+    client->in.clear();
+    client->in_pos = 0;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = client;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        return false;
+    }
+    return true;
+}
+
+
+void Bench::close_client(Client* client)
+{
+    if (client->fd >= 0) {
+        close(client->fd);
+        client->fd = -1;
+    }
+}
+
+
+bool Bench::more() const
+{
+    if (filling) {
+        return issued < keys.size();
+    }
+    if (opt.seconds > 0) {
+        return now_ns() < deadline_ns;
+    }
+    return issued < opt.requests;
+}
+
+
+void Bench::append_request(Client* client, bool read, const std::string& key)
+{
+    std::string& out = client->out;
+    if (!opt.binary) {
+        out.append(read ? "load_value\n" : "store_value\n");
+        out.append(key);
+        out.append("\nstring\n");
+        if (!read) {
+            size_t size = std::uniform_int_distribution<size_t>(opt.min_value, opt.max_value)(rng);
+            out.append(values, 0, size);
+            out.push_back('\n');
+        }
+        return;
+    }
+
+    frame_header_t header;
+    header.magic = BINARY_MAGIC;
+    header.opcode = read ? OP_MGET : OP_MSET;
+    header.count = 1;
+    size_t size = read ? 0 : std::uniform_int_distribution<size_t>(opt.min_value, opt.max_value)(rng);
+    header.length = sizeof(uint32_t) + key.size() + (read ? 0 : sizeof(uint32_t) + size);
+    out.append((const char *)&header, sizeof(header));
+    uint32_t length = key.size();
+    out.append((const char *)&length, sizeof(length));
+    out.append(key);
+    if (!read) {
+        length = size;
+        out.append((const char *)&length, sizeof(length));
+        out.append(values, 0, size);
+    }
+}
+
+
+void Bench::issue(Client* client)
+{
+    size_t depth = opt.reconnect ? 1 : opt.pipeline;
+    while (client->pending.size() < depth && more()) {
+        bool read;
+        size_t index;
+        if (filling) {
+            read = false;
+            index = issued;
+        }
+        else {
+            read = std::uniform_int_distribution<unsigned>(0, 99)(rng) < opt.read_percent;
+            index = zipfian ? zipfian->next(rng) : std::uniform_int_distribution<size_t>(0, keys.size() - 1)(rng);
+        }
+        append_request(client, read, keys[index]);
+        client->pending.push_back(Pending{now_ns(), read});
+        ++issued;
+        ++in_flight;
+    }
+}
+
+
+bool Bench::flush(Client* client)
+{
+    while (!client->connecting && client->out_pos < client->out.size()) {
+        ssize_t sent = send(client->fd, client->out.data() + client->out_pos, client->out.size() - client->out_pos, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            perror("send failed");
+            return false;
+        }
+        client->out_pos += sent;
+    }
+    if (client->out_pos == client->out.size()) {
+        client->out.clear();
+        client->out_pos = 0;
+    }
+    return true;
+}
+
+
+// Returns 1 and sets ok and hit if a whole reply is buffered, 0 if more has
+// to be read and -1 if the reply makes no sense
+int Bench::parse_reply(Client* client, bool read, bool* ok, bool* hit)
+{
+    const std::string& in = client->in;
+    size_t pos = client->in_pos;
+
+    if (opt.binary) {
+        frame_header_t header;
+        if (in.size() - pos < sizeof(header)) {
+            return 0;
+        }
+        memcpy(&header, in.data() + pos, sizeof(header));
+        if (header.magic != BINARY_MAGIC || header.count != 1 || header.length == 0) {
+            return -1;
+        }
+        if (in.size() - pos < sizeof(header) + header.length) {
+            return 0;
+        }
+        uint8_t status = in[pos + sizeof(header)];
+        *hit = status == STATUS_OK;
+        *ok = status == STATUS_OK || (read && status == STATUS_NOT_FOUND);
+        client->in_pos = pos + sizeof(header) + header.length;
+        return 1;
+    }
+
+    // Values end in a newline; messages are sent as a line and an empty one
+    size_t end = in.find('\n', pos);
+    if (end == std::string::npos) {
+        return 0;
+    }
+    std::string line = in.substr(pos, end - pos);
+    if (read && line != NO_SUCH_KEY) {
+        *ok = *hit = true;
+        client->in_pos = end + 1;
+        return 1;
+    }
+    if (in.size() < end + 2) {
+        return 0;
+    }
+    if (in[end + 1] != '\n') {
+        return -1;
+    }
+    *hit = false;
+    *ok = read || line == "saved.";
+    client->in_pos = end + 2;
+    return 1;
+}
+
+
+bool Bench::receive(Client* client)
+{
+    char buf[READ_SIZE];
+    bool closed = false;
+    for (;;) {
+        ssize_t n = recv(client->fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("recv failed");
+            return false;
+        }
+        if (n == 0) {
+            closed = true;
+            break;
+        }
+        client->in.append(buf, n);
+    }
+
+    while (!client->pending.empty()) {
+        bool ok, hit;
+        int status = parse_reply(client, client->pending.front().read, &ok, &hit);
+        if (status < 0) {
+            fprintf(stderr, "unexpected reply from the server\n");
+            return false;
+        }
+        if (status == 0) {
+            break;
+        }
+
+        Pending done = client->pending.front();
+        client->pending.pop_front();
+        --in_flight;
+        if (!ok) {
+            ++errors;
+        }
+        if (filling) {
+            continue;
+        }
+        uint64_t latency = now_ns() - done.start_ns;
+        if (done.read) {
+            read_latency.push_back(latency);
+            ++(hit ? hits : misses);
+        }
+        else {
+            write_latency.push_back(latency);
+        }
+    }
+    if (client->in_pos == client->in.size()) {
+        client->in.clear();
+        client->in_pos = 0;
+    }
+
+    if (opt.reconnect && client->pending.empty()) {
+        // A forking server closes the connection after one request anyway
+        close_client(client);
+        return !more() || open_client(client);
+    }
+    if (closed) {
+        fprintf(stderr, "server closed the connection\n");
+        return false;
+    }
+    return true;
+}
+
+
+bool Bench::run()
+{
+    issued = 0;
+    in_flight = 0;
+    for (Client& client : clients) {
+        if (client.fd < 0 && !open_client(&client)) {
+            return false;
+        }
+        issue(&client);
+        if (!flush(&client)) {
+            return false;
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (in_flight > 0 || more()) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            return false;
+        }
+        for (int i = 0; i < n; ++i) {
+            Client* client = (Client*)events[i].data.ptr;
+            if (client->connecting && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    fprintf(stderr, "connect failed: %s\n", strerror(err));
+                    return false;
+                }
+                client->connecting = false;
+            }
+            if ((events[i].events & EPOLLIN) && !receive(client)) {
+                return false;
+            }
+            if (client->fd < 0) {
+                continue;
+            }
+            issue(client);
+            if (!flush(client)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+bool Bench::fill()
+{
+    filling = true;
+    bool ok = run();
+    filling = false;
+    return ok;
+}
+
+
+bool Bench::measure()
+{
+    deadline_ns = now_ns() + (uint64_t)(opt.seconds * 1e9);
+    uint64_t start = now_ns();
+    bool ok = run();
+    elapsed_ns = now_ns() - start;
+    return ok;
+}
+
+
+void report_latency(const char *name, std::vector<uint64_t> latency)
+{
+    if (latency.empty()) {
+        return;
+    }
+    std::sort(latency.begin(), latency.end());
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    printf("%-6s", name);
+    for (double quantile : quantiles) {
+        size_t rank = (size_t)std::ceil(quantile * latency.size());
+        printf(" %10.1f", latency[std::max(rank, (size_t)1) - 1] / 1e3);
+    }
+    printf(" %10.1f\n", latency.back() / 1e3);
+}
+
+
+void Bench::report() const
+{
+    size_t ops = read_latency.size() + write_latency.size();
+    double seconds = elapsed_ns / 1e9;
+    printf("%zu connections%s, pipeline %zu, %s protocol\n", opt.connections,
+           opt.reconnect ? " (reconnecting)" : "", opt.reconnect ? 1 : opt.pipeline, opt.binary ? "binary" : "text");
+    if (opt.zipf > 0) {
+        printf("%zu keys, zipfian %.2f", opt.keys, opt.zipf);
+    }
+    else {
+        printf("%zu keys, uniform", opt.keys);
+    }
+    printf(", %u%% reads, values of %zu-%zu bytes\n", opt.read_percent, opt.min_value, opt.max_value);
+    printf("%zu requests in %.2f s: %.0f ops/s, %zu hits, %zu misses, %zu errors\n",
+           ops, seconds, ops / seconds, hits, misses, errors);
+    printf("%-6s %10s %10s %10s %10s %10s\n", "us", "p50", "p90", "p99", "p99.9", "max");
+    report_latency("read", read_latency);
+    report_latency("write", write_latency);
+    std::vector<uint64_t> all(read_latency);
+    all.insert(all.end(), write_latency.begin(), write_latency.end());
+    report_latency("all", all);
+}
+
+
+// The replication check makes `requests` random changes on the server, to
+// keys of the default namespace and of CHECK_NAMESPACES it creates and drops
+// along the way, then reads every one of those keys from the server and the
+// replica until they agree. Run against a replica that was down during an
+// earlier run, it checks the full sync that brings it back.
+static const char *const check_namespaces[] = {"", "repl_a", "repl_b", "repl_c"};
+#define CHECK_NAMESPACES (sizeof(check_namespaces) / sizeof(check_namespaces[0]))
+
+int connect_to(const char *host, int port)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    struct addrinfo *result;
+    int err = getaddrinfo(host, port_str, &hints, &result);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+        return -1;
+    }
+    int fd = socket(result->ai_family, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, result->ai_addr, result->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    if (fd < 0) {
+        fprintf(stderr, "cannot connect to %s port %d: %s\n", host, port, strerror(errno));
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+
+void append_field(std::string *out, const std::string& field)
+{
+    uint32_t length = field.size();
+    out->append((const char *)&length, sizeof(length));
+    out->append(field);
+}
+
+
+void append_int_field(std::string *out, int64_t value)
+{
+    append_field(out, std::string((const char *)&value, sizeof(value)));
+}
+
+
+// Sends one request of `count` items to namespace `ns`, "" for the default
+// one, and reads back the body of its reply
+bool call(int fd, uint8_t opcode, const char *ns, uint16_t count, const std::string& items, std::string *reply)
+{
+    std::string body;
+    if (*ns) {
+        opcode |= OP_NAMESPACE;
+        append_field(&body, ns);
+    }
+    body.append(items);
+    frame_header_t header;
+    header.magic = BINARY_MAGIC;
+    header.opcode = opcode;
+    header.count = count;
+    header.length = body.size();
+    std::string frame((const char *)&header, sizeof(header));
+    frame.append(body);
+    for (size_t sent = 0; sent < frame.size(); ) {
+        ssize_t n = send(fd, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            perror("send failed");
+            return false;
+        }
+        sent += n;
+    }
+
+    reply->clear();
+    size_t need = sizeof(header);
+    char buf[READ_SIZE];
+    while (reply->size() < need) {
+        ssize_t n = recv(fd, buf, std::min(sizeof(buf), need - reply->size()), 0);
+        if (n <= 0) {
+            fprintf(stderr, "server closed the connection\n");
+            return false;
+        }
+        reply->append(buf, n);
+        if (need == sizeof(header) && reply->size() == need) {
+            memcpy(&header, reply->data(), sizeof(header));
+            if (header.magic != BINARY_MAGIC) {
+                fprintf(stderr, "unexpected reply from the server\n");
+                return false;
+            }
+            need += header.length;
+        }
+    }
+    reply->erase(0, sizeof(header));
+    return true;
+}
+
+
+bool make_changes(int fd, const Options& opt)
+{
+    std::mt19937_64 rng(opt.seed);
+    std::string items, reply;
+    char value[64];
+    size_t refused = 0;
+    for (size_t ns = 1; ns < CHECK_NAMESPACES; ++ns) {
+        items.clear();
+        append_field(&items, check_namespaces[ns]);
+        append_int_field(&items, 0);
+        if (!call(fd, OP_NS_CREATE, "", 1, items, &reply)) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < opt.requests; ++i) {
+        size_t ns = std::uniform_int_distribution<size_t>(0, CHECK_NAMESPACES - 1)(rng);
+        unsigned roll = std::uniform_int_distribution<unsigned>(0, 999)(rng);
+        std::string key = "repl:" + std::to_string(std::uniform_int_distribution<size_t>(0, opt.keys - 1)(rng));
+        uint8_t opcode;
+        const char *target = check_namespaces[ns];
+        items.clear();
+        if (ns > 0 && roll < 4) {
+            opcode = OP_NS_DROP;
+            append_field(&items, check_namespaces[ns]);
+            target = "";
+        }
+        else if (ns > 0 && roll < 12) {
+            opcode = OP_NS_CREATE;
+            append_field(&items, check_namespaces[ns]);
+            append_int_field(&items, 0);
+            target = "";
+        }
+        else if (roll < 400) {
+            opcode = OP_MDEL;
+            append_field(&items, key);
+        }
+        else {
+            opcode = OP_MSET;
+            snprintf(value, sizeof(value), "%u:%zu", opt.seed, i);
+            append_field(&items, key);
+            append_field(&items, value);
+        }
+        if (!call(fd, opcode, target, 1, items, &reply)) {
+            return false;
+        }
+        // A missing key or namespace, or a name that is taken, is expected
+        uint8_t status = reply.empty() ? STATUS_BAD_REQUEST : reply[0];
+        if (status != STATUS_OK && status != STATUS_NOT_FOUND && status != STATUS_NO_NAMESPACE &&
+            !(opcode == OP_NS_CREATE && status == STATUS_BAD_REQUEST)) {
+            ++refused;
+        }
+    }
+    if (refused > 0) {
+        fprintf(stderr, "%zu of %zu changes refused by the server\n", refused, opt.requests);
+        return false;
+    }
+    return true;
+}
+
+
+// Reads every key the check may have written, as a status byte and the
+// value for each
+bool read_keys(int fd, const Options& opt, std::vector<std::string> *state)
+{
+    state->clear();
+    std::string items, reply;
+    for (size_t ns = 0; ns < CHECK_NAMESPACES; ++ns) {
+        for (size_t first = 0; first < opt.keys; first += CHECK_BATCH) {
+            size_t count = std::min((size_t)CHECK_BATCH, opt.keys - first);
+            items.clear();
+            for (size_t i = first; i < first + count; ++i) {
+                append_field(&items, "repl:" + std::to_string(i));
+            }
+            if (!call(fd, OP_MGET, check_namespaces[ns], count, items, &reply)) {
+                return false;
+            }
+            if (reply.size() == 1 && reply[0] == (char)STATUS_NO_NAMESPACE) {
+                state->insert(state->end(), count, reply);
+                continue;
+            }
+            size_t pos = 0;
+            for (size_t i = 0; i < count; ++i) {
+                if (pos >= reply.size()) {
+                    fprintf(stderr, "unexpected reply from the server\n");
+                    return false;
+                }
+                std::string entry(1, reply[pos++]);
+                if (entry[0] == (char)STATUS_OK) {
+                    uint32_t length;
+                    if (reply.size() - pos < sizeof(length)) {
+                        return false;
+                    }
+                    memcpy(&length, reply.data() + pos, sizeof(length));
+                    pos += sizeof(length);
+                    entry.append(reply, pos, length);
+                    pos += length;
+                }
+                state->push_back(entry);
+            }
+        }
+    }
+    return true;
+}
+
+
+bool check_replica(const Options& opt)
+{
+    int primary = connect_to(opt.host, opt.port);
+    if (primary < 0) {
+        return false;
+    }
+    bool ok = make_changes(primary, opt);
+    std::vector<std::string> expected, seen;
+    ok = ok && read_keys(primary, opt, &expected);
+    close(primary);
+    if (!ok || opt.write_only) {
+        printf("%zu changes made on the server\n", opt.requests);
+        return ok;
+    }
+
+    uint64_t start = now_ns();
+    size_t differ = expected.size();
+    while (differ > 0 && now_ns() - start < CHECK_TIMEOUT_MS * 1000000ULL) {
+        // The replica may still be starting
+        int replica = connect_to(opt.host, opt.check_port);
+        if (replica >= 0) {
+            if (read_keys(replica, opt, &seen) && seen.size() == expected.size()) {
+                differ = 0;
+                for (size_t i = 0; i < expected.size(); ++i) {
+                    differ += seen[i] != expected[i];
+                }
+            }
+            close(replica);
+        }
+        if (differ > 0) {
+            usleep(100000);
+        }
+    }
+    size_t present = 0;
+    for (const std::string& entry : expected) {
+        present += entry[0] == (char)STATUS_OK;
+    }
+    if (differ > 0) {
+        printf("replica still differs on %zu of %zu keys after %d s\n", differ, expected.size(), CHECK_TIMEOUT_MS / 1000);
+        return false;
+    }
+    printf("replica agrees on %zu keys, %zu present, after %.1f s\n", expected.size(), present, (now_ns() - start) / 1e9);
+    return true;
+}
+
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [options]\n", prog);
+    fprintf(stderr, "  -h host        server address (default " DEFAULT_HOST ")\n");
+    fprintf(stderr, "  -p port        server port (default $KVSTORE_PORT or %d)\n", DEFAULT_PORT);
+    fprintf(stderr, "  -c conns       concurrent connections (default 16)\n");
+    fprintf(stderr, "  -n requests    requests to measure (default 100000)\n");
+    fprintf(stderr, "  -t seconds     measure for this long instead\n");
+    fprintf(stderr, "  -r percent     share of reads, the rest are writes (default 90)\n");
+    fprintf(stderr, "  -k keys        number of distinct keys (default 10000)\n");
+    fprintf(stderr, "  -z theta       zipfian keys with skew theta in (0, 1), e.g. 0.99 (default uniform)\n");
+    fprintf(stderr, "  -s min[:max]   value size in bytes, or a uniform range (default 32)\n");
+    fprintf(stderr, "  -P depth       requests in flight per connection (default 1)\n");
+    fprintf(stderr, "  -b             use the binary protocol\n");
+    fprintf(stderr, "  -R             a new connection for every request, as fork mode needs\n");
+    fprintf(stderr, "  -F             do not store the keys before measuring\n");
+    fprintf(stderr, "  -S seed        random seed (default 1)\n");
+    fprintf(stderr, "  -C port        make -n random changes to -k keys and namespaces instead of\n");
+    fprintf(stderr, "                 measuring, and check that the replica on port agrees\n");
+    fprintf(stderr, "  -W             with -C, only make the changes\n");
+}
+
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    opt.host = DEFAULT_HOST;
+    char* port_str = getenv("KVSTORE_PORT");
+    opt.port = port_str ? atoi(port_str) : DEFAULT_PORT;
+    opt.connections = 16;
+    opt.requests = 100000;
+    opt.seconds = 0;
+    opt.read_percent = 90;
+    opt.keys = 10000;
+    opt.zipf = 0;
+    opt.min_value = opt.max_value = 32;
+    opt.pipeline = 1;
+    opt.binary = false;
+    opt.reconnect = false;
+    opt.prefill = true;
+    opt.seed = 1;
+    opt.check_port = 0;
+    opt.write_only = false;
+
+    int c;
+    char *end;
+    while ((c = getopt(argc, argv, "h:p:c:n:t:r:k:z:s:P:bRFS:C:W")) != -1) {
+        switch (c) {
+        case 'h':
+            opt.host = optarg;
+            break;
+        case 'p':
+            opt.port = atoi(optarg);
+            break;
+        case 'c':
+            opt.connections = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            opt.requests = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            opt.seconds = atof(optarg);
+            break;
+        case 'r':
+            opt.read_percent = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            opt.keys = strtoul(optarg, NULL, 10);
+            break;
+        case 'z':
+            opt.zipf = atof(optarg);
+            break;
+        case 's':
+            opt.min_value = opt.max_value = strtoul(optarg, &end, 10);
+            if (*end == ':') {
+                opt.max_value = strtoul(end + 1, NULL, 10);
+            }
+            break;
+        case 'P':
+            opt.pipeline = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            opt.binary = true;
+            break;
+        case 'R':
+            opt.reconnect = true;
+            break;
+        case 'F':
+            opt.prefill = false;
+            break;
+        case 'S':
+            opt.seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'C':
+            opt.check_port = atoi(optarg);
+            break;
+        case 'W':
+            opt.write_only = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    // Empty values are ignored by the text protocol and never answered
+    if (optind != argc || opt.connections == 0 || (opt.requests == 0 && opt.seconds <= 0) ||
+        opt.read_percent > 100 || opt.keys == 0 || opt.zipf < 0 || opt.zipf >= 1 ||
+        opt.min_value == 0 || opt.min_value > opt.max_value || opt.max_value > MAX_FRAME_SIZE / 2 ||
+        opt.pipeline == 0 || (opt.write_only && opt.check_port <= 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (opt.check_port > 0) {
+        return check_replica(opt) ? 0 : 1;
+    }
+
+    Bench bench(opt);
+    if (!bench.resolve()) {
+        return 1;
+    }
+    if (opt.prefill && !bench.fill()) {
+        return 1;
+    }
+    if (!bench.measure()) {
+        return 1;
+    }
+    bench.report();
+    return bench.errors > 0 ? 1 : 0;
+}
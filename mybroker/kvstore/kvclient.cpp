@@ -0,0 +1,582 @@
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <new>
+
+#include "kvclient.hpp"
+#include "protocol.hpp"
+
+#define DEFAULT_TIMEOUT_MS 5000
+#define READ_SIZE 65536
+// Keys per frame; the protocol allows up to 65535
+#define MAX_FRAME_ITEMS 4096
+
+
+KvConnection::~KvConnection()
+{
+    close(fd);
+}
+
+
+KvPool::KvPool(size_t max_idle)
+    : max_idle(max_idle), pid(getpid()), addr_len(0), timeout_ms(DEFAULT_TIMEOUT_MS)
+{
+}
+
+KvPool::~KvPool()
+{
+    for (KvConnection* conn : idle) {
+        delete conn;
+    }
+}
+
+bool KvPool::resolve(const char *host, int port)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    struct addrinfo *result;
+    if (getaddrinfo(host, port_str, &hints, &result) != 0) {
+        return false;
+    }
+    memcpy(&addr, result->ai_addr, result->ai_addrlen);
+    addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+// A forked child, such as a web worker, must not share its parent's
+// connections; closing its copies leaves the parent's open
+void KvPool::drop_inherited()
+{
+    if (pid == getpid()) {
+        return;
+    }
+    for (KvConnection* conn : idle) {
+        delete conn;
+    }
+    idle.clear();
+    pid = getpid();
+}
+
+KvConnection* KvPool::acquire()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        drop_inherited();
+        if (!idle.empty()) {
+            KvConnection* conn = idle.back();
+            idle.pop_back();
+            conn->reused = true;
+            return conn;
+        }
+    }
+
+    int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return nullptr;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, addr_len) < 0) {
+        close(fd);
+        return nullptr;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return new KvConnection(fd);
+}
+
+void KvPool::release(KvConnection* conn, bool ok)
+{
+    if (ok && conn->in.empty()) {
+        std::lock_guard<std::mutex> guard(lock);
+        drop_inherited();
+        if (idle.size() < max_idle) {
+            idle.push_back(conn);
+            return;
+        }
+    }
+    delete conn;
+}
+
+
+// Items of OP_EXEC are a key, a number and a value; of the others a key and
+// either a value or a number
+static size_t item_size(uint8_t opcode, boost::string_view key, boost::string_view value, const int64_t* number)
+{
+    size_t size = sizeof(uint32_t) + key.size();
+    if (opcode == OP_MSET || opcode == OP_EXEC) {
+        size += sizeof(uint32_t) + value.size();
+    }
+    if (number) {
+        size += sizeof(uint32_t) + sizeof(int64_t);
+    }
+    return size;
+}
+
+bool KvPipeline::add(uint8_t opcode, boost::string_view key, boost::string_view value, const int64_t* number, bool join)
+{
+    size_t item_len = item_size(opcode, key, value, number);
+    if (item_len > MAX_FRAME_SIZE) {
+        return false;
+    }
+
+    frame_header_t header;
+    join = join && !frames.empty() && frames.back().opcode == opcode && frames.back().count < MAX_FRAME_ITEMS;
+    if (join) {
+        memcpy(&header, &out[last_frame], sizeof(header));
+        join = header.length + item_len <= MAX_FRAME_SIZE;
+    }
+    if (!join) {
+        last_frame = out.size();
+        header.magic = BINARY_MAGIC;
+        header.opcode = opcode;
+        header.count = 0;
+        header.length = 0;
+        out.append((const char*)&header, sizeof(header));
+        frames.push_back(Frame{opcode, 0});
+    }
+    header.count += 1;
+    header.length += item_len;
+    memcpy(&out[last_frame], &header, sizeof(header));
+    frames.back().count += 1;
+
+    uint32_t len = key.size();
+    out.append((const char*)&len, sizeof(len));
+    out.append(key.data(), key.size());
+    if (number) {
+        len = sizeof(int64_t);
+        out.append((const char*)&len, sizeof(len));
+        out.append((const char*)number, sizeof(int64_t));
+    }
+    if (opcode == OP_MSET || opcode == OP_EXEC) {
+        len = value.size();
+        out.append((const char*)&len, sizeof(len));
+        out.append(value.data(), value.size());
+    }
+    ++keys;
+    return true;
+}
+
+bool KvPipeline::get(boost::string_view key)
+{
+    return add(OP_MGET, key, boost::string_view(), nullptr);
+}
+
+bool KvPipeline::set(boost::string_view key, boost::string_view value)
+{
+    return add(OP_MSET, key, value, nullptr);
+}
+
+bool KvPipeline::del(boost::string_view key)
+{
+    return add(OP_MDEL, key, boost::string_view(), nullptr);
+}
+
+bool KvPipeline::incr(boost::string_view key, int64_t delta)
+{
+    return add(OP_INCR, key, boost::string_view(), &delta);
+}
+
+bool KvPipeline::transaction(const std::vector<KvChange>& changes)
+{
+    // Split across frames, it would no longer be applied as a whole
+    size_t size = 0;
+    for (const KvChange& change : changes) {
+        int64_t op = change.del ? EXEC_REMOVE : EXEC_STORE;
+        size += item_size(OP_EXEC, change.key, change.value, &op);
+    }
+    if (changes.empty() || changes.size() > MAX_FRAME_ITEMS || size > MAX_FRAME_SIZE) {
+        return false;
+    }
+    for (size_t i = 0; i < changes.size(); ++i) {
+        int64_t op = changes[i].del ? EXEC_REMOVE : EXEC_STORE;
+        boost::string_view value = changes[i].del ? boost::string_view() : changes[i].value;
+        add(OP_EXEC, changes[i].key, value, &op, i > 0);
+    }
+    return true;
+}
+
+
+// Takes the reply to frame off the front of conn->in if it is all there.
+// Returns false until it is, or with *status set if it makes no sense.
+bool KvPipeline::parse_frame(KvConnection* conn, const Frame& frame, std::vector<KvResult>* results, int* status)
+{
+    frame_header_t header;
+    if (conn->in.size() < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, conn->in.data(), sizeof(header));
+    if (header.magic != BINARY_MAGIC || header.opcode != frame.opcode) {
+        *status = KV_ERR_PROTOCOL;
+        return false;
+    }
+    if (conn->in.size() < sizeof(header) + header.length) {
+        return false;
+    }
+
+    const char* pos = conn->in.data() + sizeof(header);
+    const char* end = pos + header.length;
+    if (header.count != frame.count) {
+        // A request the server could not parse, a write to a replica, or a
+        // request to a missing namespace gets a single status back
+        uint8_t item_status = header.length >= 1 ? (uint8_t)*pos : STATUS_OK;
+        if (header.count != 1 || (item_status != STATUS_BAD_REQUEST && item_status != STATUS_READ_ONLY && item_status != STATUS_NO_NAMESPACE)) {
+            *status = KV_ERR_PROTOCOL;
+            return false;
+        }
+        for (uint16_t i = 0; i < frame.count; ++i) {
+            results->push_back(KvResult{(kv_status_t)item_status, std::string(), 0});
+        }
+        conn->in.erase(0, sizeof(header) + header.length);
+        return true;
+    }
+
+    for (uint16_t i = 0; i < header.count; ++i) {
+        if (pos >= end) {
+            *status = KV_ERR_PROTOCOL;
+            return false;
+        }
+        KvResult result{(uint8_t)*pos++, std::string(), 0};
+        if (frame.opcode == OP_MGET && result.status == STATUS_OK) {
+            uint32_t len;
+            if (end - pos < (ptrdiff_t)sizeof(len)) {
+                *status = KV_ERR_PROTOCOL;
+                return false;
+            }
+            memcpy(&len, pos, sizeof(len));
+            pos += sizeof(len);
+            if ((size_t)(end - pos) < len) {
+                *status = KV_ERR_PROTOCOL;
+                return false;
+            }
+            result.value.assign(pos, len);
+            pos += len;
+        }
+        else if (frame.opcode == OP_INCR && result.status == STATUS_OK) {
+            if (end - pos < (ptrdiff_t)sizeof(int64_t)) {
+                *status = KV_ERR_PROTOCOL;
+                return false;
+            }
+            memcpy(&result.number, pos, sizeof(int64_t));
+            pos += sizeof(int64_t);
+        }
+        results->push_back(std::move(result));
+    }
+    conn->in.erase(0, sizeof(header) + header.length);
+    return true;
+}
+
+// Writes the requests while reading replies, since the server stops reading
+// a connection whose replies are not being read
+int KvPipeline::run(KvConnection* conn, std::vector<KvResult>* results, bool* received)
+{
+    size_t sent = 0;
+    size_t frame = 0;
+    char buf[READ_SIZE];
+    int timeout_ms = pool->timeout();
+    while (frame < frames.size()) {
+        struct pollfd p;
+        p.fd = conn->fd;
+        p.events = POLLIN | (sent < out.size() ? POLLOUT : 0);
+        int n = poll(&p, 1, timeout_ms > 0 ? timeout_ms : -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return KV_ERR_IO;
+        }
+
+        if (p.revents & POLLOUT) {
+            ssize_t written = send(conn->fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return KV_ERR_IO;
+            }
+            if (written > 0) {
+                sent += written;
+            }
+        }
+        if (p.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t got = recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                return KV_ERR_IO;
+            }
+            if (got > 0) {
+                *received = true;
+                conn->in.append(buf, got);
+            }
+            int status = KV_OK;
+            while (frame < frames.size() && parse_frame(conn, frames[frame], results, &status)) {
+                ++frame;
+            }
+            if (status != KV_OK) {
+                return status;
+            }
+        }
+    }
+    return KV_OK;
+}
+
+int KvPipeline::exec(std::vector<KvResult>* results)
+{
+    int status = KV_OK;
+    results->clear();
+    if (!frames.empty()) {
+        results->reserve(keys);
+        // A pooled connection may have been closed by the server since it was
+        // last used; that shows as a failure before any reply, and only then
+        // is the request sent again on another connection
+        for (;;) {
+            KvConnection* conn = pool->acquire();
+            if (!conn) {
+                status = KV_ERR_IO;
+                break;
+            }
+            bool received = false;
+            status = run(conn, results, &received);
+            bool retry = status == KV_ERR_IO && conn->reused && !received;
+            pool->release(conn, status == KV_OK);
+            if (!retry) {
+                break;
+            }
+        }
+    }
+    out.clear();
+    frames.clear();
+    keys = 0;
+    return status;
+}
+
+
+struct kv_client
+{
+    KvPool pool;
+
+    kv_client(size_t max_idle) : pool(max_idle) {}
+};
+
+struct kv_pipeline
+{
+    KvPipeline pipeline;
+    std::vector<KvResult> results;
+
+    kv_pipeline(KvPool* pool) : pipeline(pool) {}
+};
+
+
+static char* copy_value(const std::string& value)
+{
+    char* copy = (char*)malloc(value.size() + 1);
+    if (copy) {
+        memcpy(copy, value.data(), value.size());
+        copy[value.size()] = '\0';
+    }
+    return copy;
+}
+
+// Runs a pipeline of one request
+static int exec_one(KvPipeline& pipeline, KvResult* result)
+{
+    std::vector<KvResult> results;
+    int status = pipeline.exec(&results);
+    if (status != KV_OK) {
+        return status;
+    }
+    *result = std::move(results[0]);
+    return result->status;
+}
+
+
+extern "C" {
+
+kv_client* kv_client_new(const char *host, int port, size_t max_idle)
+{
+    kv_client* client = new (std::nothrow) kv_client(max_idle);
+    if (client && !client->pool.resolve(host, port)) {
+        delete client;
+        return nullptr;
+    }
+    return client;
+}
+
+void kv_client_free(kv_client *client)
+{
+    delete client;
+}
+
+void kv_client_set_timeout(kv_client *client, int timeout_ms)
+{
+    client->pool.set_timeout(timeout_ms);
+}
+
+int kv_get(kv_client *client, const char *key, size_t key_len, char **value, size_t *value_len)
+{
+    KvPipeline pipeline(&client->pool);
+    KvResult result;
+    if (!pipeline.get(boost::string_view(key, key_len))) {
+        return KV_ERR_ARGUMENT;
+    }
+    int status = exec_one(pipeline, &result);
+    if (status == KV_OK) {
+        *value = copy_value(result.value);
+        *value_len = result.value.size();
+    }
+    return status;
+}
+
+int kv_set(kv_client *client, const char *key, size_t key_len, const char *value, size_t value_len)
+{
+    KvPipeline pipeline(&client->pool);
+    KvResult result;
+    if (!pipeline.set(boost::string_view(key, key_len), boost::string_view(value, value_len))) {
+        return KV_ERR_ARGUMENT;
+    }
+    return exec_one(pipeline, &result);
+}
+
+int kv_del(kv_client *client, const char *key, size_t key_len)
+{
+    KvPipeline pipeline(&client->pool);
+    KvResult result;
+    if (!pipeline.del(boost::string_view(key, key_len))) {
+        return KV_ERR_ARGUMENT;
+    }
+    return exec_one(pipeline, &result);
+}
+
+int kv_incr(kv_client *client, const char *key, size_t key_len, int64_t delta, int64_t *value)
+{
+    KvPipeline pipeline(&client->pool);
+    KvResult result;
+    if (!pipeline.incr(boost::string_view(key, key_len), delta)) {
+        return KV_ERR_ARGUMENT;
+    }
+    int status = exec_one(pipeline, &result);
+    if (status == KV_OK) {
+        *value = result.number;
+    }
+    return status;
+}
+
+int kv_mget(kv_client *client, size_t count, const char *const *keys, const size_t *key_lens,
+            char **values, size_t *value_lens, int *statuses)
+{
+    KvPipeline pipeline(&client->pool);
+    for (size_t i = 0; i < count; ++i) {
+        if (!pipeline.get(boost::string_view(keys[i], key_lens[i]))) {
+            return KV_ERR_ARGUMENT;
+        }
+    }
+    std::vector<KvResult> results;
+    int status = pipeline.exec(&results);
+    if (status != KV_OK) {
+        return status;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        statuses[i] = results[i].status;
+        values[i] = results[i].status == KV_OK ? copy_value(results[i].value) : nullptr;
+        value_lens[i] = results[i].value.size();
+    }
+    return KV_OK;
+}
+
+int kv_exec(kv_client *client, size_t count, const char *const *keys, const size_t *key_lens,
+            const char *const *values, const size_t *value_lens, int *statuses)
+{
+    KvPipeline pipeline(&client->pool);
+    std::vector<KvChange> changes(count);
+    for (size_t i = 0; i < count; ++i) {
+        changes[i].key = boost::string_view(keys[i], key_lens[i]);
+        changes[i].del = values[i] == nullptr;
+        if (values[i]) {
+            changes[i].value = boost::string_view(values[i], value_lens[i]);
+        }
+    }
+    if (!pipeline.transaction(changes)) {
+        return KV_ERR_ARGUMENT;
+    }
+    std::vector<KvResult> results;
+    int status = pipeline.exec(&results);
+    if (status != KV_OK) {
+        return status;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        statuses[i] = results[i].status;
+        if (results[i].status != KV_OK && results[i].status != KV_NOT_FOUND) {
+            // Every change failed with the same status
+            return results[i].status;
+        }
+    }
+    return KV_OK;
+}
+
+kv_pipeline* kv_pipeline_new(kv_client *client)
+{
+    return new (std::nothrow) kv_pipeline(&client->pool);
+}
+
+void kv_pipeline_free(kv_pipeline *pipeline)
+{
+    delete pipeline;
+}
+
+int kv_pipeline_get(kv_pipeline *pipeline, const char *key, size_t key_len)
+{
+    return pipeline->pipeline.get(boost::string_view(key, key_len)) ? KV_OK : KV_ERR_ARGUMENT;
+}
+
+int kv_pipeline_set(kv_pipeline *pipeline, const char *key, size_t key_len, const char *value, size_t value_len)
+{
+    return pipeline->pipeline.set(boost::string_view(key, key_len), boost::string_view(value, value_len)) ? KV_OK : KV_ERR_ARGUMENT;
+}
+
+int kv_pipeline_del(kv_pipeline *pipeline, const char *key, size_t key_len)
+{
+    return pipeline->pipeline.del(boost::string_view(key, key_len)) ? KV_OK : KV_ERR_ARGUMENT;
+}
+
+int kv_pipeline_incr(kv_pipeline *pipeline, const char *key, size_t key_len, int64_t delta)
+{
+    return pipeline->pipeline.incr(boost::string_view(key, key_len), delta) ? KV_OK : KV_ERR_ARGUMENT;
+}
+
+int kv_pipeline_exec(kv_pipeline *pipeline)
+{
+    return pipeline->pipeline.exec(&pipeline->results);
+}
+
+size_t kv_pipeline_size(kv_pipeline *pipeline)
+{
+    return pipeline->results.size();
+}
+
+int kv_pipeline_result(kv_pipeline *pipeline, size_t i, const char **value, size_t *value_len, int64_t *number)
+{
+    if (i >= pipeline->results.size()) {
+        return KV_ERR_ARGUMENT;
+    }
+    const KvResult& result = pipeline->results[i];
+    if (value) {
+        *value = result.value.data();
+        *value_len = result.value.size();
+    }
+    if (number) {
+        *number = result.number;
+    }
+    return result.status;
+}
+
+void kv_free(void *ptr)
+{
+    free(ptr);
+}
+
+}
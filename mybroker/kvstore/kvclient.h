@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// C interface of the client library, libkvclient.so, for callers that cannot
+// use kvclient.hpp, such as Python through ctypes. A kv_client is a pool of
+// binary protocol connections and may be shared between threads; a
+// kv_pipeline belongs to one thread at a time.
+//
+// Functions that talk to the server return a kv_status_t. Values they hand
+// out are allocated with malloc() and released with kv_free().
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The protocol's status_t, and negative values for failures on our side
+typedef enum {
+    KV_OK = 0,
+    KV_NOT_FOUND = 1,
+    KV_FULL = 2,
+    KV_BAD_REQUEST = 3,
+    KV_WRONG_TYPE = 4,
+    KV_MISMATCH = 5,
+    KV_OVERFLOW = 6,
+    KV_READ_ONLY = 7,       // a write sent to a replica
+    KV_NO_NAMESPACE = 8,    // a request to a namespace that does not exist
+    KV_ERR_IO = -1,         // could not connect, or the connection failed
+    KV_ERR_PROTOCOL = -2,   // the server's reply makes no sense
+    KV_ERR_ARGUMENT = -3,   // a request too large for a frame, or a bad index
+} kv_status_t;
+
+typedef struct kv_client kv_client;
+typedef struct kv_pipeline kv_pipeline;
+
+// Keeps up to max_idle connections open between calls. Connections are only
+// made when needed, so this fails only if host cannot be resolved.
+kv_client* kv_client_new(const char *host, int port, size_t max_idle);
+void kv_client_free(kv_client *client);
+// Send and receive timeout of every connection; 0 waits forever
+void kv_client_set_timeout(kv_client *client, int timeout_ms);
+
+int kv_get(kv_client *client, const char *key, size_t key_len, char **value, size_t *value_len);
+int kv_set(kv_client *client, const char *key, size_t key_len, const char *value, size_t value_len);
+int kv_del(kv_client *client, const char *key, size_t key_len);
+int kv_incr(kv_client *client, const char *key, size_t key_len, int64_t delta, int64_t *result);
+
+// Gets count keys in as few round trips as the frame size allows. statuses[i]
+// is KV_OK or KV_NOT_FOUND for every key if the call returns KV_OK.
+int kv_mget(kv_client *client, size_t count, const char *const *keys, const size_t *key_lens,
+            char **values, size_t *value_lens, int *statuses);
+
+// Applies count changes atomically, in one round trip: a NULL values[i]
+// removes keys[i], any other stores it. Returns KV_OK if they were applied,
+// with statuses[i] KV_OK, or KV_NOT_FOUND for removing a missing key;
+// otherwise none of them was, and KV_ERR_ARGUMENT means there are none or
+// they do not fit in one frame.
+int kv_exec(kv_client *client, size_t count, const char *const *keys, const size_t *key_lens,
+            const char *const *values, const size_t *value_lens, int *statuses);
+
+// Requests queued on a pipeline are written together and their replies read
+// back in one go by kv_pipeline_exec(). Each queued request has an index,
+// in order from 0, to fetch its result by.
+kv_pipeline* kv_pipeline_new(kv_client *client);
+void kv_pipeline_free(kv_pipeline *pipeline);
+int kv_pipeline_get(kv_pipeline *pipeline, const char *key, size_t key_len);
+int kv_pipeline_set(kv_pipeline *pipeline, const char *key, size_t key_len, const char *value, size_t value_len);
+int kv_pipeline_del(kv_pipeline *pipeline, const char *key, size_t key_len);
+int kv_pipeline_incr(kv_pipeline *pipeline, const char *key, size_t key_len, int64_t delta);
+// Sends everything queued and empties the queue. The results stay until the
+// next exec.
+int kv_pipeline_exec(kv_pipeline *pipeline);
+size_t kv_pipeline_size(kv_pipeline *pipeline);
+// The status of request i. value and number, if not NULL, are set to its
+// value, which stays owned by the pipeline, or to its integer result.
+int kv_pipeline_result(kv_pipeline *pipeline, size_t i, const char **value, size_t *value_len, int64_t *number);
+
+void kv_free(void *ptr);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+
+#include "kvclient.h"
+
+// Client library for the binary protocol. A KvPool keeps connections open
+// between requests, so a request costs a round trip instead of a TCP
+// handshake and a round trip. A KvPipeline sends any number of requests in
+// one write and reads their replies back in order.
+
+// One result of a pipeline, per key of the request it belongs to
+struct KvResult
+{
+    int status;         // kv_status_t
+    std::string value;  // for a get
+    int64_t number;     // for an incr, or the current value on a CAS mismatch
+};
+
+// One change of a transaction
+struct KvChange
+{
+    boost::string_view key;
+    boost::string_view value;
+    bool del;           // remove the key; value is ignored
+};
+
+class KvConnection
+{
+public:
+    explicit KvConnection(int fd) : fd(fd), reused(false) {}
+    ~KvConnection();
+
+    int fd;
+    bool reused;        // has served a request before
+    std::string in;
+
+private:
+    KvConnection(const KvConnection&);
+    KvConnection& operator=(const KvConnection&);
+};
+
+class KvPool
+{
+public:
+    KvPool(size_t max_idle);
+    ~KvPool();
+
+    // Resolves host; false if it cannot be
+    bool resolve(const char *host, int port);
+    void set_timeout(int timeout_ms) { this->timeout_ms = timeout_ms; }
+    int timeout() const { return timeout_ms; }
+
+    // Returns an idle connection, or a new one, or nullptr if connecting fails
+    KvConnection* acquire();
+    // Takes a connection back. One that failed is closed instead.
+    void release(KvConnection* conn, bool ok);
+
+private:
+    KvPool(const KvPool&);
+    KvPool& operator=(const KvPool&);
+
+    void drop_inherited();
+
+    std::mutex lock;
+    std::vector<KvConnection*> idle;
+    size_t max_idle;
+    pid_t pid;          // connections made before a fork are the parent's
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int timeout_ms;
+};
+
+class KvPipeline
+{
+public:
+    explicit KvPipeline(KvPool* pool) : pool(pool) {}
+
+    // Each queues a request for a single key and returns false if it does not
+    // fit in a frame. Requests of the same kind in a row share a frame, so a
+    // run of gets goes out as one multi-key get.
+    bool get(boost::string_view key);
+    bool set(boost::string_view key, boost::string_view value);
+    bool del(boost::string_view key);
+    bool incr(boost::string_view key, int64_t delta);
+    // Queues changes that the server applies all or none of, atomically.
+    // Returns false if there are none or they do not fit in one frame. Each gets KV_OK, or
+    // KV_NOT_FOUND for removing a missing key; if the transaction failed,
+    // every one gets the status that stopped it.
+    bool transaction(const std::vector<KvChange>& changes);
+
+    // Runs every queued request and empties the queue. Returns KV_OK if all
+    // replies were received, in which case results holds one KvResult per
+    // key, in the order they were queued.
+    int exec(std::vector<KvResult>* results);
+
+    size_t size() const { return keys; }
+
+private:
+    struct Frame
+    {
+        uint8_t opcode;
+        uint16_t count;
+    };
+
+    bool add(uint8_t opcode, boost::string_view key, boost::string_view value, const int64_t* number, bool join = true);
+    int run(KvConnection* conn, std::vector<KvResult>* results, bool* received);
+    bool parse_frame(KvConnection* conn, const Frame& frame, std::vector<KvResult>* results, int* status);
+
+    KvPool* pool;
+    std::string out;
+    std::vector<Frame> frames;
+    size_t last_frame = 0;  // offset of the last frame in `out`
+    size_t keys = 0;
+};
@@ -0,0 +1,212 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.hpp"
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+// As in LZ4, the last match starts at least LZ_MATCH_LIMIT bytes before the
+// end, and the last LZ_LAST_LITERALS bytes are always literals
+#define LZ_MATCH_LIMIT 12
+#define LZ_LAST_LITERALS 5
+// Misses in a row before the search starts skipping ahead faster, so that
+// incompressible data costs little
+#define LZ_SKIP_TRIGGER 6
+
+
+static inline uint32_t read32(const uint8_t* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t read64(const uint8_t* p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash4(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// A length of 15 or more continues in bytes of 255 and a last one below it
+static inline uint8_t* write_length(uint8_t* op, size_t length)
+{
+    for (; length >= 255; length -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+static uint8_t* write_sequence(uint8_t* op, const uint8_t* literals, size_t literal_count, size_t offset, size_t match_length)
+{
+    uint8_t* token = op++;
+    *token = (uint8_t)((literal_count < 15 ? literal_count : 15) << 4);
+    if (literal_count >= 15) {
+        op = write_length(op, literal_count - 15);
+    }
+    memcpy(op, literals, literal_count);
+    op += literal_count;
+    if (offset == 0) {
+        // The last sequence has literals only
+        return op;
+    }
+
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    match_length -= LZ_MIN_MATCH;
+    *token |= (uint8_t)(match_length < 15 ? match_length : 15);
+    if (match_length >= 15) {
+        op = write_length(op, match_length - 15);
+    }
+    return op;
+}
+
+// How far the bytes at a and b agree, up to limit for a
+static inline const uint8_t* match_end(const uint8_t* a, const uint8_t* b, const uint8_t* limit)
+{
+    while (a + 8 <= limit) {
+        uint64_t diff = read64(a) ^ read64(b);
+        if (diff) {
+            // Little endian: the lowest set bit is in the first differing byte
+            return a + (__builtin_ctzll(diff) >> 3);
+        }
+        a += 8;
+        b += 8;
+    }
+    while (a < limit && *a == *b) {
+        ++a;
+        ++b;
+    }
+    return a;
+}
+
+size_t lz_compress(const char* src, size_t size, std::string* out)
+{
+    size_t start = out->size();
+    out->resize(start + lz_bound(size));
+    uint8_t* op = (uint8_t*)&(*out)[start];
+    uint8_t* op_start = op;
+
+    const uint8_t* base = (const uint8_t*)src;
+    const uint8_t* ip = base;
+    const uint8_t* end = base + size;
+    const uint8_t* anchor = base;
+    if (size > LZ_MATCH_LIMIT) {
+        const uint8_t* match_limit = end - LZ_MATCH_LIMIT;
+        const uint8_t* copy_limit = end - LZ_LAST_LITERALS;
+        // Positions of the last 4-byte sequence seen with each hash; a stale or
+        // colliding one is caught by comparing the bytes
+        uint32_t table[1 << LZ_HASH_BITS];
+        memset(table, 0, sizeof(table));
+        uint32_t misses = 1 << LZ_SKIP_TRIGGER;
+
+        while (ip < match_limit) {
+            uint32_t sequence = read32(ip);
+            uint32_t h = hash4(sequence);
+            const uint8_t* ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != sequence) {
+                ip += misses++ >> LZ_SKIP_TRIGGER;
+                continue;
+            }
+            misses = 1 << LZ_SKIP_TRIGGER;
+
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                --ip;
+                --ref;
+            }
+            const uint8_t* matched = match_end(ip + LZ_MIN_MATCH, ref + LZ_MIN_MATCH, copy_limit);
+            op = write_sequence(op, anchor, ip - anchor, ip - ref, matched - ip);
+            ip = matched;
+            anchor = ip;
+            if (ip < match_limit) {
+                table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+            }
+        }
+    }
+    op = write_sequence(op, anchor, end - anchor, 0, 0);
+
+    size_t written = op - op_start;
+    out->resize(start + written);
+    return written;
+}
+
+// Reads the rest of a length that started at 15 in the token
+static inline bool read_length(const uint8_t** ip, const uint8_t* end, size_t* length)
+{
+    uint8_t byte;
+    do {
+        if (*ip >= end) {
+            return false;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool lz_decompress(const char* src, size_t src_size, char* dst, size_t dst_size)
+{
+    const uint8_t* ip = (const uint8_t*)src;
+    const uint8_t* end = ip + src_size;
+    uint8_t* op = (uint8_t*)dst;
+    uint8_t* op_end = op + dst_size;
+
+    for (;;) {
+        if (ip >= end) {
+            return false;
+        }
+        uint8_t token = *ip++;
+        size_t literal_count = token >> 4;
+        if (literal_count == 15 && !read_length(&ip, end, &literal_count)) {
+            return false;
+        }
+        if (literal_count > (size_t)(end - ip) || literal_count > (size_t)(op_end - op)) {
+            return false;
+        }
+        memcpy(op, ip, literal_count);
+        ip += literal_count;
+        op += literal_count;
+        if (ip == end) {
+            return op == op_end;
+        }
+
+        if (end - ip < 2) {
+            return false;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && !read_length(&ip, end, &match_length)) {
+            return false;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t*)dst) || match_length > (size_t)(op_end - op)) {
+            return false;
+        }
+        const uint8_t* match = op - offset;
+        if (offset >= match_length) {
+            memcpy(op, match, match_length);
+            op += match_length;
+        }
+        else {
+            // Overlapping: a short offset repeats the bytes just written, so
+            // copy no more than offset bytes at a time
+            uint8_t* copy_end = op + match_length;
+            if (offset >= 8) {
+                for (; op + 8 <= copy_end; op += 8, match += 8) {
+                    memcpy(op, match, 8);
+                }
+            }
+            while (op < copy_end) {
+                *op++ = *match++;
+            }
+        }
+    }
+}
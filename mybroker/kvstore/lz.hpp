@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+
+// A small LZ77 codec for large values, in the LZ4 block format: a sequence
+// of runs of literal bytes, each followed by a copy of up to 64KB back in the
+// output, found through a hash table of 4-byte prefixes. It trades ratio for
+// speed, compressing at hundreds of MB/s and decompressing faster still.
+//
+// Only the block is stored, not the uncompressed size; the caller keeps that.
+
+#define LZ_MAX_OFFSET 65535
+
+// Most bytes lz_compress() may write for size bytes of input
+inline size_t lz_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+// Appends the compressed form of src to *out. Returns its size.
+size_t lz_compress(const char* src, size_t size, std::string* out);
+// Decompresses a block into exactly dst_size bytes at dst. Returns false if
+// the block is malformed or does not decompress to that size; it never reads
+// or writes out of bounds either way.
+bool lz_decompress(const char* src, size_t src_size, char* dst, size_t dst_size);
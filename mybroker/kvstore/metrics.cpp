@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <memory>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "metrics.hpp"
+#include "shm.hpp"
+
+namespace bip = boost::interprocess;
+
+static const char* command_names[CMD_COUNT] = {
+    "store", "load", "remove", "incr", "cas", "expire", "scan", "stats", "watch", "exec",
+};
+
+static std::unique_ptr<bip::mapped_region> region;
+static ServerMetrics* metrics = nullptr;
+static std::atomic<int> listener_count(0);
+static int listeners[MAX_LISTENERS];
+// The kernel's counters at startup
+static uint64_t base_overflows = 0;
+static uint64_t base_drops = 0;
+
+
+static uint64_t realtime_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+uint64_t metrics_clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Reads the connections dropped because an accept queue was full, and all
+// connections dropped on the way to an accept queue, from /proc/net/netstat.
+// The kernel only counts these for the whole network namespace.
+static bool listen_drops(uint64_t* overflows, uint64_t* drops)
+{
+    FILE* f = fopen("/proc/net/netstat", "r");
+    if (!f) {
+        return false;
+    }
+    // A "TcpExt:" line of names is followed by one of their values
+    char names[4096], values[4096];
+    bool found = false;
+    while (!found && fgets(names, sizeof(names), f)) {
+        if (strncmp(names, "TcpExt:", 7) != 0 || !fgets(values, sizeof(values), f)) {
+            continue;
+        }
+        char *name_save, *value_save;
+        char* name = strtok_r(names, " \n", &name_save);
+        char* value = strtok_r(values, " \n", &value_save);
+        while (name && value) {
+            if (strcmp(name, "ListenOverflows") == 0) {
+                *overflows = strtoull(value, NULL, 10);
+                found = true;
+            }
+            else if (strcmp(name, "ListenDrops") == 0) {
+                *drops = strtoull(value, NULL, 10);
+            }
+            name = strtok_r(NULL, " \n", &name_save);
+            value = strtok_r(NULL, " \n", &value_save);
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+void init_metrics()
+{
+    std::string name = segment_name(METRICS_SEGMENT, "_metrics");
+    bip::shared_memory_object::remove(name.c_str());
+    bip::shared_memory_object shm(bip::create_only, name.c_str(), bip::read_write);
+    shm.truncate(sizeof(ServerMetrics));
+    region.reset(new bip::mapped_region(shm, bip::read_write));
+    metrics = static_cast<ServerMetrics*>(region->get_address());
+    metrics->start_ms = realtime_ms();
+    listen_drops(&base_overflows, &base_drops);
+}
+
+
+// Values below 2^LATENCY_SUB_BITS get a bucket each; above that, every power
+// of two is split into 2^LATENCY_SUB_BITS buckets
+static size_t latency_bucket(uint64_t value)
+{
+    const uint64_t sub_count = 1 << LATENCY_SUB_BITS;
+    if (value < sub_count) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    size_t block = exponent - LATENCY_SUB_BITS + 1;
+    return (block << LATENCY_SUB_BITS) + ((value >> (exponent - LATENCY_SUB_BITS)) & (sub_count - 1));
+}
+
+// The highest value that falls into bucket i
+static uint64_t bucket_limit(size_t i)
+{
+    const uint64_t sub_count = 1 << LATENCY_SUB_BITS;
+    size_t block = i >> LATENCY_SUB_BITS;
+    uint64_t sub = i & (sub_count - 1);
+    if (block == 0) {
+        return sub;
+    }
+    return ((sub_count + sub + 1) << (block - 1)) - 1;
+}
+
+void record_command(Command cmd, uint64_t start_ns)
+{
+    if (!metrics) {
+        return;
+    }
+    CommandMetrics& command = metrics->commands[cmd];
+    command.ops.fetch_add(1, std::memory_order_relaxed);
+    command.latency[latency_bucket(metrics_clock_ns() - start_ns)].fetch_add(1, std::memory_order_relaxed);
+
+    // Whoever first counts in a new second resets its slot; a count racing
+    // with the reset may be lost, which a rate can afford
+    uint64_t second = realtime_ms() / 1000;
+    RateSlot& slot = command.rate[second % RATE_SLOTS];
+    uint64_t seen = slot.second.load(std::memory_order_relaxed);
+    if (seen != second && slot.second.compare_exchange_strong(seen, second, std::memory_order_relaxed)) {
+        slot.count.store(0, std::memory_order_relaxed);
+    }
+    slot.count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void record_get(bool hit)
+{
+    if (metrics) {
+        (hit ? metrics->get_hits : metrics->get_misses).fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void connection_opened()
+{
+    if (metrics) {
+        metrics->curr_connections.fetch_add(1, std::memory_order_relaxed);
+        metrics->total_connections.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void connection_closed()
+{
+    if (metrics) {
+        metrics->curr_connections.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+void add_listener(int fd)
+{
+    int i = listener_count.load();
+    if (i < MAX_LISTENERS) {
+        listeners[i] = fd;
+        listener_count.store(i + 1);
+    }
+}
+
+void record_compression(uint64_t size, uint64_t compressed, uint64_t ns)
+{
+    if (!metrics) {
+        return;
+    }
+    if (compressed) {
+        metrics->compressed_values.fetch_add(1, std::memory_order_relaxed);
+        metrics->compress_bytes_in.fetch_add(size, std::memory_order_relaxed);
+        metrics->compress_bytes_out.fetch_add(compressed, std::memory_order_relaxed);
+    }
+    else {
+        metrics->incompressible_values.fetch_add(1, std::memory_order_relaxed);
+    }
+    metrics->compress_ns.fetch_add(ns, std::memory_order_relaxed);
+}
+
+void record_decompression(uint64_t ns)
+{
+    if (metrics) {
+        metrics->decompressed_values.fetch_add(1, std::memory_order_relaxed);
+        metrics->decompress_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+}
+
+void replica_attached(bool attached)
+{
+    if (metrics) {
+        if (attached) {
+            metrics->replicas.fetch_add(1, std::memory_order_relaxed);
+        }
+        else {
+            metrics->replicas.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+void replica_connected(bool connected)
+{
+    if (metrics) {
+        metrics->replica.store(true, std::memory_order_relaxed);
+        metrics->repl_connected.store(connected, std::memory_order_relaxed);
+    }
+}
+
+void record_sync_frame(uint64_t position, uint64_t head, uint64_t sent_ms, bool full_sync_done)
+{
+    if (!metrics) {
+        return;
+    }
+    uint64_t now_ms = realtime_ms();
+    metrics->repl_position.store(position, std::memory_order_relaxed);
+    metrics->repl_head.store(head, std::memory_order_relaxed);
+    metrics->repl_last_io_ms.store(now_ms, std::memory_order_relaxed);
+    if (full_sync_done) {
+        metrics->repl_full_syncs.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (position >= head) {
+        // Clocks of two hosts may disagree by more than the transit time
+        metrics->repl_transit_ms.store(now_ms > sent_ms ? now_ms - sent_ms : 0, std::memory_order_relaxed);
+        metrics->repl_caught_up_ms.store(now_ms, std::memory_order_relaxed);
+    }
+}
+
+
+static void append_line(std::string* out, const char* format, const char* name, double value)
+{
+    char line[96];
+    snprintf(line, sizeof(line), format, name, value);
+    out->append(line);
+}
+
+void append_metrics(std::string* out)
+{
+    if (!metrics) {
+        return;
+    }
+
+    uint64_t now_ms = realtime_ms();
+    char line[96];
+    const struct {
+        const char *name;
+        uint64_t value;
+    } fields[] = {
+        {"uptime", (now_ms - metrics->start_ms) / 1000},
+        {"curr_connections", metrics->curr_connections.load(std::memory_order_relaxed)},
+        {"total_connections", metrics->total_connections.load(std::memory_order_relaxed)},
+        {"get_hits", metrics->get_hits.load(std::memory_order_relaxed)},
+        {"get_misses", metrics->get_misses.load(std::memory_order_relaxed)},
+    };
+    for (const auto &field : fields) {
+        snprintf(line, sizeof(line), "%s %llu\n", field.name, (unsigned long long)field.value);
+        out->append(line);
+    }
+
+    // For a listening socket, TCP_INFO gives the accept queue's length in
+    // tcpi_unacked and its limit in tcpi_sacked. Fork mode children have
+    // closed the listener, so they cannot see the queue.
+    uint64_t queued = 0, backlog = 0;
+    int listener_total = listener_count.load();
+    for (int i = 0; i < listener_total; ++i) {
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+        if (getsockopt(listeners[i], IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+            queued += info.tcpi_unacked;
+            backlog = info.tcpi_sacked;
+        }
+    }
+    uint64_t overflows = 0, drops = 0;
+    listen_drops(&overflows, &drops);
+    const struct {
+        const char *name;
+        uint64_t value;
+    } listen_fields[] = {
+        {"listeners", (uint64_t)listener_total},
+        {"listen_backlog", backlog},
+        {"accept_queue", queued},
+        {"listen_overflows", overflows - base_overflows},
+        {"listen_drops", drops - base_drops},
+    };
+    for (const auto &field : listen_fields) {
+        snprintf(line, sizeof(line), "%s %llu\n", field.name, (unsigned long long)field.value);
+        out->append(line);
+    }
+
+    uint64_t bytes_in = metrics->compress_bytes_in.load(std::memory_order_relaxed);
+    uint64_t bytes_out = metrics->compress_bytes_out.load(std::memory_order_relaxed);
+    const struct {
+        const char *name;
+        uint64_t value;
+    } compress_fields[] = {
+        {"compressed_values", metrics->compressed_values.load(std::memory_order_relaxed)},
+        {"incompressible_values", metrics->incompressible_values.load(std::memory_order_relaxed)},
+        {"compress_bytes_in", bytes_in},
+        {"compress_bytes_out", bytes_out},
+        {"compress_cpu_us", metrics->compress_ns.load(std::memory_order_relaxed) / 1000},
+        {"decompressed_values", metrics->decompressed_values.load(std::memory_order_relaxed)},
+        {"decompress_cpu_us", metrics->decompress_ns.load(std::memory_order_relaxed) / 1000},
+    };
+    for (const auto &field : compress_fields) {
+        snprintf(line, sizeof(line), "%s %llu\n", field.name, (unsigned long long)field.value);
+        out->append(line);
+    }
+    // Bytes in per byte stored, of the values that were compressed
+    snprintf(line, sizeof(line), "compression_ratio %.2f\n", bytes_out ? (double)bytes_in / bytes_out : 1.0);
+    out->append(line);
+
+    if (!metrics->replica.load(std::memory_order_relaxed)) {
+        out->append("role primary\n");
+        snprintf(line, sizeof(line), "connected_replicas %llu\n",
+                 (unsigned long long)metrics->replicas.load(std::memory_order_relaxed));
+        out->append(line);
+    }
+    else {
+        // A replica that is caught up lags by the time its last change took
+        // to arrive; one that is behind, by how long ago it last caught up
+        uint64_t position = metrics->repl_position.load(std::memory_order_relaxed);
+        uint64_t head = metrics->repl_head.load(std::memory_order_relaxed);
+        uint64_t caught_up_ms = metrics->repl_caught_up_ms.load(std::memory_order_relaxed);
+        uint64_t lag_ms = metrics->repl_transit_ms.load(std::memory_order_relaxed);
+        bool connected = metrics->repl_connected.load(std::memory_order_relaxed);
+        if (position < head || !connected) {
+            lag_ms = caught_up_ms && now_ms > caught_up_ms ? now_ms - caught_up_ms : 0;
+        }
+        uint64_t last_io_ms = metrics->repl_last_io_ms.load(std::memory_order_relaxed);
+        out->append("role replica\n");
+        const struct {
+            const char *name;
+            uint64_t value;
+        } repl_fields[] = {
+            {"repl_connected", connected},
+            {"repl_full_syncs", metrics->repl_full_syncs.load(std::memory_order_relaxed)},
+            {"repl_position", position},
+            {"repl_lag_events", head > position ? head - position : 0},
+            {"repl_lag_ms", lag_ms},
+            {"repl_last_io_ms", last_io_ms && now_ms > last_io_ms ? now_ms - last_io_ms : 0},
+        };
+        for (const auto &field : repl_fields) {
+            snprintf(line, sizeof(line), "%s %llu\n", field.name, (unsigned long long)field.value);
+            out->append(line);
+        }
+    }
+
+    uint64_t second = now_ms / 1000;
+    for (int cmd = 0; cmd < CMD_COUNT; ++cmd) {
+        const CommandMetrics& command = metrics->commands[cmd];
+        const char* name = command_names[cmd];
+
+        snprintf(line, sizeof(line), "cmd_%s %llu\n", name, (unsigned long long)command.ops.load(std::memory_order_relaxed));
+        out->append(line);
+
+        // The current second is still filling up, so the window ends before it
+        uint64_t recent = 0;
+        for (const RateSlot& slot : command.rate) {
+            uint64_t slot_second = slot.second.load(std::memory_order_relaxed);
+            if (slot_second < second && slot_second + RATE_WINDOW >= second) {
+                recent += slot.count.load(std::memory_order_relaxed);
+            }
+        }
+        append_line(out, "cmd_%s_per_sec %.1f\n", name, (double)recent / RATE_WINDOW);
+
+        // Percentiles of a copy, since other workers keep recording
+        uint64_t counts[LATENCY_BUCKETS];
+        uint64_t total = 0;
+        for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+            counts[i] = command.latency[i].load(std::memory_order_relaxed);
+            total += counts[i];
+        }
+        const struct {
+            const char* format;
+            double quantile;
+        } percentiles[] = {
+            {"cmd_%s_p50_us %.3f\n", 0.5},
+            {"cmd_%s_p99_us %.3f\n", 0.99},
+            {"cmd_%s_p999_us %.3f\n", 0.999},
+        };
+        for (const auto& percentile : percentiles) {
+            uint64_t rank = (uint64_t)(percentile.quantile * total + 0.5);
+            uint64_t seen = 0;
+            uint64_t value = 0;
+            for (size_t i = 0; i < LATENCY_BUCKETS && total > 0; ++i) {
+                seen += counts[i];
+                if (seen >= rank && seen > 0) {
+                    value = bucket_limit(i);
+                    break;
+                }
+            }
+            append_line(out, percentile.format, name, value / 1000.0);
+        }
+    }
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+// Server metrics for the stats command. They live in a shared-memory segment
+// of their own, apart from the store, so every worker process and thread
+// adds to the same counters, and restoring the store from a snapshot does not
+// bring back old ones.
+//
+// Latencies go into HDR-style histograms: log-linear buckets with
+// 2^LATENCY_SUB_BITS buckets per power of two, so any recorded value is off
+// by at most 1/16 of it, whatever its magnitude.
+
+#define METRICS_SEGMENT "kvstore_metrics"
+#define LATENCY_SUB_BITS 4
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+#define RATE_SLOTS 16           // seconds of per-second counts kept
+#define RATE_WINDOW 10          // seconds ops/sec is averaged over
+#define MAX_LISTENERS 256
+
+enum Command
+{
+    CMD_STORE,
+    CMD_LOAD,
+    CMD_REMOVE,
+    CMD_INCR,
+    CMD_CAS,
+    CMD_EXPIRE,
+    CMD_SCAN,
+    CMD_STATS,
+    CMD_WATCH,
+    CMD_EXEC,
+    CMD_COUNT,
+};
+
+struct RateSlot
+{
+    std::atomic<uint64_t> second;
+    std::atomic<uint64_t> count;
+};
+
+struct CommandMetrics
+{
+    std::atomic<uint64_t> ops;
+    RateSlot rate[RATE_SLOTS];
+    std::atomic<uint64_t> latency[LATENCY_BUCKETS];     // nanoseconds
+};
+
+// Created zeroed, which is a valid initial state for every field
+struct ServerMetrics
+{
+    uint64_t start_ms;
+    std::atomic<uint64_t> curr_connections;
+    std::atomic<uint64_t> total_connections;
+    std::atomic<uint64_t> get_hits;
+    std::atomic<uint64_t> get_misses;
+    CommandMetrics commands[CMD_COUNT];
+    // Replication: a primary counts the replicas streaming from it, a
+    // replica where it is in the primary's stream of changes
+    std::atomic<uint64_t> replicas;
+    std::atomic<bool> replica;
+    std::atomic<bool> repl_connected;
+    std::atomic<uint64_t> repl_full_syncs;
+    std::atomic<uint64_t> repl_position;
+    std::atomic<uint64_t> repl_head;
+    std::atomic<uint64_t> repl_last_io_ms;
+    // When the replica last had every change the primary had made, and how
+    // long that change took to arrive
+    std::atomic<uint64_t> repl_caught_up_ms;
+    std::atomic<uint64_t> repl_transit_ms;
+    // Values that were compressed when stored, and those that did not
+    // shrink and were stored as they were; the bytes are of the former only
+    std::atomic<uint64_t> compressed_values;
+    std::atomic<uint64_t> incompressible_values;
+    std::atomic<uint64_t> compress_bytes_in;
+    std::atomic<uint64_t> compress_bytes_out;
+    std::atomic<uint64_t> compress_ns;
+    std::atomic<uint64_t> decompressed_values;
+    std::atomic<uint64_t> decompress_ns;
+};
+
+// Creates the metrics segment. Called once, before any worker starts; until
+// then recording does nothing.
+void init_metrics();
+
+uint64_t metrics_clock_ns();
+// Counts a request of cmd whose handling started at start_ns
+void record_command(Command cmd, uint64_t start_ns);
+void record_get(bool hit);
+void connection_opened();
+void connection_closed();
+// Reports the accept queue of a listening socket in stats
+void add_listener(int fd);
+// A value of `size` bytes took ns to compress, to `compressed` bytes, or
+// did not shrink if that is 0
+void record_compression(uint64_t size, uint64_t compressed, uint64_t ns);
+void record_decompression(uint64_t ns);
+// A primary's replica started or stopped streaming
+void replica_attached(bool attached);
+// A replica connected to its primary, or lost it
+void replica_connected(bool connected);
+// A replica applied a sync frame; full_sync_done if it ended a full sync
+void record_sync_frame(uint64_t position, uint64_t head, uint64_t sent_ms, bool full_sync_done);
+
+// Appends "name value" lines for the stats command
+void append_metrics(std::string* out);
@@ -0,0 +1,493 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "persist.hpp"
+#include "store.hpp"
+
+#define SNAPSHOT_MAGIC "KVSNAP04"
+// The image starts on a page boundary so it can be mapped on its own
+#define SNAPSHOT_DATA_OFFSET 4096
+#define SNAPSHOT_SEGMENT "kvstore_snapshot"
+#define DEL_MARKER 0xffffffff
+
+#define DEFAULT_SNAPSHOT_INTERVAL 300           // seconds
+#define DEFAULT_SNAPSHOT_LOG_SIZE (64 << 20)    // bytes of log since the last one
+
+
+typedef struct snapshot_header {
+    char magic[8];
+    uint64_t generation;    // first log generation not included
+    uint64_t seq;           // last log record included
+    uint64_t size;          // bytes of segment image
+} snapshot_header_t;
+
+// Every record is checksummed, so replay stops at a record that was torn by
+// a crash.
+typedef struct log_record_header {
+    uint32_t checksum;      // of everything after this field
+    uint32_t key_length;
+    uint32_t value_length;  // DEL_MARKER for a deletion
+    uint16_t slot;          // of the key's keyspace
+    uint16_t kind;          // record_kind_t
+    uint64_t seq;
+} log_record_header_t;
+
+// A keyspace record's key is the keyspace's name; a RECORD_KEYSPACE's value
+// is its quota as a u64. A RECORD_BATCH has no key, and its value is the
+// number of RECORD_KEY records of the batch that follow it, as a u32.
+typedef enum record_kind {
+    RECORD_KEY = 0,
+    RECORD_KEYSPACE = 1,
+    RECORD_DROP = 2,
+    RECORD_BATCH = 3,
+} record_kind_t;
+
+
+uint32_t record_checksum(const char* record, size_t size)
+{
+    size_t skip = sizeof(uint32_t);
+    return (uint32_t)hash_key(boost::string_view(record + skip, size - skip));
+}
+
+
+Durability durability_from_string(const char* str)
+{
+    if (!str || strcmp(str, "none") == 0) {
+        return DURABILITY_NONE;
+    }
+    if (strcmp(str, "write") == 0) {
+        return DURABILITY_WRITE;
+    }
+    if (strcmp(str, "always") == 0) {
+        return DURABILITY_ALWAYS;
+    }
+    return DURABILITY_BATCH;
+}
+
+
+std::string log_path(const std::string& dir, uint64_t generation)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/" LOG_FILE_PREFIX "%llu", (unsigned long long)generation);
+    return dir + name;
+}
+
+
+bool write_all(int fd, const char* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+WriteLog::WriteLog(const std::string& dir, Durability durability)
+    : dir(dir)
+    , mode(durability)
+    , fd(-1)
+    , generation(0)
+    , file_size(0) {
+}
+
+WriteLog::~WriteLog() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void WriteLog::append(uint64_t seq, uint16_t slot, uint16_t kind, boost::string_view key, boost::string_view value, bool del) {
+    std::lock_guard<std::mutex> guard(lock);
+    encode(seq, slot, kind, key, value, del);
+}
+
+// Adds a record to the buffer; called with `lock` held
+void WriteLog::encode(uint64_t seq, uint16_t slot, uint16_t kind, boost::string_view key, boost::string_view value, bool del) {
+    log_record_header_t header;
+    header.key_length = key.size();
+    header.value_length = del ? DEL_MARKER : value.size();
+    header.slot = slot;
+    header.kind = kind;
+    header.seq = seq;
+
+    size_t start = buffer.size();
+    buffer.append((const char*)&header, sizeof(header));
+    buffer.append(key.data(), key.size());
+    buffer.append(value.data(), value.size());
+    header.checksum = record_checksum(&buffer[start], buffer.size() - start);
+    memcpy(&buffer[start], &header.checksum, sizeof(header.checksum));
+}
+
+void WriteLog::append_set(uint64_t seq, uint32_t slot, boost::string_view key, boost::string_view value) {
+    append(seq, slot, RECORD_KEY, key, value, false);
+}
+
+void WriteLog::append_del(uint64_t seq, uint32_t slot, boost::string_view key) {
+    append(seq, slot, RECORD_KEY, key, boost::string_view(), true);
+}
+
+void WriteLog::append_batch(uint64_t seq, uint32_t slot, const std::vector<LoggedChange>& changes) {
+    uint32_t count = changes.size();
+    std::lock_guard<std::mutex> guard(lock);
+    encode(seq, slot, RECORD_BATCH, boost::string_view(), boost::string_view((const char*)&count, sizeof(count)), false);
+    for (const LoggedChange& change : changes) {
+        encode(++seq, slot, RECORD_KEY, change.key, change.value, change.del);
+    }
+}
+
+void WriteLog::append_keyspace(uint64_t seq, uint32_t slot, boost::string_view name, uint64_t quota) {
+    append(seq, slot, RECORD_KEYSPACE, name, boost::string_view((const char*)&quota, sizeof(quota)), false);
+}
+
+void WriteLog::append_drop(uint64_t seq, uint32_t slot, boost::string_view name) {
+    append(seq, slot, RECORD_DROP, name, boost::string_view(), true);
+}
+
+bool WriteLog::pending() {
+    std::lock_guard<std::mutex> guard(lock);
+    return !buffer.empty();
+}
+
+bool WriteLog::commit(uint64_t new_generation) {
+    std::string batch;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        batch.swap(buffer);
+    }
+    if (batch.empty()) {
+        return true;
+    }
+
+    if (fd < 0 || generation != new_generation) {
+        // A snapshot has started a new log file
+        if (fd >= 0) {
+            close(fd);
+        }
+        fd = open(log_path(dir, new_generation).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        generation = new_generation;
+        file_size = 0;
+    }
+
+    // One write per batch: O_APPEND keeps batches from different processes
+    // whole
+    if (!write_all(fd, batch.data(), batch.size())) {
+        return false;
+    }
+    file_size += batch.size();
+    if (mode != DURABILITY_WRITE && fdatasync(fd) < 0) {
+        return false;
+    }
+    return true;
+}
+
+
+// Builds a compact segment holding the live keys of the image and writes it
+// out as the new snapshot, then deletes the log files it covers. Runs in a
+// child process, so it can take its time.
+bool write_snapshot(const std::string& dir, const SegmentImage& image)
+{
+    StoreOptions options;
+    options.initial_size = std::max<size_t>(DEFAULT_SEGMENT_SIZE, image.used);
+    options.max_size = image.size * 2;
+    options.index = image.index;
+    options.stripes = image.stripe_count;
+    options.evict_water = image.evict_water;
+
+    // Named after the server's segments, so servers on one machine do not
+    // write their snapshots through the same one
+    std::string name = segment_name(SNAPSHOT_SEGMENT, "_snapshot");
+    bip::shared_memory_object::remove(name.c_str());
+    try {
+        SharedKeyValueStore snapshot(name.c_str(), options);
+        // Keyspaces keep their slots, which the log refers to them by
+        KeyspaceId keyspaces[MAX_KEYSPACES] = {DEFAULT_KEYSPACE};
+        for (const SegmentImage::KeyspaceImage& keyspace : image.keyspaces) {
+            snapshot.restore_keyspace(keyspace.slot, keyspace.name, keyspace.quota, &keyspaces[keyspace.slot]);
+        }
+        image.for_each([&](uint32_t slot, boost::string_view key, boost::string_view item) {
+            snapshot.restore(keyspaces[slot], key, item);
+        });
+    }
+    catch (bip::interprocess_exception &) {
+        bip::shared_memory_object::remove(name.c_str());
+        return false;
+    }
+
+    std::string path = dir + "/" SNAPSHOT_FILE;
+    std::string tmp_path = path + ".tmp";
+    bool ok = false;
+    {
+        bip::shared_memory_object shm(bip::open_only, name.c_str(), bip::read_only);
+        bip::mapped_region region(shm, bip::read_only);
+
+        snapshot_header_t header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.generation = image.generation;
+        header.seq = image.seq;
+        header.size = region.get_size();
+
+        int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            std::string padding(SNAPSHOT_DATA_OFFSET - sizeof(header), '\0');
+            ok = write_all(fd, (const char*)&header, sizeof(header))
+                && write_all(fd, padding.data(), padding.size())
+                && write_all(fd, (const char*)region.get_address(), region.get_size())
+                && fsync(fd) == 0;
+            close(fd);
+        }
+    }
+    bip::shared_memory_object::remove(name.c_str());
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    for (uint64_t generation : log_generations(dir)) {
+        if (generation < image.generation) {
+            unlink(log_path(dir, generation).c_str());
+        }
+    }
+    return true;
+}
+
+
+std::vector<uint64_t> log_generations(const std::string& dir)
+{
+    std::vector<uint64_t> generations;
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        return generations;
+    }
+    size_t prefix_size = strlen(LOG_FILE_PREFIX);
+    while (struct dirent* ent = readdir(d)) {
+        if (strncmp(ent->d_name, LOG_FILE_PREFIX, prefix_size) == 0) {
+            generations.push_back(strtoull(ent->d_name + prefix_size, NULL, 10));
+        }
+    }
+    closedir(d);
+    std::sort(generations.begin(), generations.end());
+    return generations;
+}
+
+
+bool restore_snapshot(const std::string& dir, const char* name, uint64_t* seq, uint64_t* generation)
+{
+    int fd = open((dir + "/" SNAPSHOT_FILE).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    snapshot_header_t header;
+    struct stat st;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+        || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+        || fstat(fd, &st) < 0
+        || (uint64_t)st.st_size < SNAPSHOT_DATA_OFFSET + header.size) {
+        fprintf(stderr, "ignoring invalid snapshot in %s\n", dir.c_str());
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(NULL, header.size, PROT_READ, MAP_PRIVATE, fd, SNAPSHOT_DATA_OFFSET);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, header.size, MADV_SEQUENTIAL);
+
+    bip::shared_memory_object::remove(name);
+    {
+        bip::shared_memory_object shm(bip::create_only, name, bip::read_write);
+        shm.truncate(header.size);
+        bip::mapped_region region(shm, bip::read_write);
+        memcpy(region.get_address(), data, header.size);
+    }
+    munmap(data, header.size);
+
+    *seq = header.seq;
+    *generation = header.generation;
+    return true;
+}
+
+
+size_t replay_logs(const std::string& dir, SharedKeyValueStore& store, uint64_t* seq, uint64_t* generation)
+{
+    struct mapped_log {
+        void* data;
+        size_t size;
+    };
+    struct record {
+        uint64_t seq;
+        const char* data;
+    };
+    std::vector<mapped_log> logs;
+    std::vector<record> records;
+
+    for (uint64_t gen : log_generations(dir)) {
+        *generation = std::max(*generation, gen);
+        int fd = open(log_path(dir, gen).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size == 0) {
+            close(fd);
+            continue;
+        }
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            continue;
+        }
+        logs.push_back({data, (size_t)st.st_size});
+
+        const char* pos = (const char*)data;
+        const char* end = pos + st.st_size;
+        // A batch is buffered and written whole, so its records are
+        // contiguous; one cut short by the damage is left out entirely
+        uint32_t batch_left = 0;
+        size_t batch_start = 0;
+        while ((size_t)(end - pos) >= sizeof(log_record_header_t)) {
+            log_record_header_t header;
+            memcpy(&header, pos, sizeof(header));
+            size_t value_length = header.value_length == DEL_MARKER ? 0 : header.value_length;
+            size_t size = sizeof(header) + header.key_length + value_length;
+            if ((size_t)(end - pos) < size || record_checksum(pos, size) != header.checksum) {
+                fprintf(stderr, "log %llu is truncated, replaying it up to the damage\n", (unsigned long long)gen);
+                break;
+            }
+            if (header.kind == RECORD_BATCH && header.value_length == sizeof(uint32_t)) {
+                memcpy(&batch_left, pos + sizeof(header) + header.key_length, sizeof(batch_left));
+                batch_start = records.size();
+            }
+            else if (batch_left > 0) {
+                --batch_left;
+            }
+            if (header.seq > *seq) {
+                records.push_back({header.seq, pos});
+            }
+            pos += size;
+        }
+        if (batch_left > 0) {
+            records.resize(batch_start);
+        }
+    }
+
+    // Batches from different processes interleave in the files
+    std::sort(records.begin(), records.end(), [](const record& a, const record& b) {
+        return a.seq < b.seq;
+    });
+    for (const record& r : records) {
+        log_record_header_t header;
+        memcpy(&header, r.data, sizeof(header));
+        boost::string_view key(r.data + sizeof(header), header.key_length);
+        KeyspaceId keyspace;
+        if (header.kind == RECORD_KEYSPACE && header.value_length == sizeof(uint64_t)) {
+            uint64_t quota;
+            memcpy(&quota, key.end(), sizeof(quota));
+            store.restore_keyspace(header.slot % MAX_KEYSPACES, key, quota, &keyspace);
+        }
+        else if (header.kind == RECORD_DROP) {
+            if (store.keyspace_at(header.slot % MAX_KEYSPACES, &keyspace)) {
+                store.drop_keyspace(keyspace);
+            }
+        }
+        else if (header.kind == RECORD_KEY && store.keyspace_at(header.slot % MAX_KEYSPACES, &keyspace)) {
+            if (header.value_length == DEL_MARKER) {
+                store.remove(keyspace, key);
+            }
+            else {
+                store.restore(keyspace, key, boost::string_view(key.end(), header.value_length));
+            }
+        }
+        *seq = r.seq;
+    }
+
+    for (const mapped_log& log : logs) {
+        munmap(log.data, log.size);
+    }
+    return records.size();
+}
+
+
+// Periodic snapshots, taken by a child process. Only one runs at a time.
+static pid_t snapshot_pid = 0;
+static time_t last_snapshot = 0;
+
+bool snapshot_running()
+{
+    if (snapshot_pid > 0 && waitpid(snapshot_pid, NULL, WNOHANG) != 0) {
+        // Exited, or already reaped because SIGCHLD is ignored
+        snapshot_pid = 0;
+    }
+    return snapshot_pid > 0;
+}
+
+pid_t start_snapshot(SharedKeyValueStore& store)
+{
+    if (snapshot_running()) {
+        return 0;
+    }
+    last_snapshot = time(NULL);
+
+    SegmentImage image;
+    store.capture(&image);
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(write_snapshot(store.log_directory(), image) ? 0 : 1);
+    }
+    if (pid < 0) {
+        perror("snapshot fork failed");
+        return 0;
+    }
+    snapshot_pid = pid;
+    return pid;
+}
+
+void snapshot_if_due(SharedKeyValueStore& store)
+{
+    static long interval = -1;
+    static size_t log_limit;
+    if (interval < 0) {
+        char* str = getenv("KVSTORE_SNAPSHOT_INTERVAL");
+        interval = str ? atol(str) : DEFAULT_SNAPSHOT_INTERVAL;
+        str = getenv("KVSTORE_SNAPSHOT_LOG_SIZE");
+        log_limit = str ? strtoull(str, NULL, 0) : DEFAULT_SNAPSHOT_LOG_SIZE;
+        last_snapshot = time(NULL);
+    }
+
+    bool due = (interval > 0 && time(NULL) - last_snapshot >= interval)
+        || (log_limit > 0 && store.log_size() >= log_limit);
+    if (due) {
+        start_snapshot(store);
+    }
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <mutex>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+
+// Persistence: an append-only write log plus periodic snapshots.
+//
+// Every change is logged as the key's new stored value (or its deletion)
+// and the slot of its keyspace, tagged with a sequence number that is taken
+// under the key's stripe lock. Creating and dropping a keyspace are logged
+// too, under the lock that serializes them. The changes of an atomic batch
+// follow a record giving their count, and are replayed all or not at all.
+// Processes buffer their records and append them to the log in batches, so
+// records from different processes can land out of order; replay sorts them
+// by sequence number. Expiry times in values are absolute, so an expired key
+// is simply skipped on replay.
+//
+// A snapshot is an image of a freshly built, compact segment. Restoring it is
+// a single copy of a memory-mapped file into a new segment; only the log
+// written since the snapshot is replayed.
+
+#define SNAPSHOT_FILE "kvstore.snapshot"
+#define LOG_FILE_PREFIX "kvstore.log."
+
+enum Durability
+{
+    DURABILITY_NONE,        // nothing is logged or restored
+    DURABILITY_WRITE,       // logged in batches, flushed to disk by the OS
+    DURABILITY_BATCH,       // every batch is fsynced before it is replied to
+    DURABILITY_ALWAYS,      // every change is fsynced before the next one
+};
+
+// One change of an atomic batch, as logged
+struct LoggedChange
+{
+    boost::string_view key;
+    boost::string_view value;
+    bool del;
+};
+
+class WriteLog
+{
+public:
+    WriteLog(const std::string& dir, Durability durability);
+    ~WriteLog();
+
+    Durability durability() const { return mode; }
+    const std::string& directory() const { return dir; }
+
+    // Buffer a record. Called with the key's stripe locked for writing.
+    void append_set(uint64_t seq, uint32_t slot, boost::string_view key, boost::string_view value);
+    void append_del(uint64_t seq, uint32_t slot, boost::string_view key);
+    // Buffers the changes of an atomic batch together, numbered from seq + 1
+    // on; seq itself numbers the record that announces them. Called with
+    // the stripes of all their keys locked for writing.
+    void append_batch(uint64_t seq, uint32_t slot, const std::vector<LoggedChange>& changes);
+    // Called with keyspace_lock held
+    void append_keyspace(uint64_t seq, uint32_t slot, boost::string_view name, uint64_t quota);
+    void append_drop(uint64_t seq, uint32_t slot, boost::string_view name);
+
+    // Appends the buffered records to log file `generation`, and fsyncs them
+    // unless the mode is DURABILITY_WRITE. Replies to the requests that made
+    // the changes must not be sent before this returns. Returns false if the
+    // log could not be written.
+    bool commit(uint64_t generation);
+    // Whether records are buffered that commit() has not written yet
+    bool pending();
+
+    // Bytes this process has appended to the current log file
+    size_t written() const { return file_size; }
+
+private:
+    WriteLog(const WriteLog&);
+    WriteLog& operator=(const WriteLog&);
+
+    void append(uint64_t seq, uint16_t slot, uint16_t kind, boost::string_view key, boost::string_view value, bool del);
+    void encode(uint64_t seq, uint16_t slot, uint16_t kind, boost::string_view key, boost::string_view value, bool del);
+
+    std::string dir;
+    Durability mode;
+    std::mutex lock;
+    std::string buffer;
+    int fd;
+    uint64_t generation;
+    size_t file_size;
+};
+
+class SharedKeyValueStore;
+struct SegmentImage;
+
+Durability durability_from_string(const char* str);
+std::string log_path(const std::string& dir, uint64_t generation);
+std::vector<uint64_t> log_generations(const std::string& dir);
+
+// Writes the image as the snapshot in dir, then deletes the log files it
+// covers. The previous snapshot stays in place if this fails.
+bool write_snapshot(const std::string& dir, const SegmentImage& image);
+
+// Recreates segment `name` from the snapshot in dir. Returns false if there
+// is none; otherwise *seq and *generation tell where its log continues.
+bool restore_snapshot(const std::string& dir, const char* name, uint64_t* seq, uint64_t* generation);
+
+// Applies every logged change after *seq to the store, then sets *seq to the
+// last change applied and *generation to the newest log file seen. Returns
+// the number of changes applied.
+size_t replay_logs(const std::string& dir, SharedKeyValueStore& store, uint64_t* seq, uint64_t* generation);
+
+// Captures the store and writes the snapshot from a child process. Returns
+// the child's pid, or 0 if a snapshot is already running or fork failed.
+pid_t start_snapshot(SharedKeyValueStore& store);
+
+// Starts a snapshot once KVSTORE_SNAPSHOT_INTERVAL seconds have passed since
+// the last one or the log has grown past KVSTORE_SNAPSHOT_LOG_SIZE bytes.
+void snapshot_if_due(SharedKeyValueStore& store);
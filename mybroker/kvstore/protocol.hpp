@@ -0,0 +1,139 @@
+#pragma once
+
+#include <stdint.h>
+
+// Binary framed protocol.
+//
+// A connection speaks the binary protocol if its first byte is BINARY_MAGIC.
+// Text commands always start with a letter, so text clients are unaffected.
+// Every request and response is a frame_header followed by `length` bytes of
+// body holding `count` items. Integers are in host byte order, as in fileup.
+//
+// Request items:
+//   OP_MGET, OP_MDEL:  u32 key length, key
+//   OP_MSET:           u32 key length, key, u32 value length, value (not
+//                      empty, as in the text protocol)
+//   OP_INCR, OP_DECR:  u32 key length, key, u32 8, i64 delta
+//   OP_CAS:            u32 key length, key, u32 8, i64 expected, u32 8, i64 desired
+//   OP_EXPIRE:         u32 key length, key, u32 8, i64 TTL in milliseconds (0 = none)
+//   OP_SCAN:           one item: u32 prefix length, prefix
+//   OP_RANGE:          one item: u32 start length, start, u32 end length, end
+//                      (keys from start up to but not including end; an
+//                      empty end is no bound)
+//   OP_NS_CREATE:      u32 name length, name, u32 8, i64 quota in bytes (0 = none)
+//   OP_NS_DROP:        u32 name length, name
+//   OP_EXEC:           u32 key length, key, u32 8, i64 EXEC_STORE or
+//                      EXEC_REMOVE, u32 value length, value (empty for
+//                      EXEC_REMOVE, and only then)
+// Response items, one per request item and in the same order:
+//   u8 status, and
+//   for OP_MGET with STATUS_OK: u32 value length, value
+//   for OP_INCR, OP_DECR with STATUS_OK: i64 new value
+//   for OP_CAS with STATUS_OK or STATUS_MISMATCH: i64 current value
+//
+// OP_SCAN and OP_RANGE are answered with a stream of frames in key order,
+// each holding up to SCAN_CHUNK items of u32 key length, key, u32 value
+// length, value, with integers given in decimal. A frame with no items ends
+// the stream.
+//
+// Keys live in namespaces. A request whose opcode has OP_NAMESPACE set
+// addresses the namespace named by a u32 length and name at the start of its
+// body, before the items and not counted in `count`; others address the
+// namespace "default". The response echoes the opcode without OP_NAMESPACE.
+// A request to a namespace that does not exist is answered with a single
+// STATUS_NO_NAMESPACE item. OP_NS_CREATE answers STATUS_BAD_REQUEST for a
+// namespace whose name is taken or invalid, or that does not fit, and
+// OP_NS_DROP answers STATUS_NOT_FOUND for one that does not exist.
+//
+// OP_EXEC applies all of its items or none, atomically: no other request
+// sees some of them applied and others not. Each item is answered with
+// STATUS_OK, or STATUS_NOT_FOUND for the removal of a missing key, if the
+// batch was applied, and otherwise every item with the status that stopped
+// it, such as STATUS_FULL.
+//
+// OP_MGET only returns strings; integers are read with an OP_INCR of 0,
+// which creates a missing key at 0.
+//
+// A request that cannot be parsed is answered with a single
+// STATUS_BAD_REQUEST item, and a write to a replica with a single
+// STATUS_READ_ONLY item.
+//
+// OP_SYNC, with no items, makes the connection a replica's: the server
+// streams it every key in OP_SYNC frames, then every change as it happens.
+// Each of these frames starts with a sync_block_t, followed by `count` items
+// of u8 sync_op_t and u32 namespace slot, then
+//   SYNC_SET: u32 key length, key, u32 value length, value, where the value
+//     is in the store's internal format with its expiry time
+//   SYNC_DEL: u32 key length, key; deletes the key
+//   SYNC_NAMESPACE: u32 name length, name, u64 quota; creates the namespace
+//     in the slot, in place of any namespace with the slot or the name
+//   SYNC_DROP: nothing; drops the namespace in the slot
+// Namespaces are known by their slot on the primary, which the replica
+// gives them too; slot 0 is the default namespace. The frames from the one
+// with SYNC_BEGIN to the one with SYNC_END hold every namespace and key; the
+// replica drops any other namespace and deletes any other key it has then. A
+// further OP_SYNC on the connection is answered with a frame of no items, as
+// a heartbeat.
+
+#define BINARY_MAGIC 0x80
+#define MAX_FRAME_SIZE (1 << 20)
+
+enum opcode_t : uint8_t {
+    OP_MGET = 0x01,
+    OP_MSET = 0x02,
+    OP_MDEL = 0x03,
+    OP_INCR = 0x04,
+    OP_DECR = 0x05,
+    OP_CAS = 0x06,
+    OP_EXPIRE = 0x07,
+    OP_SCAN = 0x08,
+    OP_RANGE = 0x09,
+    OP_SYNC = 0x0A,
+    OP_NS_CREATE = 0x0B,
+    OP_NS_DROP = 0x0C,
+    OP_EXEC = 0x0D,
+};
+
+enum exec_op_t : int64_t {
+    EXEC_STORE = 0,
+    EXEC_REMOVE = 1,
+};
+
+#define OP_NAMESPACE 0x80   // flag of an opcode
+
+enum status_t : uint8_t {
+    STATUS_OK = 0x00,
+    STATUS_NOT_FOUND = 0x01,
+    STATUS_FULL = 0x02,
+    STATUS_BAD_REQUEST = 0x03,
+    STATUS_WRONG_TYPE = 0x04,
+    STATUS_MISMATCH = 0x05,
+    STATUS_OVERFLOW = 0x06,
+    STATUS_READ_ONLY = 0x07,
+    STATUS_NO_NAMESPACE = 0x08,
+};
+
+typedef struct frame_header {
+    uint8_t magic;      // BINARY_MAGIC
+    uint8_t opcode;     // opcode_t; responses echo the request's opcode
+    uint16_t count;     // number of items in the body
+    uint32_t length;    // body length in bytes, excluding the header
+} frame_header_t;
+
+enum sync_op_t : uint8_t {
+    SYNC_SET = 0x00,
+    SYNC_DEL = 0x01,
+    SYNC_NAMESPACE = 0x02,
+    SYNC_DROP = 0x03,
+};
+
+#define SYNC_BEGIN 0x1  // first frame of a full sync
+#define SYNC_END 0x2    // last frame of a full sync
+
+typedef struct sync_block {
+    uint64_t position;  // changes the primary had sent when it sent this
+    uint64_t head;      // changes the primary had made by then
+    uint64_t sent_ms;   // CLOCK_REALTIME when it was sent
+    uint32_t flags;     // SYNC_BEGIN, SYNC_END
+    uint32_t reserved;
+} sync_block_t;
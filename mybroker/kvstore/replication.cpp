@@ -0,0 +1,349 @@
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <string>
+#include <thread>
+#include <unordered_set>
+
+#include "metrics.hpp"
+#include "protocol.hpp"
+#include "replication.hpp"
+#include "store.hpp"
+#include "watch.hpp"
+
+#define REPL_PING_MS 1000       // heartbeat interval while the primary is quiet
+#define REPL_TIMEOUT_MS 5000    // silence after which the primary is given up
+#define REPL_RETRY_S 1
+#define REPL_SWEEP_CHUNK 1024
+
+static bool replica = false;
+
+
+bool read_only()
+{
+    return replica;
+}
+
+
+static uint64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+
+static int connect_primary(const std::string& host, const std::string& port)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* addrs;
+    int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs);
+    if (error != 0) {
+        fprintf(stderr, "replication: cannot resolve %s: %s\n", host.c_str(), gai_strerror(error));
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo* addr = addrs; addr; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    return fd;
+}
+
+
+static bool send_sync(int fd)
+{
+    frame_header_t header;
+    header.magic = BINARY_MAGIC;
+    header.opcode = OP_SYNC;
+    header.count = 0;
+    header.length = 0;
+    return send(fd, &header, sizeof(header), MSG_NOSIGNAL) == (ssize_t)sizeof(header);
+}
+
+
+static bool read_field(const char** pos, const char* end, boost::string_view* field)
+{
+    uint32_t length;
+    if ((size_t)(end - *pos) < sizeof(length)) {
+        return false;
+    }
+    memcpy(&length, *pos, sizeof(length));
+    *pos += sizeof(length);
+    if ((size_t)(end - *pos) < length) {
+        return false;
+    }
+    *field = boost::string_view(*pos, length);
+    *pos += length;
+    return true;
+}
+
+
+// The state of one connection to the primary
+struct SyncStream
+{
+    bool full_sync = false;
+    // Namespaces and keys of each slot the current full sync has sent; any
+    // other namespace or key is gone
+    std::vector<bool> namespaces;
+    std::vector<std::unordered_set<std::string>> seen;
+
+    SyncStream() : namespaces(MAX_KEYSPACES), seen(MAX_KEYSPACES) {}
+
+    void clear(uint32_t slot) {
+        namespaces[slot] = false;
+        seen[slot].clear();
+    }
+};
+
+
+// Drops every namespace and deletes every key the full sync that just ended
+// did not send
+static void sweep(SyncStream* stream)
+{
+    for (uint32_t slot = DEFAULT_KEYSPACE; slot < MAX_KEYSPACES; ++slot) {
+        KeyspaceId keyspace;
+        if (!namespace_at(slot, &keyspace, nullptr, nullptr)) {
+            continue;
+        }
+        if (slot != DEFAULT_KEYSPACE && !stream->namespaces[slot]) {
+            drop_namespace_at(slot);
+            continue;
+        }
+        KeyRange range = prefix_range("");
+        std::vector<ScanEntry> entries;
+        bool more = true;
+        while (more) {
+            more = scan_values(keyspace, &range, REPL_SWEEP_CHUNK, &entries);
+            for (const ScanEntry& entry : entries) {
+                if (!stream->seen[slot].count(entry.first)) {
+                    remove_value(keyspace, entry.first);
+                }
+            }
+        }
+    }
+    for (uint32_t slot = DEFAULT_KEYSPACE; slot < MAX_KEYSPACES; ++slot) {
+        stream->clear(slot);
+    }
+    stream->full_sync = false;
+}
+
+
+// Applies one item of a frame. Returns false if it is malformed.
+static bool apply_item(SyncStream* stream, const char** pos, const char* end)
+{
+    uint8_t op;
+    uint32_t slot;
+    if ((size_t)(end - *pos) < sizeof(op) + sizeof(slot)) {
+        return false;
+    }
+    op = (uint8_t)**pos;
+    memcpy(&slot, *pos + sizeof(op), sizeof(slot));
+    *pos += sizeof(op) + sizeof(slot);
+    if (slot >= MAX_KEYSPACES) {
+        return false;
+    }
+
+    boost::string_view key, stored;
+    uint64_t quota;
+    size_t old_quota;
+    std::string name;
+    KeyspaceId keyspace;
+    switch (op) {
+    case SYNC_SET:
+        if (!read_field(pos, end, &key) || !read_field(pos, end, &stored)) {
+            return false;
+        }
+        // A namespace the replica could not create has its keys dropped
+        if (namespace_at(slot, &keyspace, nullptr, nullptr) && !restore_value(keyspace, key, stored)) {
+            fprintf(stderr, "replication: no room for a key of %zu bytes\n", key.size() + stored.size());
+        }
+        if (stream->full_sync) {
+            stream->seen[slot].insert(std::string(key.data(), key.size()));
+        }
+        return true;
+    case SYNC_DEL:
+        if (!read_field(pos, end, &key)) {
+            return false;
+        }
+        if (namespace_at(slot, &keyspace, nullptr, nullptr)) {
+            remove_value(keyspace, key);
+        }
+        return true;
+    case SYNC_NAMESPACE:
+        if (slot == DEFAULT_KEYSPACE || !read_field(pos, end, &key) || (size_t)(end - *pos) < sizeof(quota)) {
+            return false;
+        }
+        memcpy(&quota, *pos, sizeof(quota));
+        *pos += sizeof(quota);
+        if (!namespace_at(slot, &keyspace, &name, &old_quota) || name != key || old_quota != quota) {
+            // Replaced by an empty one
+            stream->seen[slot].clear();
+        }
+        if (!restore_namespace(slot, key, quota)) {
+            fprintf(stderr, "replication: cannot create namespace %.*s\n", (int)key.size(), key.data());
+        }
+        stream->namespaces[slot] = true;
+        return true;
+    case SYNC_DROP:
+        if (slot == DEFAULT_KEYSPACE) {
+            return false;
+        }
+        drop_namespace_at(slot);
+        stream->clear(slot);
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+// Applies one frame's body. Returns false if it is malformed.
+static bool apply_frame(SyncStream* stream, const frame_header_t& header, const char* body)
+{
+    const char* pos = body;
+    const char* end = body + header.length;
+    sync_block_t block;
+    if (header.length < sizeof(block)) {
+        return false;
+    }
+    memcpy(&block, pos, sizeof(block));
+    pos += sizeof(block);
+    if (block.flags & SYNC_BEGIN) {
+        for (uint32_t slot = DEFAULT_KEYSPACE; slot < MAX_KEYSPACES; ++slot) {
+            stream->clear(slot);
+        }
+        stream->full_sync = true;
+    }
+
+    for (uint16_t i = 0; i < header.count; ++i) {
+        if (!apply_item(stream, &pos, end)) {
+            return false;
+        }
+    }
+    if (pos != end) {
+        return false;
+    }
+
+    bool ended = block.flags & SYNC_END;
+    if (ended) {
+        sweep(stream);
+    }
+    record_sync_frame(block.position, block.head, block.sent_ms, ended);
+    return true;
+}
+
+
+// Follows the primary on a connected socket until it fails or goes quiet
+static void stream_from(int fd)
+{
+    if (!send_sync(fd)) {
+        return;
+    }
+    replica_connected(true);
+    SyncStream stream;
+    std::string in;
+    char chunk[65536];
+    uint64_t last_io = monotonic_ms();
+    for (;;) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        int ready = poll(&pfd, 1, REPL_PING_MS);
+        if (ready < 0 && errno != EINTR) {
+            return;
+        }
+        if (ready <= 0) {
+            if (monotonic_ms() - last_io >= REPL_TIMEOUT_MS) {
+                fprintf(stderr, "replication: primary timed out\n");
+                return;
+            }
+            if (!send_sync(fd)) {
+                return;
+            }
+            continue;
+        }
+
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        last_io = monotonic_ms();
+        in.append(chunk, n);
+
+        size_t done = 0;
+        frame_header_t header;
+        while (in.size() - done >= sizeof(header)) {
+            memcpy(&header, in.data() + done, sizeof(header));
+            if (header.magic != BINARY_MAGIC || header.opcode != OP_SYNC) {
+                fprintf(stderr, "replication: unexpected frame from the primary\n");
+                return;
+            }
+            if (in.size() - done - sizeof(header) < header.length) {
+                break;
+            }
+            if (!apply_frame(&stream, header, in.data() + done + sizeof(header))) {
+                fprintf(stderr, "replication: malformed sync frame\n");
+                return;
+            }
+            done += sizeof(header) + header.length;
+        }
+        in.erase(0, done);
+        // Like a round of the event loop
+        if (!commit_values()) {
+            perror("write log commit failed");
+        }
+        notify_watchers();
+    }
+}
+
+
+static void replicate(std::string host, std::string port)
+{
+    for (;;) {
+        int fd = connect_primary(host, port);
+        if (fd >= 0) {
+            stream_from(fd);
+            close(fd);
+            replica_connected(false);
+        }
+        sleep(REPL_RETRY_S);
+    }
+}
+
+
+bool start_replication(const char* primary)
+{
+    std::string address(primary);
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == address.size()) {
+        return false;
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+    replica = true;
+    replica_connected(false);
+    std::thread(replicate, host, port).detach();
+    return true;
+}
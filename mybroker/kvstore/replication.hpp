@@ -0,0 +1,19 @@
+#pragma once
+
+// Asynchronous replication, KVSTORE_REPLICA_OF=host:port.
+//
+// A replica connects to its primary over the binary protocol and sends
+// OP_SYNC. The primary streams it every namespace and key, then watches
+// every key for the connection and sends each changed key as it is after
+// the change, and each namespace created or dropped. The
+// replica applies what it gets to its own segment as it arrives and serves
+// reads from there, refusing writes. If the connection drops, the replica
+// connects again and starts over with a full sync; if the primary cannot
+// keep up with sending changes, it starts one itself.
+
+// Starts the thread that follows the primary at host:port (an IPv6 address
+// may be in brackets) and makes the server read-only. Returns false if the
+// address cannot be parsed.
+bool start_replication(const char* primary);
+// Whether this server is a replica, which clients may not write to
+bool read_only();
@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <boost/interprocess/exceptions.hpp>
+
+#include "robust.hpp"
+
+namespace bip = boost::interprocess;
+
+// A waiter spins this many rounds, then yields until YIELD_ROUNDS, then sleeps
+// SLEEP_NS per round
+#define SPIN_ROUNDS 64
+#define YIELD_ROUNDS 1024
+#define SLEEP_NS 50000
+// Once sleeping, a writer looks for dead readers every this many rounds
+#define REAP_ROUNDS 64
+
+// A reader slot holds pid << 42 | start << 16 | count, where start is the
+// low bits of the process's start time, so a process that took over the pid
+// of a dead reader is not mistaken for it. pid_max is at most 2^22.
+#define START_BITS 26
+#define SLOT_PID(held) ((uint64_t)(held) >> 42)
+#define SLOT_START(held) (((uint64_t)(held) >> 16) & ((1ULL << START_BITS) - 1))
+#define SLOT_COUNT(held) ((held) & 0xffffULL)
+#define SLOT_OWNER(held) ((held) & ~0xffffULL)
+
+
+RobustMutex::RobustMutex(bool recursive)
+    : died(0) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (recursive) {
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    }
+    int rc = pthread_mutex_init(&mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc != 0) {
+        throw bip::interprocess_exception("robust mutex initialization failed");
+    }
+}
+
+RobustMutex::~RobustMutex() {
+    pthread_mutex_destroy(&mutex);
+}
+
+// The mutex is ours after rc; marks it consistent again if its owner died
+bool RobustMutex::acquired(int rc) {
+    if (rc == EOWNERDEAD) {
+        pthread_mutex_consistent(&mutex);
+        ++died;
+        return true;
+    }
+    if (rc != 0) {
+        throw bip::lock_exception();
+    }
+    return false;
+}
+
+bool RobustMutex::lock() {
+    return acquired(pthread_mutex_lock(&mutex));
+}
+
+bool RobustMutex::try_lock() {
+    int rc = pthread_mutex_trylock(&mutex);
+    if (rc == EBUSY) {
+        return false;
+    }
+    acquired(rc);
+    return true;
+}
+
+void RobustMutex::unlock() {
+    pthread_mutex_unlock(&mutex);
+}
+
+
+// Reads the state and the start time, in clock ticks since boot, of a
+// process from /proc/<pid>/stat. Returns false if there is no such process.
+static bool process_stat(pid_t pid, char* state, uint64_t* start)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    char stat[1024];
+    size_t n = fread(stat, 1, sizeof(stat) - 1, f);
+    fclose(f);
+    stat[n] = '\0';
+    // The state follows the command name, which may itself contain ')', and
+    // the start time is the 20th field after it
+    const char* pos = strrchr(stat, ')');
+    if (!pos || pos[1] != ' ') {
+        return false;
+    }
+    *state = pos[2];
+    pos += 2;
+    for (int field = 0; field < 19 && pos; ++field) {
+        pos = strchr(pos, ' ');
+        pos = pos ? pos + 1 : NULL;
+    }
+    *start = pos ? strtoull(pos, NULL, 10) : 0;
+    return true;
+}
+
+// getpid() is a system call and the start time a read of /proc; reader
+// slots need them on every lock
+static uint64_t cached_owner = 0;
+
+static void forget_owner()
+{
+    cached_owner = 0;
+}
+
+// The process's reader slot with a count of 0
+static uint64_t own_owner()
+{
+    if (cached_owner == 0) {
+        static bool registered = false;
+        if (!registered) {
+            registered = true;
+            pthread_atfork(NULL, NULL, forget_owner);
+        }
+        pid_t pid = getpid();
+        char state;
+        uint64_t start = 0;
+        process_stat(pid, &state, &start);
+        cached_owner = (uint64_t)pid << 42 | (start & ((1ULL << START_BITS) - 1)) << 16;
+    }
+    return cached_owner;
+}
+
+// Whether the process that took a reader slot has exited. A zombie still
+// answers kill() but will never let go of anything, so it counts as gone,
+// and so does a process with its pid but a different start time.
+static bool process_gone(uint64_t owner)
+{
+    pid_t pid = (pid_t)SLOT_PID(owner);
+    if (kill(pid, 0) < 0 && errno == ESRCH) {
+        return true;
+    }
+    char state;
+    uint64_t start;
+    if (!process_stat(pid, &state, &start)) {
+        return false;
+    }
+    return state == 'Z' || state == 'X' || (start & ((1ULL << START_BITS) - 1)) != SLOT_START(owner);
+}
+
+static void backoff(unsigned round)
+{
+    if (round < SPIN_ROUNDS) {
+        return;
+    }
+    if (round < YIELD_ROUNDS) {
+        sched_yield();
+        return;
+    }
+    struct timespec ts = {0, SLEEP_NS};
+    nanosleep(&ts, NULL);
+}
+
+
+RobustSharableMutex::RobustSharableMutex()
+    : writing(0)
+    , recovered(0) {
+    for (size_t i = 0; i < READER_SLOTS; ++i) {
+        readers[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void RobustSharableMutex::lock() {
+    if (writer.lock()) {
+        recovered.fetch_add(1, std::memory_order_relaxed);
+    }
+    // Readers register before they look at `writing`, and a writer raises
+    // it before it looks at the slots, so one of the two always sees the
+    // other
+    writing.store(1);
+    wait_for_readers();
+}
+
+void RobustSharableMutex::unlock() {
+    writing.store(0, std::memory_order_release);
+    writer.unlock();
+}
+
+void RobustSharableMutex::wait_for_readers() {
+    uint64_t self = own_owner();
+    for (size_t i = 0; i < READER_SLOTS; ++i) {
+        for (unsigned round = 0; ; ++round) {
+            uint64_t held = readers[i].load();
+            if (held == 0) {
+                break;
+            }
+            if (round >= YIELD_ROUNDS && round % REAP_ROUNDS == 0 && SLOT_OWNER(held) != self && process_gone(held)) {
+                if (readers[i].compare_exchange_strong(held, 0)) {
+                    recovered.fetch_add(1, std::memory_order_relaxed);
+                }
+                continue;
+            }
+            backoff(round);
+        }
+    }
+}
+
+void RobustSharableMutex::wait_for_writer() {
+    for (unsigned round = 0; writing.load(std::memory_order_acquire); ++round) {
+        if (round < YIELD_ROUNDS) {
+            backoff(round);
+            continue;
+        }
+        // Sleep on the writer's own mutex. Holding it while `writing` is
+        // still raised means the writer died before lowering it.
+        bool died = writer.lock();
+        if (died) {
+            recovered.fetch_add(1, std::memory_order_relaxed);
+        }
+        writing.store(0, std::memory_order_relaxed);
+        writer.unlock();
+    }
+}
+
+void RobustSharableMutex::lock_sharable() {
+    uint64_t me = own_owner();
+    for (;;) {
+        if (writing.load(std::memory_order_acquire)) {
+            wait_for_writer();
+            continue;
+        }
+
+        // The process's own slot, or a free one to claim
+        size_t i = SLOT_PID(me) % READER_SLOTS;
+        for (unsigned round = 0; ; ++round, i = (i + 1) % READER_SLOTS) {
+            uint64_t held = readers[i].load(std::memory_order_relaxed);
+            if ((held == 0 || SLOT_OWNER(held) == me) && readers[i].compare_exchange_weak(held, (held | me) + 1)) {
+                break;
+            }
+            if (round >= READER_SLOTS) {
+                // Every slot is taken by another process
+                backoff(round - READER_SLOTS);
+            }
+        }
+        if (!writing.load()) {
+            return;
+        }
+        // A writer got in first: let it have the lock
+        unlock_sharable();
+        wait_for_writer();
+    }
+}
+
+void RobustSharableMutex::unlock_sharable() {
+    uint64_t me = own_owner();
+    size_t i = SLOT_PID(me) % READER_SLOTS;
+    for (size_t n = 0; n < READER_SLOTS; ++n, i = (i + 1) % READER_SLOTS) {
+        uint64_t held = readers[i].load(std::memory_order_relaxed);
+        while (SLOT_OWNER(held) == me && SLOT_COUNT(held) > 0) {
+            uint64_t left = SLOT_COUNT(held) == 1 ? 0 : held - 1;
+            if (readers[i].compare_exchange_weak(held, left, std::memory_order_release, std::memory_order_relaxed)) {
+                return;
+            }
+        }
+    }
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+
+// Locks that live inside the segment and survive the death of a process
+// holding them.
+//
+// The server forks a worker per connection, and a worker can be killed at
+// any moment, lock held or not. Boost's interprocess mutexes would then stay
+// locked for good and stall every other process. These are built on robust
+// pthread mutexes instead: the kernel hands a mutex whose owner died to the
+// next process that locks it. Whatever the dead owner was changing under the
+// lock is left as it was; repairing it is up to the caller.
+
+#define READER_SLOTS 64
+
+// A process-shared, robust mutex
+class RobustMutex
+{
+public:
+    RobustMutex() : RobustMutex(false) {}
+    ~RobustMutex();
+
+    // Returns true if the previous owner died holding the mutex. Throws
+    // bip::lock_exception on any other error.
+    bool lock();
+    bool try_lock();
+    void unlock();
+
+    // Times the mutex was taken over from an owner that had died
+    uint32_t recoveries() const { return died; }
+
+protected:
+    explicit RobustMutex(bool recursive);
+
+private:
+    RobustMutex(const RobustMutex&);
+    RobustMutex& operator=(const RobustMutex&);
+
+    bool acquired(int rc);
+
+    pthread_mutex_t mutex;
+    uint32_t died;      // only changed with the mutex held
+};
+
+class RobustRecursiveMutex : public RobustMutex
+{
+public:
+    RobustRecursiveMutex() : RobustMutex(true) {}
+};
+
+// Takes the place of bip::mutex_family in the segment's allocator, so that a
+// worker killed inside allocate() does not leave the allocator locked
+struct RobustMutexFamily
+{
+    typedef RobustMutex mutex_type;
+    typedef RobustRecursiveMutex recursive_mutex_type;
+};
+
+// A readers-writer lock with the interface of bip::interprocess_sharable_mutex,
+// so bip::scoped_lock and bip::sharable_lock work with it.
+//
+// A writer holds a robust mutex and raises `writing` while it has the lock.
+// Readers take no mutex: each registers in a slot of its own process, keyed
+// by pid and start time, so threads of one process share a slot and its
+// count. A writer waits for the slots to drain, clearing the slots of
+// processes that no longer exist; readers that find `writing` raised wait on
+// the mutex, which tells them if the writer died. Either way the lock is freed, and
+// recoveries() counts it. Writers are preferred, as with Boost's lock.
+class RobustSharableMutex
+{
+public:
+    RobustSharableMutex();
+
+    void lock();
+    void unlock();
+    void lock_sharable();
+    void unlock_sharable();
+
+    // Times the lock was freed from a writer or readers that had died
+    uint32_t recoveries() const { return recovered.load(std::memory_order_relaxed); }
+
+private:
+    RobustSharableMutex(const RobustSharableMutex&);
+    RobustSharableMutex& operator=(const RobustSharableMutex&);
+
+    void wait_for_writer();
+    void wait_for_readers();
+
+    RobustMutex writer;
+    std::atomic<uint32_t> writing;
+    std::atomic<uint32_t> recovered;
+    // pid, start time and number of the process's threads holding the lock
+    // shared; see robust.cpp
+    std::atomic<uint64_t> readers[READER_SLOTS];
+};
@@ -1,219 +1,491 @@
 #include <stdio.h>
-#include <string.h>   
-#include <stdlib.h>   
-#include <unistd.h>   
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <string>
+#include <thread>
+#include <vector>
 
+#include "connection.hpp"
+#include "metrics.hpp"
+#include "replication.hpp"
 #include "store.hpp"
+#include "uring.hpp"
+#include "watch.hpp"
 
-#define MAX_CONNECTIONS 5
-#define BUFFER_SIZE 1024
+#define DEFAULT_BACKLOG 128
+#define MAX_EVENTS 64
 #define PORT 8902
-#define NO_SUCH_KEY "No such key.\n"
+// Expired keys are erased by writers to their stripe, and by the server at
+// least this often. Snapshots are checked for at the same time.
+#define EXPIRE_INTERVAL_MS 1000
 
+// epoll data of the loop's watch eventfd; listeners have NULL
+static int watch_token;
 
-int recv_until(int sock_fd, unsigned char stop_char, char* outbuf, int outbuf_size)
-{
-    size_t buf_size = outbuf_size;
-    size_t buf_used = 0;
-    char *buf = (char*)malloc(buf_size);
 
-    if (!buf) {
-        return 0;
+// Picks the protocol from the first byte the client sends, then hands the
+// request to that protocol's handler.
+int handle_request(connection_t *conn)
+{
+    if (conn->protocol == PROTOCOL_UNKNOWN) {
+        if (conn->in.size() == 0) {
+            return 0;
+        }
+        conn->protocol = (unsigned char)conn->in.data()[0] == BINARY_MAGIC ? PROTOCOL_BINARY : PROTOCOL_TEXT;
+    }
+    if (conn->protocol == PROTOCOL_BINARY) {
+        return handle_binary_request(conn);
     }
+    return handle_text_request(conn);
+}
 
-    for (;;) {
-        unsigned char ch;
-        ssize_t status = read(sock_fd, &ch, 1);
 
-        if (status < 1) {
-            // error or connection closed by client
-            free(buf);
-            return 0;
+// Handles every complete request buffered on the connection.
+void handle_requests(connection_t *conn)
+{
+    int status;
+    while (!conn->closing && (status = handle_request(conn)) != 0) {
+        if (status < 0) {
+            conn->closing = true;
         }
+    }
+}
 
-        if (ch == stop_char) {
-            // stop character found, return the string
-            break;
+
+// Sends as much of conn->out as the socket accepts.
+// Returns -1 on a socket error.
+int flush_output(connection_t *conn)
+{
+    size_t sent = 0;
+    while (sent < conn->out.size()) {
+        ssize_t n = send(conn->fd, conn->out.data() + sent, conn->out.size() - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
         }
+        sent += n;
+    }
+    conn->out.erase(0, sent);
+    return 0;
+}
 
-        // add character to buffer, resizing it if necessary
-        if (buf_used == buf_size - 1) {
-            buf_size *= 2;
-            char *new_buf = (char*)realloc(buf, buf_size);
 
-            if (!new_buf) {
-                free(buf);
-                return 0;
+// A child whose request was a watch stays to send the events, waiting on
+// its eventfd and the socket, until the client closes the connection.
+void serve_watcher(connection_t *conn)
+{
+    struct pollfd fds[2];
+    fds[0].fd = conn->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = watch_eventfd();
+    fds[1].events = POLLIN;
+    std::vector<connection_t*> touched;
+    while (!conn->closing) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        if (fds[0].revents) {
+            ssize_t read_size = conn->in.fill(conn->fd);
+            if (read_size <= 0) {
+                return;
             }
+            // More watches, or a replica's heartbeats
+            handle_requests(conn);
+        }
+        if (fds[1].revents) {
+            dispatch_changes(&touched);
+            touched.clear();
+        }
+        // The socket blocks, so every flush sends all of `out`; a replica's
+        // full sync runs to its end here
+        int status;
+        while ((status = flush_output(conn)) == 0 && conn->scanning) {
+            handle_request(conn);
+        }
+        if (status < 0) {
+            return;
+        }
+    }
+}
+
+
+// Original model: one child process per connection, serving a single request.
+int serve_fork(int socket_desc)
+{
+    int client_sock, c;
+    struct sockaddr_in6 client;
+
+    c = sizeof(client);
+    while((client_sock = accept(socket_desc, (struct sockaddr *)&client, (socklen_t*)&c))) {
+        if (client_sock < 0) {
+            perror("accept failed");
+            return 1;
+        }
+
+        connection_opened();
+        // Create child process
+        if (fork() == 0) {
+            // Child process
+            close(socket_desc); // Child doesn't need the listener
+
+            connection_t conn(client_sock);
 
-            buf = new_buf;
+            int status = 0;
+            while (status == 0) {
+                ssize_t read_size = conn.in.fill(client_sock);
+                if (read_size < 0) {
+                    perror("recv failed");
+                    break;
+                }
+                if (read_size == 0) {
+                    break;
+                }
+                status = handle_request(&conn);
+            }
+            if (!commit_values()) {
+                perror("write log commit failed");
+            }
+            notify_watchers();
+            // The socket blocks, so every flush sends all of `out`
+            while (flush_output(&conn) == 0 && conn.scanning) {
+                handle_request(&conn);
+            }
+            if (!conn.watches.empty()) {
+                serve_watcher(&conn);
+                unwatch(&conn);
+            }
+            close(client_sock);
+            connection_closed();
+            exit(0);
         }
 
-        buf[buf_used++] = ch;
+        signal(SIGCHLD,SIG_IGN);
+        // Parent process
+        close(client_sock);
+        snapshot_values();
     }
 
-    memcpy(outbuf, buf, buf_used);
-    free(buf);
-    return buf_used;
+    return 0;
 }
 
 
-void send_str(int sock_fd, char* str)
+uint64_t monotonic_ms()
 {
-    char* buf = (char*)malloc(strlen(str) + 1);
-    strcpy(buf, str);
-    buf[strlen(str)] = '\n';
-    send(sock_fd, buf, strlen(str) + 1, 0);
-    free(buf);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
 }
 
 
-void store_value_handler(int sock)
+int set_nonblocking(int fd)
 {
-    char key[256];
-    int key_length;
-    char type[256];
-    int type_length;
-    char value[2048];
-    int value_length;
-
-    key_length = recv_until(sock, '\n', key, sizeof(key));
-    if (key_length <= 0) {
-        return;
-    }
-    type_length = recv_until(sock, '\n', type, sizeof(type));
-    if (type_length <= 0) {
-        return;
-    }
-    value_length = recv_until(sock, '\n', value, sizeof(value));
-    if (value_length <= 0) {
-        return;
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
     }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-    if (strstr(type, "string") != NULL) {
-        key[key_length] = 0;
-        value[value_length] = 0;
-        store_value(std::string(key), std::string(value));
-        send_str(sock, "saved.\n");
-    }
+
+void update_interest(int epoll_fd, connection_t *conn)
+{
+    struct epoll_event ev;
+    // A scan goes on once the socket takes more
+    ev.events = conn->out.empty() && !conn->scanning ? EPOLLIN : EPOLLOUT;
+    ev.data.ptr = conn;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
 }
 
 
-void load_value_handler(int sock)
+void close_connection(int epoll_fd, connection_t *conn)
 {
-    char key[256];
-    int key_length;
-    char type[256];
-    int type_length;
+    unwatch(conn);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    delete conn;
+    connection_closed();
+}
 
-    key_length = recv_until(sock, '\n', key, sizeof(key));
-    if (key_length <= 0) {
-        return;
-    }
-    type_length = recv_until(sock, '\n', type, sizeof(type));
-    if (type_length <= 0) {
-        return;
-    }
 
-    if (strstr(type, "string") != NULL) {
-        key[key_length] = 0;
-        std::string value = load_string_value(std::string(key));
-        if (value.length() == 0) {
-            send_str(sock, NO_SUCH_KEY);
+void accept_connections(int epoll_fd, int socket_desc)
+{
+    for (;;) {
+        int client_sock = accept4(socket_desc, NULL, NULL, SOCK_NONBLOCK);
+        if (client_sock < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept failed");
+            }
+            return;
         }
-        else {
-            char value_str[256] = {0};
-            strncpy(value_str, value.c_str(), strlen(value.c_str()));
-            value_str[std::min(strlen(value_str), sizeof(value_str))] = '\x00';
-            send_str(sock, value_str);
+
+        int one = 1;
+        setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        connection_t *conn = new connection_t(client_sock);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+            perror("epoll_ctl failed");
+            close(client_sock);
+            delete conn;
+            continue;
         }
+        connection_opened();
     }
 }
 
 
-int main()
+// Persistent connections: requests are pipelined on each connection and
+// replied to in order. A connection stops being read while it has unsent
+// replies, so a slow reader cannot make the server buffer without bound.
+//
+// Every worker thread runs one of these loops on a listener of its own. Only
+// the one given `maintenance` erases expired keys and takes snapshots.
+int serve_epoll(int socket_desc, bool maintenance)
 {
-    initialize();
-
-    char* port_str = getenv("KVSTORE_PORT");
-    int port;
-    if (!port_str) {
-        port = PORT;
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        return 1;
     }
-    else {
-        port = atoi(port_str);
+
+    set_nonblocking(socket_desc);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_desc, &ev);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &watch_token;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watch_eventfd(), &ev);
+
+    struct epoll_event events[MAX_EVENTS];
+    std::vector<connection_t*> watchers;
+    uint64_t last_expire = monotonic_ms();
+    for (;;) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, EXPIRE_INTERVAL_MS);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            return 1;
+        }
+
+        if (maintenance && monotonic_ms() - last_expire >= EXPIRE_INTERVAL_MS) {
+            expire_values();
+            snapshot_values();
+            last_expire = monotonic_ms();
+        }
+
+        connection_t *ready[MAX_EVENTS];
+        int ready_count = 0;
+        bool changes = false;
+        for (int i = 0; i < n; ++i) {
+            connection_t *conn = (connection_t*)events[i].data.ptr;
+            if (conn == NULL) {
+                accept_connections(epoll_fd, socket_desc);
+                continue;
+            }
+            if (events[i].data.ptr == &watch_token) {
+                changes = true;
+                continue;
+            }
+
+            if (events[i].events & EPOLLIN) {
+                ssize_t read_size = conn->in.fill(conn->fd);
+                if (read_size == 0 || (read_size < 0 && errno != EAGAIN && errno != EINTR)) {
+                    close_connection(epoll_fd, conn);
+                    continue;
+                }
+            }
+            else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                close_connection(epoll_fd, conn);
+                continue;
+            }
+
+            // Requests left over from a previous write stall are handled too
+            handle_requests(conn);
+            ready[ready_count++] = conn;
+        }
+
+        // Group commit: the changes of every request in this round reach the
+        // log before any of them is replied to
+        if (!commit_values()) {
+            perror("write log commit failed");
+        }
+        notify_watchers();
+
+        for (int i = 0; i < ready_count; ++i) {
+            connection_t *conn = ready[i];
+            if (flush_output(conn) < 0 || (conn->closing && conn->out.empty())) {
+                close_connection(epoll_fd, conn);
+                continue;
+            }
+            update_interest(epoll_fd, conn);
+        }
+
+        // After the round's connections are flushed, so none of the watchers
+        // has been closed meanwhile
+        if (changes) {
+            dispatch_changes(&watchers);
+            for (connection_t *conn : watchers) {
+                if (flush_output(conn) < 0) {
+                    close_connection(epoll_fd, conn);
+                    continue;
+                }
+                update_interest(epoll_fd, conn);
+            }
+            watchers.clear();
+        }
     }
 
-    int socket_desc, client_sock, c;
-    struct sockaddr_in6 server, client;
-    
+    return 0;
+}
+
+
+// Binds a listener to the port on ::1. SO_REUSEPORT lets every worker bind
+// one, and the kernel spreads incoming connections across them.
+int open_listener(int port, int backlog)
+{
+    int socket_desc;
+    struct sockaddr_in6 server;
+
     //Create socket
     socket_desc = socket(AF_INET6, SOCK_STREAM, 0);
     if (socket_desc == -1) {
         printf("Could not create socket");
-        return 1;
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(socket_desc, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("SO_REUSEPORT failed");
+        close(socket_desc);
+        return -1;
     }
-    
+
     //Prepare the sockaddr_in structure
+    memset(&server, 0, sizeof(server));
     server.sin6_family = AF_INET6;
     server.sin6_port = htons(port);
     inet_pton(AF_INET6, "::1", &server.sin6_addr);
-    
+
     //Bind
     if (bind(socket_desc, (struct sockaddr *)&server, sizeof(server)) < 0) {
         perror("bind failed. Error");
-        return 1;
+        close(socket_desc);
+        return -1;
     }
-    
+
     //Listen
-    listen(socket_desc, MAX_CONNECTIONS);
-    
-    //Accept incoming connection
-    c = sizeof(struct sockaddr_in);
-    while((client_sock = accept(socket_desc, (struct sockaddr *)&client, (socklen_t*)&c))) {
-        if (client_sock < 0) {
-            perror("accept failed");
+    if (listen(socket_desc, backlog) < 0) {
+        perror("listen failed");
+        close(socket_desc);
+        return -1;
+    }
+    add_listener(socket_desc);
+    return socket_desc;
+}
+
+
+int main()
+{
+    // Every segment is replaced or repaired here, so a second server on the
+    // same segment names must stop first
+    if (!initialize()) {
+        return 1;
+    }
+    init_metrics();
+    init_watch();
+
+    // A replica follows its primary from the start, and refuses writes
+    char* primary_str = getenv("KVSTORE_REPLICA_OF");
+    if (primary_str && !start_replication(primary_str)) {
+        fprintf(stderr, "KVSTORE_REPLICA_OF must be host:port\n");
+        return 1;
+    }
+
+    char* port_str = getenv("KVSTORE_PORT");
+    int port;
+    if (!port_str) {
+        port = PORT;
+    }
+    else {
+        port = atoi(port_str);
+    }
+
+    // "fork" keeps the original process-per-connection model, and "uring"
+    // replaces the epoll loops with io_uring ones
+    char* mode_str = getenv("KVSTORE_MODE");
+    bool fork_mode = mode_str && strcmp(mode_str, "fork") == 0;
+    int (*serve)(int, bool) = serve_epoll;
+    if (mode_str && strcmp(mode_str, "uring") == 0) {
+        if (uring_supported()) {
+            serve = serve_uring;
+        }
+        else {
+            perror("io_uring unavailable, using epoll");
+        }
+    }
+
+    // Connections waiting to be accepted, per listener; the kernel caps it
+    // at net.core.somaxconn
+    char* backlog_str = getenv("KVSTORE_BACKLOG");
+    int backlog = backlog_str ? atoi(backlog_str) : DEFAULT_BACKLOG;
+    if (backlog <= 0) {
+        backlog = DEFAULT_BACKLOG;
+    }
+
+    // Worker threads, each with its own listener and event loop; one per
+    // core by default. Fork mode always has one listener.
+    char* workers_str = getenv("KVSTORE_WORKERS");
+    long workers = workers_str ? atol(workers_str) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0 || fork_mode) {
+        workers = 1;
+    }
+
+    // All listeners are bound before any worker starts, so a failed bind
+    // stops the server instead of leaving some workers running
+    std::vector<int> listeners;
+    for (long i = 0; i < workers; ++i) {
+        int socket_desc = open_listener(port, backlog);
+        if (socket_desc < 0) {
             return 1;
         }
-        
-        // Create child process
-        if (fork() == 0) {
-            // Child process
-            close(socket_desc); // Child doesn't need the listener
-            
-            // Receive a message from client
-            char client_message[BUFFER_SIZE];
-            int read_size;
-            if ((read_size = recv_until(client_sock, '\n', client_message, BUFFER_SIZE)) > 0 ) {
-                client_message[read_size] = '\0'; // Null terminate the message
-
-                if (strstr(client_message, "store_value")) {
-                    store_value_handler(client_sock);
-                } else if (strstr(client_message, "load_value")) {
-                    load_value_handler(client_sock);
-                } else if (strcmp(client_message, "remove_value") == 0) {
-                    // Implement remove_value functionality here
-                    write(client_sock, "Received remove_value command", strlen("Received remove_value command"));
-                } else {
-                    write(client_sock, "Invalid command", strlen("Invalid command"));
-                }
-            }
-            
-            if(read_size == 0) {
-                close(client_sock);
-            } else if(read_size == -1) {
-                perror("recv failed");
+        listeners.push_back(socket_desc);
+    }
+
+    if (fork_mode) {
+        return serve_fork(listeners[0]);
+    }
+    for (size_t i = 1; i < listeners.size(); ++i) {
+        int socket_desc = listeners[i];
+        std::thread([serve, socket_desc] {
+            if (serve(socket_desc, false) != 0) {
+                exit(1);
             }
-            
-            exit(0);
-        }
-        
-        signal(SIGCHLD,SIG_IGN);
-        // Parent process
-        close(client_sock);
+        }).detach();
     }
-    
-    return 0;
+    return serve(listeners[0], true);
 }
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <boost/interprocess/allocators/allocator.hpp>
+#include <boost/interprocess/containers/string.hpp>
+#include <boost/utility/string_view.hpp>
+
+#include "slab.hpp"
+
+// Types shared by everything that lives inside the shared-memory segment.
+// Pointers between objects in the segment must be offset pointers, since
+// every process may map the segment at a different address.
+
+template <typename T> using Alloc = bip::allocator<T, SegmentManager>;
+// Keys and values come from their stripe's SlabPool
+using ShString = bip::basic_string<char, std::char_traits<char>, SlabAlloc<char>>;
+
+// A key and its serialized item, as stored by every index
+using Entry = std::pair<ShString const, ShString>;
+
+// Name of one of the server's shared-memory segments. Setting KVSTORE_SHM_NAME
+// replaces the default names with that name plus `suffix`, so servers on one
+// machine, such as a primary and its replica, keep to their own segments.
+inline std::string segment_name(const char* default_name, const char* suffix) {
+    const char* name = getenv("KVSTORE_SHM_NAME");
+    if (!name || !*name) {
+        return default_name;
+    }
+    return std::string(name) + suffix;
+}
+
+inline boost::string_view to_view(const ShString& str) {
+    return boost::string_view(str.data(), str.size());
+}
+
+// Orders ShString keys and allows lookups by string_view, so reads do not
+// have to build a temporary key inside the segment.
+struct KeyLess
+{
+    typedef void is_transparent;
+
+    bool operator()(const ShString& a, const ShString& b) const { return to_view(a) < to_view(b); }
+    bool operator()(const ShString& a, boost::string_view b) const { return to_view(a) < b; }
+    bool operator()(boost::string_view a, const ShString& b) const { return a < to_view(b); }
+};
+
+// 64-bit hash of a key, reading eight bytes at a time. It has to give the
+// same result in every process, so it must not be seeded per process.
+inline uint64_t hash_key(boost::string_view key) {
+    const uint64_t mul = 0x9e3779b97f4a7c15ULL;
+    uint64_t h = key.size() * mul;
+    const char *p = key.data();
+    size_t n = key.size();
+    while (n >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        h = (h ^ word) * mul;
+        h ^= h >> 29;
+        p += 8;
+        n -= 8;
+    }
+    if (n > 0) {
+        uint64_t word = 0;
+        memcpy(&word, p, n);
+        h = (h ^ word) * mul;
+    }
+    h ^= h >> 32;
+    h *= 0xd6e8feb86659fd93ULL;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,167 @@
+#include <new>
+
+#include "slab.hpp"
+
+// Spaced about 1.5x apart, so rounding up wastes at most a third of a block
+static const uint32_t class_sizes[SLAB_CLASSES] = {16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512};
+
+// Blocks start after the page header, 16-byte aligned
+#define PAGE_HEADER_SIZE 48
+// Pages are allocated this much short of SLAB_PAGE_SIZE, which leaves room
+// for the segment manager's block header in front of the next page. Without
+// it, every other aligned page slot would be skipped.
+#define PAGE_SLACK 64
+#define PAGE_BYTES (SLAB_PAGE_SIZE - PAGE_SLACK)
+
+
+static int size_class(size_t size)
+{
+    int c = 0;
+    while (class_sizes[c] < size) {
+        ++c;
+    }
+    return c;
+}
+
+static uint32_t page_blocks(int c)
+{
+    return (PAGE_BYTES - PAGE_HEADER_SIZE) / class_sizes[c];
+}
+
+
+SlabPool::SlabPool(SegmentManager* segment_manager)
+    : manager(segment_manager)
+    , requested(0)
+    , pages(0)
+    , block_bytes(0)
+    , large_bytes(0) {
+    static_assert(sizeof(Page) <= PAGE_HEADER_SIZE, "slab page header too large");
+    for (int c = 0; c < SLAB_CLASSES; ++c) {
+        partial[c] = nullptr;
+    }
+}
+
+SlabPool::Page* SlabPool::new_page(int c) {
+    Page* page = static_cast<Page*>(manager->allocate_aligned(PAGE_BYTES, SLAB_PAGE_SIZE));
+    page->prev = nullptr;
+    page->next = nullptr;
+    page->free = nullptr;
+    page->size_class = c;
+    page->used = 0;
+    page->carved = 0;
+    link(page);
+    pages.store(pages.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return page;
+}
+
+void SlabPool::link(Page* page) {
+    Page* head = partial[page->size_class].get();
+    page->prev = nullptr;
+    page->next = head;
+    if (head) {
+        head->prev = page;
+    }
+    partial[page->size_class] = page;
+}
+
+void SlabPool::unlink(Page* page) {
+    if (page->prev) {
+        page->prev->next = page->next;
+    }
+    else {
+        partial[page->size_class] = page->next;
+    }
+    if (page->next) {
+        page->next->prev = page->prev;
+    }
+    page->prev = nullptr;
+    page->next = nullptr;
+}
+
+void* SlabPool::allocate(size_t size) {
+    if (size > SLAB_MAX_BLOCK) {
+        void* block = manager->allocate(size);
+        large_bytes.store(large_bytes.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+        requested.store(requested.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+        return block;
+    }
+
+    int c = size_class(size);
+    Page* page = partial[c].get();
+    if (!page) {
+        page = new_page(c);
+    }
+
+    void* block;
+    if (page->free) {
+        bip::offset_ptr<void>* free_block = static_cast<bip::offset_ptr<void>*>(page->free.get());
+        block = free_block;
+        page->free = *free_block;
+    }
+    else {
+        block = (char*)page + PAGE_HEADER_SIZE + (size_t)page->carved * class_sizes[c];
+        ++page->carved;
+    }
+    if (++page->used == page_blocks(c)) {
+        unlink(page);
+    }
+
+    block_bytes.store(block_bytes.load(std::memory_order_relaxed) + class_sizes[c], std::memory_order_relaxed);
+    requested.store(requested.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+    return block;
+}
+
+void SlabPool::deallocate(void* block, size_t size) {
+    requested.store(requested.load(std::memory_order_relaxed) - size, std::memory_order_relaxed);
+    if (size > SLAB_MAX_BLOCK) {
+        manager->deallocate(block);
+        large_bytes.store(large_bytes.load(std::memory_order_relaxed) - size, std::memory_order_relaxed);
+        return;
+    }
+
+    // Pages are aligned to their size in every process, since each maps the
+    // segment at a page boundary
+    Page* page = (Page*)((uintptr_t)block & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    int c = page->size_class;
+    block_bytes.store(block_bytes.load(std::memory_order_relaxed) - class_sizes[c], std::memory_order_relaxed);
+
+    if (page->used-- == page_blocks(c)) {
+        link(page);
+    }
+    if (page->used == 0 && (page->prev || page->next)) {
+        // Empty, and not the only page of its class with room: keeping one
+        // spare avoids a page round trip for a key that comes and goes
+        unlink(page);
+        manager->deallocate(page);
+        pages.store(pages.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        return;
+    }
+
+    // A free block holds the next free block of its page
+    page->free = new (block) bip::offset_ptr<void>(page->free);
+}
+
+uint32_t allocator_recoveries(SegmentManager* manager)
+{
+    // The segment manager starts with its allocator, and rbtree_best_fit
+    // starts with its lock; neither is reachable by name. An owner's death
+    // is only noticed by whoever takes the lock next.
+    RobustMutex* lock = reinterpret_cast<RobustMutex*>(manager);
+    lock->lock();
+    lock->unlock();
+    return lock->recoveries();
+}
+
+size_t SlabPool::free_bytes() const {
+    // Read without the lock, the two may be from different moments
+    size_t capacity = pages.load(std::memory_order_relaxed) * (PAGE_BYTES - PAGE_HEADER_SIZE);
+    size_t used = block_bytes.load(std::memory_order_relaxed);
+    return capacity > used ? capacity - used : 0;
+}
+
+void SlabPool::add_stats(SlabStats* stats) const {
+    stats->requested += requested.load(std::memory_order_relaxed);
+    stats->slab_bytes += pages.load(std::memory_order_relaxed) * SLAB_PAGE_SIZE;
+    stats->slab_free += free_bytes();
+    stats->large_bytes += large_bytes.load(std::memory_order_relaxed);
+}
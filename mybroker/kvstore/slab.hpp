@@ -0,0 +1,131 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <boost/interprocess/offset_ptr.hpp>
+
+#include "robust.hpp"
+
+// Size-class allocator for the small blocks keys, values and index entries
+// are made of, inside the segment.
+//
+// The segment manager is a general-purpose best-fit allocator: every block
+// carries a header, and freed blocks of mixed sizes are left scattered between
+// live ones. Blocks up to SLAB_MAX_BLOCK bytes are instead rounded up to one
+// of a few size classes and carved out of SLAB_PAGE_SIZE pages, one class per
+// page, with no per-block header. A page that becomes empty goes back to the
+// segment manager, so memory freed by one size class can be reused by
+// another. Larger blocks come from the segment manager directly.
+//
+// A pool is not locked: every stripe has its own, only used with the stripe
+// locked for writing. The counters are atomic only so that stats can be read
+// without the lock.
+
+#define SLAB_CLASSES 11
+#define SLAB_MAX_BLOCK 512
+#define SLAB_PAGE_SIZE 4096     // also the alignment of pages
+
+namespace bip = boost::interprocess;
+
+// A managed segment whose allocator lock survives a process dying inside it
+using ManagedSegment = bip::basic_managed_shared_memory<char, bip::rbtree_best_fit<RobustMutexFamily>, bip::iset_index>;
+using SegmentManager = ManagedSegment::segment_manager;
+
+// Times a process died holding the segment allocator's lock. Its free lists
+// are then in whatever state that process left them, which nothing short of
+// building a new segment can fix.
+uint32_t allocator_recoveries(SegmentManager* manager);
+
+struct SlabStats
+{
+    size_t requested;       // bytes asked for by live allocations
+    size_t slab_bytes;      // bytes of pages
+    size_t slab_free;       // bytes of pages not handed out
+    size_t large_bytes;     // bytes allocated from the segment manager directly
+};
+
+class SlabPool
+{
+public:
+    explicit SlabPool(SegmentManager* segment_manager);
+
+    // Throws bip::bad_alloc if the segment is out of memory
+    void* allocate(size_t size);
+    void deallocate(void* block, size_t size);
+
+    SegmentManager* segment_manager() const { return manager.get(); }
+    // Bytes in pages that can be handed out again without growing
+    size_t free_bytes() const;
+    // Bytes asked for by live allocations
+    size_t used_bytes() const { return requested.load(std::memory_order_relaxed); }
+    // Bytes of the blocks and large allocations handed out; what a new pool
+    // needs, give or take a page per class, to hold the same allocations
+    size_t held_bytes() const {
+        return block_bytes.load(std::memory_order_relaxed) + large_bytes.load(std::memory_order_relaxed);
+    }
+    void add_stats(SlabStats* stats) const;
+
+private:
+    struct Page
+    {
+        // Neighbours in the list of pages of this class with a free block
+        bip::offset_ptr<Page> prev;
+        bip::offset_ptr<Page> next;
+        bip::offset_ptr<void> free;     // blocks freed since the page was carved
+        uint32_t size_class;
+        uint32_t used;                  // blocks handed out
+        uint32_t carved;                // blocks ever handed out; the rest is untouched
+    };
+
+    SlabPool(const SlabPool&);
+    SlabPool& operator=(const SlabPool&);
+
+    Page* new_page(int size_class);
+    void link(Page* page);
+    void unlink(Page* page);
+
+    bip::offset_ptr<SegmentManager> manager;
+    bip::offset_ptr<Page> partial[SLAB_CLASSES];
+    std::atomic<size_t> requested;
+    std::atomic<size_t> pages;
+    std::atomic<size_t> block_bytes;
+    std::atomic<size_t> large_bytes;
+};
+
+// Allocator for containers in the segment that draws from a stripe's pool
+template <class T>
+class SlabAlloc
+{
+public:
+    typedef T value_type;
+    typedef bip::offset_ptr<T> pointer;
+    typedef bip::offset_ptr<const T> const_pointer;
+    typedef bip::offset_ptr<void> void_pointer;
+    typedef bip::offset_ptr<const void> const_void_pointer;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <class U> struct rebind { typedef SlabAlloc<U> other; };
+
+    explicit SlabAlloc(SlabPool* pool) : pool(pool) {}
+    template <class U> SlabAlloc(const SlabAlloc<U>& other) : pool(other.get_pool()) {}
+
+    pointer allocate(size_type n) {
+        return pointer(static_cast<T*>(pool->allocate(n * sizeof(T))));
+    }
+    void deallocate(const pointer& p, size_type n) {
+        pool->deallocate(p.get(), n * sizeof(T));
+    }
+    size_type max_size() const { return (size_type)-1 / sizeof(T); }
+
+    SlabPool* get_pool() const { return pool.get(); }
+    SegmentManager* get_segment_manager() const { return pool->segment_manager(); }
+
+    template <class U> bool operator==(const SlabAlloc<U>& other) const { return pool == other.get_pool(); }
+    template <class U> bool operator!=(const SlabAlloc<U>& other) const { return pool != other.get_pool(); }
+
+private:
+    bip::offset_ptr<SlabPool> pool;
+};
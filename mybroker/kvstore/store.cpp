@@ -1,110 +1,2541 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <algorithm>
 #include <map>
 #include <string>
 #include <iostream>
-#include <boost/interprocess/managed_shared_memory.hpp>
-#include <boost/interprocess/allocators/allocator.hpp>
-#include <boost/interprocess/containers/map.hpp>
-#include <boost/interprocess/containers/string.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
 
-namespace bip = boost::interprocess;
+#include "lz.hpp"
+#include "metrics.hpp"
+#include "store.hpp"
+#include "watch.hpp"
 
-template <typename T> using Alloc = bip::allocator<T, bip::managed_shared_memory::segment_manager>;
-using ShString = bip::basic_string<char, std::char_traits<char>, Alloc<char>>;
-using ShmemAllocator = Alloc<std::pair<ShString const, ShString>>;
-using StringMap = bip::map<ShString, ShString, std::less<ShString>, ShmemAllocator>;
+// Rough per-entry cost of a map node on top of the key and value bytes
+#define NODE_OVERHEAD 128
+#define STRIPE_INITIAL_SLOTS 8
+// Seqlock reads that collide with writers this often fall back to the lock
+#define OPTIMISTIC_ATTEMPTS 8
+// Most keys one write evicts, so a single writer does not stall for long
+#define EVICT_BATCH 16
+// Most keys of dropped keyspaces one expire_due() erases
+#define RECLAIM_BATCH 4096
+// Rough size of a new stripe's index and filter
+#define NEW_STRIPE_SIZE 1024
+// Locked by a running server; see claim_segments()
+#define LOCK_SEGMENT "kvstore_lock"
 
-class SharedKeyValueStore
+// Every value is an item: a type byte followed by the payload. An integer's
+// payload is an int64_t in host byte order, so its item always has the same
+// size and can be overwritten in place.
+const int type_int = 0x30;
+const int type_string = 0x31;
+const int type_py = 0x39;
+
+#define INT_ITEM_SIZE (1 + sizeof(int64_t))
+
+// A string of at least KVSTORE_COMPRESS_MIN bytes is stored compressed if
+// that makes it smaller. The type byte of its item then has item_flagged set
+// and is followed by a flag byte, flag_lz, and the length of the string as a
+// u32. Other items have no flag byte, so integers keep their fixed size and
+// items stored before compression existed read as they did.
+const int item_flagged = 0x80;
+const int flag_lz = 0x01;
+
+#define LZ_ITEM_HEADER_SIZE (2 + sizeof(uint32_t))
+
+
+std::string make_item(int type, boost::string_view payload)
+{
+    std::string item;
+    item.reserve(1 + payload.size());
+    item.push_back((char)type);
+    item.append(payload.data(), payload.size());
+    return item;
+}
+
+std::string make_int_item(int64_t value)
+{
+    char item[INT_ITEM_SIZE];
+    item[0] = (char)type_int;
+    memcpy(item + 1, &value, sizeof(value));
+    return std::string(item, sizeof(item));
+}
+
+// A value with a TTL is the item wrapped in a header: tag_expires, then the
+// expiry time in milliseconds since the epoch. Keys without a TTL pay nothing.
+const int tag_expires = 0x45;
+
+#define EXPIRES_SIZE (1 + sizeof(uint64_t))
+
+
+uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+std::string make_expires(uint64_t expires)
+{
+    char header[EXPIRES_SIZE];
+    header[0] = (char)tag_expires;
+    memcpy(header + 1, &expires, sizeof(expires));
+    return std::string(header, sizeof(header));
+}
+
+bool value_expires(boost::string_view value, uint64_t* expires)
+{
+    if (value.size() < EXPIRES_SIZE || value[0] != (char)tag_expires) {
+        return false;
+    }
+    memcpy(expires, value.data() + 1, sizeof(*expires));
+    return true;
+}
+
+bool value_expired(boost::string_view value, uint64_t now)
+{
+    uint64_t expires;
+    return value_expires(value, &expires) && expires <= now;
+}
+
+// Strips the expiry header from a copied value. Returns false if the value
+// has expired.
+bool unwrap_value(std::string* value)
+{
+    uint64_t expires;
+    if (!value_expires(*value, &expires)) {
+        return true;
+    }
+    if (expires <= now_ms()) {
+        return false;
+    }
+    value->erase(0, EXPIRES_SIZE);
+    return true;
+}
+
+bool live_item(boost::string_view stored, boost::string_view* item)
+{
+    uint64_t expires;
+    if (!value_expires(stored, &expires)) {
+        *item = stored;
+        return true;
+    }
+    if (expires <= now_ms()) {
+        return false;
+    }
+    *item = stored.substr(EXPIRES_SIZE);
+    return true;
+}
+
+size_t item_offset(const ShString& value)
+{
+    uint64_t expires;
+    return value_expires(to_view(value), &expires) ? EXPIRES_SIZE : 0;
+}
+
+bool int_item_value(const ShString& value, int64_t* result)
+{
+    size_t offset = item_offset(value);
+    if (value.size() != offset + INT_ITEM_SIZE || value[offset] != (char)type_int) {
+        return false;
+    }
+    memcpy(result, value.data() + offset + 1, sizeof(*result));
+    return true;
+}
+
+void set_int_item_value(ShString& value, int64_t result)
+{
+    memcpy(&value[item_offset(value) + 1], &result, sizeof(result));
+}
+
+
+Stripe::Stripe(SegmentManager* segment_manager, IndexType index, uint32_t clock_words, uint32_t slot)
+    : seq(0)
+    , clock_words(clock_words)
+    , slot(slot)
+    , clock_hand(0)
+    , pool(segment_manager)
+    , clock_key(SlabAlloc<char>(&pool))
+    , changing(nullptr)
+    , repairs(0)
+    , lost(0) {
+    if (index == INDEX_TREE) {
+        tree = segment_manager->construct<StringMap>(bip::anonymous_instance)(KeyLess(), ShmemAllocator(&pool));
+    }
+    else {
+        table = segment_manager->construct<HashIndex>(bip::anonymous_instance)(&pool, STRIPE_INITIAL_SLOTS);
+    }
+    filter = segment_manager->construct<CountingBloom>(bip::anonymous_instance)(segment_manager, STRIPE_INITIAL_SLOTS);
+    if (clock_words > 0) {
+        referenced = segment_manager->construct<std::atomic<uint64_t>>(bip::anonymous_instance)[clock_words](0);
+    }
+}
+
+Entry* Stripe::find(boost::string_view key, uint64_t hash) {
+    if (!filter->may_contain(hash)) {
+        return nullptr;
+    }
+    if (table) {
+        return table->find(key, hash);
+    }
+    auto it = tree->find(key);
+    return it == tree->end() ? nullptr : &*it;
+}
+
+// A value is overwritten where it is, so one cut short is half old and half
+// new; `changing` tells rebuild() to leave it out
+static void overwrite(bip::offset_ptr<Entry>& changing, Entry* entry, boost::string_view value)
+{
+    changing = entry;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    try {
+        entry->second.assign(value.data(), value.size());
+    }
+    catch (bip::bad_alloc &) {
+        // The old value is left whole
+        changing = nullptr;
+        throw;
+    }
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    changing = nullptr;
+}
+
+void Stripe::put(boost::string_view key, uint64_t hash, boost::string_view value) {
+    if (table) {
+        Entry* entry = table->find(key, hash);
+        if (entry) {
+            overwrite(changing, entry, value);
+            return;
+        }
+        table->put(key, hash, value);
+        add_to_filter(hash);
+        return;
+    }
+    auto it = tree->find(key);
+    if (it != tree->end()) {
+        overwrite(changing, &*it, value);
+    }
+    else {
+        SlabAlloc<char> sa(tree->get_allocator());
+        tree->emplace(ShString(key.data(), key.size(), sa), ShString(value.data(), value.size(), sa));
+        add_to_filter(hash);
+    }
+}
+
+void Stripe::replace(Entry* entry, ShString& value) {
+    changing = entry;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    entry->second.swap(value);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    changing = nullptr;
+}
+
+void Stripe::add_to_filter(uint64_t hash) {
+    if (!filter->full()) {
+        filter->add(hash);
+        return;
+    }
+    try {
+        filter->grow();
+    }
+    catch (bip::bad_alloc &) {
+        // Overfull only costs more false positives
+        filter->add(hash);
+        return;
+    }
+    // The key is in the index already, so this adds it too
+    if (table) {
+        for (size_t i = 0; i < table->capacity(); ++i) {
+            uint32_t slot_hash;
+            if (table->at(i, &slot_hash)) {
+                filter->add(slot_hash);
+            }
+        }
+    }
+    else {
+        for (const Entry& entry : *tree) {
+            filter->add(hash_key(to_view(entry.first)));
+        }
+    }
+}
+
+bool Stripe::erase(boost::string_view key, uint64_t hash) {
+    bool erased;
+    if (table) {
+        erased = table->erase(key, hash);
+    }
+    else {
+        auto it = tree->find(key);
+        erased = it != tree->end();
+        if (erased) {
+            tree->erase(it);
+        }
+    }
+    if (erased) {
+        filter->remove(hash);
+    }
+    return erased;
+}
+
+size_t Stripe::clear(size_t limit) {
+    size_t erased = 0;
+    if (table) {
+        // Erasing shifts the next key back into the slot, so the slot is
+        // looked at again
+        for (size_t i = 0; table->size() > 0 && erased < limit; i = (i + 1) & (table->capacity() - 1)) {
+            uint32_t hash;
+            while (Entry* entry = table->at(i, &hash)) {
+                boost::string_view key = to_view(entry->first);
+                table->erase(key, hash_key(key));
+                filter->remove(hash);
+                if (++erased == limit) {
+                    break;
+                }
+            }
+        }
+        return erased;
+    }
+    while (!tree->empty() && erased < limit) {
+        auto it = tree->begin();
+        filter->remove(hash_key(to_view(it->first)));
+        tree->erase(it);
+        ++erased;
+    }
+    return erased;
+}
+
+size_t Stripe::expire_due(uint64_t now_ms) {
+    if (!timers) {
+        return 0;
+    }
+    size_t expired = 0;
+    timers->advance(now_ms, [&](boost::string_view key, uint64_t expires) {
+        uint64_t hash = hash_key(key);
+        Entry* entry = find(key, hash);
+        uint64_t entry_expires;
+        // Skip timers left behind by a later store or expire
+        if (entry && value_expires(to_view(entry->second), &entry_expires) && entry_expires == expires) {
+            erase(key, hash);
+            publish_change(CHANGE_DEL, slot, key);
+            ++expired;
+        }
+    });
+    return expired;
+}
+
+bool Stripe::evict(uint64_t now_ms, bool* expired, std::string* key) {
+    // Clears the bit and returns true if the key was referenced since the
+    // hand last passed it
+    auto second_chance = [this](uint64_t hash) {
+        std::atomic<uint64_t>& word = referenced[((uint32_t)hash / 64) & (clock_words - 1)];
+        uint64_t bit = 1ULL << (hash % 64);
+        if (!(word.load(std::memory_order_relaxed) & bit)) {
+            return false;
+        }
+        word.fetch_and(~bit, std::memory_order_relaxed);
+        return true;
+    };
+
+    // The first lap clears every bit, so two laps always find a victim
+    if (table) {
+        size_t capacity = table->capacity();
+        for (size_t n = 0; n < 2 * capacity; ++n) {
+            size_t i = clock_hand++ & (capacity - 1);
+            uint32_t hash;
+            Entry* entry = table->at(i, &hash);
+            if (!entry) {
+                continue;
+            }
+            *expired = value_expired(to_view(entry->second), now_ms);
+            if (!*expired && second_chance(hash)) {
+                continue;
+            }
+            if (key) {
+                key->assign(entry->first.data(), entry->first.size());
+            }
+            boost::string_view victim = to_view(entry->first);
+            table->erase(victim, hash_key(victim));
+            filter->remove(hash);
+            // Erasing shifts the next key back into this slot
+            clock_hand = i;
+            return true;
+        }
+        return false;
+    }
+
+    auto it = tree->upper_bound(to_view(clock_key));
+    for (size_t n = 0, laps = 2 * tree->size(); n < laps; ++n, ++it) {
+        if (it == tree->end()) {
+            it = tree->begin();
+        }
+        *expired = value_expired(to_view(it->second), now_ms);
+        if (!*expired && second_chance(hash_key(to_view(it->first)))) {
+            continue;
+        }
+        if (key) {
+            key->assign(it->first.data(), it->first.size());
+        }
+        try {
+            clock_key.assign(it->first.data(), it->first.size());
+        }
+        catch (bip::bad_alloc &) {
+            // The hand starts over from the first key
+            clock_key.clear();
+        }
+        filter->remove(hash_key(to_view(it->first)));
+        tree->erase(it);
+        return true;
+    }
+    return false;
+}
+
+// Whether `size` bytes at p lie inside the segment
+static bool in_bounds(const void* p, size_t size, const SegmentBounds& bounds)
+{
+    const char* start = (const char*)p;
+    return start >= bounds.start && start <= bounds.end && size <= (size_t)(bounds.end - start);
+}
+
+static bool sound_string(const ShString& str, const SegmentBounds& bounds)
+{
+    return in_bounds(&str, sizeof(str), bounds) && in_bounds(str.data(), str.size(), bounds);
+}
+
+// Whether an entry that an index points to can be trusted after a writer
+// died: it and its strings lie inside the segment, its key belongs in the
+// stripe, and its value is at least a type byte. A value the writer was in
+// the middle of replacing can still hold garbage that passes.
+static bool sound_entry(const Entry* entry, const SegmentBounds& bounds)
+{
+    if (!in_bounds(entry, sizeof(Entry), bounds) || (uintptr_t)entry % alignof(Entry) != 0
+        || !sound_string(entry->first, bounds) || !sound_string(entry->second, bounds)) {
+        return false;
+    }
+    return ((hash_key(to_view(entry->first)) >> 32) & bounds.stripe_mask) == bounds.stripe_index
+        && !entry->second.empty();
+}
+
+// Walks a tree index in order, calling f(entry) for each sound entry. A
+// torn tree may have a cycle, so the walk stops after a few more steps than
+// there are keys. Returns false if an entry is unsound or out of order, or
+// the walk does not end where the count says it should.
+template <class F>
+static bool walk_tree(StringMap& tree, const SegmentBounds& bounds, F f)
+{
+    bool whole = true;
+    size_t steps = 0;
+    const Entry* last = nullptr;
+    for (auto it = tree.begin(); it != tree.end(); ++it) {
+        if (++steps > tree.size() + 2) {
+            return false;
+        }
+        const Entry& entry = *it;
+        if (!sound_entry(&entry, bounds)) {
+            whole = false;
+            continue;
+        }
+        if (last && to_view(last->first) >= to_view(entry.first)) {
+            whole = false;
+        }
+        f(entry);
+        last = &entry;
+    }
+    return whole && steps == tree.size();
+}
+
+bool Stripe::consistent(const SegmentBounds& bounds) {
+    auto sound = [&](const Entry* entry) { return sound_entry(entry, bounds); };
+    size_t keys = 0;
+    bool filtered = true;
+    if (table) {
+        if (!table->consistent(sound)) {
+            return false;
+        }
+        for (size_t i = 0; i < table->capacity(); ++i) {
+            uint32_t hash;
+            if (table->at(i, &hash)) {
+                filtered = filtered && filter->may_contain(hash);
+                ++keys;
+            }
+        }
+    }
+    else if (!walk_tree(*tree, bounds, [&](const Entry& entry) {
+                 filtered = filtered && filter->may_contain(hash_key(to_view(entry.first)));
+                 ++keys;
+             })) {
+        return false;
+    }
+    return filtered && filter->size() == keys;
+}
+
+size_t Stripe::salvage(const SegmentBounds& bounds, std::vector<ScanEntry>* entries) {
+    auto copy = [&](const Entry& entry) {
+        entries->emplace_back(std::string(entry.first.data(), entry.first.size()), std::string(entry.second.data(), entry.second.size()));
+    };
+    const Entry* cut = changing.get();
+    size_t dropped = 0;
+    if (table) {
+        dropped = table->salvage([&](const Entry* entry) { return entry != cut && sound_entry(entry, bounds); }, copy);
+    }
+    else {
+        walk_tree(*tree, bounds, [&](const Entry& entry) {
+            if (&entry != cut) {
+                copy(entry);
+            }
+        });
+    }
+    // A torn tree can lead a walk to the same entry twice
+    std::sort(entries->begin(), entries->end(), [](const ScanEntry& a, const ScanEntry& b) { return a.first < b.first; });
+    entries->erase(std::unique(entries->begin(), entries->end(), [](const ScanEntry& a, const ScanEntry& b) { return a.first == b.first; }), entries->end());
+    if (tree && tree->size() > entries->size()) {
+        // The count may be off by the change that was interrupted
+        dropped = tree->size() - entries->size();
+    }
+    return dropped;
+}
+
+size_t Stripe::rebuild(const SegmentBounds& bounds) {
+    std::vector<ScanEntry> entries;
+    size_t dropped = salvage(bounds, &entries);
+
+    // The old pool is abandoned, so the entries need fresh room; without it
+    // most would be lost, where growing the segment first keeps them
+    SegmentManager* manager = pool.segment_manager();
+    if (pool.held_bytes() + SLAB_CLASSES * SLAB_PAGE_SIZE > manager->get_free_memory()) {
+        throw bip::bad_alloc();
+    }
+    CountingBloom* new_filter = manager->construct<CountingBloom>(bip::anonymous_instance)(manager, STRIPE_INITIAL_SLOTS);
+    HashIndex* new_table = nullptr;
+    StringMap* new_tree = nullptr;
+    try {
+        if (table) {
+            new_table = manager->construct<HashIndex>(bip::anonymous_instance)(&pool, STRIPE_INITIAL_SLOTS);
+        }
+        else {
+            new_tree = manager->construct<StringMap>(bip::anonymous_instance)(KeyLess(), ShmemAllocator(&pool));
+        }
+    }
+    catch (bip::bad_alloc &) {
+        manager->destroy_ptr(new_filter);
+        throw;
+    }
+
+    // The old pool, index, filter and timer wheel are abandoned rather than
+    // freed: the writer may have died halfway through changing any of them,
+    // the pool's free lists included. Their memory is only reclaimed when
+    // the segment is rebuilt; see rebuild_segment().
+    new (&pool) SlabPool(manager);
+    new (&clock_key) ShString(SlabAlloc<char>(&pool));
+    clock_hand = 0;
+    changing = nullptr;
+    table = new_table;
+    tree = new_tree;
+    filter = new_filter;
+    timers = nullptr;
+    for (const ScanEntry& entry : entries) {
+        try {
+            put(entry.first, hash_key(entry.first), entry.second);
+        }
+        catch (bip::bad_alloc &) {
+            ++dropped;
+            continue;
+        }
+        uint64_t expires;
+        if (value_expires(entry.second, &expires)) {
+            try {
+                if (!timers) {
+                    timers = manager->construct<TimerWheel>(bip::anonymous_instance)(&pool, now_ms());
+                }
+                timers->add(entry.first, expires);
+            }
+            catch (bip::bad_alloc &) {
+                // The key still reads as expired, and eviction still erases it
+            }
+        }
+    }
+    return dropped;
+}
+
+SharedKeyValueStore::Mapping::Mapping(const char* name)
+    : segment(bip::open_only, name)
+    , header(segment.find<StoreHeader>("StoreHeader").first)
+    , mapped_size(segment.get_size()) {
+}
+
+SharedKeyValueStore::Mapping::Mapping(const char* name, const StoreOptions& options)
+    : segment(bip::open_or_create, name, options.initial_size)
+    , header(nullptr)
+    , mapped_size(segment.get_size()) {
+    uint32_t stripe_count = 1;
+    while (stripe_count < options.stripes) {
+        stripe_count *= 2;
+    }
+
+    // About one reference bit per 16 bytes of max_size, so that few keys share
+    // a bit, as long as the bitmaps take no more than a quarter of the segment
+    // as created
+    uint32_t clock_words = 0;
+    if (options.evict_water > 0) {
+        clock_words = MIN_CLOCK_WORDS;
+        while ((uint64_t)clock_words * 2 * 64 * 16 * stripe_count <= options.max_size
+               && (uint64_t)clock_words * 2 * 8 * stripe_count * 4 <= options.initial_size) {
+            clock_words *= 2;
+        }
+    }
+
+    // Another process must never see the header without the default
+    // keyspace's stripes
+    auto construct = [&] {
+        header = segment.find_or_construct<StoreHeader>("StoreHeader")(segment.get_size(), options.index, stripe_count, clock_words, options.evict_water);
+        Keyspace& keyspace = header->keyspaces[DEFAULT_KEYSPACE];
+        if (!keyspace.stripes) {
+            keyspace.stripes = segment.construct<Stripe>("Stripes")[header->stripe_count](segment.get_segment_manager(), header->index, header->clock_words, DEFAULT_KEYSPACE);
+            strcpy(keyspace.name, DEFAULT_KEYSPACE_NAME);
+            keyspace.state.store(KEYSPACE_LIVE);
+        }
+    };
+    segment.atomic_func(construct);
+}
+
+SharedKeyValueStore::SharedKeyValueStore(const char* segmentName, const StoreOptions& options)
+    : name(segmentName)
+    , options(options) {
+    mappings.emplace_back(new Mapping(segmentName, options));
+    active.store(mappings.back().get());
+}
+
+// Returns a mapping that covers the whole segment, remapping if another
+// process has grown it.
+SharedKeyValueStore::Mapping* SharedKeyValueStore::current() {
+    Mapping* mapping = active.load(std::memory_order_acquire);
+    if (mapping->header->size.load(std::memory_order_acquire) == mapping->mapped_size) {
+        return mapping;
+    }
+
+    std::lock_guard<std::mutex> guard(remap_lock);
+    mapping = active.load(std::memory_order_acquire);
+    if (mapping->header->size.load(std::memory_order_acquire) != mapping->mapped_size) {
+        mappings.emplace_back(new Mapping(name.c_str()));
+        mapping = mappings.back().get();
+        active.store(mapping, std::memory_order_release);
+    }
+    return mapping;
+}
+
+Stripe& SharedKeyValueStore::remap(Stripe& stripe) {
+    Mapping* to = current();
+    std::lock_guard<std::mutex> guard(remap_lock);
+    for (const auto& from : mappings) {
+        const char* base = (const char*)from->segment.get_address();
+        if ((const char*)&stripe >= base && (const char*)&stripe < base + from->mapped_size) {
+            return *(Stripe*)((char*)to->segment.get_address() + ((const char*)&stripe - base));
+        }
+    }
+    return stripe;
+}
+
+SegmentBounds SharedKeyValueStore::bounds(Mapping* mapping, Stripe& stripe) {
+    SegmentBounds bounds;
+    bounds.start = (const char*)mapping->segment.get_address();
+    bounds.end = bounds.start + mapping->mapped_size;
+    bounds.stripe_mask = mapping->header->stripe_count - 1;
+    bounds.stripe_index = &stripe - mapping->header->keyspaces[stripe.slot].stripes.get();
+    return bounds;
+}
+
+void SharedKeyValueStore::lock_stripe(Stripe& stripe) {
+    stripe.lock.lock();
+    if (stripe.torn()) {
+        // The segment cannot grow while the lock is held, so the current
+        // mapping covers everything the stripe points to
+        Mapping* mapping = current();
+        try {
+            repair(mapping, remap(stripe));
+        }
+        catch (bip::bad_alloc &) {
+            // Still torn, for the next writer to try again
+            stripe.lock.unlock();
+            throw;
+        }
+    }
+}
+
+void SharedKeyValueStore::lock_stripe_sharable(Stripe& stripe) {
+    for (;;) {
+        stripe.lock.lock_sharable();
+        // Odd under a shared lock, when no writer can be at work, means the
+        // last one died
+        if (!stripe.torn()) {
+            return;
+        }
+        stripe.lock.unlock_sharable();
+        lock_stripe(stripe);
+        stripe.lock.unlock();
+    }
+}
+
+size_t SharedKeyValueStore::repair(Mapping* mapping, Stripe& stripe) {
+    // Lockless readers retry across the rebuild
+    if (!stripe.torn()) {
+        stripe.write_begin();
+    }
+    SegmentBounds where = bounds(mapping, stripe);
+    size_t lost = stripe.rebuild(where);
+    stripe.repairs.fetch_add(1, std::memory_order_relaxed);
+    stripe.lost.fetch_add(lost, std::memory_order_relaxed);
+    stripe.write_end();
+    fprintf(stderr, "rebuilt stripe %u of keyspace %u, %zu entries lost\n", where.stripe_index, stripe.slot, lost);
+    return lost;
+}
+
+Stripe* SharedKeyValueStore::live_stripes(KeyspaceId keyspace) {
+    if (!current()->stripes(keyspace)) {
+        return nullptr;
+    }
+    // The keyspace may have been created in a part of the segment this
+    // process had not mapped yet. Seeing it live means that growth is
+    // visible now.
+    return current()->stripes(keyspace);
+}
+
+Stripe* SharedKeyValueStore::live_stripe(KeyspaceId keyspace, uint64_t hash) {
+    Stripe* stripes = live_stripes(keyspace);
+    return stripes ? &stripes[(hash >> 32) & (current()->header->stripe_count - 1)] : nullptr;
+}
+
+bool SharedKeyValueStore::needs_growth(Mapping* mapping, size_t needed) {
+    size_t size = mapping->mapped_size;
+    size_t in_use = size - mapping->segment.get_free_memory();
+    return size < options.max_size && (in_use + needed) * 100 > size * options.high_water;
+}
+
+// Grows the segment so that `needed` more bytes fit below the high-water mark.
+// Must be called without any stripe lock held. Returns false if the segment
+// is already at max_size or cannot be grown; returns true without doing
+// anything if another writer has grown it since it was seen at seen_size.
+bool SharedKeyValueStore::grow(size_t seen_size, size_t needed) {
+    // The segment is only allocated from with a stripe lock or keyspace_lock
+    // held, so holding all of them stops every writer in every process. No
+    // keyspace can be created once keyspace_lock is held, so the mapping
+    // taken then covers every stripe.
+    current()->header->keyspace_lock.lock();
+    Mapping* mapping = current();
+    mapping->for_each_stripe([](Stripe& stripe) {
+        stripe.lock.lock();
+    });
+
+    bool grown = true;
+    size_t old_size = mapping->header->size.load(std::memory_order_acquire);
+    if (old_size == seen_size) {
+        size_t in_use = old_size - mapping->segment.get_free_memory();
+        size_t new_size = old_size * 2;
+        while (new_size < options.max_size && (in_use + needed) * 100 > new_size * options.high_water) {
+            new_size *= 2;
+        }
+        if (new_size > options.max_size) {
+            new_size = options.max_size;
+        }
+
+        mapping->header->growing.store(1);
+        grown = old_size < options.max_size
+            && ManagedSegment::grow(name.c_str(), new_size - old_size);
+        if (grown) {
+            mapping->header->size.store(new_size, std::memory_order_release);
+        }
+        mapping->header->growing.store(0);
+    }
+
+    mapping->for_each_stripe([](Stripe& stripe) {
+        stripe.lock.unlock();
+    });
+    mapping->header->keyspace_lock.unlock();
+    return grown;
+}
+
+bool SharedKeyValueStore::over_evict_water(Mapping* mapping, size_t needed) {
+    // Blocks freed into the stripes' pools are reused before the segment
+    // grows, so eviction counts them as free
+    size_t in_use = mapping->mapped_size - mapping->segment.get_free_memory();
+    mapping->for_each_stripe([&](Stripe& stripe) {
+        in_use -= std::min(in_use, stripe.pool.free_bytes());
+    });
+    return (in_use + needed) * 100 > options.max_size * mapping->header->evict_water;
+}
+
+// Whether `needed` more bytes would take the keyspace past its quota
+bool SharedKeyValueStore::over_quota(Mapping* mapping, KeyspaceId keyspace, size_t needed) {
+    Keyspace& ks = mapping->keyspace(keyspace);
+    if (ks.quota == 0) {
+        return false;
+    }
+    size_t used = needed;
+    for (uint32_t i = 0; i < mapping->header->stripe_count; ++i) {
+        used += ks.stripes[i].pool.used_bytes();
+    }
+    return used > ks.quota;
+}
+
+// Evicts from the locked stripe until the store is below its eviction
+// watermark, or the keyspace below its quota if it has one, and at least one
+// key if `force` is set.
+void SharedKeyValueStore::evict(Mapping* mapping, KeyspaceId keyspace, Stripe& stripe, size_t needed, uint64_t now, bool force, bool* evicted) {
+    std::string key;
+    bool need_key = log || watch_active();
+    auto over = [&] {
+        if (mapping->keyspace(keyspace).quota > 0) {
+            return over_quota(mapping, keyspace, needed);
+        }
+        return over_evict_water(mapping, needed);
+    };
+    for (int n = 0; n < EVICT_BATCH && ((force && n == 0) || over()); ++n) {
+        bool expired;
+        if (!stripe.evict(now, &expired, need_key ? &key : nullptr)) {
+            return;
+        }
+        if (need_key && !expired) {
+            log_del(keyspace, key);
+        }
+        else if (need_key) {
+            // Expired keys are dropped on replay anyway
+            publish_change(CHANGE_DEL, keyspace % MAX_KEYSPACES, key);
+        }
+        if (expired) {
+            mapping->header->expirations.fetch_add(1, std::memory_order_relaxed);
+        }
+        else {
+            mapping->header->evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+        *evicted = true;
+    }
+}
+
+template <class Op>
+auto SharedKeyValueStore::write(KeyspaceId keyspace, uint64_t hash, size_t needed, Op op) -> decltype(op(std::declval<Stripe&>())) {
+    // Set once the segment is full at max_size, so the next round makes room
+    // even if the watermark says there is enough
+    bool starved = false;
+    for (;;) {
+        size_t seen_size;
+        bool evicted = false;
+        Stripe* locked = live_stripe(keyspace, hash);
+        if (!locked) {
+            throw NoSuchKeyspace();
+        }
+        if (locked->torn() && !StripeLock(this, locked, std::nothrow)) {
+            // A writer died in the stripe and there is no room to rebuild it
+            if (!grow(current()->mapped_size, needed)) {
+                throw bip::bad_alloc();
+            }
+            continue;
+        }
+        {
+            StripeLock lock(this, locked);
+            // The segment cannot grow while a stripe lock is held
+            Mapping* mapping = current();
+            seen_size = mapping->mapped_size;
+
+            // Dropping the keyspace locks this stripe too
+            Stripe* live = mapping->stripe(keyspace, hash);
+            if (!live) {
+                throw NoSuchKeyspace();
+            }
+            Stripe& stripe = *live;
+            uint64_t now = now_ms();
+            stripe.write_begin();
+            size_t expired = stripe.expire_due(now);
+            if (expired > 0) {
+                mapping->header->expirations.fetch_add(expired, std::memory_order_relaxed);
+            }
+            if (mapping->header->evict_water > 0) {
+                evict(mapping, keyspace, stripe, needed, now, starved, &evicted);
+            }
+            if (needed > 0 && over_quota(mapping, keyspace, needed)) {
+                // Eviction could not make room in the keyspace; another
+                // round may, as long as it finds something to evict
+                stripe.write_end();
+                if (evicted) {
+                    continue;
+                }
+                throw bip::bad_alloc();
+            }
+
+            if (!needs_growth(mapping, needed)) {
+                try {
+                    auto result = op(stripe);
+                    stripe.write_end();
+                    return result;
+                }
+                catch (bip::bad_alloc &) {
+                    // The high-water estimate was too optimistic
+                }
+            }
+            stripe.write_end();
+        }
+
+        if (!grow(seen_size, needed)) {
+            if (current()->header->evict_water == 0 || (starved && !evicted)) {
+                throw bip::bad_alloc();
+            }
+            starved = true;
+        }
+    }
+}
+
+// Change logging and watch events; called with the key's stripe locked for
+// writing, so the sequence numbers of one key's changes are in the order they
+// were made.
+void SharedKeyValueStore::log_set(KeyspaceId keyspace, boost::string_view key, boost::string_view value) {
+    publish_change(CHANGE_SET, keyspace % MAX_KEYSPACES, key);
+    if (log) {
+        log->append_set(current()->header->log_seq.fetch_add(1) + 1, keyspace % MAX_KEYSPACES, key, value);
+        if (log->durability() == DURABILITY_ALWAYS) {
+            commit_log();
+        }
+    }
+}
+
+void SharedKeyValueStore::log_del(KeyspaceId keyspace, boost::string_view key) {
+    publish_change(CHANGE_DEL, keyspace % MAX_KEYSPACES, key);
+    if (log) {
+        log->append_del(current()->header->log_seq.fetch_add(1) + 1, keyspace % MAX_KEYSPACES, key);
+        if (log->durability() == DURABILITY_ALWAYS) {
+            commit_log();
+        }
+    }
+}
+
+// Logs a batch so that replay applies all of it or none, and publishes its
+// changes one by one. Called with the stripes of the batch locked.
+void SharedKeyValueStore::log_batch(KeyspaceId keyspace, const std::vector<BatchOp>& batch) {
+    for (const BatchOp& op : batch) {
+        publish_change(op.remove ? CHANGE_DEL : CHANGE_SET, keyspace % MAX_KEYSPACES, op.key);
+    }
+    if (log) {
+        std::vector<LoggedChange> changes;
+        changes.reserve(batch.size());
+        for (const BatchOp& op : batch) {
+            changes.push_back(LoggedChange{op.key, op.value, op.remove});
+        }
+        uint64_t seq = current()->header->log_seq.fetch_add(changes.size() + 1) + 1;
+        log->append_batch(seq, keyspace % MAX_KEYSPACES, changes);
+        if (log->durability() == DURABILITY_ALWAYS) {
+            commit_log();
+        }
+    }
+}
+
+// Gives the key a timer, creating the stripe's timer wheel if needed.
+// Called with the stripe locked for writing.
+void SharedKeyValueStore::add_timer(Stripe& stripe, boost::string_view key, uint64_t expires) {
+    if (!stripe.timers) {
+        stripe.timers = current()->segment.construct<TimerWheel>(bip::anonymous_instance)(&stripe.pool, now_ms());
+    }
+    stripe.timers->add(key, expires);
+}
+
+void SharedKeyValueStore::store(KeyspaceId keyspace, boost::string_view key, boost::string_view value, uint64_t ttl_ms) {
+    uint64_t hash = hash_key(key);
+    if (ttl_ms == 0) {
+        write(keyspace, hash, key.size() + value.size() + NODE_OVERHEAD, [&](Stripe& stripe) {
+            stripe.put(key, hash, value);
+            log_set(keyspace, key, value);
+            return true;
+        });
+        return;
+    }
+
+    uint64_t expires = now_ms() + ttl_ms;
+    std::string wrapped = make_expires(expires);
+    wrapped.append(value.data(), value.size());
+    write(keyspace, hash, key.size() * 2 + wrapped.size() + NODE_OVERHEAD * 2, [&](Stripe& stripe) {
+        add_timer(stripe, key, expires);
+        stripe.put(key, hash, wrapped);
+        log_set(keyspace, key, wrapped);
+        return true;
+    });
+}
+
+bool SharedKeyValueStore::expire(KeyspaceId keyspace, boost::string_view key, uint64_t ttl_ms) {
+    uint64_t hash = hash_key(key);
+    uint64_t now = now_ms();
+    uint64_t expires = now + ttl_ms;
+    return write(keyspace, hash, key.size() + EXPIRES_SIZE + NODE_OVERHEAD, [&](Stripe& stripe) {
+        Entry* entry = stripe.find(key, hash);
+        if (!entry || value_expired(to_view(entry->second), now)) {
+            return false;
+        }
+        boost::string_view value = to_view(entry->second);
+        uint64_t old_expires;
+        bool had_ttl = value_expires(value, &old_expires);
+        if (had_ttl) {
+            value.remove_prefix(EXPIRES_SIZE);
+        }
+        else if (ttl_ms == 0) {
+            return true;
+        }
+
+        // Built apart and swapped in, so a writer dying here cannot leave
+        // the value half edited
+        SlabAlloc<char> sa(&stripe.pool);
+        ShString fresh(sa);
+        if (ttl_ms > 0) {
+            std::string header = make_expires(expires);
+            fresh.reserve(header.size() + value.size());
+            fresh.assign(header.data(), header.size());
+        }
+        fresh.append(value.data(), value.size());
+        if (ttl_ms > 0) {
+            add_timer(stripe, key, expires);
+        }
+        stripe.replace(entry, fresh);
+        log_set(keyspace, key, to_view(entry->second));
+        return true;
+    });
+}
+
+void SharedKeyValueStore::expire_due() {
+    Mapping* mapping = current();
+    uint32_t stripe_count = mapping->header->stripe_count;
+    for (uint32_t slot = 0; slot < MAX_KEYSPACES; ++slot) {
+        if (mapping->header->keyspaces[slot].state.load(std::memory_order_acquire) != KEYSPACE_LIVE) {
+            continue;
+        }
+        // Remapped after seeing the keyspace live; see live_stripes()
+        Stripe* stripes = current()->header->keyspaces[slot].stripes.get();
+        for (uint32_t i = 0; i < stripe_count; ++i) {
+            StripeLock lock(this, &stripes[i], std::nothrow);
+            if (!lock) {
+                // Torn, with no room to rebuild it; its keys expire once a
+                // writer has rebuilt it
+                continue;
+            }
+            Stripe& stripe = current()->header->keyspaces[slot].stripes[i];
+            if (!stripe.timers) {
+                continue;
+            }
+            stripe.write_begin();
+            size_t expired = stripe.expire_due(now_ms());
+            stripe.write_end();
+            if (expired > 0) {
+                mapping->header->expirations.fetch_add(expired, std::memory_order_relaxed);
+            }
+        }
+    }
+    if (mapping->header->dropped.load(std::memory_order_relaxed) > 0) {
+        reclaim_dropped(RECLAIM_BATCH);
+    }
+}
+
+void SharedKeyValueStore::restore(KeyspaceId keyspace, boost::string_view key, boost::string_view stored_value) {
+    uint64_t expires = 0;
+    if (value_expires(stored_value, &expires) && expires <= now_ms()) {
+        // Replaces an older value of the key
+        remove(keyspace, key);
+        return;
+    }
+    uint64_t hash = hash_key(key);
+    write(keyspace, hash, key.size() * 2 + stored_value.size() + NODE_OVERHEAD * 2, [&](Stripe& stripe) {
+        if (expires) {
+            add_timer(stripe, key, expires);
+        }
+        stripe.put(key, hash, stored_value);
+        publish_change(CHANGE_SET, keyspace % MAX_KEYSPACES, key);
+        return true;
+    });
+}
+
+bool valid_keyspace_name(boost::string_view name)
 {
-public:
-    SharedKeyValueStore(const char* segmentName)
-        : segment(bip::open_or_create, segmentName, 65536) // Shared memory size set to 64KB
-        , map(segment.find_or_construct<StringMap>("StringMap")(std::less<ShString>(), segment.get_segment_manager())) {
+    return !name.empty() && name.size() <= KEYSPACE_NAME_MAX && name != DEFAULT_KEYSPACE_NAME
+        && name.find('\0') == boost::string_view::npos;
+}
+
+bool SharedKeyValueStore::find_keyspace(boost::string_view name, KeyspaceId* id) {
+    StoreHeader* header = current()->header;
+    for (uint32_t slot = 0; slot < MAX_KEYSPACES; ++slot) {
+        Keyspace& keyspace = header->keyspaces[slot];
+        // A name read between two equal generations is that generation's
+        uint32_t generation = keyspace.generation.load(std::memory_order_acquire);
+        if (keyspace.state.load(std::memory_order_acquire) == KEYSPACE_LIVE && name == keyspace.name
+            && keyspace.generation.load(std::memory_order_acquire) == generation) {
+            *id = keyspace_id(slot, generation);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SharedKeyValueStore::keyspace_at(uint32_t slot, KeyspaceId* id) {
+    Keyspace& keyspace = current()->header->keyspaces[slot];
+    if (keyspace.state.load(std::memory_order_acquire) != KEYSPACE_LIVE) {
+        return false;
+    }
+    *id = keyspace_id(slot, keyspace.generation.load(std::memory_order_relaxed));
+    return true;
+}
+
+bool SharedKeyValueStore::keyspace_at(uint32_t slot, KeyspaceId* id, std::string* name, size_t* quota) {
+    // Names and quotas only change under the lock
+    bip::scoped_lock<RobustMutex> lock(current()->header->keyspace_lock);
+    Keyspace& keyspace = current()->header->keyspaces[slot];
+    if (!keyspace_at(slot, id)) {
+        return false;
+    }
+    name->assign(keyspace.name);
+    *quota = keyspace.quota;
+    return true;
+}
+
+bool SharedKeyValueStore::create_keyspace(boost::string_view name, size_t quota, KeyspaceId* id) {
+    return valid_keyspace_name(name) && create_in(MAX_KEYSPACES, name, quota, id);
+}
+
+bool SharedKeyValueStore::restore_keyspace(uint32_t slot, boost::string_view name, size_t quota, KeyspaceId* id) {
+    KeyspaceId old;
+    if (keyspace_at(slot, &old)) {
+        drop_keyspace(old);
+    }
+    while (current()->header->keyspaces[slot].state.load() == KEYSPACE_DROPPED) {
+        reclaim_dropped(SIZE_MAX);
+    }
+    return valid_keyspace_name(name) && create_in(slot, name, quota, id);
+}
+
+// Creates the keyspace in `slot` if it is free, or in the first free slot if
+// `slot` is MAX_KEYSPACES, growing the segment if the slot needs stripes
+bool SharedKeyValueStore::create_in(uint32_t slot, boost::string_view name, size_t quota, KeyspaceId* id) {
+    StoreHeader* header = current()->header;
+    size_t needed = header->stripe_count * (sizeof(Stripe) + header->clock_words * sizeof(uint64_t) + NEW_STRIPE_SIZE);
+    for (;;) {
+        size_t seen_size;
+        {
+            bip::scoped_lock<RobustMutex> lock(current()->header->keyspace_lock);
+            Mapping* mapping = current();
+            seen_size = mapping->mapped_size;
+
+            uint32_t found = MAX_KEYSPACES;
+            for (uint32_t i = 0; i < MAX_KEYSPACES; ++i) {
+                Keyspace& keyspace = mapping->header->keyspaces[i];
+                if (keyspace.state.load() == KEYSPACE_LIVE && name == keyspace.name) {
+                    return false;
+                }
+                if (keyspace.state.load() == KEYSPACE_FREE && found == MAX_KEYSPACES && (slot == MAX_KEYSPACES || slot == i)) {
+                    found = i;
+                }
+            }
+            if (found == MAX_KEYSPACES) {
+                return false;
+            }
+
+            Keyspace& keyspace = mapping->header->keyspaces[found];
+            if (keyspace.stripes || !needs_growth(mapping, needed)) {
+                try {
+                    if (!keyspace.stripes) {
+                        keyspace.stripes = mapping->segment.construct<Stripe>(bip::anonymous_instance)[mapping->header->stripe_count](
+                            mapping->segment.get_segment_manager(), mapping->header->index, mapping->header->clock_words, found);
+                    }
+                    memcpy(keyspace.name, name.data(), name.size());
+                    keyspace.name[name.size()] = '\0';
+                    keyspace.quota = quota;
+                    // Logged before any write to the keyspace can be
+                    log_keyspace(found, name, quota, false);
+                    keyspace.state.store(KEYSPACE_LIVE, std::memory_order_release);
+                    *id = keyspace_id(found, keyspace.generation.load());
+                    return true;
+                }
+                catch (bip::bad_alloc &) {
+                    // The high-water estimate was too optimistic
+                }
+            }
+        }
+
+        if (!grow(seen_size, needed)) {
+            throw bip::bad_alloc();
+        }
+    }
+}
+
+bool SharedKeyValueStore::drop_keyspace(KeyspaceId id) {
+    if (id % MAX_KEYSPACES == DEFAULT_KEYSPACE) {
+        return false;
+    }
+    bip::scoped_lock<RobustMutex> lock(current()->header->keyspace_lock);
+    Mapping* mapping = current();
+    Stripe* stripes = mapping->stripes(id);
+    if (!stripes) {
+        return false;
+    }
+
+    // Every reader and writer of the keyspace checks that it is live with one
+    // of its stripes locked, or under that stripe's seqlock
+    uint32_t stripe_count = mapping->header->stripe_count;
+    for (uint32_t i = 0; i < stripe_count; ++i) {
+        lock_stripe(stripes[i]);
+        stripes[i].write_begin();
+    }
+    Keyspace& keyspace = mapping->keyspace(id);
+    log_keyspace(id % MAX_KEYSPACES, keyspace.name, 0, true);
+    keyspace.state.store(KEYSPACE_DROPPED, std::memory_order_release);
+    keyspace.generation.fetch_add(1, std::memory_order_release);
+    mapping->header->dropped.fetch_add(1);
+    for (uint32_t i = stripe_count; i > 0; --i) {
+        stripes[i - 1].write_end();
+        stripes[i - 1].lock.unlock();
+    }
+    return true;
+}
+
+size_t SharedKeyValueStore::reclaim_dropped(size_t limit) {
+    size_t erased = 0;
+    for (uint32_t slot = 0; slot < MAX_KEYSPACES && erased < limit; ++slot) {
+        if (current()->header->keyspaces[slot].state.load(std::memory_order_acquire) != KEYSPACE_DROPPED) {
+            continue;
+        }
+        Stripe* stripes = current()->header->keyspaces[slot].stripes.get();
+        uint32_t stripe_count = current()->header->stripe_count;
+        for (uint32_t i = 0; i < stripe_count && erased < limit; ++i) {
+            StripeLock lock(this, &stripes[i]);
+            // The slot cannot be reused before all of its stripes are empty,
+            // so whatever is in this one belongs to the dropped keyspace
+            Stripe& stripe = current()->header->keyspaces[slot].stripes[i];
+            stripe.write_begin();
+            erased += stripe.clear(limit - erased);
+            stripe.write_end();
+        }
+        if (erased < limit) {
+            free_dropped(slot);
+        }
+    }
+    return erased;
+}
+
+// Frees the slot of a dropped keyspace once every one of its stripes is
+// empty. Returns false if one is not.
+bool SharedKeyValueStore::free_dropped(uint32_t slot) {
+    bip::scoped_lock<RobustMutex> lock(current()->header->keyspace_lock);
+    Mapping* mapping = current();
+    Keyspace& keyspace = mapping->header->keyspaces[slot];
+    if (keyspace.state.load() != KEYSPACE_DROPPED) {
+        return false;
+    }
+    for (uint32_t i = 0; i < mapping->header->stripe_count; ++i) {
+        Stripe& stripe = keyspace.stripes[i];
+        StripeLock stripe_lock(this, &stripe);
+        if ((stripe.table ? stripe.table->size() : stripe.tree->size()) > 0) {
+            return false;
+        }
+        // Stale timers and saturated counters would outlive the keys
+        if (stripe.timers) {
+            mapping->segment.destroy_ptr(stripe.timers.get());
+            stripe.timers = nullptr;
+        }
+        stripe.filter->clear();
+        stripe.clock_key.clear();
+        stripe.clock_hand = 0;
+    }
+    keyspace.name[0] = '\0';
+    keyspace.quota = 0;
+    keyspace.state.store(KEYSPACE_FREE, std::memory_order_release);
+    mapping->header->dropped.fetch_sub(1);
+    return true;
+}
+
+// Called with keyspace_lock held, so keyspace records and events are in
+// order with those of their keys
+void SharedKeyValueStore::log_keyspace(uint32_t slot, boost::string_view name, size_t quota, bool drop) {
+    publish_change(drop ? CHANGE_NS_DROP : CHANGE_NS_CREATE, slot, name, quota);
+    if (log) {
+        uint64_t seq = current()->header->log_seq.fetch_add(1) + 1;
+        if (drop) {
+            log->append_drop(seq, slot, name);
+        }
+        else {
+            log->append_keyspace(seq, slot, name, quota);
+        }
+        if (log->durability() == DURABILITY_ALWAYS) {
+            commit_log();
+        }
+    }
+}
+
+void SharedKeyValueStore::open_log(const std::string& dir, Durability durability, uint64_t seq, uint64_t generation) {
+    current()->header->log_seq.store(seq);
+    current()->header->log_generation.store(generation);
+    log.reset(new WriteLog(dir, durability));
+}
+
+bool SharedKeyValueStore::commit_log() {
+    // Read the generation first: every record buffered by now was made
+    // before any snapshot that starts a later generation
+    return !log || log->commit(current()->header->log_generation.load());
+}
+
+bool SharedKeyValueStore::log_pending() {
+    return log && log->pending();
+}
+
+size_t SharedKeyValueStore::log_size() {
+    return log ? log->written() : 0;
+}
+
+std::string SharedKeyValueStore::log_directory() {
+    return log ? log->directory() : std::string();
+}
+
+void SharedKeyValueStore::capture(SegmentImage* image) {
+    // Keyspace changes wait while the log boundary is taken, so each
+    // keyspace is either in the copy or created by a change after it
+    std::vector<KeyspaceId> keyspaces;
+    {
+        bip::scoped_lock<RobustMutex> keyspace_lock(current()->header->keyspace_lock);
+        Mapping* mapping = current();
+        image->size = mapping->mapped_size;
+        image->used = mapping->mapped_size - mapping->segment.get_free_memory();
+        image->stripe_count = mapping->header->stripe_count;
+        image->index = mapping->header->index;
+        image->evict_water = mapping->header->evict_water;
+        // Changes numbered after seq are committed to the new generation or
+        // a later one, even those buffered already
+        image->generation = mapping->header->log_generation.fetch_add(1) + 1;
+        image->seq = mapping->header->log_seq.load();
+        image->keyspaces.clear();
+        for (uint32_t slot = 0; slot < MAX_KEYSPACES; ++slot) {
+            Keyspace& keyspace = mapping->header->keyspaces[slot];
+            if (keyspace.state.load() != KEYSPACE_LIVE) {
+                continue;
+            }
+            keyspaces.push_back(keyspace_id(slot, keyspace.generation.load()));
+            if (slot != DEFAULT_KEYSPACE) {
+                image->keyspaces.push_back(SegmentImage::KeyspaceImage{slot, keyspace.name, keyspace.quota});
+            }
+        }
+    }
+
+    // Copies the live entries only, so the image is no larger than the
+    // data; a keyspace dropped meanwhile is dropped again by the log
+    image->entries.clear();
+    for (KeyspaceId keyspace : keyspaces) {
+        for (uint32_t i = 0; i < image->stripe_count; ++i) {
+            Stripe* stripes = live_stripes(keyspace);
+            if (!stripes) {
+                break;
+            }
+            SharableStripeLock lock(this, &stripes[i]);
+            stripes = live_stripes(keyspace);
+            if (!stripes) {
+                break;
+            }
+            uint32_t slot = keyspace % MAX_KEYSPACES;
+            auto copy = [&](const Entry& entry) {
+                image->add(slot, to_view(entry.first), to_view(entry.second));
+            };
+            if (stripes[i].table) {
+                stripes[i].table->for_each(copy);
+            }
+            else {
+                for (const Entry& entry : *stripes[i].tree) {
+                    copy(entry);
+                }
+            }
+        }
+    }
+}
+
+UpdateStatus SharedKeyValueStore::increment(KeyspaceId keyspace, boost::string_view key, int64_t delta, int64_t* result) {
+    uint64_t hash = hash_key(key);
+    return write(keyspace, hash, key.size() + INT_ITEM_SIZE + NODE_OVERHEAD, [&](Stripe& stripe) {
+        Entry* entry = stripe.find(key, hash);
+        if (!entry || value_expired(to_view(entry->second), now_ms())) {
+            std::string item = make_int_item(delta);
+            stripe.put(key, hash, item);
+            log_set(keyspace, key, item);
+            *result = delta;
+            return UPDATE_OK;
+        }
+        int64_t value;
+        if (!int_item_value(entry->second, &value)) {
+            return UPDATE_WRONG_TYPE;
+        }
+        if (__builtin_add_overflow(value, delta, result)) {
+            return UPDATE_OVERFLOW;
+        }
+        set_int_item_value(entry->second, *result);
+        log_set(keyspace, key, to_view(entry->second));
+        return UPDATE_OK;
+    });
+}
+
+UpdateStatus SharedKeyValueStore::compare_and_swap(KeyspaceId keyspace, boost::string_view key, int64_t expected, int64_t desired, int64_t* current) {
+    uint64_t hash = hash_key(key);
+    // The swap itself never allocates, so it asks for no room; write() can
+    // still throw bip::bad_alloc if rebuilding a torn stripe needs the
+    // segment to grow and it cannot
+    return write(keyspace, hash, 0, [&](Stripe& stripe) {
+        Entry* entry = stripe.find(key, hash);
+        if (!entry || value_expired(to_view(entry->second), now_ms())) {
+            return UPDATE_NOT_FOUND;
+        }
+        if (!int_item_value(entry->second, current)) {
+            return UPDATE_WRONG_TYPE;
+        }
+        if (*current != expected) {
+            return UPDATE_MISMATCH;
+        }
+        set_int_item_value(entry->second, desired);
+        log_set(keyspace, key, to_view(entry->second));
+        *current = desired;
+        return UPDATE_OK;
+    });
+}
+
+// Seqlock read of a hash index stripe. Returns false if a writer got in the
+// way and the read has to be retried.
+bool SharedKeyValueStore::retrieve_optimistic(KeyspaceId keyspace, boost::string_view key, uint64_t hash, std::string* value, bool* found) {
+    Stripe* stripe = live_stripe(keyspace, hash);
+    if (!stripe) {
+        *found = false;
+        return true;
+    }
+    uint32_t start = stripe->seq.load(std::memory_order_acquire);
+    if (start & 1) {
+        return false;
+    }
+
+    // Remap only after reading seq: anything added to this stripe in a part of
+    // the segment that is not mapped yet changes seq. So does a drop of the
+    // keyspace.
+    stripe = live_stripe(keyspace, hash);
+    if (!stripe) {
+        *found = false;
+        return true;
+    }
+    auto valid = [stripe, start] {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return stripe->seq.load(std::memory_order_relaxed) == start;
+    };
+
+    if (!stripe->filter->may_contain_optimistic(hash, valid)) {
+        *found = false;
+        return valid();
+    }
+    const Entry* entry = stripe->table->find_optimistic(key, hash, valid);
+    if (!entry) {
+        *found = false;
+        return valid();
+    }
+
+    const char* data = entry->second.data();
+    size_t size = entry->second.size();
+    if (!valid()) {
+        return false;
+    }
+    value->assign(data, size);
+    *found = true;
+    return valid();
+}
+
+bool SharedKeyValueStore::retrieve(KeyspaceId keyspace, boost::string_view key, std::string* value) {
+    uint64_t hash = hash_key(key);
+    bool found;
+
+    if (current()->header->index == INDEX_HASH) {
+        for (int attempt = 0; attempt < OPTIMISTIC_ATTEMPTS; ++attempt) {
+            if (retrieve_optimistic(keyspace, key, hash, value, &found)) {
+                if (!found || !unwrap_value(value)) {
+                    return false;
+                }
+                current()->keyspace(keyspace).stripes[(hash >> 32) & (current()->header->stripe_count - 1)].touch(hash);
+                return true;
+            }
+        }
+    }
+
+    // Tree index, or a hash stripe under constant writes
+    Stripe* stripe = live_stripe(keyspace, hash);
+    if (!stripe) {
+        return false;
+    }
+    {
+        SharableStripeLock lock(this, stripe);
+        stripe = live_stripe(keyspace, hash);
+        Entry* entry = stripe ? stripe->find(key, hash) : nullptr;
+        if (!entry) {
+            return false;
+        }
+        value->assign(entry->second.data(), entry->second.size());
+    }
+    if (!unwrap_value(value)) {
+        return false;
+    }
+    stripe->touch(hash);
+    return true;
+}
+
+bool SharedKeyValueStore::retrieve_stored(KeyspaceId keyspace, boost::string_view key, std::string* stored) {
+    uint64_t hash = hash_key(key);
+    Stripe* stripe = live_stripe(keyspace, hash);
+    if (!stripe) {
+        return false;
+    }
+    SharableStripeLock lock(this, stripe);
+    stripe = live_stripe(keyspace, hash);
+    Entry* entry = stripe ? stripe->find(key, hash) : nullptr;
+    if (!entry || value_expired(to_view(entry->second), now_ms())) {
+        return false;
+    }
+    stored->assign(entry->second.data(), entry->second.size());
+    return true;
+}
+
+bool SharedKeyValueStore::remove(KeyspaceId keyspace, boost::string_view key) {
+    uint64_t hash = hash_key(key);
+    Stripe* stripe = live_stripe(keyspace, hash);
+    if (!stripe) {
+        return false;
+    }
+    StripeLock lock(this, stripe);
+    stripe = live_stripe(keyspace, hash);
+    if (!stripe) {
+        return false;
+    }
+    stripe->write_begin();
+    bool removed = stripe->erase(key, hash);
+    if (removed) {
+        log_del(keyspace, key);
+    }
+    stripe->write_end();
+    return removed;
+}
+
+// Holds the write locks of a batch's stripes, taken in index order as
+// grow() takes them, so batches cannot deadlock with each other or with it.
+// Between begin_writes() and end_writes() the stripes' seqlocks are held odd;
+// they are made even again whatever leaves the scope.
+struct BatchLocks
+{
+    BatchLocks(SharedKeyValueStore* store, Stripe* stripes, const std::vector<uint32_t>& indexes)
+        : stripes(stripes), indexes(indexes), writing(false), count(0) {
+        try {
+            for (uint32_t i : indexes) {
+                store->lock_stripe(stripes[i]);
+                ++count;
+            }
+        }
+        catch (bip::bad_alloc &) {
+            unlock();
+            throw;
+        }
+    }
+    ~BatchLocks() {
+        end_writes();
+        unlock();
+    }
+
+    void unlock() {
+        while (count > 0) {
+            stripes[indexes[--count]].lock.unlock();
+        }
+    }
+
+    void begin_writes() {
+        for (uint32_t i : indexes) {
+            stripes[i].write_begin();
+        }
+        writing = true;
+    }
+    void end_writes() {
+        if (writing) {
+            for (uint32_t i : indexes) {
+                stripes[i].write_end();
+            }
+            writing = false;
+        }
+    }
+
+    Stripe* stripes;
+    const std::vector<uint32_t>& indexes;
+    bool writing;
+    size_t count;   // locks taken
+};
+
+void SharedKeyValueStore::apply(KeyspaceId keyspace, std::vector<BatchOp>& batch) {
+    if (batch.empty()) {
+        return;
+    }
+    uint32_t mask = current()->header->stripe_count - 1;
+    std::vector<uint64_t> hashes;
+    std::vector<uint32_t> indexes;
+    size_t needed = 0;
+    hashes.reserve(batch.size());
+    for (const BatchOp& op : batch) {
+        hashes.push_back(hash_key(op.key));
+        indexes.push_back((hashes.back() >> 32) & mask);
+        if (!op.remove) {
+            needed += op.key.size() + op.value.size() + NODE_OVERHEAD;
+        }
+    }
+    std::sort(indexes.begin(), indexes.end());
+    indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+
+    // The same rounds as write(), over every stripe of the batch at once
+    bool starved = false;
+    for (;;) {
+        size_t seen_size;
+        bool evicted = false;
+        Stripe* locked = live_stripes(keyspace);
+        if (!locked) {
+            throw NoSuchKeyspace();
+        }
+        bool unrepaired = false;
+        for (uint32_t i : indexes) {
+            if (locked[i].torn() && !StripeLock(this, &locked[i], std::nothrow)) {
+                unrepaired = true;
+                break;
+            }
+        }
+        if (unrepaired) {
+            // As in write(): only a bigger segment has room to rebuild it
+            if (!grow(current()->mapped_size, needed)) {
+                throw bip::bad_alloc();
+            }
+            continue;
+        }
+        {
+            BatchLocks locks(this, locked, indexes);
+            Mapping* mapping = current();
+            seen_size = mapping->mapped_size;
+            Stripe* stripes = mapping->stripes(keyspace);
+            if (!stripes) {
+                throw NoSuchKeyspace();
+            }
+            uint64_t now = now_ms();
+            locks.begin_writes();
+            for (uint32_t i : indexes) {
+                size_t expired = stripes[i].expire_due(now);
+                if (expired > 0) {
+                    mapping->header->expirations.fetch_add(expired, std::memory_order_relaxed);
+                }
+            }
+            if (mapping->header->evict_water > 0) {
+                for (uint32_t i : indexes) {
+                    evict(mapping, keyspace, stripes[i], needed, now, starved, &evicted);
+                }
+            }
+            if (needed > 0 && over_quota(mapping, keyspace, needed)) {
+                locks.end_writes();
+                if (evicted) {
+                    continue;
+                }
+                throw bip::bad_alloc();
+            }
+
+            if (!needs_growth(mapping, needed)) {
+                // Each key as the whole batch leaves it
+                struct Change {
+                    boost::string_view key;
+                    uint64_t hash;
+                    Stripe* stripe;
+                    Entry* entry;               // as found before the batch
+                    bool present;
+                    const std::string* value;   // null if unchanged
+                };
+                std::vector<Change> changes;
+                std::map<boost::string_view, size_t> by_key;
+                for (size_t n = 0; n < batch.size(); ++n) {
+                    BatchOp& op = batch[n];
+                    auto first = by_key.emplace(boost::string_view(op.key), changes.size());
+                    if (first.second) {
+                        Stripe* stripe = &stripes[(hashes[n] >> 32) & mask];
+                        Entry* entry = stripe->find(op.key, hashes[n]);
+                        changes.push_back(Change{op.key, hashes[n], stripe, entry, entry != nullptr, nullptr});
+                    }
+                    Change& change = changes[first.first->second];
+                    if (op.remove) {
+                        op.found = change.present;
+                        change.present = false;
+                        change.value = nullptr;
+                    }
+                    else {
+                        change.present = true;
+                        change.value = &op.value;
+                    }
+                }
+
+                // Everything that allocates comes first: new keys are
+                // inserted and new values for existing ones built aside.
+                // Undoing that only frees, so it cannot fail in turn.
+                std::vector<ShString> values;
+                values.reserve(changes.size());
+                size_t n = 0;
+                try {
+                    for (; n < changes.size(); ++n) {
+                        Change& change = changes[n];
+                        if (!change.value) {
+                            continue;
+                        }
+                        if (change.entry) {
+                            values.emplace_back(change.value->data(), change.value->size(), SlabAlloc<char>(&change.stripe->pool));
+                        }
+                        else {
+                            change.stripe->put(change.key, change.hash, *change.value);
+                        }
+                    }
+                }
+                catch (bip::bad_alloc &) {
+                    for (size_t i = 0; i < n; ++i) {
+                        if (changes[i].value && !changes[i].entry) {
+                            changes[i].stripe->erase(changes[i].key, changes[i].hash);
+                        }
+                    }
+                    values.clear();
+                }
+                if (n == changes.size()) {
+                    // Then the keys that existed change without allocating
+                    auto value = values.begin();
+                    for (Change& change : changes) {
+                        if (change.entry && change.value) {
+                            change.stripe->replace(change.entry, *value++);
+                        }
+                        else if (change.entry && !change.present) {
+                            change.stripe->erase(change.key, change.hash);
+                        }
+                    }
+                    log_batch(keyspace, batch);
+                    return;
+                }
+            }
+        }
+
+        if (!grow(seen_size, needed)) {
+            if (current()->header->evict_water == 0 || (starved && !evicted)) {
+                throw bip::bad_alloc();
+            }
+            starved = true;
+        }
     }
+}
 
-    void store(const std::string& key, const std::string& value) {
-        auto sa = segment.get_segment_manager();
-        ShString sh_key = ShString(key.c_str(), sa);
-        ShString sh_value = ShString(value.c_str(), sa);
-        map->erase(sh_key);
-        map->insert(std::make_pair(sh_key, sh_value));
+size_t SharedKeyValueStore::scan(KeyspaceId keyspace, KeyRange* range, size_t limit, std::vector<ScanEntry>* entries) {
+    entries->clear();
+    Stripe* stripes = live_stripes(keyspace);
+    if (limit == 0 || !stripes) {
+        return 0;
+    }
+    if (current()->header->index == INDEX_TREE) {
+        return scan_tree(keyspace, *range, limit, entries);
     }
 
-    std::string retrieve(const std::string& key) const {
-        auto sa = segment.get_segment_manager();
-        ShString sh_key = ShString(key.c_str(), sa);
-        auto it = map->find(sh_key);
-        if (it == map->end()) {
-            throw std::runtime_error("Key not found");
+    // A hash index has no order to resume in, so the first chunk takes the
+    // keys in range from every stripe at once, and later ones read on from
+    // where the last left off
+    bool resumed = !range->inclusive && range->next > 0 && range->next <= range->pending.size() &&
+        range->pending[range->next - 1] == range->start;
+    if (!resumed) {
+        range->pending.clear();
+        range->next = 0;
+        Mapping* mapping = current();
+        boost::string_view start = range->start;
+        boost::string_view end = range->end;
+        auto in_range = [&](boost::string_view key) {
+            return (range->inclusive ? key >= start : key > start) && (end.empty() || key < end);
+        };
+        for (uint32_t i = 0; i < mapping->header->stripe_count; ++i) {
+            SharableStripeLock lock(this, &stripes[i], std::nothrow);
+            if (!lock) {
+                // Torn, with no room to rebuild it: its keys read as missing
+                continue;
+            }
+            if (!live_stripes(keyspace)) {
+                // Dropped meanwhile
+                range->pending.clear();
+                return 0;
+            }
+            Stripe& stripe = current()->keyspace(keyspace).stripes[i];
+            stripe.table->for_each([&](const Entry& entry) {
+                boost::string_view key = to_view(entry.first);
+                if (in_range(key)) {
+                    range->pending.emplace_back(key.data(), key.size());
+                }
+            });
         }
-        return std::string(it->second.c_str());
+        std::sort(range->pending.begin(), range->pending.end());
     }
 
-private:
-    bip::managed_shared_memory segment;
-    StringMap* map;
-};
+    // Each key as it is now; one removed since is skipped
+    boost::string_view item;
+    while (entries->size() < limit && range->next < range->pending.size()) {
+        const std::string& key = range->pending[range->next++];
+        uint64_t hash = hash_key(key);
+        Stripe* stripe = live_stripe(keyspace, hash);
+        if (!stripe) {
+            break;
+        }
+        SharableStripeLock lock(this, stripe, std::nothrow);
+        if (!lock) {
+            continue;
+        }
+        stripe = live_stripe(keyspace, hash);
+        Entry* entry = stripe ? stripe->find(key, hash) : nullptr;
+        if (entry && live_item(to_view(entry->second), &item)) {
+            entries->emplace_back(key, std::string(item.data(), item.size()));
+        }
+    }
+    if (entries->size() < limit) {
+        // The last chunk; the keys need not outlive the scan
+        std::vector<std::string>().swap(range->pending);
+        range->next = 0;
+    }
+    return entries->size();
+}
 
+// Every stripe of a tree index is ordered, so the stripes are merged from
+// the start of the range with all of them locked shared, and nothing past
+// the last entry returned is read.
+size_t SharedKeyValueStore::scan_tree(KeyspaceId keyspace, const KeyRange& range, size_t limit, std::vector<ScanEntry>* entries) {
+    // Released even if copying an entry throws
+    struct SharedLocks {
+        Stripe* stripes;
+        uint32_t count;
+        SharedLocks(SharedKeyValueStore* store, Stripe* stripes, uint32_t count) : stripes(stripes), count(0) {
+            for (uint32_t i = 0; i < count; ++i) {
+                try {
+                    store->lock_stripe_sharable(stripes[i]);
+                }
+                catch (bip::bad_alloc &) {
+                    // A torn stripe with no room to rebuild it; the
+                    // destructor does not run for a constructor that throws
+                    unlock();
+                    throw;
+                }
+                this->count = i + 1;
+            }
+        }
+        ~SharedLocks() {
+            unlock();
+        }
+        void unlock() {
+            for (uint32_t i = count; i > 0; --i) {
+                stripes[i - 1].lock.unlock_sharable();
+            }
+            count = 0;
+        }
+    };
 
-const int type_int = 0x30;
-const int type_string = 0x31;
-const int type_py = 0x39;
+    uint32_t stripe_count = current()->header->stripe_count;
+    Stripe* stripes = live_stripes(keyspace);
+    if (!stripes) {
+        return 0;
+    }
+    SharedLocks locks(this, stripes, stripe_count);
+    stripes = live_stripes(keyspace);
+    if (!stripes) {
+        // Dropped meanwhile
+        return 0;
+    }
 
+    // A heap of each stripe's next key, smallest on top
+    typedef std::pair<StringMap::iterator, StringMap::iterator> Run;
+    std::vector<Run> runs;
+    for (uint32_t i = 0; i < stripe_count; ++i) {
+        StringMap& tree = *stripes[i].tree;
+        Run run(range.inclusive ? tree.lower_bound(range.start) : tree.upper_bound(range.start), tree.end());
+        if (run.first != run.second) {
+            runs.push_back(run);
+        }
+    }
+    auto later = [](const Run& a, const Run& b) {
+        return to_view(a.first->first) > to_view(b.first->first);
+    };
+    std::make_heap(runs.begin(), runs.end(), later);
 
-typedef struct item {
-    int type;
-    std::string value;
-} item_t;
+    boost::string_view item;
+    while (!runs.empty() && entries->size() < limit) {
+        std::pop_heap(runs.begin(), runs.end(), later);
+        Run& run = runs.back();
+        boost::string_view key = to_view(run.first->first);
+        if (!range.end.empty() && key >= range.end) {
+            break;
+        }
+        if (live_item(to_view(run.first->second), &item)) {
+            entries->emplace_back(std::string(key.data(), key.size()), std::string(item.data(), item.size()));
+        }
+        if (++run.first == run.second) {
+            runs.pop_back();
+        }
+        else {
+            std::push_heap(runs.begin(), runs.end(), later);
+        }
+    }
+    return entries->size();
+}
+
+size_t SharedKeyValueStore::size() {
+    return current()->segment.get_size();
+}
+
+size_t SharedKeyValueStore::free_memory() {
+    return current()->segment.get_free_memory();
+}
+
+StoreStats SharedKeyValueStore::stats() {
+    Mapping* mapping = current();
+    StoreStats stats;
+    stats.size = mapping->mapped_size;
+    stats.free = mapping->segment.get_free_memory();
+    stats.keys = 0;
+    stats.timers = 0;
+    stats.filter_bytes = 0;
+    stats.lock_recoveries = 0;
+    stats.repairs = 0;
+    stats.lost = 0;
+    stats.slab = SlabStats();
+    // Dropped keyspaces count until their keys are erased
+    bip::scoped_lock<RobustMutex> keyspace_lock(mapping->header->keyspace_lock);
+    for (uint32_t slot = 0; slot < MAX_KEYSPACES; ++slot) {
+        Keyspace& keyspace = current()->header->keyspaces[slot];
+        if (!keyspace.stripes) {
+            continue;
+        }
+        KeyspaceStats keyspace_stats;
+        keyspace_stats.name = keyspace.name;
+        keyspace_stats.keys = 0;
+        keyspace_stats.used = 0;
+        keyspace_stats.quota = keyspace.quota;
+        for (uint32_t i = 0; i < mapping->header->stripe_count; ++i) {
+            // Repairs the stripe first if a writer died in it, and leaves it
+            // out if there is no room to
+            SharableStripeLock lock(this, &keyspace.stripes[i], std::nothrow);
+            if (!lock) {
+                continue;
+            }
+            Stripe& stripe = current()->header->keyspaces[slot].stripes[i];
+            keyspace_stats.keys += stripe.table ? stripe.table->size() : stripe.tree->size();
+            keyspace_stats.used += stripe.pool.used_bytes();
+            stats.timers += stripe.timers ? stripe.timers->size() : 0;
+            stats.filter_bytes += stripe.filter->bytes();
+            stats.lock_recoveries += stripe.lock.recoveries();
+            stats.repairs += stripe.repairs.load(std::memory_order_relaxed);
+            stats.lost += stripe.lost.load(std::memory_order_relaxed);
+            stripe.pool.add_stats(&stats.slab);
+        }
+        stats.keys += keyspace_stats.keys;
+        if (slot != DEFAULT_KEYSPACE && keyspace.state.load() == KEYSPACE_LIVE) {
+            stats.keyspaces.push_back(keyspace_stats);
+        }
+    }
+    stats.evictions = mapping->header->evictions.load(std::memory_order_relaxed);
+    stats.expirations = mapping->header->expirations.load(std::memory_order_relaxed);
+    return stats;
+}
+
+CheckReport SharedKeyValueStore::check() {
+    CheckReport report = CheckReport();
+    bip::scoped_lock<RobustMutex> keyspace_lock(current()->header->keyspace_lock);
+    Mapping* mapping = current();
+
+    // A drop or a free of a slot that was cut short leaves the slot as it
+    // was, or dropped with its keys still to erase; only the count of
+    // dropped slots can be off
+    uint32_t dropped = 0;
+    for (uint32_t slot = 0; slot < MAX_KEYSPACES; ++slot) {
+        Keyspace& keyspace = mapping->header->keyspaces[slot];
+        keyspace.name[KEYSPACE_NAME_MAX] = '\0';
+        if (keyspace.state.load() == KEYSPACE_DROPPED) {
+            ++dropped;
+        }
+    }
+    mapping->header->dropped.store(dropped);
 
+    // Rebuilding a stripe allocates, which a torn allocator must not do
+    report.allocator_torn = allocator_torn();
 
-std::string item_to_string(item_t & item)
+    mapping->for_each_stripe([&](Stripe& stripe) {
+        bip::scoped_lock<RobustSharableMutex> lock(stripe.lock);
+        ++report.stripes;
+        if (stripe.torn() || !stripe.consistent(bounds(mapping, stripe))) {
+            if (report.allocator_torn) {
+                ++report.failed;
+                return;
+            }
+            try {
+                report.lost += repair(mapping, stripe);
+                ++report.repaired;
+            }
+            catch (bip::bad_alloc &) {
+                ++report.failed;
+                return;
+            }
+        }
+        report.keys += stripe.table ? stripe.table->size() : stripe.tree->size();
+    });
+    return report;
+}
+
+bool SharedKeyValueStore::allocator_torn() {
+    Mapping* mapping = current();
+    return allocator_recoveries(mapping->segment.get_segment_manager()) > 0 || mapping->header->growing.load();
+}
+
+size_t SharedKeyValueStore::salvage_into(const char* target, const StoreOptions& options) {
+    Mapping* mapping = current();
+    StoreHeader* header = mapping->header;
+    StoreOptions layout = options;
+    layout.initial_size = std::max(options.initial_size, mapping->mapped_size - mapping->segment.get_free_memory());
+    layout.index = header->index;
+    layout.stripes = header->stripe_count;
+    layout.evict_water = header->evict_water;
+
+    SharedKeyValueStore copy(target, layout);
+    size_t lost = 0;
+    for (uint32_t slot = 0; slot < MAX_KEYSPACES; ++slot) {
+        Keyspace& keyspace = header->keyspaces[slot];
+        KeyspaceId id = DEFAULT_KEYSPACE;
+        if (keyspace.state.load() != KEYSPACE_LIVE
+            || (slot != DEFAULT_KEYSPACE && !copy.restore_keyspace(slot, boost::string_view(keyspace.name, strnlen(keyspace.name, KEYSPACE_NAME_MAX)), keyspace.quota, &id))) {
+            continue;
+        }
+        for (uint32_t i = 0; i < header->stripe_count; ++i) {
+            Stripe& stripe = keyspace.stripes[i];
+            std::vector<ScanEntry> entries;
+            lost += stripe.salvage(bounds(mapping, stripe), &entries);
+            for (const ScanEntry& entry : entries) {
+                copy.restore(id, entry.first, entry.second);
+            }
+        }
+    }
+    copy.current()->header->log_seq.store(header->log_seq.load());
+    copy.current()->header->log_generation.store(header->log_generation.load());
+    return lost;
+}
+
+void SharedKeyValueStore::log_position(uint64_t* seq, uint64_t* generation) {
+    *seq = current()->header->log_seq.load();
+    *generation = current()->header->log_generation.load();
+}
+
+
+size_t env_size(const char* name, size_t fallback)
 {
-    std::ostringstream ss;
-    ss << (char)item.type << item.value;
-    return ss.str();
+    char* str = getenv(name);
+    if (!str) {
+        return fallback;
+    }
+    return strtoull(str, NULL, 0);
 }
 
-item_t string_to_item(std::string &str)
+StoreOptions options_from_env()
 {
-    item_t item;
-    item.type = str[0];
-    item.value = std::string(str, 1, str.length() - 1);
-    return item;
+    StoreOptions options;
+    options.initial_size = env_size("KVSTORE_SHM_SIZE", DEFAULT_SEGMENT_SIZE);
+    options.max_size = env_size("KVSTORE_SHM_MAX_SIZE", DEFAULT_SEGMENT_MAX_SIZE);
+    options.high_water = env_size("KVSTORE_SHM_HIGH_WATER", DEFAULT_HIGH_WATER);
+
+    options.stripes = env_size("KVSTORE_STRIPES", DEFAULT_STRIPES);
+    options.evict_water = env_size("KVSTORE_EVICT_WATER", DEFAULT_EVICT_WATER);
+
+    char* index_str = getenv("KVSTORE_INDEX");
+    if (index_str && strcmp(index_str, "tree") == 0) {
+        options.index = INDEX_TREE;
+    }
+    return options;
 }
 
-void store_value(std::string key, std::string value)
+SharedKeyValueStore& shared_store()
 {
-    SharedKeyValueStore store("shared_mem");
-    item_t item;
-    item.type = type_string;
-    item.value = value;
-    std::string item_str = item_to_string(item);
-    store.store(key, item_str);
+    // Opened once per process; the segment stays mapped until exit and forked
+    // children inherit the mapping. Function-local statics are initialized
+    // thread-safely.
+    static SharedKeyValueStore store(segment_name(SEGMENT_NAME, "").c_str(), options_from_env());
+    return store;
 }
 
-std::string load_string_value(std::string key)
+std::string make_string_item(boost::string_view value)
+{
+    static const size_t compress_min = env_size("KVSTORE_COMPRESS_MIN", DEFAULT_COMPRESS_MIN);
+    if (compress_min == 0 || value.size() < compress_min || value.size() > UINT32_MAX) {
+        return make_item(type_string, value);
+    }
+
+    uint64_t start = metrics_clock_ns();
+    std::string item;
+    item.reserve(LZ_ITEM_HEADER_SIZE + lz_bound(value.size()));
+    item.push_back((char)(type_string | item_flagged));
+    item.push_back((char)flag_lz);
+    uint32_t size = value.size();
+    item.append((const char*)&size, sizeof(size));
+    lz_compress(value.data(), value.size(), &item);
+    bool smaller = item.size() < 1 + value.size();
+    record_compression(value.size(), smaller ? item.size() : 0, metrics_clock_ns() - start);
+    return smaller ? item : make_item(type_string, value);
+}
+
+bool find_namespace(boost::string_view name, KeyspaceId* keyspace)
+{
+    if (name == DEFAULT_KEYSPACE_NAME) {
+        *keyspace = DEFAULT_KEYSPACE;
+        return true;
+    }
+    return shared_store().find_keyspace(name, keyspace);
+}
+
+bool create_namespace(boost::string_view name, size_t quota)
+{
+    KeyspaceId keyspace;
+    try {
+        return shared_store().create_keyspace(name, quota, &keyspace);
+    }
+    catch (bip::bad_alloc &) {
+        return false;
+    }
+}
+
+bool drop_namespace(boost::string_view name)
+{
+    KeyspaceId keyspace;
+    return shared_store().find_keyspace(name, &keyspace) && shared_store().drop_keyspace(keyspace);
+}
+
+UpdateStatus store_value(KeyspaceId keyspace, boost::string_view key, boost::string_view value)
+{
+    try {
+        shared_store().store(keyspace, key, make_string_item(value));
+    }
+    catch (bip::bad_alloc &) {
+        return UPDATE_FULL;
+    }
+    catch (NoSuchKeyspace &) {
+        return UPDATE_NO_KEYSPACE;
+    }
+    return UPDATE_OK;
+}
+
+UpdateStatus expire_value(KeyspaceId keyspace, boost::string_view key, uint64_t ttl_ms)
+{
+    try {
+        return shared_store().expire(keyspace, key, ttl_ms) ? UPDATE_OK : UPDATE_NOT_FOUND;
+    }
+    catch (bip::bad_alloc &) {
+        return UPDATE_FULL;
+    }
+    catch (NoSuchKeyspace &) {
+        return UPDATE_NO_KEYSPACE;
+    }
+}
+
+void expire_values()
+{
+    shared_store().expire_due();
+}
+
+StoreStats store_stats()
+{
+    return shared_store().stats();
+}
+
+UpdateStatus store_int_value(KeyspaceId keyspace, boost::string_view key, int64_t value)
+{
+    try {
+        shared_store().store(keyspace, key, make_int_item(value));
+    }
+    catch (bip::bad_alloc &) {
+        return UPDATE_FULL;
+    }
+    catch (NoSuchKeyspace &) {
+        return UPDATE_NO_KEYSPACE;
+    }
+    return UPDATE_OK;
+}
+
+// SharedKeyValueStore::retrieve() throws bip::bad_alloc when the key's
+// stripe is torn and there is no room to rebuild it
+static bool retrieve_item(KeyspaceId keyspace, boost::string_view key, std::string* item)
 {
-    SharedKeyValueStore store("shared_mem");
-    std::string value;
     try {
-        value = store.retrieve(key);
+        return shared_store().retrieve(keyspace, key, item);
+    }
+    catch (bip::bad_alloc &) {
+        return false;
+    }
+}
+
+bool load_string_value(KeyspaceId keyspace, boost::string_view key, std::string* value)
+{
+    std::string item_str;
+    if (!retrieve_item(keyspace, key, &item_str)) {
+        return false;
+    }
+    std::string scratch;
+    boost::string_view payload;
+    if (!string_item_value(item_str, &payload, &scratch)) {
+        return false;
+    }
+    value->assign(payload.data(), payload.size());
+    return true;
+}
+
+bool load_int_value(KeyspaceId keyspace, boost::string_view key, int64_t* value)
+{
+    std::string item_str;
+    return retrieve_item(keyspace, key, &item_str) && int_item_value(item_str, value);
+}
+
+bool compressed_item(boost::string_view item)
+{
+    return !item.empty() && item[0] == (char)(type_string | item_flagged);
+}
+
+bool string_item_value(boost::string_view item, boost::string_view* value, std::string* scratch)
+{
+    if (!item.empty() && item[0] == (char)type_string) {
+        *value = item.substr(1);
+        return true;
+    }
+    if (!compressed_item(item) || item.size() < LZ_ITEM_HEADER_SIZE || item[1] != (char)flag_lz) {
+        return false;
+    }
+    uint64_t start = metrics_clock_ns();
+    uint32_t size;
+    memcpy(&size, item.data() + 2, sizeof(size));
+    scratch->resize(size);
+    if (!lz_decompress(item.data() + LZ_ITEM_HEADER_SIZE, item.size() - LZ_ITEM_HEADER_SIZE, &(*scratch)[0], size)) {
+        return false;
+    }
+    record_decompression(metrics_clock_ns() - start);
+    *value = *scratch;
+    return true;
+}
+
+bool int_item_value(boost::string_view item, int64_t* value)
+{
+    if (item.size() != INT_ITEM_SIZE || item[0] != (char)type_int) {
+        return false;
     }
-    catch (std::runtime_error &) {
+    memcpy(value, item.data() + 1, sizeof(*value));
+    return true;
+}
+
+std::string load_string_value(KeyspaceId keyspace, boost::string_view key)
+{
+    std::string value;
+    if (!load_string_value(keyspace, key, &value)) {
         return "";
     }
-    item_t item = string_to_item(value);
-    if (item.type == type_string) {
-        return item.value;
+    return value;
+}
+
+// Whether segment `name` exists and holds a store laid out as this one is
+bool segment_reusable(const char* name)
+{
+    try {
+        ManagedSegment segment(bip::open_only, name);
+        StoreHeader* header = segment.find<StoreHeader>("StoreHeader").first;
+        return header && header->magic == STORE_MAGIC;
+    }
+    catch (bip::interprocess_exception &) {
+        return false;
+    }
+}
+
+size_t rebuild_segment(const char* name, const StoreOptions& options)
+{
+    // Built under another name and copied into place, like a snapshot, so
+    // the old segment is only removed once the new one is whole
+    std::string scratch = std::string(name) + "_rebuild";
+    bip::shared_memory_object::remove(scratch.c_str());
+    size_t lost;
+    {
+        SharedKeyValueStore old(name, options);
+        lost = old.salvage_into(scratch.c_str(), options);
+    }
+    {
+        bip::shared_memory_object from(bip::open_only, scratch.c_str(), bip::read_only);
+        bip::mapped_region source(from, bip::read_only);
+        bip::shared_memory_object::remove(name);
+        bip::shared_memory_object to(bip::create_only, name, bip::read_write);
+        to.truncate(source.get_size());
+        bip::mapped_region region(to, bip::read_write);
+        memcpy(region.get_address(), source.get_address(), source.get_size());
+    }
+    bip::shared_memory_object::remove(scratch.c_str());
+    return lost;
+}
+
+// Takes an exclusive flock() on a shared-memory object named after the
+// server's segments. The descriptor stays open, and workers forked later
+// inherit the lock, so it is held until the last process using the segments
+// exits. Returns false if another server holds it.
+static bool claim_segments()
+{
+    std::string name = "/" + segment_name(LOCK_SEGMENT, "_lock");
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        perror("shm_open failed");
+        return false;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        fprintf(stderr, "segments of %s are in use by another server\n", segment_name(SEGMENT_NAME, "").c_str());
+        close(fd);
+        return false;
+    }
+    return true;
+}
+
+// A segment left behind by an earlier run, whether it exited or crashed, is
+// kept: it is checked and repaired, and the log carries on after the last
+// change in it. If anything had to be rebuilt, the segment is then rebuilt
+// as a whole, which reclaims the memory the repairs abandoned and fixes what
+// they cannot. Otherwise, with KVSTORE_DURABILITY set, the store is rebuilt
+// from the snapshot and log in KVSTORE_DATA_DIR instead of starting empty.
+// Removing the segment forces that.
+bool initialize()
+{
+    if (!claim_segments()) {
+        return false;
+    }
+
+    Durability durability = durability_from_string(getenv("KVSTORE_DURABILITY"));
+    const char* dir = getenv("KVSTORE_DATA_DIR");
+    std::string data_dir = dir ? dir : ".";
+
+    std::string name = segment_name(SEGMENT_NAME, "");
+    uint64_t seq = 0, generation = 0;
+    if (segment_reusable(name.c_str())) {
+        StoreOptions options = options_from_env();
+        CheckReport report;
+        bool repaired;
+        {
+            // Not yet the server's store, which must not map the segment
+            // until it is known to stay
+            SharedKeyValueStore kept(name.c_str(), options);
+            report = kept.check();
+            repaired = report.repaired > 0 || report.failed > 0 || report.allocator_torn || kept.stats().repairs > 0;
+        }
+        fprintf(stderr, "kept segment %s: %zu keys, %zu of %zu stripes rebuilt, %zu entries lost\n",
+                name.c_str(), report.keys, report.repaired, report.stripes, report.lost);
+        if (repaired) {
+            size_t lost = rebuild_segment(name.c_str(), options);
+            fprintf(stderr, "rebuilt segment %s, %zu entries lost\n", name.c_str(), lost);
+        }
+
+        SharedKeyValueStore& store = shared_store();
+        if (durability != DURABILITY_NONE) {
+            store.log_position(&seq, &generation);
+            store.open_log(data_dir, durability, seq, generation + 1);
+            // A process that died may have made changes it never logged
+            start_snapshot(store);
+        }
+        return true;
+    }
+
+    bip::shared_memory_object::remove(name.c_str());
+    if (durability != DURABILITY_NONE) {
+        restore_snapshot(data_dir, name.c_str(), &seq, &generation);
+    }
+
+    SharedKeyValueStore& store = shared_store();
+    if (durability != DURABILITY_NONE) {
+        replay_logs(data_dir, store, &seq, &generation);
+        // Never append after a record that may have been torn by a crash
+        store.open_log(data_dir, durability, seq, generation + 1);
+    }
+    return true;
+}
+
+bool commit_values()
+{
+    return shared_store().commit_log();
+}
+
+bool commit_pending()
+{
+    return shared_store().log_pending();
+}
+
+void snapshot_values()
+{
+    try {
+        snapshot_if_due(shared_store());
+    }
+    catch (bip::bad_alloc &) {
+        // A stripe could not be rebuilt to copy it; the log keeps every change
+        // until a later snapshot succeeds
+        fprintf(stderr, "snapshot skipped: no room to rebuild a torn stripe\n");
+    }
+}
+
+CheckReport check_store()
+{
+    return shared_store().check();
+}
+
+bool remove_value(KeyspaceId keyspace, boost::string_view key)
+{
+    try {
+        return shared_store().remove(keyspace, key);
+    }
+    catch (bip::bad_alloc &) {
+        // Its stripe is torn and cannot be rebuilt
+        return false;
+    }
+}
+
+void batch_store(std::vector<BatchOp>* batch, boost::string_view key, boost::string_view value)
+{
+    batch->push_back(BatchOp{std::string(key.data(), key.size()), make_string_item(value), false, false});
+}
+
+void batch_store_int(std::vector<BatchOp>* batch, boost::string_view key, int64_t value)
+{
+    batch->push_back(BatchOp{std::string(key.data(), key.size()), make_int_item(value), false, false});
+}
+
+void batch_remove(std::vector<BatchOp>* batch, boost::string_view key)
+{
+    batch->push_back(BatchOp{std::string(key.data(), key.size()), std::string(), true, false});
+}
+
+UpdateStatus apply_batch(KeyspaceId keyspace, std::vector<BatchOp>* batch)
+{
+    try {
+        shared_store().apply(keyspace, *batch);
+    }
+    catch (bip::bad_alloc &) {
+        return UPDATE_FULL;
+    }
+    catch (NoSuchKeyspace &) {
+        return UPDATE_NO_KEYSPACE;
+    }
+    return UPDATE_OK;
+}
+
+bool load_stored_value(KeyspaceId keyspace, boost::string_view key, std::string* stored)
+{
+    try {
+        return shared_store().retrieve_stored(keyspace, key, stored);
+    }
+    catch (bip::bad_alloc &) {
+        return false;
+    }
+}
+
+bool restore_value(KeyspaceId keyspace, boost::string_view key, boost::string_view stored)
+{
+    try {
+        shared_store().restore(keyspace, key, stored);
+    }
+    catch (bip::bad_alloc &) {
+        return false;
+    }
+    catch (NoSuchKeyspace &) {
+        return false;
+    }
+    return true;
+}
+
+bool namespace_at(uint32_t slot, KeyspaceId* keyspace, std::string* name, size_t* quota)
+{
+    if (!name) {
+        // Without taking the keyspace lock
+        return shared_store().keyspace_at(slot, keyspace);
+    }
+    return shared_store().keyspace_at(slot, keyspace, name, quota);
+}
+
+bool restore_namespace(uint32_t slot, boost::string_view name, size_t quota)
+{
+    KeyspaceId keyspace;
+    std::string old_name;
+    size_t old_quota;
+    if (namespace_at(slot, &keyspace, &old_name, &old_quota) && old_name == name && old_quota == quota) {
+        return true;
+    }
+    // Moved to another slot on the primary
+    if (shared_store().find_keyspace(name, &keyspace) && keyspace % MAX_KEYSPACES != slot) {
+        shared_store().drop_keyspace(keyspace);
+    }
+    try {
+        return shared_store().restore_keyspace(slot, name, quota, &keyspace);
+    }
+    catch (bip::bad_alloc &) {
+        return false;
+    }
+}
+
+bool drop_namespace_at(uint32_t slot)
+{
+    KeyspaceId keyspace;
+    return shared_store().keyspace_at(slot, &keyspace) && shared_store().drop_keyspace(keyspace);
+}
+
+KeyRange prefix_range(boost::string_view prefix)
+{
+    KeyRange range;
+    range.start.assign(prefix.data(), prefix.size());
+    // The first key past the prefix: increment its last byte that is not
+    // 0xff and drop the ones after it. A prefix of only 0xff bytes, or none,
+    // has no bound.
+    range.end = range.start;
+    while (!range.end.empty() && (unsigned char)range.end.back() == 0xff) {
+        range.end.pop_back();
     }
-    return "";
+    if (!range.end.empty()) {
+        range.end.back() = (char)((unsigned char)range.end.back() + 1);
+    }
+    return range;
 }
 
-void initialize()
+bool scan_values(KeyspaceId keyspace, KeyRange* range, size_t limit, std::vector<ScanEntry>* entries)
 {
-    bip::shared_memory_object::remove("shared_mem");
+    size_t found;
+    try {
+        found = shared_store().scan(keyspace, range, limit, entries);
+    }
+    catch (bip::bad_alloc &) {
+        // A tree scan needs every stripe, and one is torn and cannot be
+        // rebuilt
+        entries->clear();
+        return false;
+    }
+    if (found < limit) {
+        return false;
+    }
+    range->start = entries->back().first;
+    range->inclusive = false;
+    return true;
 }
 
-// void remove_value(std::string key)
-// {
-//     store.erase(key);
-// }
 
+UpdateStatus incr_value(KeyspaceId keyspace, boost::string_view key, int64_t delta, int64_t* result)
+{
+    try {
+        return shared_store().increment(keyspace, key, delta, result);
+    }
+    catch (bip::bad_alloc &) {
+        return UPDATE_FULL;
+    }
+    catch (NoSuchKeyspace &) {
+        return UPDATE_NO_KEYSPACE;
+    }
+}
+
+UpdateStatus cas_value(KeyspaceId keyspace, boost::string_view key, int64_t expected, int64_t desired, int64_t* current)
+{
+    try {
+        return shared_store().compare_and_swap(keyspace, key, expected, desired, current);
+    }
+    catch (bip::bad_alloc &) {
+        return UPDATE_FULL;
+    }
+    catch (NoSuchKeyspace &) {
+        return UPDATE_NO_KEYSPACE;
+    }
+}
@@ -1,9 +1,738 @@
+#pragma once
+
 #include <map>
 #include <string>
 #include <iostream>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+#include <boost/interprocess/containers/map.hpp>
+
+#include "shm.hpp"
+#include "bloom.hpp"
+#include "hashindex.hpp"
+#include "robust.hpp"
+#include "timerwheel.hpp"
+#include "persist.hpp"
+
+#define SEGMENT_NAME "shared_mem"
+#define DEFAULT_SEGMENT_SIZE 65536              // 64KB
+#define DEFAULT_SEGMENT_MAX_SIZE (64 << 20)     // 64MB
+#define DEFAULT_HIGH_WATER 75                   // percent of the segment in use
+#define DEFAULT_STRIPES 16
+#define DEFAULT_EVICT_WATER 0                   // percent of max_size; 0 never evicts
+#define MIN_CLOCK_WORDS 64                      // reference bits per stripe / 64
+#define DEFAULT_COMPRESS_MIN 1024               // bytes; 0 never compresses
+#define MAX_KEYSPACES 64
+#define KEYSPACE_NAME_MAX 64
+#define DEFAULT_KEYSPACE 0
+#define DEFAULT_KEYSPACE_NAME "default"
+// Starts every StoreHeader; changed whenever anything kept in the segment is
+// laid out differently, so a segment left by another version is not reused
+#define STORE_MAGIC 0x3145524f5453564bULL       // "KVSTORE1" in memory
+
+using ShmemAllocator = SlabAlloc<Entry>;
+using StringMap = bip::map<ShString, ShString, KeyLess, ShmemAllocator>;
+
+enum IndexType
+{
+    INDEX_HASH,     // HashIndex: flat open addressing, fastest point lookups
+    INDEX_TREE,     // StringMap: red-black tree, keeps keys ordered
+};
+
+struct StoreOptions
+{
+    // The segment starts at initial_size and doubles whenever more than
+    // high_water percent of it is in use, up to max_size.
+    size_t initial_size = DEFAULT_SEGMENT_SIZE;
+    size_t max_size = DEFAULT_SEGMENT_MAX_SIZE;
+    unsigned high_water = DEFAULT_HIGH_WATER;
+    // Only used when the segment is created
+    IndexType index = INDEX_HASH;
+    uint32_t stripes = DEFAULT_STRIPES;
+    // Once more than evict_water percent of max_size is in use, writers evict
+    // keys to make room instead of failing when the segment is full
+    unsigned evict_water = DEFAULT_EVICT_WATER;
+};
+
+// A key and its item, copied out of the segment
+using ScanEntry = std::pair<std::string, std::string>;
+
+// Where the entries of one stripe can be, for telling sound entries from
+// the leftovers of a writer that died: inside the mapped segment, with a key
+// that hashes to the stripe
+struct SegmentBounds
+{
+    const char* start;
+    const char* end;
+    uint32_t stripe_mask;       // stripe_count - 1
+    uint32_t stripe_index;      // within its keyspace
+};
+
+// One stripe of the keyspace. Keys are spread over the stripes by hash, and
+// each stripe has its own index and lock, so writers to different stripes do
+// not wait for each other.
+//
+// Writers hold `lock` exclusively and make `seq` odd while they modify the
+// index. Readers of a hash index take no lock: they read optimistically and
+// retry if `seq` changed underneath them (a seqlock). Tree lookups walk
+// rebalancing nodes that cannot be validated that way, so tree readers hold
+// `lock` shared instead.
+//
+// Each keyspace has stripes of its own; see Keyspace.
+//
+// Every key is also in the stripe's counting Bloom filter, which find()
+// consults first, so a miss rarely reads the index.
+//
+// Eviction is approximate LRU (CLOCK). Readers cannot safely write to an entry
+// they have not locked, so reference bits live in a per-stripe bitmap indexed
+// by hash instead, and keys whose hashes collide there share a bit.
+//
+// `lock` is robust: a process killed while holding it does not leave it
+// held. If it was killed between write_begin() and write_end(), `seq` stays
+// odd, and whoever locks the stripe next rebuilds it before going on; see
+// SharedKeyValueStore::lock_stripe().
+struct Stripe
+{
+    RobustSharableMutex lock;
+    std::atomic<uint32_t> seq;
+    // Exactly one of the two indexes exists, depending on the index type
+    bip::offset_ptr<StringMap> tree;
+    bip::offset_ptr<HashIndex> table;
+    bip::offset_ptr<CountingBloom> filter;
+    // Created when the first key in the stripe is given a TTL
+    bip::offset_ptr<TimerWheel> timers;
+    // Only exists if the store evicts; clock_words is a power of two
+    bip::offset_ptr<std::atomic<uint64_t>> referenced;
+    uint32_t clock_words;
+    uint32_t slot;              // of its keyspace
+    // Where the CLOCK hand stopped: a slot of the hash index, or the last key
+    // evicted from the tree
+    size_t clock_hand;
+    // Every key, value and index entry of the stripe is allocated from here
+    SlabPool pool;
+    ShString clock_key;
+    // The entry whose value put() is overwriting, if any
+    bip::offset_ptr<Entry> changing;
+    // Times the stripe was rebuilt, and entries left out as unsound then
+    std::atomic<uint64_t> repairs;
+    std::atomic<uint64_t> lost;
+
+    Stripe(SegmentManager* segment_manager, IndexType index, uint32_t clock_words, uint32_t slot);
+
+    Entry* find(boost::string_view key, uint64_t hash);
+    void put(boost::string_view key, uint64_t hash, boost::string_view value);
+    // Swaps a value built in the stripe's pool into the entry, which unlike
+    // put() never allocates; `value` is left holding the old one
+    void replace(Entry* entry, ShString& value);
+    bool erase(boost::string_view key, uint64_t hash);
+    // Erases up to `limit` keys, whichever come first. Returns how many.
+    size_t clear(size_t limit);
+    // Adds a key that put() inserted to the filter, growing it if it is full
+    void add_to_filter(uint64_t hash);
+
+    // Whether a writer died in the middle of changing the stripe. Only
+    // meaningful with the lock held, when no live writer can be at work.
+    bool torn() const { return seq.load(std::memory_order_relaxed) & 1; }
+    // Whether the index holds only sound entries, each where a lookup finds
+    // it, and the filter has all of them
+    bool consistent(const SegmentBounds& bounds);
+    // Copies out the sound entries the index still points to, each key
+    // once, without changing anything in the segment. Returns the number of
+    // entries left out.
+    size_t salvage(const SegmentBounds& bounds, std::vector<ScanEntry>* entries);
+    // Moves the entries salvage() finds into a new pool, index, filter and
+    // timer wheel. Called with the stripe locked for writing. Returns the
+    // number of entries left out. Throws bip::bad_alloc, with the stripe
+    // left as it was, if the segment has no room for the new index and the
+    // entries.
+    size_t rebuild(const SegmentBounds& bounds);
+
+    // Erases the keys whose timers are due. Returns how many expired.
+    size_t expire_due(uint64_t now_ms);
+    // Erases the next key the CLOCK hand finds unreferenced or expired, and
+    // copies it to *key unless that is null. Returns false if there was none.
+    bool evict(uint64_t now_ms, bool* expired, std::string* key);
+
+    void touch(uint64_t hash) {
+        if (referenced) {
+            std::atomic<uint64_t>& word = referenced[((uint32_t)hash / 64) & (clock_words - 1)];
+            uint64_t bit = 1ULL << (hash % 64);
+            if (!(word.load(std::memory_order_relaxed) & bit)) {
+                word.fetch_or(bit, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void write_begin() {
+        seq.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+    void write_end() {
+        seq.fetch_add(1, std::memory_order_release);
+    }
+};
+
+// A keyspace as its slot in the header plus the slot's generation, so an id
+// kept across a drop finds nothing rather than whatever reuses the slot. The
+// default keyspace, slot 0, is never dropped and its id is always 0.
+typedef uint32_t KeyspaceId;
+
+inline KeyspaceId keyspace_id(uint32_t slot, uint32_t generation) {
+    return generation * MAX_KEYSPACES + slot;
+}
+
+enum KeyspaceState : uint32_t
+{
+    KEYSPACE_FREE,
+    KEYSPACE_LIVE,
+    KEYSPACE_DROPPED,   // keys still being erased before the slot is free
+};
+
+// A named, independent set of keys with stripes of its own. The stripes are
+// created along with the slot and kept when the keyspace is dropped, for the
+// next keyspace in the slot, so a pointer to them never dangles. Dropping
+// only marks the slot; its keys are erased a batch at a time afterwards.
+//
+// A non-zero quota caps the bytes the keyspace's keys, values and index
+// entries take. A write that would go over it evicts from the keyspace if
+// the store evicts, and otherwise fails as if the segment were full. Other
+// keyspaces are never evicted from on its behalf.
+struct Keyspace
+{
+    std::atomic<uint32_t> state;        // KeyspaceState
+    std::atomic<uint32_t> generation;   // bumped by every drop
+    size_t quota;
+    bip::offset_ptr<Stripe> stripes;
+    char name[KEYSPACE_NAME_MAX + 1];
+
+    Keyspace() : state(KEYSPACE_FREE), generation(0), quota(0), stripes(nullptr) {
+        name[0] = '\0';
+    }
+};
+
+// Lives at the start of the segment. `size` is the current size of the
+// segment, so processes that mapped an older, smaller size know to remap.
+struct StoreHeader
+{
+    uint64_t magic;             // STORE_MAGIC
+    std::atomic<size_t> size;
+    IndexType index;
+    uint32_t stripe_count;      // a power of two, in every keyspace
+    uint32_t clock_words;       // of every stripe
+    unsigned evict_water;
+    std::atomic<uint64_t> evictions;
+    std::atomic<uint64_t> expirations;
+    // Sequence number of the last logged change, and the log file changes
+    // are currently written to
+    std::atomic<uint64_t> log_seq;
+    std::atomic<uint64_t> log_generation;
+    // Creating and dropping keyspaces, and anything that has to lock every
+    // stripe, hold this first
+    RobustMutex keyspace_lock;
+    std::atomic<uint32_t> dropped;      // keyspaces in KEYSPACE_DROPPED
+    // Set while grow() extends the allocator, which takes no lock of its own
+    // for it
+    std::atomic<uint32_t> growing;
+    Keyspace keyspaces[MAX_KEYSPACES];
+
+    StoreHeader(size_t size, IndexType index, uint32_t stripe_count, uint32_t clock_words, unsigned evict_water)
+        : magic(STORE_MAGIC), size(size), index(index), stripe_count(stripe_count), clock_words(clock_words), evict_water(evict_water)
+        , evictions(0), expirations(0), log_seq(0), log_generation(1), dropped(0), growing(0) {}
+};
+
+// The keys of the store, copied for a snapshot one stripe at a time. The
+// stripes are copied at different moments, but every change after `seq` is
+// in the log from `generation` on, and replaying it over the copy brings
+// every key to the same point, since a logged change carries the key's whole
+// value.
+struct SegmentImage
+{
+    struct KeyspaceImage
+    {
+        uint32_t slot;
+        std::string name;
+        uint64_t quota;
+    };
+
+    size_t size;
+    size_t used;
+    uint32_t stripe_count;
+    IndexType index;
+    unsigned evict_water;
+    uint64_t seq;               // last logged change before the copy
+    uint64_t generation;        // first log file not included
+    std::vector<KeyspaceImage> keyspaces;   // live ones but the default
+    // Per entry: u32 slot, u32 key length, u32 item length, key, item
+    std::string entries;
+
+    void add(uint32_t slot, boost::string_view key, boost::string_view item) {
+        uint32_t header[3] = {slot, (uint32_t)key.size(), (uint32_t)item.size()};
+        entries.append((const char*)header, sizeof(header));
+        entries.append(key.data(), key.size());
+        entries.append(item.data(), item.size());
+    }
+
+    // Calls f(slot, key, item) for every entry copied
+    template <class F> void for_each(F f) const {
+        const char* pos = entries.data();
+        const char* end = pos + entries.size();
+        while (pos < end) {
+            uint32_t header[3];
+            memcpy(header, pos, sizeof(header));
+            pos += sizeof(header);
+            f(header[0], boost::string_view(pos, header[1]), boost::string_view(pos + header[1], header[2]));
+            pos += header[1] + header[2];
+        }
+    }
+};
+
+struct KeyspaceStats
+{
+    std::string name;
+    size_t keys;
+    size_t used;            // bytes of keys, values and index entries
+    size_t quota;
+};
+
+struct StoreStats
+{
+    size_t size;
+    size_t free;
+    size_t keys;            // including expired keys that are not erased yet
+    size_t timers;          // pending expiry timers, some of them stale
+    size_t filter_bytes;    // of the stripes' Bloom filters
+    uint64_t evictions;
+    uint64_t expirations;
+    uint64_t lock_recoveries;   // stripe locks freed from dead processes
+    uint64_t repairs;           // stripes rebuilt after a writer died
+    uint64_t lost;              // entries left out by those rebuilds
+    SlabStats slab;
+    std::vector<KeyspaceStats> keyspaces;   // but the default keyspace
+};
+
+// Keys from `start` up to but not including `end`, in byte order. An empty
+// end is no bound. Clearing `inclusive` leaves out `start` itself, which is
+// how a scan resumes after the last key it returned.
+struct KeyRange
+{
+    std::string start;
+    std::string end;
+    bool inclusive = true;
+    // Kept by a hash index scan between chunks: the keys in range it took
+    // on its first chunk, in order, and the next one to return. Only used
+    // while `start` is the last key returned before `next`.
+    std::vector<std::string> pending;
+    size_t next = 0;
+};
+
+// Outcome of an in-place update of a value
+enum UpdateStatus
+{
+    UPDATE_OK,
+    UPDATE_NOT_FOUND,
+    UPDATE_WRONG_TYPE,      // the key holds a value that is not an integer
+    UPDATE_MISMATCH,        // compare_and_swap() found a different value
+    UPDATE_OVERFLOW,        // the result does not fit in an int64_t
+    UPDATE_FULL,            // the update did not fit in the segment
+    UPDATE_NO_KEYSPACE,     // the keyspace has been dropped
+};
+
+// One change of an atomic batch; see SharedKeyValueStore::apply()
+struct BatchOp
+{
+    std::string key;
+    std::string value;      // the item to store, unless `remove` is set
+    bool remove;
+    bool found;             // set by apply(): whether the key existed
+};
+
+// Outcome of SharedKeyValueStore::check()
+struct CheckReport
+{
+    size_t stripes;         // checked
+    size_t keys;            // in them afterwards
+    size_t repaired;        // stripes rebuilt
+    size_t lost;            // entries left out by the rebuilds
+    // Stripes left torn, for want of memory or because the allocator was
+    // torn, and whether a process died inside the allocator. Only
+    // rebuild_segment() fixes either.
+    size_t failed;
+    bool allocator_torn;
+};
+
+// Thrown by writes to a keyspace that has been dropped
+class NoSuchKeyspace : public std::runtime_error
+{
+public:
+    NoSuchKeyspace() : std::runtime_error("Keyspace not found") {}
+};
+
+class SharedKeyValueStore
+{
+public:
+    SharedKeyValueStore(const char* segmentName, const StoreOptions& options = StoreOptions());
+
+    // Every key lives in a keyspace. Reads of a keyspace that has been
+    // dropped find nothing; writes throw NoSuchKeyspace.
+
+    // Creates an empty keyspace with a quota in bytes, 0 for none. Returns
+    // false if the name is taken or invalid, or every slot is in use. Throws
+    // bip::bad_alloc if its stripes do not fit even at max_size.
+    bool create_keyspace(boost::string_view name, size_t quota, KeyspaceId* id);
+    // Returns false if no live keyspace has the name
+    bool find_keyspace(boost::string_view name, KeyspaceId* id);
+    // Makes the keyspace unreachable at once, however many keys it holds;
+    // they are erased later by expire_due(). Returns false if it was dropped
+    // already or is the default keyspace.
+    bool drop_keyspace(KeyspaceId id);
+    // Erases up to `limit` keys of dropped keyspaces and frees the slots of
+    // those left empty. Returns the number of keys erased.
+    size_t reclaim_dropped(size_t limit);
+    // For rebuilding a store: creates a keyspace in the given slot, dropping
+    // and erasing whatever keyspace had it first. Returns false like
+    // create_keyspace().
+    bool restore_keyspace(uint32_t slot, boost::string_view name, size_t quota, KeyspaceId* id);
+    // The id of the live keyspace in a slot. Returns false if there is none.
+    bool keyspace_at(uint32_t slot, KeyspaceId* id);
+    // Also copies out its name and quota
+    bool keyspace_at(uint32_t slot, KeyspaceId* id, std::string* name, size_t* quota);
+
+    // Throws bip::bad_alloc if the value does not fit even at max_size, or
+    // in the keyspace's quota. A non-zero ttl_ms makes the key expire that
+    // many milliseconds from now; otherwise the key never expires, even if
+    // it had a TTL before.
+    void store(KeyspaceId keyspace, boost::string_view key, boost::string_view value, uint64_t ttl_ms = 0);
+    // Copies the key's item into *value. Returns false if the key does not
+    // exist.
+    bool retrieve(KeyspaceId keyspace, boost::string_view key, std::string* value);
+    // Copies the key's value as stored, TTL included, for restore() in
+    // another store. Returns false if the key does not exist.
+    bool retrieve_stored(KeyspaceId keyspace, boost::string_view key, std::string* stored);
+    bool remove(KeyspaceId keyspace, boost::string_view key);
+    // Applies every store and removal of the batch, in order, or throws like
+    // store() having applied none. The stripes of all the keys are locked
+    // for writing together, so no reader sees the batch half applied.
+    void apply(KeyspaceId keyspace, std::vector<BatchOp>& batch);
+
+    // Calls f with a view of the key's item in the segment itself, with the
+    // stripe locked shared so no writer can change or free it meanwhile.
+    // Nothing is copied. f must be brief and must not use the store. Returns
+    // false if the key does not exist.
+    template <class F> bool view(KeyspaceId keyspace, boost::string_view key, F f);
+
+    // Copies the first `limit` live keys in range and their items into
+    // *entries, in key order. With a tree index the stripes are merged in
+    // order. A hash index is swept whole, one stripe at a time, on the first
+    // chunk of a scan, and later chunks read on through the keys it found,
+    // so a scan misses the keys added after it began and is not a snapshot
+    // of the whole store.
+    size_t scan(KeyspaceId keyspace, KeyRange* range, size_t limit, std::vector<ScanEntry>* entries);
+
+    // Sets the TTL of an existing key, or removes it if ttl_ms is 0. Returns
+    // false if the key does not exist. Throws bip::bad_alloc like store().
+    bool expire(KeyspaceId keyspace, boost::string_view key, uint64_t ttl_ms);
+    // Erases every key whose TTL has run out, and a batch of the keys of
+    // dropped keyspaces. Writers also expire keys in the stripe they write
+    // to, so it only needs calling now and then.
+    void expire_due();
+
+    // Stores a value exactly as another store held it, TTL included. Used to
+    // rebuild a store from a snapshot or log; an expired value deletes the key.
+    void restore(KeyspaceId keyspace, boost::string_view key, boost::string_view stored_value);
+
+    // Logs every change from now on, continuing after change `seq` in log
+    // file `generation`.
+    void open_log(const std::string& dir, Durability durability, uint64_t seq, uint64_t generation);
+    // Writes out the changes logged so far; see WriteLog::commit().
+    bool commit_log();
+    bool log_pending();
+    size_t log_size();
+    std::string log_directory();
+
+    // Copies the keys for a snapshot and starts a new log file. Writers only
+    // wait while their stripe is copied.
+    void capture(SegmentImage* image);
+
+    // Integer values are updated in place under the stripe lock, so
+    // concurrent updates from any process are never lost.
+    // Adds delta to the integer at key, creating it at 0 first if the key is
+    // missing. *result is the new value. Throws bip::bad_alloc like store().
+    UpdateStatus increment(KeyspaceId keyspace, boost::string_view key, int64_t delta, int64_t* result);
+    // Sets the integer at key to desired if it is currently expected. *current
+    // is the value after the call, whether or not it was swapped.
+    UpdateStatus compare_and_swap(KeyspaceId keyspace, boost::string_view key, int64_t expected, int64_t desired, int64_t* current);
+
+    size_t size();
+    size_t free_memory();
+    StoreStats stats();
+
+    // Checks every stripe and the keyspace table, and rebuilds whatever a
+    // process that died in the middle of a change left inconsistent. Stripes
+    // are locked one at a time, so requests carry on meanwhile. Nothing is
+    // rebuilt if the allocator itself may be torn.
+    CheckReport check();
+    // Whether a process died while changing the segment allocator, whose
+    // state then cannot be trusted; see rebuild_segment()
+    bool allocator_torn();
+    // The last change logged, and the log file it went to
+    void log_position(uint64_t* seq, uint64_t* generation);
+    // Creates segment `target` laid out as this store, with the sound keys
+    // of its live keyspaces and its log position; see rebuild_segment().
+    // Takes no locks. Returns the number of entries left out.
+    size_t salvage_into(const char* target, const StoreOptions& options);
+
+private:
+    struct Mapping
+    {
+        ManagedSegment segment;
+        StoreHeader* header;
+        // get_size() reads the shared segment manager and so already reports
+        // a grown size before this process has remapped
+        size_t mapped_size;
+
+        Mapping(const char* name);
+        Mapping(const char* name, const StoreOptions& options);
+
+        Keyspace& keyspace(KeyspaceId id) {
+            return header->keyspaces[id % MAX_KEYSPACES];
+        }
+        // The keyspace's stripes, or null if it has been dropped. Only
+        // certain while one of them is locked, since dropping locks them all.
+        Stripe* stripes(KeyspaceId id) {
+            Keyspace& ks = keyspace(id);
+            if (ks.state.load(std::memory_order_acquire) != KEYSPACE_LIVE
+                || ks.generation.load(std::memory_order_relaxed) != id / MAX_KEYSPACES) {
+                return nullptr;
+            }
+            return ks.stripes.get();
+        }
+        Stripe* stripe(KeyspaceId id, uint64_t hash) {
+            Stripe* all = stripes(id);
+            return all ? &all[(hash >> 32) & (header->stripe_count - 1)] : nullptr;
+        }
+        // Calls f(stripe) for every stripe ever created, whether its
+        // keyspace is live, dropped or freed. Hold keyspace_lock so that no
+        // stripes are added meanwhile.
+        template <class F> void for_each_stripe(F f) {
+            for (uint32_t slot = 0; slot < MAX_KEYSPACES; ++slot) {
+                Stripe* all = header->keyspaces[slot].stripes.get();
+                for (uint32_t i = 0; all && i < header->stripe_count; ++i) {
+                    f(all[i]);
+                }
+            }
+        }
+    };
+
+    // Locked and unlocked by lock_stripe() and lock_stripe_sharable(). Given
+    // std::nothrow, they hold nothing and test false instead of throwing
+    // bip::bad_alloc when a torn stripe cannot be rebuilt for want of room.
+    struct StripeLock
+    {
+        StripeLock(SharedKeyValueStore* store, Stripe* stripe) : stripe(stripe) { store->lock_stripe(*stripe); }
+        StripeLock(SharedKeyValueStore* store, Stripe* stripe, const std::nothrow_t&) : stripe(stripe) {
+            try {
+                store->lock_stripe(*stripe);
+            }
+            catch (bip::bad_alloc &) {
+                this->stripe = nullptr;
+            }
+        }
+        ~StripeLock() { if (stripe) stripe->lock.unlock(); }
+        explicit operator bool() const { return stripe; }
+        Stripe* stripe;
+    };
+    struct SharableStripeLock
+    {
+        SharableStripeLock(SharedKeyValueStore* store, Stripe* stripe) : stripe(stripe) { store->lock_stripe_sharable(*stripe); }
+        SharableStripeLock(SharedKeyValueStore* store, Stripe* stripe, const std::nothrow_t&) : stripe(stripe) {
+            try {
+                store->lock_stripe_sharable(*stripe);
+            }
+            catch (bip::bad_alloc &) {
+                this->stripe = nullptr;
+            }
+        }
+        ~SharableStripeLock() { if (stripe) stripe->lock.unlock_sharable(); }
+        explicit operator bool() const { return stripe; }
+        Stripe* stripe;
+    };
+    friend struct BatchLocks;
+
+    SharedKeyValueStore(const SharedKeyValueStore&);
+    SharedKeyValueStore& operator=(const SharedKeyValueStore&);
+
+    Mapping* current();
+    // The stripe as seen through the current mapping, whichever mapping it
+    // was reached through
+    Stripe& remap(Stripe& stripe);
+    SegmentBounds bounds(Mapping* mapping, Stripe& stripe);
+    // Lock a stripe as its lock would, but rebuild it first if a writer died
+    // in the middle of changing it, so no one works on a torn index
+    void lock_stripe(Stripe& stripe);
+    void lock_stripe_sharable(Stripe& stripe);
+    // Rebuilds a stripe locked for writing. Returns the entries left out.
+    size_t repair(Mapping* mapping, Stripe& stripe);
+    // The keyspace's stripes, or one of them, through a mapping that covers
+    // them, or null if the keyspace has been dropped
+    Stripe* live_stripes(KeyspaceId keyspace);
+    Stripe* live_stripe(KeyspaceId keyspace, uint64_t hash);
+    bool needs_growth(Mapping* mapping, size_t needed);
+    bool over_evict_water(Mapping* mapping, size_t needed);
+    bool over_quota(Mapping* mapping, KeyspaceId keyspace, size_t needed);
+    void add_timer(Stripe& stripe, boost::string_view key, uint64_t expires);
+    void log_set(KeyspaceId keyspace, boost::string_view key, boost::string_view value);
+    void log_del(KeyspaceId keyspace, boost::string_view key);
+    void log_batch(KeyspaceId keyspace, const std::vector<BatchOp>& batch);
+    void evict(Mapping* mapping, KeyspaceId keyspace, Stripe& stripe, size_t needed, uint64_t now, bool force, bool* evicted);
+    bool grow(size_t seen_size, size_t needed);
+    // Runs op on the key's stripe with the stripe locked for writing, growing
+    // the segment first if it is running out of room for `needed` bytes
+    template <class Op>
+    auto write(KeyspaceId keyspace, uint64_t hash, size_t needed, Op op) -> decltype(op(std::declval<Stripe&>()));
+    bool create_in(uint32_t slot, boost::string_view name, size_t quota, KeyspaceId* id);
+    bool free_dropped(uint32_t slot);
+    void log_keyspace(uint32_t slot, boost::string_view name, size_t quota, bool drop);
+    size_t scan_tree(KeyspaceId keyspace, const KeyRange& range, size_t limit, std::vector<ScanEntry>* entries);
+    bool retrieve_optimistic(KeyspaceId keyspace, boost::string_view key, uint64_t hash, std::string* value, bool* found);
+
+    std::string name;
+    StoreOptions options;
+
+    // Mappings of smaller, older sizes are kept until the store is destroyed:
+    // other threads may still be reading through them.
+    std::mutex remap_lock;
+    std::vector<std::unique_ptr<Mapping>> mappings;
+    std::atomic<Mapping*> active;
+
+    std::unique_ptr<WriteLog> log;
+};
+
+// Points *item past the expiry header of a stored value. Returns false if
+// the value has expired.
+bool live_item(boost::string_view stored, boost::string_view* item);
 
-void initialize();
-void store_value(std::string key, std::string value);
-std::string load_string_value(std::string key);
-void remove_value(std::string key);
+template <class F>
+bool SharedKeyValueStore::view(KeyspaceId keyspace, boost::string_view key, F f) {
+    uint64_t hash = hash_key(key);
+    Stripe* stripe = live_stripe(keyspace, hash);
+    if (!stripe) {
+        return false;
+    }
+    SharableStripeLock lock(this, stripe);
+    stripe = live_stripe(keyspace, hash);
+    Entry* entry = stripe ? stripe->find(key, hash) : nullptr;
+    boost::string_view item;
+    if (!entry || !live_item(to_view(entry->second), &item)) {
+        return false;
+    }
+    stripe->touch(hash);
+    f(item);
+    return true;
+}
 
+// Opens the server's store: keeps and checks the segment an earlier run left,
+// if any, or else rebuilds it from disk. Returns false, touching nothing, if
+// another server is running on the same segments; init_metrics() and
+// init_watch() must only be called after it succeeds.
+bool initialize();
+SharedKeyValueStore& shared_store();
+// SharedKeyValueStore::check() of the server's store
+CheckReport check_store();
+// Copies the sound keys of segment `name` into a new segment of that name,
+// which leaves behind everything a crash tore, the allocator included, and
+// the memory stripe rebuilds abandoned. Keyspaces keep their slots, and the
+// log its position. No other process may be using the segment. Returns the
+// number of entries left out.
+size_t rebuild_segment(const char* name, const StoreOptions& options);
+// Namespaces are the protocols' name for keyspaces. find_namespace() also
+// finds DEFAULT_KEYSPACE_NAME. create_namespace() returns false if the
+// keyspace could not be created, for whatever reason.
+bool find_namespace(boost::string_view name, KeyspaceId* keyspace);
+bool create_namespace(boost::string_view name, size_t quota);
+bool drop_namespace(boost::string_view name);
+UpdateStatus store_value(KeyspaceId keyspace, boost::string_view key, boost::string_view value);
+UpdateStatus expire_value(KeyspaceId keyspace, boost::string_view key, uint64_t ttl_ms);
+void expire_values();
+bool commit_values();
+// True while this process has changes that commit_values() has not written
+bool commit_pending();
+void snapshot_values();
+StoreStats store_stats();
+UpdateStatus store_int_value(KeyspaceId keyspace, boost::string_view key, int64_t value);
+// Reads, removals and scans never throw. A stripe a crashed writer tore is
+// rebuilt before it is read; if the segment has no room for that, its keys
+// read as missing until a writer grows the segment and rebuilds it.
+std::string load_string_value(KeyspaceId keyspace, boost::string_view key);
+bool load_string_value(KeyspaceId keyspace, boost::string_view key, std::string* value);
+// Points *value at the payload of a string item, decompressing it into
+// *scratch if it is stored compressed. Returns false if the item holds
+// something else.
+bool string_item_value(boost::string_view item, boost::string_view* value, std::string* scratch);
+// Whether string_item_value() would have to decompress the item
+bool compressed_item(boost::string_view item);
+bool int_item_value(boost::string_view item, int64_t* value);
+// Calls f with a view of the string at key, under the read lock of
+// SharedKeyValueStore::view(). A compressed string is copied out instead and
+// f sees it decompressed, after the lock is released. Returns false if the
+// key holds no string.
+template <class F>
+bool view_string_value(KeyspaceId keyspace, boost::string_view key, F f)
+{
+    bool found = false;
+    std::string compressed, scratch;
+    try {
+        shared_store().view(keyspace, key, [&](boost::string_view item) {
+            boost::string_view value;
+            if (compressed_item(item)) {
+                compressed.assign(item.data(), item.size());
+            }
+            else if (string_item_value(item, &value, &scratch)) {
+                found = true;
+                f(value);
+            }
+        });
+    }
+    catch (bip::bad_alloc &) {
+        // The key's stripe is torn, with no room to rebuild it; a miss
+        return false;
+    }
+    boost::string_view value;
+    if (!compressed.empty() && string_item_value(compressed, &value, &scratch)) {
+        found = true;
+        f(value);
+    }
+    return found;
+}
+bool load_int_value(KeyspaceId keyspace, boost::string_view key, int64_t* value);
+bool remove_value(KeyspaceId keyspace, boost::string_view key);
+// Atomic batches: queue changes with batch_store(), batch_store_int() and
+// batch_remove(), then apply them all or none with apply_batch(). After
+// UPDATE_OK, each removal's `found` tells whether the key existed.
+void batch_store(std::vector<BatchOp>* batch, boost::string_view key, boost::string_view value);
+void batch_store_int(std::vector<BatchOp>* batch, boost::string_view key, int64_t value);
+void batch_remove(std::vector<BatchOp>* batch, boost::string_view key);
+UpdateStatus apply_batch(KeyspaceId keyspace, std::vector<BatchOp>* batch);
+// The stored form of a value, and setting it, for replication; restoring
+// returns false if the value does not fit or the keyspace has been dropped.
+bool load_stored_value(KeyspaceId keyspace, boost::string_view key, std::string* stored);
+bool restore_value(KeyspaceId keyspace, boost::string_view key, boost::string_view stored);
+// Namespaces by slot, for replication, which keeps each in the slot it has on
+// the primary. namespace_at() returns false if the slot holds no live
+// namespace; name and quota may both be null. restore_namespace() keeps a live
+// namespace of the same name and quota in the slot, and otherwise replaces
+// whatever namespace had the slot or the name with an empty one.
+bool namespace_at(uint32_t slot, KeyspaceId* keyspace, std::string* name, size_t* quota);
+bool restore_namespace(uint32_t slot, boost::string_view name, size_t quota);
+bool drop_namespace_at(uint32_t slot);
+// Every key that starts with prefix
+KeyRange prefix_range(boost::string_view prefix);
+// Copies the next `limit` entries of *range into *entries and moves the
+// range past them. Returns false once nothing is left after this chunk.
+bool scan_values(KeyspaceId keyspace, KeyRange* range, size_t limit, std::vector<ScanEntry>* entries);
+UpdateStatus incr_value(KeyspaceId keyspace, boost::string_view key, int64_t delta, int64_t* result);
+UpdateStatus cas_value(KeyspaceId keyspace, boost::string_view key, int64_t expected, int64_t desired, int64_t* current);
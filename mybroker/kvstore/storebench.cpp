@@ -0,0 +1,1219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "lz.hpp"
+#include "store.hpp"
+
+// Microbenchmarks for the shared-memory store. They run against their own
+// segment, so they do not disturb a live server.
+#define BENCH_SEGMENT "kvstore_bench"
+#define DEFAULT_OPS 100000
+#define KEY_COUNT 100
+#define STRESS_KEYS 1000
+#define BATCH_KEYS 8
+#define CRASH_KEYS 1000
+// Batches applied to a full store, and the changes in each
+#define FULL_ROUNDS 200
+#define FULL_BATCH 64
+// A crash round runs the workers for up to this long before killing them
+#define CRASH_ROUND_MS 20
+// Time to recover from a round before the run counts as hung
+#define CRASH_TIMEOUT 60
+// Changes per group commit in the persistence benchmark, like one round of
+// the server's event loop
+#define COMMIT_BATCH 32
+// Processes writing while a snapshot is captured
+#define SNAPSHOT_WRITERS 4
+// Size of the large values the codec benchmark compresses
+#define LZ_VALUE_SIZE 65536
+// How much a scan's cost per key may grow from the smallest index benchmark
+// to the largest; one that grows with the key count grows 100x by default
+#define SCAN_GROWTH_LIMIT 4
+
+
+double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+std::vector<std::string> make_keys(size_t count, const char *prefix = "key")
+{
+    std::vector<std::string> keys;
+    char key[32];
+    for (size_t i = 0; i < count; ++i) {
+        snprintf(key, sizeof(key), "%s:%zu", prefix, i);
+        keys.push_back(key);
+    }
+    return keys;
+}
+
+
+void report(const char *name, size_t ops, double start, double end)
+{
+    printf("%-28s %10.1f ns/op %12.0f ops/s\n", name, (end - start) / ops, ops / ((end - start) / 1e9));
+}
+
+
+// Compares opening the segment for every operation, as store_value() and
+// load_string_value() used to, against one handle kept for the whole run.
+void bench_handle(size_t ops)
+{
+    std::vector<std::string> keys = make_keys(KEY_COUNT);
+    const std::string value(32, 'v');
+    double start;
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+
+    start = now_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        SharedKeyValueStore store(BENCH_SEGMENT);
+        store.store(DEFAULT_KEYSPACE, keys[i % KEY_COUNT], value);
+    }
+    report("store, open per op", ops, start, now_ns());
+
+    start = now_ns();
+    std::string item;
+    for (size_t i = 0; i < ops; ++i) {
+        SharedKeyValueStore store(BENCH_SEGMENT);
+        store.retrieve(DEFAULT_KEYSPACE, keys[i % KEY_COUNT], &item);
+    }
+    report("retrieve, open per op", ops, start, now_ns());
+
+    SharedKeyValueStore store(BENCH_SEGMENT);
+
+    start = now_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        store.store(DEFAULT_KEYSPACE, keys[i % KEY_COUNT], value);
+    }
+    report("store, shared handle", ops, start, now_ns());
+
+    start = now_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        store.retrieve(DEFAULT_KEYSPACE, keys[i % KEY_COUNT], &item);
+    }
+    report("retrieve, shared handle", ops, start, now_ns());
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+}
+
+
+// Inserts `count` keys, then looks each of them up in random order, then
+// looks up as many keys that are not in the store, then scans them all.
+// Returns the scan's time per key in ns, or -1 if it missed any.
+double bench_index(IndexType index, size_t count)
+{
+    std::vector<std::string> keys = make_keys(count);
+    std::vector<std::string> missing = make_keys(count, "missing");
+    std::shuffle(missing.begin(), missing.end(), std::mt19937(1));
+    const std::string value(32, 'v');
+    const char *index_name = index == INDEX_HASH ? "hash" : "tree";
+    char name[64];
+    double start, end;
+    double scan_ns = -1;
+
+    // Size the segment up front so growing it is not part of the timing
+    StoreOptions options;
+    options.initial_size = count * 256 + (1 << 20);
+    options.max_size = options.initial_size * 4;
+    options.index = index;
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    {
+        SharedKeyValueStore store(BENCH_SEGMENT, options);
+
+        start = now_ns();
+        for (size_t i = 0; i < count; ++i) {
+            store.store(DEFAULT_KEYSPACE, keys[i], value);
+        }
+        snprintf(name, sizeof(name), "%s %zuk insert", index_name, count / 1000);
+        report(name, count, start, now_ns());
+
+        std::shuffle(keys.begin(), keys.end(), std::mt19937(2));
+        start = now_ns();
+        std::string item;
+        for (size_t i = 0; i < count; ++i) {
+            store.retrieve(DEFAULT_KEYSPACE, keys[i], &item);
+        }
+        snprintf(name, sizeof(name), "%s %zuk hit", index_name, count / 1000);
+        report(name, count, start, now_ns());
+
+        start = now_ns();
+        for (size_t i = 0; i < count; ++i) {
+            store.retrieve(DEFAULT_KEYSPACE, missing[i], &item);
+        }
+        snprintf(name, sizeof(name), "%s %zuk miss", index_name, count / 1000);
+        report(name, count, start, now_ns());
+
+        // Ordered scan of every key, in the server's chunks
+        KeyRange range;
+        std::vector<ScanEntry> entries;
+        size_t scanned = 0;
+        start = now_ns();
+        for (bool more = true; more; ) {
+            more = store.scan(DEFAULT_KEYSPACE, &range, 64, &entries) == 64;
+            scanned += entries.size();
+            if (more) {
+                range.start = entries.back().first;
+                range.inclusive = false;
+            }
+        }
+        end = now_ns();
+        snprintf(name, sizeof(name), "%s %zuk scan", index_name, count / 1000);
+        report(name, scanned, start, end);
+        if (scanned == count) {
+            scan_ns = (end - start) / count;
+        }
+        else {
+            printf("%s scan returned %zu of %zu keys\n", index_name, scanned, count);
+        }
+    }
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    return scan_ns;
+}
+
+
+// Reads values of each size by copying them out of the segment, as
+// retrieve() does, and by viewing them in place, as the server's load path
+// does.
+void bench_read(const std::vector<size_t> &sizes, size_t ops)
+{
+    std::vector<std::string> keys = make_keys(KEY_COUNT);
+    char name[64];
+    double start;
+
+    for (size_t size : sizes) {
+        StoreOptions options;
+        options.initial_size = KEY_COUNT * (size + 256) * 2 + (1 << 20);
+        options.max_size = options.initial_size;
+
+        bip::shared_memory_object::remove(BENCH_SEGMENT);
+        {
+            SharedKeyValueStore store(BENCH_SEGMENT, options);
+            const std::string value(size, 'v');
+            for (const std::string &key : keys) {
+                store.store(DEFAULT_KEYSPACE, key, value);
+            }
+
+            size_t total = 0;
+            std::string item;
+            start = now_ns();
+            for (size_t i = 0; i < ops; ++i) {
+                store.retrieve(DEFAULT_KEYSPACE, keys[i % KEY_COUNT], &item);
+                total += item.size();
+            }
+            snprintf(name, sizeof(name), "retrieve %zuB", size);
+            report(name, ops, start, now_ns());
+
+            start = now_ns();
+            for (size_t i = 0; i < ops; ++i) {
+                store.view(DEFAULT_KEYSPACE, keys[i % KEY_COUNT], [&total](boost::string_view item) {
+                    total += item.size();
+                });
+            }
+            snprintf(name, sizeof(name), "view %zuB", size);
+            report(name, ops, start, now_ns());
+
+            if (total == 0) {
+                printf("nothing read\n");
+            }
+        }
+        bip::shared_memory_object::remove(BENCH_SEGMENT);
+    }
+}
+
+
+// Fills a fixed-size segment with small keys of mixed value sizes until it
+// is full, then frees every other key and refills it, which is where
+// fragmentation shows. Reports how much of the segment ends up holding keys
+// and values.
+int bench_fill(size_t segment_size)
+{
+    StoreOptions options;
+    options.initial_size = segment_size;
+    options.max_size = segment_size;
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    SharedKeyValueStore store(BENCH_SEGMENT, options);
+    std::mt19937 rng(3);
+    std::vector<std::string> keys;
+    size_t payload = 0;
+    char key[32];
+
+    auto fill = [&](const char *prefix, size_t min_value, size_t max_value) {
+        std::uniform_int_distribution<size_t> value_size(min_value, max_value);
+        for (size_t i = 0; ; ++i) {
+            snprintf(key, sizeof(key), "%s:%zu", prefix, i);
+            std::string value(value_size(rng), 'v');
+            try {
+                store.store(DEFAULT_KEYSPACE, key, value);
+            }
+            catch (bip::bad_alloc &) {
+                return;
+            }
+            keys.push_back(key);
+            payload += strlen(key) + value.size();
+        }
+    };
+
+    auto report_fill = [&](const char *name) {
+        StoreStats stats = store.stats();
+        printf("%-28s %10zu keys %9.1f%% of the segment is payload, %zu bytes free, %zu in slabs\n", name, keys.size(),
+               100.0 * payload / segment_size, stats.free, stats.slab.slab_free);
+    };
+
+    fill("small", 8, 64);
+    report_fill("fill");
+
+    std::vector<std::string> kept;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (i % 2 == 0) {
+            kept.push_back(keys[i]);
+            continue;
+        }
+        std::string value;
+        store.retrieve(DEFAULT_KEYSPACE, keys[i], &value);
+        payload -= keys[i].size() + value.size() - 1;
+        store.remove(DEFAULT_KEYSPACE, keys[i]);
+    }
+    keys.swap(kept);
+
+    fill("refill", 8, 64);
+    report_fill("free half, refill");
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    return 0;
+}
+
+
+char checksum(const char *data, size_t size)
+{
+    unsigned sum = 0;
+    for (size_t i = 0; i < size; ++i) {
+        sum += (unsigned char)data[i];
+    }
+    return 'a' + sum % 26;
+}
+
+
+// Values carry their key and a checksum, so a reader can tell a torn or
+// misplaced value from one that some other writer legitimately stored.
+std::string stress_value(const std::string &key, unsigned writer, size_t iteration, size_t padding)
+{
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "|%u|%zu|", writer, iteration);
+    std::string value = key + prefix + std::string(padding, 'a' + iteration % 26);
+    value.push_back(checksum(value.data(), value.size()));
+    return value;
+}
+
+
+bool stress_value_ok(const std::string &key, const std::string &value)
+{
+    return value.size() > key.size() + 1
+        && value.compare(0, key.size(), key) == 0
+        && value[key.size()] == '|'
+        && value.back() == checksum(value.data(), value.size() - 1);
+}
+
+
+// One stress worker: random reads and writes over a small shared keyspace.
+// Returns the number of corrupt values it read.
+size_t stress_worker(const StoreOptions &options, unsigned writer, size_t ops)
+{
+    SharedKeyValueStore store(BENCH_SEGMENT, options);
+    std::vector<std::string> keys = make_keys(STRESS_KEYS, "stress");
+    std::mt19937 rng(writer);
+    size_t errors = 0;
+
+    for (size_t i = 0; i < ops; ++i) {
+        const std::string &key = keys[rng() % keys.size()];
+        if (rng() % 2) {
+            store.store(DEFAULT_KEYSPACE, key, stress_value(key, writer, i, rng() % 300));
+            continue;
+        }
+        // A key not written yet is fine
+        std::string item;
+        if (store.retrieve(DEFAULT_KEYSPACE, key, &item) && !stress_value_ok(key, item)) {
+            ++errors;
+        }
+    }
+    return errors;
+}
+
+
+// Forks `procs` workers that hammer one segment concurrently, starting small
+// enough that it has to grow while they run, then checks every key.
+int bench_stress(IndexType index, unsigned procs, size_t ops)
+{
+    StoreOptions options;
+    options.index = index;
+    options.max_size = 256 << 20;
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    SharedKeyValueStore store(BENCH_SEGMENT, options);
+
+    double start = now_ns();
+    for (unsigned p = 0; p < procs; ++p) {
+        if (fork() == 0) {
+            _exit(stress_worker(options, p, ops) == 0 ? 0 : 1);
+        }
+    }
+
+    size_t failed = 0;
+    int status;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            ++failed;
+        }
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "%s stress, %u procs", index == INDEX_HASH ? "hash" : "tree", procs);
+    report(name, procs * ops, start, now_ns());
+
+    size_t corrupt = 0;
+    for (const std::string &key : make_keys(STRESS_KEYS, "stress")) {
+        std::string item;
+        if (store.retrieve(DEFAULT_KEYSPACE, key, &item) && !stress_value_ok(key, item)) {
+            ++corrupt;
+        }
+    }
+    printf("%u of %u workers failed, %zu corrupt keys, segment grew to %zu bytes\n",
+           (unsigned)failed, procs, corrupt, store.size());
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    return failed == 0 && corrupt == 0 ? 0 : 1;
+}
+
+
+// Forks `procs` workers that all increment the same counters, then checks
+// that no increment was lost.
+int bench_counter(unsigned procs, size_t ops)
+{
+    std::vector<std::string> keys = make_keys(KEY_COUNT, "counter");
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    SharedKeyValueStore store(BENCH_SEGMENT);
+
+    double start = now_ns();
+    for (unsigned p = 0; p < procs; ++p) {
+        if (fork() == 0) {
+            SharedKeyValueStore worker_store(BENCH_SEGMENT);
+            int64_t result;
+            for (size_t i = 0; i < ops; ++i) {
+                worker_store.increment(DEFAULT_KEYSPACE, keys[i % KEY_COUNT], 1, &result);
+            }
+            _exit(0);
+        }
+    }
+    int status;
+    while (wait(&status) > 0) {
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "increment, %u procs", procs);
+    report(name, procs * ops, start, now_ns());
+
+    int64_t total = 0;
+    for (const std::string &key : keys) {
+        int64_t value;
+        if (store.increment(DEFAULT_KEYSPACE, key, 0, &value) == UPDATE_OK) {
+            total += value;
+        }
+    }
+    printf("%lld of %zu increments counted\n", (long long)total, procs * ops);
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    return total == (int64_t)(procs * ops) ? 0 : 1;
+}
+
+
+// Forks `procs` workers that store batches setting every key of a group to
+// the same value, and one more that scans the group meanwhile. A scan of a
+// tree index sees all stripes at one instant, so it must never find the
+// keys holding different values.
+int bench_batch(unsigned procs, size_t ops)
+{
+    std::vector<std::string> keys = make_keys(BATCH_KEYS, "batch");
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    StoreOptions options;
+    options.index = INDEX_TREE;
+    SharedKeyValueStore store(BENCH_SEGMENT, options);
+
+    double start = now_ns();
+    for (unsigned p = 0; p < procs; ++p) {
+        if (fork() == 0) {
+            SharedKeyValueStore worker_store(BENCH_SEGMENT);
+            std::vector<BatchOp> batch;
+            char value[32];
+            for (size_t i = 0; i < ops; ++i) {
+                snprintf(value, sizeof(value), "%u:%zu", p, i);
+                batch.clear();
+                for (const std::string &key : keys) {
+                    batch_store(&batch, key, value);
+                }
+                worker_store.apply(DEFAULT_KEYSPACE, batch);
+            }
+            _exit(0);
+        }
+    }
+    pid_t reader = fork();
+    if (reader == 0) {
+        SharedKeyValueStore reader_store(BENCH_SEGMENT);
+        KeyRange range = prefix_range("batch:");
+        std::vector<ScanEntry> entries;
+        size_t torn = 0;
+        for (size_t i = 0; i < ops; ++i) {
+            reader_store.scan(DEFAULT_KEYSPACE, &range, BATCH_KEYS, &entries);
+            for (const ScanEntry &entry : entries) {
+                if (entry.second != entries[0].second) {
+                    ++torn;
+                    break;
+                }
+            }
+        }
+        printf("%zu of %zu scans saw a batch half applied\n", torn, ops);
+        fflush(stdout);
+        _exit(torn == 0 ? 0 : 1);
+    }
+    int status;
+    int failed = 0;
+    pid_t pid;
+    while ((pid = wait(&status)) > 0) {
+        if (pid == reader && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+            failed = 1;
+        }
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "batch of %d, %u procs", BATCH_KEYS, procs);
+    report(name, procs * ops, start, now_ns());
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    return failed;
+}
+
+
+// Applies batches to a full store, with nothing to evict and no room to
+// grow, so that they run out of memory partway: some of their changes fit
+// before one does not. Each must leave every key as it was, and a check
+// must find every stripe sound afterwards.
+int bench_batch_full(IndexType index)
+{
+    StoreOptions options;
+    options.index = index;
+    options.initial_size = 1 << 20;
+    options.max_size = options.initial_size;
+    options.evict_water = 0;
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    SharedKeyValueStore store(BENCH_SEGMENT, options);
+
+    // Values of many size classes, then room for the batches to use up
+    std::mt19937 rng(1);
+    std::set<std::string> keys;
+    try {
+        for (size_t i = 0; ; ++i) {
+            std::string key = "full:" + std::to_string(i);
+            size_t size = rng() % 8 == 0 ? SLAB_MAX_BLOCK + rng() % 8192 : 1 + rng() % 300;
+            store.store(DEFAULT_KEYSPACE, key, std::string(size, 'v'));
+            keys.insert(key);
+        }
+    }
+    catch (bip::bad_alloc &) {
+    }
+    size_t n = 0;
+    for (const std::string &key : keys) {
+        if (n++ % 8 == 0) {
+            store.remove(DEFAULT_KEYSPACE, key);
+        }
+    }
+
+    size_t failed = 0, changed = 0;
+    double start = now_ns();
+    for (unsigned round = 0; round < FULL_ROUNDS; ++round) {
+        std::vector<BatchOp> batch;
+        for (unsigned i = 0; i < FULL_BATCH; ++i) {
+            std::string key = rng() % 4 == 0 ? "new:" + std::to_string(round) + ":" + std::to_string(i) : "full:" + std::to_string(rng() % keys.size());
+            keys.insert(key);
+            if (rng() % 5 == 0) {
+                batch_remove(&batch, key);
+            }
+            else {
+                // Some too large for a slab, which come from the segment
+                size_t size = rng() % 8 == 0 ? SLAB_MAX_BLOCK + rng() % 8192 : 1 + rng() % 400;
+                batch_store(&batch, key, std::string(size, 'w'));
+            }
+        }
+        // Most batches end in a value larger than the segment
+        if (round % 4 != 0) {
+            batch[FULL_BATCH / 2 + rng() % (FULL_BATCH / 2)].value.assign(2 << 20, 'x');
+        }
+
+        std::map<std::string, std::string> before;
+        for (const std::string &key : keys) {
+            store.retrieve_stored(DEFAULT_KEYSPACE, key, &before[key]);
+        }
+        try {
+            store.apply(DEFAULT_KEYSPACE, batch);
+            continue;
+        }
+        catch (bip::bad_alloc &) {
+            ++failed;
+        }
+        for (const std::string &key : keys) {
+            std::string after;
+            store.retrieve_stored(DEFAULT_KEYSPACE, key, &after);
+            changed += after != before[key];
+        }
+    }
+    CheckReport check = store.check();
+    char name[64];
+    snprintf(name, sizeof(name), "%s batch out of memory", index == INDEX_HASH ? "hash" : "tree");
+    report(name, FULL_ROUNDS, start, now_ns());
+    printf("%zu of %u batches ran out of memory, %zu keys changed by them, %zu stripes left for check\n",
+           failed, FULL_ROUNDS, changed, check.repaired + check.failed);
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    return failed > 0 && changed == 0 && check.repaired + check.failed == 0 ? 0 : 1;
+}
+
+
+// The iteration a crash worker's value was stored in, or -1 if it is not one
+int64_t crash_iteration(const std::string &key, const std::string &item)
+{
+    unsigned writer;
+    long long iteration;
+    if (!stress_value_ok(key, item) || sscanf(item.c_str() + key.size(), "|%u|%lld|", &writer, &iteration) != 2) {
+        return -1;
+    }
+    return iteration;
+}
+
+
+// Each round forks `procs` workers that store over keys of their own, a
+// quarter of them with a TTL, recording every store that returned, and kills
+// them all with SIGKILL a few milliseconds in, mostly in the middle of a
+// store. Reading every key back then rebuilds the stripes they were killed
+// in, or the whole segment if one was killed inside the allocator. Each key
+// must hold the value of its last recorded store, or of the one that was cut
+// short, unless the rebuilds lost it; a check afterwards must find nothing
+// left to rebuild. Every stripe rebuilt was torn by a writer that died with
+// its lock, which must have been recovered; a lock left held would hang the
+// next round.
+int bench_crash(IndexType index, unsigned procs, unsigned rounds)
+{
+    StoreOptions options;
+    options.index = index;
+    options.max_size = 256 << 20;
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    SharedKeyValueStore(BENCH_SEGMENT, options);
+    std::atomic<int64_t> *done = (std::atomic<int64_t> *)mmap(NULL, procs * sizeof(*done), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    for (unsigned p = 0; p < procs; ++p) {
+        done[p].store(-1);
+    }
+    std::vector<std::vector<std::string>> keys;
+    for (unsigned p = 0; p < procs; ++p) {
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "crash%u", p);
+        keys.push_back(make_keys(CRASH_KEYS, prefix));
+    }
+
+    std::mt19937 rng(1);
+    // A worker killed before its first store leaves a key missing for
+    // another round, so keys are counted by the store that was lost
+    std::set<std::pair<unsigned, int64_t>> missing;
+    size_t wrong = 0, lost = 0, unchecked = 0;
+    uint64_t repairs = 0, recoveries = 0, segments = 0;
+    double start = now_ns();
+    for (unsigned round = 0; round < rounds; ++round) {
+        // Taken before the crash: whatever looks at the stripes afterwards,
+        // stats() included, recovers their locks
+        StoreStats before;
+        {
+            SharedKeyValueStore store(BENCH_SEGMENT, options);
+            before = store.stats();
+        }
+        std::vector<pid_t> workers;
+        for (unsigned p = 0; p < procs; ++p) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                SharedKeyValueStore worker_store(BENCH_SEGMENT, options);
+                for (int64_t i = done[p].load() + 1; ; ++i) {
+                    const std::string &key = keys[p][i % CRASH_KEYS];
+                    worker_store.store(DEFAULT_KEYSPACE, key, stress_value(key, p, i, i % 200), i % 4 == 0 ? 3600 * 1000 : 0);
+                    done[p].store(i);
+                }
+            }
+            workers.push_back(pid);
+        }
+        usleep(1000 + rng() % (CRASH_ROUND_MS * 1000));
+        for (pid_t pid : workers) {
+            kill(pid, SIGKILL);
+        }
+        for (pid_t pid : workers) {
+            waitpid(pid, NULL, 0);
+        }
+
+        alarm(CRASH_TIMEOUT);
+        bool allocator_torn;
+        {
+            SharedKeyValueStore store(BENCH_SEGMENT, options);
+            allocator_torn = store.allocator_torn();
+        }
+        if (allocator_torn) {
+            lost += rebuild_segment(BENCH_SEGMENT, options);
+            ++segments;
+            // The new segment counts from zero
+            before = StoreStats();
+        }
+
+        SharedKeyValueStore store(BENCH_SEGMENT, options);
+        for (unsigned p = 0; p < procs; ++p) {
+            int64_t last = done[p].load();
+            for (int64_t k = 0; k < CRASH_KEYS; ++k) {
+                // The last recorded store of the key, and the one cut short
+                int64_t expected = last >= k ? last - (last - k) % CRASH_KEYS : -1;
+                int64_t cut = (last + 1) % CRASH_KEYS == k ? last + 1 : -1;
+                std::string item;
+                if (!store.retrieve(DEFAULT_KEYSPACE, keys[p][k], &item)) {
+                    if (expected >= 0) {
+                        missing.insert(std::make_pair(p, expected));
+                    }
+                    continue;
+                }
+                int64_t iteration = crash_iteration(keys[p][k], item);
+                if (iteration != expected && iteration != cut) {
+                    ++wrong;
+                }
+            }
+        }
+        CheckReport check = store.check();
+        unchecked += check.repaired + check.failed;
+        StoreStats after = store.stats();
+        repairs += after.repairs - before.repairs;
+        recoveries += after.lock_recoveries - before.lock_recoveries;
+        lost += after.lost - before.lost;
+        alarm(0);
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "%s crash, %u procs", index == INDEX_HASH ? "hash" : "tree", procs);
+    int64_t stores = 0;
+    for (unsigned p = 0; p < procs; ++p) {
+        stores += done[p].load() + 1;
+    }
+    report(name, stores, start, now_ns());
+    printf("%u rounds: %llu stripes and %llu segments rebuilt, %llu locks recovered, %zu entries lost; "
+           "%zu keys missing, %zu wrong, %zu stripes left for check\n",
+           rounds, (unsigned long long)repairs, (unsigned long long)segments, (unsigned long long)recoveries, lost,
+           missing.size(), wrong, unchecked);
+
+    munmap(done, procs * sizeof(*done));
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    return missing.size() <= lost && wrong == 0 && unchecked == 0 && recoveries >= repairs ? 0 : 1;
+}
+
+
+// Gives `count` keys a short TTL and checks that the timer wheels erase all
+// of them once it has run out.
+int bench_expire(size_t count)
+{
+    std::vector<std::string> keys = make_keys(count, "ttl");
+    const std::string value(32, 'v');
+
+    StoreOptions options;
+    options.initial_size = count * 512 + (1 << 20);
+    options.max_size = options.initial_size * 4;
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    SharedKeyValueStore store(BENCH_SEGMENT, options);
+
+    double start = now_ns();
+    for (size_t i = 0; i < count; ++i) {
+        store.store(DEFAULT_KEYSPACE, keys[i], value, 100 + i % 200);
+    }
+    report("store with ttl", count, start, now_ns());
+
+    usleep(500 * 1000);
+    start = now_ns();
+    store.expire_due();
+    report("expire", count, start, now_ns());
+
+    StoreStats stats = store.stats();
+    printf("%llu of %zu keys expired, %zu left, %zu timers left\n",
+           (unsigned long long)stats.expirations, count, stats.keys, stats.timers);
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    return stats.expirations == count && stats.keys == 0 ? 0 : 1;
+}
+
+
+// Writes `count` keys into a segment that only holds a fraction of them,
+// reading a small hot set in between like a cache would, storing a hot key
+// again when it misses, and reports how well CLOCK eviction kept the hot set.
+int bench_evict(size_t count)
+{
+    std::vector<std::string> keys = make_keys(count, "cold");
+    std::vector<std::string> hot = make_keys(KEY_COUNT, "hot");
+    const std::string value(128, 'v');
+
+    StoreOptions options;
+    options.initial_size = 4 << 20;
+    options.max_size = 4 << 20;
+    options.evict_water = 90;
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    SharedKeyValueStore store(BENCH_SEGMENT, options);
+    for (const std::string &key : hot) {
+        store.store(DEFAULT_KEYSPACE, key, value);
+    }
+
+    size_t hot_reads = 0, hot_hits = 0;
+    std::string item;
+    double start = now_ns();
+    for (size_t i = 0; i < count; ++i) {
+        store.store(DEFAULT_KEYSPACE, keys[i], value);
+        if (i % 4 == 0) {
+            ++hot_reads;
+            if (store.retrieve(DEFAULT_KEYSPACE, hot[(i / 4) % hot.size()], &item)) {
+                ++hot_hits;
+            }
+            else {
+                store.store(DEFAULT_KEYSPACE, hot[(i / 4) % hot.size()], value);
+            }
+        }
+    }
+    report("store with eviction", count, start, now_ns());
+
+    StoreStats stats = store.stats();
+    printf("%llu evictions, %zu keys kept, hot set hit rate %.1f%%\n",
+           (unsigned long long)stats.evictions, stats.keys, 100.0 * hot_hits / hot_reads);
+
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    return 0;
+}
+
+
+// Captures a snapshot while SNAPSHOT_WRITERS processes store and remove
+// keys, then restores it and replays the log over it, which must give back
+// every key as the writers left it. Returns the number of keys that differ.
+size_t snapshot_under_writes(const char *dir, const StoreOptions &options, const std::vector<std::string> &keys)
+{
+    for (uint64_t generation : log_generations(dir)) {
+        unlink(log_path(dir, generation).c_str());
+    }
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    SharedKeyValueStore store(BENCH_SEGMENT, options);
+    store.open_log(dir, DURABILITY_WRITE, 0, 1);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        store.store(DEFAULT_KEYSPACE, keys[i], "0");
+    }
+    store.commit_log();
+
+    // The writers share the log through the store they inherit
+    for (unsigned p = 0; p < SNAPSHOT_WRITERS; ++p) {
+        if (fork() == 0) {
+            char value[32];
+            for (size_t i = 0; i < keys.size(); ++i) {
+                const std::string &key = keys[(i * SNAPSHOT_WRITERS + p) % keys.size()];
+                if (i % 10 == 0) {
+                    store.remove(DEFAULT_KEYSPACE, key);
+                }
+                else {
+                    snprintf(value, sizeof(value), "%u:%zu", p, i);
+                    store.store(DEFAULT_KEYSPACE, key, value);
+                }
+                if (i % COMMIT_BATCH == COMMIT_BATCH - 1) {
+                    store.commit_log();
+                }
+            }
+            store.commit_log();
+            _exit(0);
+        }
+    }
+    usleep(2000);
+    SegmentImage image;
+    double start = now_ns();
+    store.capture(&image);
+    report("snapshot, capture under writes", keys.size(), start, now_ns());
+    bool ok = write_snapshot(dir, image);
+    while (wait(NULL) > 0) {
+    }
+
+    std::string restored_name = std::string(BENCH_SEGMENT) + "_restore";
+    uint64_t seq, generation;
+    ok = ok && restore_snapshot(dir, restored_name.c_str(), &seq, &generation);
+    size_t differ = keys.size();
+    if (ok) {
+        SharedKeyValueStore restored(restored_name.c_str(), options);
+        replay_logs(dir, restored, &seq, &generation);
+        differ = 0;
+        for (const std::string &key : keys) {
+            std::string live, copy;
+            bool in_live = store.retrieve_stored(DEFAULT_KEYSPACE, key, &live);
+            bool in_copy = restored.retrieve_stored(DEFAULT_KEYSPACE, key, &copy);
+            differ += in_live != in_copy || live != copy;
+        }
+    }
+    printf("%zu of %zu keys differ after restoring a snapshot taken under writes\n", differ, keys.size());
+    bip::shared_memory_object::remove(restored_name.c_str());
+    return differ;
+}
+
+
+// Write throughput with each durability mode, then how long it takes to
+// restore the result from a snapshot and from the log alone, and whether a
+// snapshot taken under writes restores correctly.
+int bench_persist(size_t ops)
+{
+    const char *mode_names[] = {"none", "write", "batch", "always"};
+    std::vector<std::string> keys = make_keys(ops, "persist");
+    const std::string value(64, 'v');
+    char dir_template[] = "/tmp/kvstore_bench.XXXXXX";
+    char *dir = mkdtemp(dir_template);
+    if (!dir) {
+        perror("mkdtemp failed");
+        return 1;
+    }
+
+    StoreOptions options;
+    options.initial_size = ops * 512 + (1 << 20);
+    options.max_size = options.initial_size * 4;
+
+    for (int mode = DURABILITY_NONE; mode <= DURABILITY_ALWAYS; ++mode) {
+        // An fsync per change is orders of magnitude slower
+        size_t count = mode == DURABILITY_ALWAYS ? std::max<size_t>(ops / 100, 100) : ops;
+
+        for (uint64_t generation : log_generations(dir)) {
+            unlink(log_path(dir, generation).c_str());
+        }
+        bip::shared_memory_object::remove(BENCH_SEGMENT);
+        SharedKeyValueStore store(BENCH_SEGMENT, options);
+        if (mode != DURABILITY_NONE) {
+            store.open_log(dir, (Durability)mode, 0, 1);
+        }
+
+        double start = now_ns();
+        for (size_t i = 0; i < count; ++i) {
+            store.store(DEFAULT_KEYSPACE, keys[i], value);
+            if (i % COMMIT_BATCH == COMMIT_BATCH - 1) {
+                store.commit_log();
+            }
+        }
+        store.commit_log();
+        char name[64];
+        snprintf(name, sizeof(name), "store, durability %s", mode_names[mode]);
+        report(name, count, start, now_ns());
+    }
+
+    // The log of the last full run is the "batch" one, replayed below
+    {
+        bip::shared_memory_object::remove(BENCH_SEGMENT);
+        SharedKeyValueStore store(BENCH_SEGMENT, options);
+        uint64_t seq = 0, generation = 0;
+        double start = now_ns();
+        size_t replayed = replay_logs(dir, store, &seq, &generation);
+        report("restore, log replay", replayed, start, now_ns());
+    }
+
+    SegmentImage image;
+    {
+        bip::shared_memory_object::remove(BENCH_SEGMENT);
+        SharedKeyValueStore store(BENCH_SEGMENT, options);
+        for (size_t i = 0; i < ops; ++i) {
+            store.store(DEFAULT_KEYSPACE, keys[i], value);
+        }
+        store.capture(&image);
+    }
+    double start = now_ns();
+    bool ok = write_snapshot(dir, image);
+    report("snapshot, write", ops, start, now_ns());
+
+    uint64_t seq, generation;
+    start = now_ns();
+    ok = ok && restore_snapshot(dir, BENCH_SEGMENT, &seq, &generation);
+    SharedKeyValueStore restored(BENCH_SEGMENT, options);
+    report("restore, snapshot", ops, start, now_ns());
+    StoreStats stats = restored.stats();
+    printf("%zu of %zu keys restored from the snapshot\n", stats.keys, ops);
+    size_t differ = snapshot_under_writes(dir, options, keys);
+
+    for (uint64_t generation : log_generations(dir)) {
+        unlink(log_path(dir, generation).c_str());
+    }
+    unlink((std::string(dir) + "/" SNAPSHOT_FILE).c_str());
+    rmdir(dir);
+    bip::shared_memory_object::remove(BENCH_SEGMENT);
+    return ok && stats.keys == ops && differ == 0 ? 0 : 1;
+}
+
+
+// Compresses `value`, checks that it decompresses to the same bytes and
+// that every truncated block is refused. Returns the number of failures.
+size_t check_lz(const char *name, const std::string &value)
+{
+    size_t failures = 0;
+    std::string block;
+    size_t written = lz_compress(value.data(), value.size(), &block);
+    std::string out(value.size(), '\0');
+    if (written != block.size() || written > lz_bound(value.size())) {
+        printf("lz %s: %zu bytes compressed to %zu, bound %zu\n", name, value.size(), block.size(), lz_bound(value.size()));
+        ++failures;
+    }
+    if (!lz_decompress(block.data(), block.size(), &out[0], out.size()) || out != value) {
+        printf("lz %s: %zu bytes do not round-trip\n", name, value.size());
+        ++failures;
+    }
+    // A block decodes to exactly the size it was made from
+    std::string longer(value.size() + 1, '\0');
+    if (lz_decompress(block.data(), block.size(), &longer[0], longer.size())) {
+        printf("lz %s: decompressed to the wrong size\n", name);
+        ++failures;
+    }
+    for (size_t size = 0; size < block.size(); ++size) {
+        if (lz_decompress(block.data(), size, &out[0], out.size())) {
+            printf("lz %s: block cut to %zu of %zu bytes accepted\n", name, size, block.size());
+            ++failures;
+            break;
+        }
+    }
+    return failures;
+}
+
+
+// Tests the codec on values that compress well, that do not, and that are
+// too short to try, then times it, then stores and loads values around the
+// compression threshold through store_value() and load_string_value().
+int bench_lz(size_t ops)
+{
+    std::string text;
+    for (size_t i = 0; text.size() < LZ_VALUE_SIZE; ++i) {
+        text += "{\"id\": " + std::to_string(i) + ", \"name\": \"user\", \"active\": true}\n";
+    }
+    text.resize(LZ_VALUE_SIZE);
+    std::mt19937 random(1);
+    std::string noise(LZ_VALUE_SIZE, '\0');
+    for (char &c : noise) {
+        c = (char)random();
+    }
+    std::string over = text.substr(0, DEFAULT_COMPRESS_MIN + 1);
+
+    size_t failures = check_lz("empty", "");
+    for (size_t size : {1, 5, 12, 13, 16}) {
+        failures += check_lz("short", text.substr(0, size));
+    }
+    failures += check_lz("compressible", text);
+    failures += check_lz("incompressible", noise);
+    failures += check_lz("over threshold", over);
+    failures += check_lz("repeated byte", std::string(LZ_VALUE_SIZE, 'x'));
+
+    std::string block;
+    double start = now_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        block.clear();
+        lz_compress(text.data(), text.size(), &block);
+    }
+    double end = now_ns();
+    printf("%-28s %10.1f MB/s %11.1f%% of the input\n", "lz compress", text.size() * ops / ((end - start) / 1e3), 100.0 * block.size() / text.size());
+    std::string out(text.size(), '\0');
+    start = now_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        lz_decompress(block.data(), block.size(), &out[0], out.size());
+    }
+    end = now_ns();
+    printf("%-28s %10.1f MB/s\n", "lz decompress", text.size() * ops / ((end - start) / 1e3));
+
+    // store_value() compresses through the server's own segment, so it is
+    // pointed at the benchmark's, at the default threshold
+    std::string segment = BENCH_SEGMENT "_lz";
+    setenv("KVSTORE_SHM_NAME", segment.c_str(), 1);
+    unsetenv("KVSTORE_COMPRESS_MIN");
+    bip::shared_memory_object::remove(segment.c_str());
+    struct Case {
+        const char *key;
+        const std::string *value;
+        bool compressed;
+    };
+    std::string under = over.substr(0, DEFAULT_COMPRESS_MIN - 1);
+    const Case cases[] = {
+        {"compressible", &text, true},
+        {"incompressible", &noise, false},
+        {"over threshold", &over, true},
+        {"under threshold", &under, false},
+    };
+    {
+        SharedKeyValueStore store(segment.c_str());
+        for (const Case &c : cases) {
+            std::string value, item;
+            if (store_value(DEFAULT_KEYSPACE, c.key, *c.value) != UPDATE_OK ||
+                !load_string_value(DEFAULT_KEYSPACE, c.key, &value) || value != *c.value) {
+                printf("lz %s: value does not survive the store\n", c.key);
+                ++failures;
+            }
+            else if (!store.retrieve(DEFAULT_KEYSPACE, c.key, &item) || compressed_item(item) != c.compressed) {
+                printf("lz %s: stored %s\n", c.key, c.compressed ? "uncompressed" : "compressed");
+                ++failures;
+            }
+        }
+    }
+    bip::shared_memory_object::remove(segment.c_str());
+    printf("%zu lz checks failed\n", failures);
+    return failures == 0 ? 0 : 1;
+}
+
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s handle [ops]\n", prog);
+    fprintf(stderr, "       %s index [keys...]\n", prog);
+    fprintf(stderr, "       %s read [value sizes...]\n", prog);
+    fprintf(stderr, "       %s stress [procs] [ops per proc]\n", prog);
+    fprintf(stderr, "       %s counter [procs] [ops per proc]\n", prog);
+    fprintf(stderr, "       %s batch [procs] [batches per proc]\n", prog);
+    fprintf(stderr, "       %s crash [procs] [rounds]\n", prog);
+    fprintf(stderr, "       %s expire [keys]\n", prog);
+    fprintf(stderr, "       %s persist [ops]\n", prog);
+    fprintf(stderr, "       %s fill [segment bytes]\n", prog);
+    fprintf(stderr, "       %s lz [ops]\n", prog);
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *bench = argc > 1 ? argv[1] : "handle";
+
+    if (strcmp(bench, "handle") == 0) {
+        size_t ops = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_OPS;
+        if (ops == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        bench_handle(ops);
+    }
+    else if (strcmp(bench, "index") == 0) {
+        std::vector<size_t> counts;
+        for (int i = 2; i < argc; ++i) {
+            counts.push_back(strtoul(argv[i], NULL, 10));
+        }
+        if (counts.empty()) {
+            counts = {10000, 100000, 1000000};
+        }
+        // A scan reads each key a bounded number of times, so its cost per
+        // key may grow with cache misses but not with the key count
+        const IndexType indexes[] = {INDEX_TREE, INDEX_HASH};
+        double first[2] = {0, 0};
+        int failed = 0;
+        for (size_t count : counts) {
+            for (int i = 0; i < 2; ++i) {
+                double scan_ns = bench_index(indexes[i], count);
+                if (scan_ns < 0) {
+                    failed = 1;
+                }
+                else if (first[i] == 0) {
+                    first[i] = scan_ns;
+                }
+                else if (scan_ns > first[i] * SCAN_GROWTH_LIMIT) {
+                    printf("%s scan: %.1f ns/key at %zu keys, %.1f at %zu\n", i ? "hash" : "tree", scan_ns, count, first[i], counts[0]);
+                    failed = 1;
+                }
+            }
+        }
+        return failed;
+    }
+    else if (strcmp(bench, "read") == 0) {
+        std::vector<size_t> sizes;
+        for (int i = 2; i < argc; ++i) {
+            sizes.push_back(strtoul(argv[i], NULL, 10));
+        }
+        if (sizes.empty()) {
+            sizes = {16, 256, 4096, 65536};
+        }
+        bench_read(sizes, DEFAULT_OPS);
+    }
+    else if (strcmp(bench, "stress") == 0) {
+        unsigned procs = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+        size_t ops = argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_OPS;
+        if (procs == 0 || ops == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        return bench_stress(INDEX_TREE, procs, ops) | bench_stress(INDEX_HASH, procs, ops);
+    }
+    else if (strcmp(bench, "counter") == 0) {
+        unsigned procs = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+        size_t ops = argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_OPS;
+        if (procs == 0 || ops == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        return bench_counter(procs, ops);
+    }
+    else if (strcmp(bench, "batch") == 0) {
+        unsigned procs = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+        size_t ops = argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_OPS;
+        if (procs == 0 || ops == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        return bench_batch(procs, ops) | bench_batch_full(INDEX_TREE) | bench_batch_full(INDEX_HASH);
+    }
+    else if (strcmp(bench, "crash") == 0) {
+        unsigned procs = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+        unsigned rounds = argc > 3 ? strtoul(argv[3], NULL, 10) : 50;
+        if (procs == 0 || rounds == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        return bench_crash(INDEX_TREE, procs, rounds) | bench_crash(INDEX_HASH, procs, rounds);
+    }
+    else if (strcmp(bench, "expire") == 0) {
+        size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_OPS;
+        if (count == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        return bench_expire(count) | bench_evict(count);
+    }
+    else if (strcmp(bench, "persist") == 0) {
+        size_t ops = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_OPS;
+        if (ops == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        return bench_persist(ops);
+    }
+    else if (strcmp(bench, "fill") == 0) {
+        size_t size = argc > 2 ? strtoul(argv[2], NULL, 10) : 8 << 20;
+        if (size == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        return bench_fill(size);
+    }
+    else if (strcmp(bench, "lz") == 0) {
+        size_t ops = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000;
+        if (ops == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        return bench_lz(ops);
+    }
+    else {
+        usage(argv[0]);
+        return 1;
+    }
+    return 0;
+}
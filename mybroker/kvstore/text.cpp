@@ -0,0 +1,789 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <string>
+#include <vector>
+
+#include "connection.hpp"
+#include "metrics.hpp"
+#include "replication.hpp"
+#include "store.hpp"
+#include "watch.hpp"
+
+#define NO_SUCH_KEY "No such key.\n"
+#define STORE_FULL "Store full.\n"
+#define NOT_AN_INTEGER "Not an integer.\n"
+#define INTEGER_OVERFLOW "Integer overflow.\n"
+#define INVALID_TTL "Invalid TTL.\n"
+#define WATCHING "Connection is watching.\n"
+#define READ_ONLY "Read-only replica.\n"
+#define NO_SUCH_NAMESPACE "No such namespace.\n"
+#define NOT_CREATED "Namespace not created.\n"
+#define INVALID_QUOTA "Invalid quota.\n"
+#define NOT_WATCHABLE "Only the default namespace can be watched.\n"
+#define NO_BATCH "No batch open.\n"
+#define BATCH_OPEN "Batch already open.\n"
+#define BATCH_TOO_LARGE "Batch too large.\n"
+#define INVALID_REQUEST "Invalid request.\n"
+#define INVALID_COMMAND "Invalid command.\n"
+
+
+bool contains(boost::string_view haystack, const char *needle)
+{
+    return haystack.find(needle) != boost::string_view::npos;
+}
+
+
+void send_str(connection_t *conn, const char* str)
+{
+    conn->out.append(str);
+    conn->out.push_back('\n');
+}
+
+
+// Replies with a value followed by '\n'. When no earlier reply is queued and
+// no change is waiting for its commit, the value goes from the segment to the
+// socket without a copy; only what the socket does not take is queued.
+void send_value(connection_t *conn, boost::string_view value)
+{
+    size_t sent = 0;
+    if (conn->direct_send && conn->out.empty() && !commit_pending()) {
+        char newline = '\n';
+        struct iovec iov[2];
+        iov[0].iov_base = (void*)value.data();
+        iov[0].iov_len = value.size();
+        iov[1].iov_base = &newline;
+        iov[1].iov_len = 1;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n > 0) {
+            sent = n;
+        }
+        if (sent == value.size() + 1) {
+            return;
+        }
+    }
+    if (sent < value.size()) {
+        conn->out.append(value.data() + sent, value.size() - sent);
+    }
+    conn->out.push_back('\n');
+}
+
+
+// Parses an optionally signed decimal integer that fills the whole field.
+bool parse_int(boost::string_view str, int64_t *value)
+{
+    bool negative = !str.empty() && str[0] == '-';
+    if (negative || (!str.empty() && str[0] == '+')) {
+        str.remove_prefix(1);
+    }
+    if (str.empty()) {
+        return false;
+    }
+
+    // Accumulate as a negative number, which has the larger range
+    int64_t result = 0;
+    for (char c : str) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        if (__builtin_mul_overflow(result, 10, &result) || __builtin_sub_overflow(result, c - '0', &result)) {
+            return false;
+        }
+    }
+    if (!negative && __builtin_sub_overflow((int64_t)0, result, &result)) {
+        return false;
+    }
+    *value = result;
+    return true;
+}
+
+
+void send_int(connection_t *conn, int64_t value)
+{
+    char value_str[32];
+    snprintf(value_str, sizeof(value_str), "%" PRId64, value);
+    send_str(conn, value_str);
+}
+
+
+void send_update_error(connection_t *conn, UpdateStatus status)
+{
+    switch (status) {
+    case UPDATE_NOT_FOUND:
+        send_str(conn, NO_SUCH_KEY);
+        break;
+    case UPDATE_WRONG_TYPE:
+        send_str(conn, NOT_AN_INTEGER);
+        break;
+    case UPDATE_OVERFLOW:
+        send_str(conn, INTEGER_OVERFLOW);
+        break;
+    case UPDATE_NO_KEYSPACE:
+        send_str(conn, NO_SUCH_NAMESPACE);
+        break;
+    default:
+        send_str(conn, STORE_FULL);
+        break;
+    }
+}
+
+
+// Replies READ_ONLY and returns true if writes are refused
+bool refuse_write(connection_t *conn)
+{
+    if (read_only()) {
+        send_str(conn, READ_ONLY);
+        return true;
+    }
+    return false;
+}
+
+
+// Queues a change of the connection's open batch, or discards the batch once
+// it has grown too large
+void queue_batch_op(connection_t *conn, size_t size)
+{
+    conn->batch_size += size;
+    if (conn->batch_too_large || conn->batch_size > MAX_BATCH_SIZE) {
+        conn->batch_too_large = true;
+        conn->batch.clear();
+        send_str(conn, BATCH_TOO_LARGE);
+        return;
+    }
+    send_str(conn, "queued.\n");
+}
+
+
+void store_value_handler(connection_t *conn, boost::string_view key, boost::string_view type, boost::string_view value)
+{
+    if (key.empty() || type.empty() || value.empty()) {
+        send_str(conn, INVALID_REQUEST);
+        return;
+    }
+    if (refuse_write(conn)) {
+        return;
+    }
+
+    UpdateStatus status;
+    if (contains(type, "string")) {
+        if (conn->in_batch) {
+            batch_store(&conn->batch, key, value);
+            queue_batch_op(conn, key.size() + value.size());
+            return;
+        }
+        status = store_value(conn->keyspace, key, value);
+    }
+    else if (contains(type, "int")) {
+        int64_t int_value;
+        if (!parse_int(value, &int_value)) {
+            send_str(conn, NOT_AN_INTEGER);
+            return;
+        }
+        if (conn->in_batch) {
+            batch_store_int(&conn->batch, key, int_value);
+            queue_batch_op(conn, key.size() + value.size());
+            return;
+        }
+        status = store_int_value(conn->keyspace, key, int_value);
+    }
+    else {
+        send_str(conn, INVALID_REQUEST);
+        return;
+    }
+
+    if (status == UPDATE_OK) {
+        send_str(conn, "saved.\n");
+    }
+    else {
+        send_update_error(conn, status);
+    }
+}
+
+
+void load_value_handler(connection_t *conn, boost::string_view key, boost::string_view type)
+{
+    if (key.empty() || type.empty()) {
+        send_str(conn, INVALID_REQUEST);
+        return;
+    }
+
+    if (contains(type, "string")) {
+        bool hit = false;
+        view_string_value(conn->keyspace, key, [conn, &hit](boost::string_view value) {
+            hit = !value.empty();
+            if (hit) {
+                send_value(conn, value);
+            }
+        });
+        record_get(hit);
+        if (!hit) {
+            send_str(conn, NO_SUCH_KEY);
+        }
+    }
+    else if (contains(type, "int")) {
+        int64_t value;
+        bool hit = load_int_value(conn->keyspace, key, &value);
+        record_get(hit);
+        if (!hit) {
+            send_str(conn, NO_SUCH_KEY);
+        }
+        else {
+            send_int(conn, value);
+        }
+    }
+    else {
+        send_str(conn, INVALID_REQUEST);
+    }
+}
+
+
+// incr_value and decr_value: replies with the new value
+void incr_value_handler(connection_t *conn, boost::string_view key, boost::string_view delta_str, bool decrement)
+{
+    if (key.empty() || delta_str.empty()) {
+        send_str(conn, INVALID_REQUEST);
+        return;
+    }
+    if (refuse_write(conn)) {
+        return;
+    }
+
+    int64_t delta, result;
+    if (!parse_int(delta_str, &delta)) {
+        send_str(conn, NOT_AN_INTEGER);
+        return;
+    }
+    if (decrement && __builtin_sub_overflow((int64_t)0, delta, &delta)) {
+        send_str(conn, INTEGER_OVERFLOW);
+        return;
+    }
+
+    UpdateStatus status = incr_value(conn->keyspace, key, delta, &result);
+    if (status != UPDATE_OK) {
+        send_update_error(conn, status);
+        return;
+    }
+    send_int(conn, result);
+}
+
+
+// Replies "swapped." or, if the value was not `expected`, the current value
+void cas_value_handler(connection_t *conn, boost::string_view key, boost::string_view expected_str, boost::string_view desired_str)
+{
+    if (key.empty() || expected_str.empty() || desired_str.empty()) {
+        send_str(conn, INVALID_REQUEST);
+        return;
+    }
+    if (refuse_write(conn)) {
+        return;
+    }
+
+    int64_t expected, desired, current;
+    if (!parse_int(expected_str, &expected) || !parse_int(desired_str, &desired)) {
+        send_str(conn, NOT_AN_INTEGER);
+        return;
+    }
+
+    UpdateStatus status = cas_value(conn->keyspace, key, expected, desired, &current);
+    if (status == UPDATE_OK) {
+        send_str(conn, "swapped.\n");
+    }
+    else if (status == UPDATE_MISMATCH) {
+        send_int(conn, current);
+    }
+    else {
+        send_update_error(conn, status);
+    }
+}
+
+
+// Sets a key's TTL in milliseconds; 0 makes it persistent again
+void expire_value_handler(connection_t *conn, boost::string_view key, boost::string_view ttl_str)
+{
+    if (key.empty() || ttl_str.empty()) {
+        send_str(conn, INVALID_REQUEST);
+        return;
+    }
+    if (refuse_write(conn)) {
+        return;
+    }
+
+    int64_t ttl;
+    if (!parse_int(ttl_str, &ttl) || ttl < 0) {
+        send_str(conn, INVALID_TTL);
+        return;
+    }
+
+    UpdateStatus status = expire_value(conn->keyspace, key, ttl);
+    if (status != UPDATE_OK) {
+        send_update_error(conn, status);
+        return;
+    }
+    send_str(conn, "saved.\n");
+}
+
+
+// One "name value" line per statistic, then "END"
+void stats_handler(connection_t *conn)
+{
+    StoreStats stats = store_stats();
+    char line[64];
+    const struct {
+        const char *name;
+        uint64_t value;
+    } fields[] = {
+        {"shm_size", stats.size},
+        {"shm_used", stats.size - stats.free},
+        {"shm_free", stats.free},
+        {"keys", stats.keys},
+        {"timers", stats.timers},
+        {"bloom_bytes", stats.filter_bytes},
+        {"evictions", stats.evictions},
+        {"expirations", stats.expirations},
+        {"lock_recoveries", stats.lock_recoveries},
+        {"stripe_repairs", stats.repairs},
+        {"repair_lost_keys", stats.lost},
+        {"requested_bytes", stats.slab.requested},
+        {"slab_bytes", stats.slab.slab_bytes},
+        {"slab_free", stats.slab.slab_free},
+        {"large_bytes", stats.slab.large_bytes},
+    };
+    for (const auto &field : fields) {
+        snprintf(line, sizeof(line), "%s %" PRIu64 "\n", field.name, field.value);
+        conn->out.append(line);
+    }
+    for (const KeyspaceStats &keyspace : stats.keyspaces) {
+        const struct {
+            const char *name;
+            uint64_t value;
+        } keyspace_fields[] = {
+            {"keys", keyspace.keys},
+            {"bytes", keyspace.used},
+            {"quota", keyspace.quota},
+        };
+        for (const auto &field : keyspace_fields) {
+            conn->out.append("namespace_" + keyspace.name + "_");
+            snprintf(line, sizeof(line), "%s %" PRIu64 "\n", field.name, field.value);
+            conn->out.append(line);
+        }
+    }
+    // Bytes of the segment in use per byte that keys, values and index
+    // entries asked for; the rest is hash slots, rounding and unusable holes
+    size_t in_use = stats.size - stats.free;
+    snprintf(line, sizeof(line), "fragmentation_ratio %.2f\n", stats.slab.requested ? (double)in_use / stats.slab.requested : 1.0);
+    conn->out.append(line);
+    append_metrics(&conn->out);
+    append_watch_stats(&conn->out);
+    conn->out.append("END\n");
+}
+
+
+// Checks the whole store and rebuilds whatever a crashed worker left torn,
+// then answers like stats
+void check_store_handler(connection_t *conn)
+{
+    CheckReport report = check_store();
+    char line[64];
+    const struct {
+        const char *name;
+        uint64_t value;
+    } fields[] = {
+        {"stripes", report.stripes},
+        {"keys", report.keys},
+        {"repaired", report.repaired},
+        {"lost_keys", report.lost},
+        // Left for the next restart to rebuild the segment
+        {"unrepaired", report.failed},
+        {"allocator_torn", report.allocator_torn},
+    };
+    for (const auto &field : fields) {
+        snprintf(line, sizeof(line), "%s %" PRIu64 "\n", field.name, field.value);
+        conn->out.append(line);
+    }
+    conn->out.append("END\n");
+}
+
+
+// The fields are views into the receive buffer and are only valid until the
+// request is consumed.
+void remove_value_handler(connection_t *conn, boost::string_view key)
+{
+    if (key.empty()) {
+        send_str(conn, INVALID_REQUEST);
+        return;
+    }
+    if (refuse_write(conn)) {
+        return;
+    }
+
+    if (conn->in_batch) {
+        batch_remove(&conn->batch, key);
+        queue_batch_op(conn, key.size());
+        return;
+    }
+    if (remove_value(conn->keyspace, key)) {
+        send_str(conn, "removed.\n");
+    }
+    else {
+        send_str(conn, NO_SUCH_KEY);
+    }
+}
+
+
+// Opens a batch: later stores and removals on the connection are queued
+// until exec applies them all at once, or discard drops them. Other
+// commands still run straight away.
+void multi_handler(connection_t *conn)
+{
+    if (refuse_write(conn)) {
+        return;
+    }
+    if (conn->in_batch) {
+        send_str(conn, BATCH_OPEN);
+        return;
+    }
+    conn->in_batch = true;
+    send_str(conn, "queued.\n");
+}
+
+
+void close_batch(connection_t *conn)
+{
+    conn->in_batch = false;
+    conn->batch_too_large = false;
+    conn->batch_size = 0;
+    conn->batch.clear();
+}
+
+
+// Applies the open batch to the namespace in use, atomically. Replies with
+// each change's own reply, in order, and then "applied."; or, if nothing was
+// applied, with a single error.
+void exec_handler(connection_t *conn)
+{
+    if (!conn->in_batch) {
+        send_str(conn, NO_BATCH);
+        return;
+    }
+    if (conn->batch_too_large) {
+        send_str(conn, BATCH_TOO_LARGE);
+        close_batch(conn);
+        return;
+    }
+
+    UpdateStatus status = apply_batch(conn->keyspace, &conn->batch);
+    if (status != UPDATE_OK) {
+        send_update_error(conn, status);
+        close_batch(conn);
+        return;
+    }
+    for (const BatchOp &op : conn->batch) {
+        if (!op.remove) {
+            send_str(conn, "saved.\n");
+        }
+        else if (op.found) {
+            send_str(conn, "removed.\n");
+        }
+        else {
+            send_str(conn, NO_SUCH_KEY);
+        }
+    }
+    send_str(conn, "applied.\n");
+    close_batch(conn);
+}
+
+
+void discard_handler(connection_t *conn)
+{
+    if (!conn->in_batch) {
+        send_str(conn, NO_BATCH);
+        return;
+    }
+    close_batch(conn);
+    send_str(conn, "discarded.\n");
+}
+
+
+// Each event is its type on one line and the key on the next; "lost" with
+// an empty key says events were dropped and the client should read anew.
+// Only keys of the default namespace are watched.
+void queue_change(connection_t *conn, const Change &change)
+{
+    const char *name;
+    if (change.slot != DEFAULT_KEYSPACE) {
+        return;
+    }
+    switch (change.type) {
+    case CHANGE_SET:
+        name = "set";
+        break;
+    case CHANGE_DEL:
+        name = "del";
+        break;
+    case CHANGE_LOST:
+        name = "lost";
+        break;
+    default:
+        return;
+    }
+    conn->out.append(name);
+    conn->out.push_back('\n');
+    conn->out.append(change.key.data(), change.key.size());
+    conn->out.push_back('\n');
+}
+
+
+// Subscribes the connection to changes of a key, or of every key starting
+// with the pattern if it ends in '*'. The connection is sent each change as
+// it happens, and is closed if it sends any request but more watches.
+void watch_handler(connection_t *conn, boost::string_view pattern)
+{
+    if (conn->keyspace != DEFAULT_KEYSPACE) {
+        send_str(conn, NOT_WATCHABLE);
+        return;
+    }
+    watch_key(conn, pattern, queue_change);
+    send_str(conn, "watching.\n");
+}
+
+
+// Queues the next chunk of the connection's scan: each entry as its key on
+// one line and its value on the next, then an empty line after the last one.
+void scan_chunk(connection_t *conn)
+{
+    std::vector<ScanEntry> entries;
+    bool more = scan_values(conn->keyspace, &conn->scan, SCAN_CHUNK, &entries);
+    std::string scratch;
+
+    for (const ScanEntry &entry : entries) {
+        conn->out.append(entry.first);
+        conn->out.push_back('\n');
+        int64_t int_value;
+        boost::string_view value;
+        if (int_item_value(entry.second, &int_value)) {
+            send_int(conn, int_value);
+        }
+        else if (string_item_value(entry.second, &value, &scratch)) {
+            conn->out.append(value.data(), value.size());
+            conn->out.push_back('\n');
+        }
+        else {
+            conn->out.append(entry.second, 1, std::string::npos);
+            conn->out.push_back('\n');
+        }
+    }
+    if (!more) {
+        conn->out.push_back('\n');
+        conn->scanning = false;
+    }
+}
+
+
+// Later requests on the connection address the namespace
+void use_namespace_handler(connection_t *conn, boost::string_view name)
+{
+    KeyspaceId keyspace;
+    if (!find_namespace(name, &keyspace)) {
+        send_str(conn, NO_SUCH_NAMESPACE);
+        return;
+    }
+    conn->keyspace = keyspace;
+    send_str(conn, "using.\n");
+}
+
+
+// Creates an empty namespace with a quota in bytes; 0 is no quota
+void create_namespace_handler(connection_t *conn, boost::string_view name, boost::string_view quota_str)
+{
+    if (name.empty() || quota_str.empty()) {
+        send_str(conn, INVALID_REQUEST);
+        return;
+    }
+    if (refuse_write(conn)) {
+        return;
+    }
+
+    int64_t quota;
+    if (!parse_int(quota_str, &quota) || quota < 0) {
+        send_str(conn, INVALID_QUOTA);
+        return;
+    }
+    if (create_namespace(name, quota)) {
+        send_str(conn, "created.\n");
+    }
+    else {
+        send_str(conn, NOT_CREATED);
+    }
+}
+
+
+// Drops a namespace and every key in it at once
+void drop_namespace_handler(connection_t *conn, boost::string_view name)
+{
+    if (name.empty()) {
+        send_str(conn, INVALID_REQUEST);
+        return;
+    }
+    if (refuse_write(conn)) {
+        return;
+    }
+
+    if (drop_namespace(name)) {
+        send_str(conn, "dropped.\n");
+    }
+    else {
+        send_str(conn, NO_SUCH_NAMESPACE);
+    }
+}
+
+
+void scan_handler(connection_t *conn, const KeyRange &range)
+{
+    conn->scan = range;
+    conn->scanning = true;
+    scan_chunk(conn);
+}
+
+
+int handle_text_request(connection_t *conn)
+{
+    size_t pos = 0;
+    boost::string_view command;
+
+    if (conn->scanning) {
+        if (!conn->out.empty()) {
+            return 0;
+        }
+        scan_chunk(conn);
+        return 1;
+    }
+
+    if (!conn->in.next_field(&pos, &command)) {
+        return conn->in.size() > MAX_REQUEST_SIZE ? -1 : 0;
+    }
+    if (command.empty()) {
+        return -1;
+    }
+
+    Command cmd = CMD_COUNT;
+    uint64_t start = metrics_clock_ns();
+
+    if (contains(command, "watch")) {
+        boost::string_view pattern;
+        if (!conn->in.next_field(&pos, &pattern)) {
+            return conn->in.size() > MAX_REQUEST_SIZE ? -1 : 0;
+        }
+        watch_handler(conn, pattern);
+        cmd = CMD_WATCH;
+    } else if (!conn->watches.empty()) {
+        // Its reply would be mixed up with the events
+        send_str(conn, WATCHING);
+        return -1;
+    } else if (contains(command, "store_value")) {
+        boost::string_view key, type, value;
+        if (!conn->in.next_field(&pos, &key) || !conn->in.next_field(&pos, &type) || !conn->in.next_field(&pos, &value)) {
+            return conn->in.size() > MAX_REQUEST_SIZE ? -1 : 0;
+        }
+        store_value_handler(conn, key, type, value);
+        cmd = CMD_STORE;
+    } else if (contains(command, "load_value")) {
+        boost::string_view key, type;
+        if (!conn->in.next_field(&pos, &key) || !conn->in.next_field(&pos, &type)) {
+            return conn->in.size() > MAX_REQUEST_SIZE ? -1 : 0;
+        }
+        load_value_handler(conn, key, type);
+        cmd = CMD_LOAD;
+    } else if (contains(command, "incr_value") || contains(command, "decr_value")) {
+        boost::string_view key, delta;
+        if (!conn->in.next_field(&pos, &key) || !conn->in.next_field(&pos, &delta)) {
+            return conn->in.size() > MAX_REQUEST_SIZE ? -1 : 0;
+        }
+        incr_value_handler(conn, key, delta, contains(command, "decr_value"));
+        cmd = CMD_INCR;
+    } else if (contains(command, "cas_value")) {
+        boost::string_view key, expected, desired;
+        if (!conn->in.next_field(&pos, &key) || !conn->in.next_field(&pos, &expected) || !conn->in.next_field(&pos, &desired)) {
+            return conn->in.size() > MAX_REQUEST_SIZE ? -1 : 0;
+        }
+        cas_value_handler(conn, key, expected, desired);
+        cmd = CMD_CAS;
+    } else if (contains(command, "expire_value")) {
+        boost::string_view key, ttl;
+        if (!conn->in.next_field(&pos, &key) || !conn->in.next_field(&pos, &ttl)) {
+            return conn->in.size() > MAX_REQUEST_SIZE ? -1 : 0;
+        }
+        expire_value_handler(conn, key, ttl);
+        cmd = CMD_EXPIRE;
+    } else if (command == "stats") {
+        stats_handler(conn);
+        cmd = CMD_STATS;
+    } else if (command == "check_store") {
+        check_store_handler(conn);
+    } else if (contains(command, "remove_value")) {
+        boost::string_view key;
+        if (!conn->in.next_field(&pos, &key)) {
+            return conn->in.size() > MAX_REQUEST_SIZE ? -1 : 0;
+        }
+        remove_value_handler(conn, key);
+        cmd = CMD_REMOVE;
+    } else if (contains(command, "scan_values")) {
+        // An empty prefix scans every key
+        boost::string_view prefix;
+        if (!conn->in.next_field(&pos, &prefix)) {
+            return conn->in.size() > MAX_REQUEST_SIZE ? -1 : 0;
+        }
+        scan_handler(conn, prefix_range(prefix));
+        cmd = CMD_SCAN;
+    } else if (contains(command, "range_values")) {
+        // From start up to but not including end; an empty end is no bound
+        boost::string_view start, end;
+        if (!conn->in.next_field(&pos, &start) || !conn->in.next_field(&pos, &end)) {
+            return conn->in.size() > MAX_REQUEST_SIZE ? -1 : 0;
+        }
+        KeyRange range;
+        range.start.assign(start.data(), start.size());
+        range.end.assign(end.data(), end.size());
+        scan_handler(conn, range);
+        cmd = CMD_SCAN;
+    } else if (contains(command, "multi")) {
+        multi_handler(conn);
+    } else if (contains(command, "exec")) {
+        exec_handler(conn);
+        cmd = CMD_EXEC;
+    } else if (contains(command, "discard")) {
+        discard_handler(conn);
+    } else if (contains(command, "use_namespace")) {
+        boost::string_view name;
+        if (!conn->in.next_field(&pos, &name)) {
+            return conn->in.size() > MAX_REQUEST_SIZE ? -1 : 0;
+        }
+        use_namespace_handler(conn, name);
+    } else if (contains(command, "create_namespace")) {
+        boost::string_view name, quota;
+        if (!conn->in.next_field(&pos, &name) || !conn->in.next_field(&pos, &quota)) {
+            return conn->in.size() > MAX_REQUEST_SIZE ? -1 : 0;
+        }
+        create_namespace_handler(conn, name, quota);
+    } else if (contains(command, "drop_namespace")) {
+        boost::string_view name;
+        if (!conn->in.next_field(&pos, &name)) {
+            return conn->in.size() > MAX_REQUEST_SIZE ? -1 : 0;
+        }
+        drop_namespace_handler(conn, name);
+    } else {
+        send_str(conn, INVALID_COMMAND);
+    }
+
+    if (cmd != CMD_COUNT) {
+        record_command(cmd, start);
+    }
+    conn->in.consume(pos);
+    return 1;
+}
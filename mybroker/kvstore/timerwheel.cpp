@@ -0,0 +1,86 @@
+#include <new>
+
+#include "timerwheel.hpp"
+
+
+TimerWheel::TimerWheel(SlabPool* pool, uint64_t now_ms)
+    : alloc(pool)
+    , now(now_ms / TIMER_TICK_MS)
+    , count(0) {
+}
+
+TimerWheel::~TimerWheel() {
+    for (int level = 0; level < TIMER_LEVELS; ++level) {
+        for (size_t slot = 0; slot < TIMER_SLOTS; ++slot) {
+            Node* node = take(level, slot);
+            while (node) {
+                Node* next = node->next.get();
+                destroy(node);
+                node = next;
+            }
+        }
+    }
+}
+
+void TimerWheel::add(boost::string_view key, uint64_t expires_ms) {
+    Node* node = alloc.allocate(1).get();
+    try {
+        new (node) Node(key, expires_ms, SlabAlloc<char>(alloc));
+    }
+    catch (...) {
+        alloc.deallocate(node, 1);
+        throw;
+    }
+    place(node);
+    ++count;
+}
+
+TimerWheel::Node* TimerWheel::take(int level, size_t slot) {
+    Node* node = slots[level][slot].get();
+    slots[level][slot] = nullptr;
+    return node;
+}
+
+void TimerWheel::place(Node* node) {
+    uint64_t expires = node->expires / TIMER_TICK_MS;
+    if (expires <= now) {
+        // Already due: fire on the next tick
+        expires = now + 1;
+    }
+
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && expires - now >= (1ULL << (TIMER_SLOT_BITS * (level + 1)))) {
+        ++level;
+    }
+    if (expires - now >= (1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS))) {
+        // Beyond the wheel: park it in the furthest slot and file it again
+        // when that slot comes round
+        expires = now + (1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+    }
+
+    size_t slot = (expires >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+    node->next = slots[level][slot];
+    slots[level][slot] = node;
+}
+
+// Called on every tick: each level whose lower level has just wrapped around
+// hands down the timers of its current slot.
+void TimerWheel::cascade() {
+    for (int level = 1; level < TIMER_LEVELS; ++level) {
+        if (((now >> (TIMER_SLOT_BITS * (level - 1))) & (TIMER_SLOTS - 1)) != 0) {
+            return;
+        }
+        Node* node = take(level, (now >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1));
+        while (node) {
+            Node* next = node->next.get();
+            place(node);
+            node = next;
+        }
+    }
+}
+
+void TimerWheel::destroy(Node* node) {
+    node->~Node();
+    alloc.deallocate(node, 1);
+    --count;
+}
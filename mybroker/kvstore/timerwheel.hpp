@@ -0,0 +1,81 @@
+#pragma once
+
+#include "shm.hpp"
+
+#define TIMER_TICK_MS 100
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+// Hierarchical timer wheel of key expiry times that lives inside the segment.
+//
+// Level 0 has one slot per tick, and each slot of level n covers a whole
+// revolution of level n-1. A timer is filed in the level that matches how far
+// away it is and moves down a level whenever the level below wraps around, so
+// adding and firing a timer cost the same however many keys have a TTL.
+//
+// Timers are never cancelled. A key that is deleted, overwritten or given a
+// new TTL leaves its old timer behind, so the caller of advance() has to check
+// that the key really expires at the time the timer fires for.
+class TimerWheel
+{
+public:
+    TimerWheel(SlabPool* pool, uint64_t now_ms);
+    ~TimerWheel();
+
+    // Throws bip::bad_alloc if the segment is out of memory.
+    void add(boost::string_view key, uint64_t expires_ms);
+
+    // Moves the wheel forward to now_ms, calling fire(key, expires_ms) for
+    // every timer that has become due.
+    template <class F> void advance(uint64_t now_ms, F fire) {
+        uint64_t target = now_ms / TIMER_TICK_MS;
+        while (now < target) {
+            if (count == 0) {
+                now = target;
+                return;
+            }
+            ++now;
+            cascade();
+            Node* node = take(0, now & (TIMER_SLOTS - 1));
+            while (node) {
+                Node* next = node->next.get();
+                if (node->expires / TIMER_TICK_MS > now) {
+                    // Was too far away for the top level
+                    place(node);
+                }
+                else {
+                    fire(to_view(node->key), node->expires);
+                    destroy(node);
+                }
+                node = next;
+            }
+        }
+    }
+
+    size_t size() const { return count; }
+
+private:
+    struct Node
+    {
+        bip::offset_ptr<Node> next;
+        uint64_t expires;       // milliseconds since the epoch
+        ShString key;
+
+        Node(boost::string_view key, uint64_t expires, const SlabAlloc<char>& alloc)
+            : next(nullptr), expires(expires), key(key.data(), key.size(), alloc) {}
+    };
+
+    TimerWheel(const TimerWheel&);
+    TimerWheel& operator=(const TimerWheel&);
+
+    Node* take(int level, size_t slot);
+    void place(Node* node);
+    void cascade();
+    void destroy(Node* node);
+
+    SlabAlloc<Node> alloc;
+    uint64_t now;       // in ticks; every timer up to here has fired
+    size_t count;
+    bip::offset_ptr<Node> slots[TIMER_LEVELS][TIMER_SLOTS];
+};
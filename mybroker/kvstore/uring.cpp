@@ -0,0 +1,572 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <string>
+#include <vector>
+
+#include "connection.hpp"
+#include "metrics.hpp"
+#include "uring.hpp"
+#include "watch.hpp"
+
+#define RING_ENTRIES 256
+#define CQ_ENTRIES 4096
+#define RECV_BUFFERS 256            // a power of two
+#define RECV_BUFFER_SIZE 8192
+#define RECV_GROUP 0
+// A connection stops receiving while this much is buffered and waiting for
+// its replies to be sent, like epoll mode stops reading it
+#define RECV_HIGH_WATER 65536
+// Expired keys are erased and snapshots checked for this often
+#define MAINTENANCE_INTERVAL_S 1
+
+// What a completion is for, in the low bits of its user_data; the rest is the
+// connection, if any
+enum uring_op_t {
+    URING_ACCEPT = 1,
+    URING_RECV,
+    URING_SEND,
+    URING_SHUTDOWN,
+    URING_CANCEL,
+    URING_TIMEOUT,
+    URING_WATCH,
+};
+#define URING_OP_MASK 7
+
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+// A submission and a completion queue shared with the kernel, and the ring of
+// receive buffers the kernel picks from for multishot recv.
+class Ring
+{
+public:
+    Ring() : fd(-1), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes(nullptr), buf_ring(nullptr), buffers(nullptr) {}
+    ~Ring();
+
+    bool setup();
+
+    // Returns a cleared entry, submitting the queue first if it is full
+    struct io_uring_sqe* get_sqe();
+    // Submits everything queued and waits for at least `wait` completions
+    int submit(unsigned wait);
+
+    struct io_uring_cqe* peek_cqe() {
+        unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            return nullptr;
+        }
+        return &cqes[head & cq_mask];
+    }
+    void cqe_seen() {
+        __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+    }
+
+    const char* buffer(unsigned bid) const { return buffers + (size_t)bid * RECV_BUFFER_SIZE; }
+    // Hands a receive buffer back to the kernel
+    void recycle(unsigned bid);
+
+private:
+    Ring(const Ring&);
+    Ring& operator=(const Ring&);
+
+    int fd;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned local_tail;        // entries queued, including unsubmitted ones
+    unsigned submitted;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // The kernel's io_uring_buf_ring, whose flexible array member C++ lays
+    // out differently; the tail overlays the first entry's resv field
+    struct io_uring_buf *buf_ring;
+    char *buffers;
+    unsigned short buf_tail;
+};
+
+
+Ring::~Ring()
+{
+    if (buffers) {
+        munmap(buffers, (size_t)RECV_BUFFERS * RECV_BUFFER_SIZE);
+    }
+    if (buf_ring) {
+        munmap(buf_ring, RECV_BUFFERS * sizeof(struct io_uring_buf));
+    }
+    if (sqes) {
+        munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+        munmap(cq_ptr, cq_size);
+    }
+    if (sq_ptr != MAP_FAILED) {
+        munmap(sq_ptr, sq_size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+
+bool Ring::setup()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Completions are only reaped by the thread that submits, when it waits
+    // for them, which spares the kernel from interrupting it
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = CQ_ENTRIES;
+    fd = sys_io_uring_setup(RING_ENTRIES, &params);
+    if (fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = CQ_ENTRIES;
+        fd = sys_io_uring_setup(RING_ENTRIES, &params);
+    }
+    if (fd < 0) {
+        return false;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        return false;
+    }
+    cq_ptr = single_mmap ? sq_ptr : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq_ptr == MAP_FAILED) {
+        return false;
+    }
+    sq_entries = params.sq_entries;
+    void *sqe_ptr = mmap(NULL, sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqe_ptr == MAP_FAILED) {
+        return false;
+    }
+    sqes = (struct io_uring_sqe*)sqe_ptr;
+
+    char *sq = (char*)sq_ptr;
+    sq_head = (unsigned*)(sq + params.sq_off.head);
+    sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + params.sq_off.array);
+    // Entry i always sits in slot i
+    for (unsigned i = 0; i < sq_entries; ++i) {
+        sq_array[i] = i;
+    }
+    local_tail = submitted = *sq_tail;
+
+    char *cq = (char*)cq_ptr;
+    cq_head = (unsigned*)(cq + params.cq_off.head);
+    cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // Registered receive buffers: the kernel picks one for each recv
+    // completion, so no buffer sits idle per connection
+    void *ring_ptr = mmap(NULL, RECV_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring_ptr == MAP_FAILED) {
+        return false;
+    }
+    buf_ring = (struct io_uring_buf*)ring_ptr;
+    void *buffer_ptr = mmap(NULL, (size_t)RECV_BUFFERS * RECV_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer_ptr == MAP_FAILED) {
+        return false;
+    }
+    buffers = (char*)buffer_ptr;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)buf_ring;
+    reg.ring_entries = RECV_BUFFERS;
+    reg.bgid = RECV_GROUP;
+    if (sys_io_uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return false;
+    }
+    buf_tail = 0;
+    for (unsigned bid = 0; bid < RECV_BUFFERS; ++bid) {
+        recycle(bid);
+    }
+    return true;
+}
+
+
+struct io_uring_sqe* Ring::get_sqe()
+{
+    if (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+        submit(0);
+    }
+    struct io_uring_sqe *sqe = &sqes[local_tail & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++local_tail;
+    return sqe;
+}
+
+
+int Ring::submit(unsigned wait)
+{
+    __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+    for (;;) {
+        int n = sys_io_uring_enter(fd, local_tail - submitted, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (n >= 0) {
+            submitted += n;
+            return n;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+
+void Ring::recycle(unsigned bid)
+{
+    struct io_uring_buf *buf = &buf_ring[buf_tail & (RECV_BUFFERS - 1)];
+    buf->addr = (uint64_t)buffer(bid);
+    buf->len = RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    ++buf_tail;
+    __atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+}
+
+
+bool uring_supported()
+{
+    Ring ring;
+    return ring.setup();
+}
+
+
+// A connection and the operations the kernel holds for it. It is freed once
+// it is closing and none are left.
+struct UringConnection
+{
+    connection_t conn;
+    std::string sending;    // the replies a send is in flight for
+    unsigned ops;           // operations submitted and not completed
+    bool recv_armed;
+    bool recv_cancelled;
+    bool send_busy;
+    bool shut;              // shutdown submitted
+    bool dead;              // no more requests are handled
+    bool touched;           // already in this round's list
+
+    UringConnection(int fd)
+        : conn(fd), ops(0), recv_armed(false), recv_cancelled(false), send_busy(false),
+          shut(false), dead(false), touched(false) {
+        // Replies are sent by the ring with everything else in the round
+        conn.direct_send = false;
+    }
+};
+
+
+static uint64_t user_data(UringConnection *uc, uring_op_t op)
+{
+    return (uint64_t)uc | op;
+}
+
+static void arm_accept(Ring *ring, int socket_desc)
+{
+    struct io_uring_sqe *sqe = ring->get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = socket_desc;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_ACCEPT;
+}
+
+static void arm_recv(Ring *ring, UringConnection *uc)
+{
+    struct io_uring_sqe *sqe = ring->get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = uc->conn.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_GROUP;
+    sqe->user_data = user_data(uc, URING_RECV);
+    uc->recv_armed = true;
+    uc->recv_cancelled = false;
+    ++uc->ops;
+}
+
+static void cancel_recv(Ring *ring, UringConnection *uc)
+{
+    struct io_uring_sqe *sqe = ring->get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data(uc, URING_RECV);
+    sqe->user_data = user_data(uc, URING_CANCEL);
+    uc->recv_cancelled = true;
+    ++uc->ops;
+}
+
+// Shutting the socket down ends its multishot recv, so the last completion
+// for the connection arrives soon after
+static void shutdown_connection(Ring *ring, UringConnection *uc)
+{
+    struct io_uring_sqe *sqe = ring->get_sqe();
+    sqe->opcode = IORING_OP_SHUTDOWN;
+    sqe->fd = uc->conn.fd;
+    sqe->len = SHUT_RDWR;
+    sqe->user_data = user_data(uc, URING_SHUTDOWN);
+    uc->shut = true;
+    uc->dead = true;
+    ++uc->ops;
+}
+
+// Sends what is in `sending`. A closing connection gets its shutdown linked
+// behind the send, so it only happens once the replies are out.
+static void send_replies(Ring *ring, UringConnection *uc, bool then_shutdown)
+{
+    struct io_uring_sqe *sqe = ring->get_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = uc->conn.fd;
+    sqe->addr = (uint64_t)uc->sending.data();
+    sqe->len = uc->sending.size();
+    // The kernel retries a short send itself
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = user_data(uc, URING_SEND);
+    uc->send_busy = true;
+    ++uc->ops;
+    if (then_shutdown) {
+        sqe->flags |= IOSQE_IO_LINK;
+        shutdown_connection(ring, uc);
+    }
+}
+
+static void retire(Ring *ring, UringConnection *uc)
+{
+    uc->dead = true;
+    if (uc->recv_armed && !uc->shut) {
+        shutdown_connection(ring, uc);
+    }
+}
+
+// The loop's watch eventfd becoming readable; the read itself is redone by
+// dispatch_changes()
+static void arm_watch(Ring *ring, int watch_fd)
+{
+    struct io_uring_sqe *sqe = ring->get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = watch_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_WATCH;
+}
+
+static void arm_timeout(Ring *ring, struct __kernel_timespec *ts)
+{
+    struct io_uring_sqe *sqe = ring->get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)ts;
+    sqe->len = 1;
+    sqe->user_data = URING_TIMEOUT;
+}
+
+
+// Every round reaps all completions, handles the requests they completed,
+// commits the log once, and queues the replies, which go to the kernel with
+// the next wait in a single system call.
+int serve_uring(int socket_desc, bool maintenance)
+{
+    Ring ring;
+    if (!ring.setup()) {
+        perror("io_uring setup failed");
+        return 1;
+    }
+
+    arm_accept(&ring, socket_desc);
+    struct __kernel_timespec interval;
+    interval.tv_sec = MAINTENANCE_INTERVAL_S;
+    interval.tv_nsec = 0;
+    if (maintenance) {
+        arm_timeout(&ring, &interval);
+    }
+    int watch_fd = watch_eventfd();
+    arm_watch(&ring, watch_fd);
+
+    std::vector<UringConnection*> touched;
+    std::vector<connection_t*> watchers;
+    for (;;) {
+        if (ring.submit(1) < 0) {
+            perror("io_uring_enter failed");
+            return 1;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = ring.peek_cqe()) != nullptr) {
+            uring_op_t op = (uring_op_t)(cqe->user_data & URING_OP_MASK);
+            UringConnection *uc = (UringConnection*)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            ring.cqe_seen();
+
+            if (op == URING_ACCEPT) {
+                if (res >= 0) {
+                    int one = 1;
+                    setsockopt(res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    UringConnection *accepted = new UringConnection(res);
+                    connection_opened();
+                    arm_recv(&ring, accepted);
+                }
+                else {
+                    errno = -res;
+                    perror("accept failed");
+                }
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    arm_accept(&ring, socket_desc);
+                }
+                continue;
+            }
+            if (op == URING_TIMEOUT) {
+                expire_values();
+                snapshot_values();
+                arm_timeout(&ring, &interval);
+                continue;
+            }
+            if (op == URING_WATCH) {
+                // Connections are only freed below, so every watcher is live
+                dispatch_changes(&watchers);
+                for (connection_t *conn : watchers) {
+                    // conn is the first member of its UringConnection
+                    UringConnection *watcher = reinterpret_cast<UringConnection*>(conn);
+                    if (!watcher->touched) {
+                        watcher->touched = true;
+                        touched.push_back(watcher);
+                    }
+                }
+                watchers.clear();
+                arm_watch(&ring, watch_fd);
+                continue;
+            }
+
+            switch (op) {
+            case URING_RECV:
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    uc->recv_armed = false;
+                    --uc->ops;
+                }
+                if (res > 0) {
+                    unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                    bool ok = uc->dead || uc->conn.in.append(ring.buffer(bid), res);
+                    ring.recycle(bid);
+                    if (!ok) {
+                        retire(&ring, uc);
+                    }
+                    else if (uc->recv_armed && !uc->recv_cancelled && uc->send_busy && uc->conn.in.size() >= RECV_HIGH_WATER) {
+                        cancel_recv(&ring, uc);
+                    }
+                }
+                else if (res != -ENOBUFS && res != -ECANCELED) {
+                    // The peer closed the connection, or it failed
+                    retire(&ring, uc);
+                }
+                break;
+            case URING_SEND:
+                --uc->ops;
+                uc->send_busy = false;
+                if (res < 0) {
+                    retire(&ring, uc);
+                    uc->sending.clear();
+                }
+                else {
+                    uc->sending.erase(0, res);
+                }
+                break;
+            case URING_SHUTDOWN:
+                --uc->ops;
+                if (res == -ECANCELED) {
+                    // The send it was linked to failed
+                    shutdown(uc->conn.fd, SHUT_RDWR);
+                }
+                break;
+            default:
+                --uc->ops;
+                break;
+            }
+            if (!uc->touched) {
+                uc->touched = true;
+                touched.push_back(uc);
+            }
+        }
+
+        // Requests are only handled while no replies are in flight, so a
+        // connection has at most one round of them queued
+        for (UringConnection *uc : touched) {
+            if (!uc->dead && !uc->send_busy && uc->sending.empty()) {
+                handle_requests(&uc->conn);
+            }
+        }
+
+        // Group commit, as in serve_epoll
+        if (!commit_values()) {
+            perror("write log commit failed");
+        }
+        notify_watchers();
+
+        for (UringConnection *uc : touched) {
+            uc->touched = false;
+            connection_t *conn = &uc->conn;
+            if (!uc->dead && !uc->send_busy) {
+                if (uc->sending.empty()) {
+                    uc->sending.swap(conn->out);
+                }
+                bool last = conn->closing && conn->out.empty() && !conn->scanning;
+                if (!uc->sending.empty()) {
+                    send_replies(&ring, uc, last);
+                }
+                else if (last) {
+                    retire(&ring, uc);
+                }
+            }
+            // Without replies in flight, whatever is buffered is an
+            // incomplete request, and only more bytes can finish it
+            if (!uc->dead && !uc->recv_armed && (conn->in.size() < RECV_HIGH_WATER || !uc->send_busy)) {
+                arm_recv(&ring, uc);
+            }
+            if (uc->dead && uc->ops == 0) {
+                unwatch(conn);
+                close(conn->fd);
+                delete uc;
+                connection_closed();
+            }
+        }
+        touched.clear();
+    }
+
+    return 0;
+}
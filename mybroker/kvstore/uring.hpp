@@ -0,0 +1,12 @@
+#pragma once
+
+// io_uring event loop, KVSTORE_MODE=uring. Talks to the kernel through the
+// raw system calls, so it needs no liburing, only a kernel of 6.0 or later
+// for multishot recv and provided buffer rings.
+
+// Whether this kernel lets us set up a ring with everything the loop uses
+bool uring_supported();
+
+// Serves connections accepted on socket_desc until a fatal error, like
+// serve_epoll().
+int serve_uring(int socket_desc, bool maintenance);
@@ -0,0 +1,348 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "connection.hpp"
+#include "watch.hpp"
+
+static_assert(WATCH_SPILL_BYTES >= MAX_FRAME_SIZE, "a key a request carries must fit in the spill");
+
+namespace bip = boost::interprocess;
+
+// The watching connections of one event loop, and how far it has read the
+// ring. Only its own thread touches it, except for `active`.
+struct LoopWatchers
+{
+    int efd;
+    std::atomic<bool> active;   // has watching connections
+    uint64_t cursor;            // next event to read
+    std::vector<connection_t*> conns;
+
+    LoopWatchers(int efd) : efd(efd), active(false), cursor(0) {}
+};
+
+static std::unique_ptr<bip::mapped_region> region;
+static WatchRing* ring = nullptr;
+// Every loop that asked for an eventfd in this process. They are never freed,
+// as worker threads run until the process exits.
+static std::mutex loops_lock;
+static std::vector<LoopWatchers*> loops;
+static thread_local LoopWatchers* this_loop = nullptr;
+static std::once_flag notifier_started;
+// Set by publish_change() until notify_watchers()
+static thread_local bool published = false;
+
+
+static long futex(std::atomic<uint32_t>* word, int op, uint32_t value)
+{
+    // Shared between processes, so not FUTEX_PRIVATE_FLAG
+    return syscall(SYS_futex, (uint32_t*)word, op, value, NULL, NULL, 0);
+}
+
+void init_watch()
+{
+    std::string name = segment_name(WATCH_SEGMENT, "_watch");
+    bip::shared_memory_object::remove(name.c_str());
+    bip::shared_memory_object shm(bip::create_only, name.c_str(), bip::read_write);
+    shm.truncate(sizeof(WatchRing));
+    region.reset(new bip::mapped_region(shm, bip::read_write));
+    ring = static_cast<WatchRing*>(region->get_address());
+}
+
+bool watch_active()
+{
+    return ring && ring->watchers.load(std::memory_order_relaxed) > 0;
+}
+
+// Keys in the spill wrap around its end
+static void spill_write(uint64_t at, boost::string_view key)
+{
+    size_t offset = at & (WATCH_SPILL_BYTES - 1);
+    size_t first = std::min(key.size(), (size_t)WATCH_SPILL_BYTES - offset);
+    memcpy(ring->spill + offset, key.data(), first);
+    memcpy(ring->spill, key.data() + first, key.size() - first);
+}
+
+static void spill_read(uint64_t at, char* key, size_t size)
+{
+    size_t offset = at & (WATCH_SPILL_BYTES - 1);
+    size_t first = std::min(size, (size_t)WATCH_SPILL_BYTES - offset);
+    memcpy(key, ring->spill + offset, first);
+    memcpy(key + first, ring->spill, size - first);
+}
+
+void publish_change(ChangeType type, uint32_t slot, boost::string_view key, uint64_t quota)
+{
+    if (!watch_active()) {
+        return;
+    }
+    bool truncated = key.size() > WATCH_SPILL_BYTES;
+    if (truncated) {
+        key = key.substr(0, WATCH_KEY_MAX);
+    }
+    uint64_t n = ring->head.fetch_add(1, std::memory_order_relaxed);
+    WatchEvent& event = ring->events[n & (WATCH_SLOTS - 1)];
+    event.stamp.store(2 * n + 1, std::memory_order_relaxed);
+    // Taken before the fence, so a reader that sees the key overwritten in
+    // the spill also sees it taken
+    uint64_t spill = 0;
+    if (key.size() > WATCH_KEY_MAX) {
+        spill = ring->spill_head.fetch_add(key.size(), std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    event.type = type;
+    event.truncated = truncated;
+    event.slot = slot;
+    event.key_size = key.size();
+    event.spill = spill;
+    event.quota = quota;
+    if (key.size() > WATCH_KEY_MAX) {
+        spill_write(spill, key);
+    }
+    else {
+        memcpy(event.key, key.data(), key.size());
+    }
+    event.stamp.store(2 * n + 2, std::memory_order_release);
+    published = true;
+}
+
+void notify_watchers()
+{
+    if (!published) {
+        return;
+    }
+    published = false;
+    // Either a sleeper is counted by now, or it reads the bumped word before
+    // it waits and so does not wait. Only the first writer after a notifier
+    // went to sleep has to wake it.
+    ring->futex.fetch_add(1);
+    if (ring->sleepers.load() > 0 && ring->sleepers.exchange(0) > 0) {
+        futex(&ring->futex, FUTEX_WAKE, INT_MAX);
+    }
+}
+
+
+// Sleeps until events are published and signals the loops that watch.
+static void notify_loops()
+{
+    uint64_t seen = ring->head.load();
+    for (;;) {
+        // The writer that wakes us resets the count
+        ring->sleepers.fetch_add(1);
+        uint32_t word = ring->futex.load();
+        if (ring->head.load() == seen) {
+            futex(&ring->futex, FUTEX_WAIT, word);
+        }
+        seen = ring->head.load();
+
+        std::lock_guard<std::mutex> guard(loops_lock);
+        for (LoopWatchers* loop : loops) {
+            if (loop->active.load(std::memory_order_relaxed)) {
+                uint64_t one = 1;
+                if (write(loop->efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                    perror("eventfd write failed");
+                }
+            }
+        }
+    }
+}
+
+int watch_eventfd()
+{
+    if (!this_loop) {
+        int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (efd < 0) {
+            perror("eventfd failed");
+            return -1;
+        }
+        this_loop = new LoopWatchers(efd);
+        std::lock_guard<std::mutex> guard(loops_lock);
+        loops.push_back(this_loop);
+    }
+    return this_loop->efd;
+}
+
+
+// Tells the connection something other than a change of a key
+static void signal_watcher(connection_t* conn, ChangeType type)
+{
+    Change change;
+    change.type = type;
+    change.slot = 0;
+    change.quota = 0;
+    conn->watch_handler(conn, change);
+}
+
+void watch_key(connection_t* conn, boost::string_view pattern, ChangeHandler handler)
+{
+    if (!ring || watch_eventfd() < 0) {
+        return;
+    }
+    if (conn->watches.empty()) {
+        if (this_loop->conns.empty()) {
+            // Only changes from now on
+            this_loop->cursor = ring->head.load();
+            this_loop->active.store(true, std::memory_order_relaxed);
+        }
+        this_loop->conns.push_back(conn);
+        conn->watch_handler = handler;
+        ring->watchers.fetch_add(1);
+        std::call_once(notifier_started, [] {
+            std::thread(notify_loops).detach();
+        });
+    }
+    conn->watches.push_back(std::string(pattern.data(), pattern.size()));
+}
+
+void unwatch(connection_t* conn)
+{
+    if (conn->watches.empty()) {
+        return;
+    }
+    conn->watches.clear();
+    std::vector<connection_t*>& conns = this_loop->conns;
+    conns.erase(std::remove(conns.begin(), conns.end(), conn), conns.end());
+    if (conns.empty()) {
+        this_loop->active.store(false, std::memory_order_relaxed);
+    }
+    ring->watchers.fetch_sub(1);
+    signal_watcher(conn, CHANGE_UNWATCH);
+}
+
+uint64_t watch_head()
+{
+    return ring ? ring->head.load() : 0;
+}
+
+uint64_t watch_cursor()
+{
+    return this_loop ? this_loop->cursor : 0;
+}
+
+
+// A key cut short matches anything that agrees with the part kept
+static bool matches(const std::string& pattern, boost::string_view key, bool truncated)
+{
+    boost::string_view want(pattern);
+    bool prefix = !want.empty() && want.back() == '*';
+    if (prefix) {
+        want.remove_suffix(1);
+    }
+    if (truncated && want.size() > key.size()) {
+        return want.substr(0, key.size()) == key;
+    }
+    if (prefix || truncated) {
+        return key.substr(0, want.size()) == want;
+    }
+    return key == want;
+}
+
+static bool queue_event(connection_t* conn, const Change& change)
+{
+    if (conn->out.size() > WATCH_MAX_PENDING) {
+        conn->watch_lost = true;
+        return false;
+    }
+    if (conn->watch_lost) {
+        conn->watch_lost = false;
+        signal_watcher(conn, CHANGE_LOST);
+    }
+    conn->watch_handler(conn, change);
+    return true;
+}
+
+void dispatch_changes(std::vector<connection_t*>* touched)
+{
+    if (!this_loop) {
+        return;
+    }
+    uint64_t count;
+    if (read(this_loop->efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("eventfd read failed");
+    }
+
+    std::vector<connection_t*>& conns = this_loop->conns;
+    std::vector<bool> got(conns.size(), false);
+    std::string key;
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    while (this_loop->cursor < head) {
+        uint64_t n = this_loop->cursor;
+        WatchEvent& event = ring->events[n & (WATCH_SLOTS - 1)];
+        uint64_t stamp = event.stamp.load(std::memory_order_acquire);
+        if (stamp < 2 * n + 2) {
+            // Still being written; its writer signals again when it is done
+            break;
+        }
+
+        Change change;
+        change.type = (ChangeType)event.type;
+        change.slot = event.slot;
+        change.quota = event.quota;
+        bool truncated = event.truncated;
+        size_t key_size = std::min((size_t)event.key_size, (size_t)WATCH_SPILL_BYTES);
+        uint64_t spill = event.spill;
+        key.resize(key_size);
+        if (key_size > WATCH_KEY_MAX) {
+            spill_read(spill, &key[0], key_size);
+        }
+        else {
+            memcpy(&key[0], event.key, key_size);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (stamp != 2 * n + 2 || event.stamp.load(std::memory_order_relaxed) != stamp
+            || (key_size > WATCH_KEY_MAX && ring->spill_head.load(std::memory_order_relaxed) - spill > WATCH_SPILL_BYTES)) {
+            // Overwritten by a later event, or its key in the spill by later
+            // keys: this loop fell a whole ring behind
+            for (size_t i = 0; i < conns.size(); ++i) {
+                conns[i]->watch_lost = true;
+                got[i] = true;
+            }
+            this_loop->cursor = head;
+            break;
+        }
+
+        // Handlers see the event as dispatched already
+        ++this_loop->cursor;
+        change.key = key;
+        for (size_t i = 0; i < conns.size(); ++i) {
+            for (const std::string& pattern : conns[i]->watches) {
+                if (matches(pattern, change.key, truncated)) {
+                    got[i] = queue_event(conns[i], change) || got[i];
+                    break;
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < conns.size(); ++i) {
+        if (got[i]) {
+            if (conns[i]->watch_lost && conns[i]->out.size() <= WATCH_MAX_PENDING) {
+                conns[i]->watch_lost = false;
+                signal_watcher(conns[i], CHANGE_LOST);
+            }
+            touched->push_back(conns[i]);
+        }
+    }
+}
+
+
+void append_watch_stats(std::string* out)
+{
+    char line[64];
+    snprintf(line, sizeof(line), "watchers %u\n", ring ? ring->watchers.load() : 0);
+    out->append(line);
+    snprintf(line, sizeof(line), "watch_events %" PRIu64 "\n", ring ? (uint64_t)ring->head.load() : 0);
+    out->append(line);
+}
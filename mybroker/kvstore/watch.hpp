@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+
+// Key change notifications for the watch command.
+//
+// Every change to the store is published to a ring of events in a
+// shared-memory segment of its own, like the metrics, so a writer in any
+// worker thread or forked process reaches every watcher. After publishing, a
+// writer bumps a futex word in the segment. Each server process with watchers
+// runs a thread that sleeps on that word and, when it changes, signals the
+// eventfd of every event loop in the process that has watchers; the loop then
+// reads the new events and queues them to its watching connections. Nothing
+// polls, and writers do nothing but check a counter while nobody watches.
+//
+// Keys longer than WATCH_KEY_MAX do not fit in an event; they are written to a
+// ring of bytes next to the events instead, the spill, and the event says
+// where. A loop that falls so far behind that the spill is overwritten before
+// it reads a key has lost events, as if it fell a whole ring behind. Only a
+// key longer than the whole spill, which no request can carry, is published
+// cut short to WATCH_KEY_MAX; a watch matches it on the part that was kept,
+// and the event carries that part only.
+
+#define WATCH_SEGMENT "kvstore_watch"
+#define WATCH_SLOTS 4096            // a power of two; events a watcher may lag by
+#define WATCH_KEY_MAX 240
+#define WATCH_SPILL_BYTES (4 << 20) // a power of two, above MAX_FRAME_SIZE
+// Events queued to a connection that does not read them are dropped beyond
+// this, and the connection is told it lost some
+#define WATCH_MAX_PENDING (1 << 20)
+
+struct connection;
+
+enum ChangeType
+{
+    CHANGE_SET,
+    CHANGE_DEL,
+    // A namespace was created or dropped; the key is its name
+    CHANGE_NS_CREATE,
+    CHANGE_NS_DROP,
+    // Only for a ChangeHandler: events were dropped, or the connection stops
+    // watching
+    CHANGE_LOST,
+    CHANGE_UNWATCH,
+};
+
+// A change as a ChangeHandler sees it
+struct Change
+{
+    ChangeType type;
+    uint32_t slot;              // of the keyspace changed
+    boost::string_view key;
+    uint64_t quota;             // of a namespace created
+};
+
+// Queues an event to a watching connection, in its protocol
+typedef void (*ChangeHandler)(connection* conn, const Change& change);
+
+struct WatchEvent
+{
+    // 2n + 1 while event n is written into the slot, 2n + 2 once it is
+    std::atomic<uint64_t> stamp;
+    uint8_t type;               // ChangeType
+    uint8_t truncated;
+    uint16_t slot;
+    uint32_t key_size;          // above WATCH_KEY_MAX, the key is in the spill
+    uint64_t spill;             // where it starts there, before wrapping
+    uint64_t quota;
+    char key[WATCH_KEY_MAX];
+};
+
+// Created zeroed, which is a valid initial state for every field
+struct WatchRing
+{
+    std::atomic<uint64_t> head;         // events published so far
+    std::atomic<uint32_t> watchers;     // watching connections in all processes
+    std::atomic<uint32_t> futex;        // bumped after every event
+    std::atomic<uint32_t> sleepers;     // notifiers about to wait on futex
+    std::atomic<uint64_t> spill_head;   // bytes ever taken from the spill
+    WatchEvent events[WATCH_SLOTS];
+    char spill[WATCH_SPILL_BYTES];
+};
+
+// Creates the watch segment. Called once, before any worker starts; until
+// then publishing does nothing.
+void init_watch();
+// Whether any connection watches; writers need not say what changed otherwise
+bool watch_active();
+// Publishes a change to a key of the keyspace in `slot`. Called with the
+// key's stripe locked for writing, so the events of one key are in the order
+// its changes were made. Creating and dropping a namespace publish its name,
+// in order with the changes to its keys.
+void publish_change(ChangeType type, uint32_t slot, boost::string_view key, uint64_t quota = 0);
+// Wakes the watchers of the changes this thread has published. Event loops
+// call it once a round, like they commit the log, so a round of writes costs
+// at most one wakeup.
+void notify_watchers();
+
+// The eventfd that signals this thread's event loop when its watching
+// connections may have events. Created on the first call in each thread.
+int watch_eventfd();
+// Subscribes the connection to changes of the key, or of every key that
+// starts with pattern without its last character if that is '*'. Every watch
+// of a connection must have the same handler.
+void watch_key(connection* conn, boost::string_view pattern, ChangeHandler handler);
+// Drops the connection's watches; called before it is freed
+void unwatch(connection* conn);
+// Reads the eventfd and queues the new events to the watching connections of
+// this thread, adding those that got any to *touched.
+void dispatch_changes(std::vector<connection*>* touched);
+// Events published so far, and how many of them this thread has dispatched
+uint64_t watch_head();
+uint64_t watch_cursor();
+
+// Appends "name value" lines for the stats command
+void append_watch_stats(std::string* out);
@@ -1,5 +1,7 @@
 from typing import Any, Optional, Tuple
+import ctypes
 import json
+import os
 import socket
 import struct
 import pickle
@@ -15,6 +17,39 @@ FILEUP_BACKEND_HOST = "::1"
 FILEUP_BACKEND_PORT = 8906
 INTEGRITY_BACKEND_HOST = "::1"
 INTEGRITY_BACKEND_PORT = 8909
+KVSTORE_MAX_IDLE = 8
+
+
+def _load_kvclient():
+    # libkvclient keeps connections to kvstore open; without it every request
+    # opens a connection of its own
+    here = os.path.dirname(os.path.abspath(__file__))
+    paths = [
+        os.environ.get("KVCLIENT_LIBRARY"),
+        os.path.join(here, "..", "libkvclient.so"),
+        os.path.join(here, "..", "kvstore", "libkvclient.so"),
+    ]
+    for path in paths:
+        if not path or not os.path.exists(path):
+            continue
+        try:
+            lib = ctypes.CDLL(path)
+        except OSError:
+            continue
+        lib.kv_client_new.restype = ctypes.c_void_p
+        lib.kv_client_new.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_size_t]
+        lib.kv_get.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t,
+                               ctypes.POINTER(ctypes.c_void_p), ctypes.POINTER(ctypes.c_size_t)]
+        lib.kv_set.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t,
+                               ctypes.c_char_p, ctypes.c_size_t]
+        lib.kv_free.argtypes = [ctypes.c_void_p]
+        client = lib.kv_client_new(KVSTORE_BACKEND_HOST.encode("ascii"), KVSTORE_BACKEND_PORT, KVSTORE_MAX_IDLE)
+        if client:
+            return lib, client
+    return None, None
+
+
+_kvclient, _kvclient_pool = _load_kvclient()
 
 
 def list_inventory() -> list[str]:
@@ -51,6 +86,13 @@ def remove_house(method, idx) -> bool:
 
 
 def kv_store(key: str, value: Any) -> bool:
+    if _kvclient is not None:
+        if not isinstance(value, str):
+            return False
+        k = key.encode("utf-8")
+        v = value.encode("utf-8")
+        return _kvclient.kv_set(_kvclient_pool, k, len(k), v, len(v)) == 0
+
     result = False
     sock = socket.socket(socket.AF_INET6, socket.SOCK_STREAM, 0)
     try:
@@ -70,7 +112,37 @@ def kv_store(key: str, value: Any) -> bool:
     return result
 
 
+def _kv_load_value(r: bytes) -> Any:
+    # handle more types of data using Python's greatness
+    try:
+        result = pickle.loads(r)
+        return str(result)  # ensure type matches
+    except Exception:
+        pass
+
+    try:
+        result = eval(r.decode("utf-8"))
+        return str(result)  # ensure type matches
+    except Exception:
+        pass
+
+    return r.decode("utf-8").strip("\n")
+
+
 def kv_load(key: str, typ) -> Optional[Any]:
+    if _kvclient is not None:
+        if typ is not str:
+            return None
+        k = key.encode("utf-8")
+        value = ctypes.c_void_p()
+        length = ctypes.c_size_t()
+        if _kvclient.kv_get(_kvclient_pool, k, len(k), ctypes.byref(value), ctypes.byref(length)) != 0:
+            return None
+        r = ctypes.string_at(value, length.value)
+        _kvclient.kv_free(value)
+        # as it reads over the text protocol
+        return _kv_load_value(r + b"\n")
+
     result = None
     sock = socket.socket(socket.AF_INET6, socket.SOCK_STREAM, 0)
     try:
@@ -85,20 +157,7 @@ def kv_load(key: str, typ) -> Optional[Any]:
         if b"No such key." in r:
             result = None
         else:
-            # handle more types of data using Python's greatness
-            try:
-                result = pickle.loads(r)
-                return str(result)  # ensure type matches
-            except Exception:
-                pass
-
-            try:
-                result = eval(r.decode("utf-8"))
-                return str(result)  # ensure type matches
-            except Exception:
-                pass
-
-            result = r.decode("utf-8").strip("\n")
+            result = _kv_load_value(r)
 
     sock.close()
     return result